@@ -0,0 +1,34 @@
+#ifndef ACCOUNTS_H
+#define ACCOUNTS_H
+
+#include <stdbool.h>
+
+// Several Repsly accounts mirrored by one process, each into a database of
+// its own on the REPSLY_DB_HOST server. Listed in the config file:
+//
+//   accounts = east, west
+//   account.east.username = ...
+//   account.east.password = ...
+//   account.east.database = repsly_east       (default <REPSLY_DB_NAME>_<name>)
+//   account.east.requests_per_minute = 60     (default accounts.requests_per_minute, 0 = no limit)
+//
+// Pages are fetched by accounts.fetch_workers threads (default 4) shared by
+// every account: they take turns between accounts, keep at most one page per
+// entity in flight, start an entity once the ones it depends on are caught
+// up and hold back requests that would exceed an account's limit. At most accounts.queued_pages (default 16) fetched pages wait to be
+// loaded. One thread loads them, finishing an account's queued pages before
+// moving to the next, and keeps at most accounts.connections (default 2)
+// databases connected, least recently used closed first. An account's
+// cursors are read, and its entities' leases taken (see leases.h), once it is
+// scheduled, and only as many accounts as there are connections sync at once. An account that is
+// caught up gets its assets mirrored and its connection closed, so idle
+// accounts hold none.
+
+// Whether the config file lists any accounts
+bool accounts_configured(const char *config_path);
+
+// Syncs every account until it is caught up; with repeat, again every
+// interval.default seconds until SIGTERM or SIGINT. Returns the exit status.
+int accounts_run(const char *config_path, bool repeat);
+
+#endif // ACCOUNTS_H
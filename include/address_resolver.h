@@ -0,0 +1,43 @@
+#ifndef ADDRESS_RESOLVER_H
+#define ADDRESS_RESOLVER_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+
+// Addresses resolved through the geography hierarchy (countries → states →
+// cities → zip_codes → core.addresses) held in memory as a trie. The trie is
+// loaded from those tables on first use, so an address seen before, or one
+// whose every level already exists, costs no round trip. Missing nodes are
+// created a level at a time, one statement per level for the whole batch.
+//
+// Parts are trimmed with inner whitespace collapsed and matched ignoring
+// ASCII case. New names are stored with that spacing; an all lower case
+// name is title cased and zip codes are upper cased. A missing part
+// is stored as an empty name, so every address has a full chain.
+//
+// All calls come from the thread that owns the connection, outside any
+// transaction that might roll back the rows created.
+
+typedef struct AddressBatch* AddressBatchPtr;
+
+AddressBatchPtr address_batch_create(void);
+void address_batch_free(AddressBatchPtr batch);
+
+// Returns the slot to read the address id from once resolved, or -1
+int address_batch_add(AddressBatchPtr batch, PGconn *db_conn, const char *street, const char *zip,
+                      const char *zip_ext, const char *city, const char *state, const char *country);
+
+// Creates whatever the added addresses are missing
+bool address_batch_resolve(AddressBatchPtr batch, PGconn *db_conn);
+
+// core.addresses id for a slot, or -1 if it couldn't be resolved
+int address_batch_id(AddressBatchPtr batch, int slot);
+
+// One address on its own
+int address_resolve(PGconn *db_conn, const char *street, const char *zip, const char *zip_ext, const char *city,
+                    const char *state, const char *country);
+
+// Drops the trie, to be reloaded from whichever database is used next
+void address_resolver_forget(void);
+
+#endif // ADDRESS_RESOLVER_H
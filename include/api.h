@@ -2,6 +2,7 @@
 #define API_H
 
 #include <jansson.h>
+#include <curl/curl.h>
 
 #define API_BASE_URL "https://api.repsly.com/v3/export/"
 
@@ -10,4 +11,28 @@ void api_cleanup(void);
 
 json_t* api_fetch_data(const char* endpoint, long last_id);
 
+// Unparsed response body, NUL-terminated; the caller frees it
+char* api_fetch_raw(const char* endpoint, long last_id, size_t *length);
+
+// A request to run on a caller-owned curl multi handle
+typedef struct ApiRequest* ApiRequestPtr;
+
+ApiRequestPtr api_request_create(const char* endpoint, long last_id, void *user_data);
+CURL* api_request_handle(ApiRequestPtr request);
+void* api_request_user_data(ApiRequestPtr request);
+ApiRequestPtr api_request_from_handle(CURL *handle);
+// Response body once the transfer is done, NUL-terminated; the caller frees it
+char* api_request_take_body(ApiRequestPtr request, size_t *length);
+void api_request_free(ApiRequestPtr request);
+
+// Basic auth for an account other than the one REPSLY_USERNAME and
+// REPSLY_PASSWORD name (see accounts.h). Requests created with it can be
+// performed on any thread.
+typedef struct ApiCredentials* ApiCredentialsPtr;
+
+ApiCredentialsPtr api_credentials_create(const char *username, const char *password);
+void api_credentials_free(ApiCredentialsPtr credentials);
+ApiRequestPtr api_request_create_as(ApiCredentialsPtr credentials, const char* endpoint, long last_id,
+                                    void *user_data);
+
 #endif 
\ No newline at end of file
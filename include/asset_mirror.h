@@ -0,0 +1,23 @@
+#ifndef ASSET_MIRROR_H
+#define ASSET_MIRROR_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+
+// Local copies of the images the mirrored rows link to: form and purchase
+// order signatures, photos and product images. Off unless REPSLY_ASSET_DIR
+// names the store.
+//
+// Each run picks up to REPSLY_ASSET_BATCH (default 500) URLs per column that
+// have no local copy yet and downloads them on one curl multi handle, at most
+// REPSLY_ASSET_PARALLEL (default 8) at a time. Files are stored by the
+// SHA-256 of their content as <dir>/<2 hex>/<64 hex>.<ext>, so an image
+// linked from many rows, or under several URLs, is stored once. The path
+// relative to the store is written to the column next to the URL (e.g.
+// photo_path beside photo_url), and every attempt is recorded in meta.assets;
+// a URL that failed is retried after a day. The batch is recorded once its
+// downloads are done: one statement for meta.assets, one per table for the
+// paths.
+bool asset_mirror_run(PGconn *db_conn);
+
+#endif // ASSET_MIRROR_H
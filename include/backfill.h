@@ -0,0 +1,27 @@
+#ifndef BACKFILL_H
+#define BACKFILL_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+
+// Bulk load of the mapped entities from their recorded cursors, for a first
+// sync or a rebuild. For each entity in registry order:
+//
+//   1. probe the API for the highest cursor and split the history into
+//      backfill.ranges cursor ranges (config, default 4), fetched in parallel
+//   2. COPY every page into an UNLOGGED, index-free backfill.<entity> table
+//   3. in one transaction: drop the target's secondary indexes and foreign
+//      keys, merge the staged rows (newest wins) with the table's triggers
+//      off, recompute what the triggers would have, rebuild the rollups
+//      it feeds and record a reload in the change feed, rebuild the
+//      indexes and keys, and move the cursor
+//   4. ANALYZE the target and drop the staging table
+//
+// Entities are merged one at a time so later ones resolve against rows the
+// earlier ones loaded. With leases (see leases.h) an entity another instance
+// holds is skipped. An entity whose fetch or load fails keeps its old
+// cursor and is left to the incremental sync. Clients, forms and pricelists
+// aren't mapped and aren't touched here.
+bool backfill_run(PGconn *db_conn, const char *config_path);
+
+#endif // BACKFILL_H
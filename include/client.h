@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 #include <libpq-fe.h>
+#include <jansson.h>
+#include "fingerprint.h"
 
 
 typedef struct ClientData* ClientDataPtr;
@@ -20,11 +22,46 @@ void client_set_contact_name_id(ClientDataPtr client, int contact_name_id);
 void client_set_contact_title_id(ClientDataPtr client, int contact_title_id);
 void client_set_name_id(ClientDataPtr client, int name_id);
 
+// Source values as exported by Repsly, resolved to ids by client_insert
+void client_set_name(ClientDataPtr client, const char* name);
+void client_set_tag(ClientDataPtr client, const char* tag);
+void client_set_territory(ClientDataPtr client, const char* territory);
+void client_set_rep_code(ClientDataPtr client, const char* rep_code);
+void client_set_rep_name(ClientDataPtr client, const char* rep_name);
+void client_set_street_address(ClientDataPtr client, const char* street_address);
+void client_set_zip(ClientDataPtr client, const char* zip);
+void client_set_zip_ext(ClientDataPtr client, const char* zip_ext);
+void client_set_city(ClientDataPtr client, const char* city);
+void client_set_state(ClientDataPtr client, const char* state);
+void client_set_country(ClientDataPtr client, const char* country);
+void client_set_email(ClientDataPtr client, const char* email);
+void client_set_phone(ClientDataPtr client, const char* phone);
+void client_set_mobile(ClientDataPtr client, const char* mobile);
+void client_set_website(ClientDataPtr client, const char* website);
+void client_set_contact_name(ClientDataPtr client, const char* contact_name);
+void client_set_contact_title(ClientDataPtr client, const char* contact_title);
+void client_set_note(ClientDataPtr client, const char* note);
+void client_set_timestamp(ClientDataPtr client, long timestamp);
+
+void client_add_custom_field(ClientDataPtr client, const char* field, const char* value);
+void client_add_price_list(ClientDataPtr client, const char* price_list_name);
+
 bool client_insert(PGconn *db_conn, ClientDataPtr client);
 
 int client_get_id(ClientDataPtr client);
+long client_get_timestamp(ClientDataPtr client);
+Fingerprint client_content_hash(ClientDataPtr client);
 void client_free(ClientDataPtr client);
 
 bool client_fetch_and_insert(PGconn *db_conn, long last_timestamp);
+bool client_load_page(PGconn *db_conn, json_t *root, long last_timestamp);
+long client_page_cursor(json_t *root, long last_timestamp);
+// client_load_page straight from the response text, without building a DOM
+// (see json_scan.h). The text is rewritten in place.
+bool client_load_text(PGconn *db_conn, char *text, size_t length, long last_timestamp, long *next_cursor,
+                      size_t *records);
+
+// Drops the fingerprints read from sales.clients, before switching databases
+void client_fingerprints_forget(void);
 
-#endif 
\ No newline at end of file
+#endif 
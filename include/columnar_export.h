@@ -0,0 +1,54 @@
+#ifndef COLUMNAR_EXPORT_H
+#define COLUMNAR_EXPORT_H
+
+#include <stdbool.h>
+#include "json_decoder.h"
+
+// Columnar snapshot export for Power BI. Loaders hand over the rows they have
+// just committed, one flat (denormalised) dataset per entity, and each dataset
+// is written as gzip-compressed Parquet under
+//
+//   $REPSLY_EXPORT_DIR/<dataset>/date=YYYY-MM-DD/part-<run>-<seq>.parquet
+//
+// Files are only ever added, never rewritten, so a run appends new part files
+// to the partitions its rows fall into and leaves everything else alone.
+// Exporting is off unless REPSLY_EXPORT_DIR is set.
+//
+// A record written again (an updated client, a changed pricelist) therefore
+// has rows in more than one file, often in different partitions. Every
+// dataset ends in two extra columns so readers can tell which are current:
+// RecordKey names the record and RecordVersion increases with each export of
+// it; only the rows of the highest version of each key are current.
+
+typedef struct {
+    const char *name;
+    FieldType type;
+} ExportColumn;
+
+typedef struct ExportDataset* ExportDatasetPtr;
+
+// Returns the process-wide dataset with this name, creating it with the given
+// columns on first use. Returns NULL when exporting is disabled.
+ExportDatasetPtr export_dataset_get(const char *name, const ExportColumn *columns, int column_count);
+
+// Buffers one row of text values (NULL for null), one per column given to
+// export_dataset_get, in the partition for partition_date, which may be a
+// timestamp; anything that doesn't start with YYYY-MM-DD goes into today's
+// partition. Consecutive rows with the same key are one version of a record
+// with several rows (the items of one pricelist). A NULL dataset is a no-op.
+bool export_dataset_append(ExportDatasetPtr dataset, const char *partition_date, const char *key,
+                           const char *const *values);
+
+// Writes every buffered partition of every dataset out as new files.
+bool export_flush_all(void);
+
+// Puts the files written from here on under $REPSLY_EXPORT_DIR/<scope>/, or
+// straight under the directory for an empty or NULL scope, after flushing
+// what was buffered for the previous one. Multi-account runs scope the
+// export by account so the accounts' rows never share a file.
+bool export_set_scope(const char *scope);
+
+// Flushes and releases all datasets.
+void export_shutdown(void);
+
+#endif // COLUMNAR_EXPORT_H
@@ -0,0 +1,21 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// Mirror settings read from a plain "key = value" file. Blank lines and lines
+// starting with '#' are ignored. Keys are free-form; the daemon reads e.g.
+//
+//   interval.default = 300
+//   interval.clients = 60
+//
+// A missing or unreadable file yields an empty config, so every lookup falls
+// back to its default.
+
+typedef struct MirrorConfig* MirrorConfigPtr;
+
+MirrorConfigPtr config_load(const char *path);
+void config_free(MirrorConfigPtr config);
+
+const char *config_get_string(MirrorConfigPtr config, const char *key, const char *default_value);
+long config_get_long(MirrorConfigPtr config, const char *key, long default_value);
+
+#endif // CONFIG_H
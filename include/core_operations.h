@@ -1,13 +1,20 @@
 #ifndef CORE_OPERATIONS_H
 #define CORE_OPERATIONS_H
 
+#include <stdbool.h>
+#include <libpq-fe.h>
+
 long get_last_processed(PGconn *conn, const char *entity_name);
 bool update_last_processed(PGconn *conn, const char *entity_name, long last_value);
+// Queues the same update without waiting for it (non-blocking / pipeline mode)
+bool send_update_last_processed(PGconn *conn, const char *entity_name, long last_value);
 
 PGconn* db_connect(void);
+PGconn* db_connect_to(const char *dbname);  // same server and user, another database
 void db_disconnect(PGconn *conn);
+bool db_ensure_connected(PGconn *conn);
+void db_reset(PGconn *conn);
 
-int get_or_create_address(PGconn *conn, const char *street, const char *zip, const char *city, const char *state, const char *country);
 int get_or_create_contact_info(PGconn *conn, const char *phone, const char *mobile, const char *website);
 int get_or_create_territory(PGconn *conn, const char *territory_name);
 int get_or_create_representative(PGconn *conn, const char *rep_code, const char *rep_name);
@@ -21,6 +28,18 @@ int get_or_create_time(PGconn *conn, const char *timestamp);
 
 int get_or_create_product(PGconn *conn, const char *product_code, const char *product_name);
 int get_or_create_client(PGconn *conn, const char *client_code, const char *client_name);
+int get_or_create_product_group(PGconn *conn, const char *group_code, const char *group_name);
+
+int get_or_create_rep_code(PGconn *conn, const char *rep_code);
+int get_or_create_email(PGconn *conn, const char *email_address);
+int get_or_create_role(PGconn *conn, const char *role_name);
+int get_or_create_document_type(PGconn *conn, const char *document_type_name);
+int get_or_create_document_status(PGconn *conn, const char *document_status_name);
+int get_or_create_custom_field(PGconn *conn, const char *entity_type, const char *field_name);
+
+// Lookup only: visits are mirrored from their own endpoint, so other entities
+// never create them. Returns 0 if the visit hasn't been mirrored yet.
+int find_visit_by_repsly_id(PGconn *conn, const char *repsly_visit_id);
 
 
 
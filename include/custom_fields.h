@@ -0,0 +1,24 @@
+#ifndef CUSTOM_FIELDS_H
+#define CUSTOM_FIELDS_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+
+// Custom field values for one page of an entity, collected as records are
+// written and stored in meta.custom_field_values with a single statement.
+// Field definitions are resolved through the dimension cache by
+// (entity_type, field_name), so each name costs one lookup per process.
+
+typedef struct CustomFieldBatch* CustomFieldBatchPtr;
+
+CustomFieldBatchPtr custom_field_batch_create(const char *entity_type);
+void custom_field_batch_free(CustomFieldBatchPtr batch);
+
+bool custom_field_batch_add(CustomFieldBatchPtr batch, PGconn *db_conn, int entity_id, const char *field_name,
+                            const char *value);
+
+// Upserts every collected value and empties the batch. A value given twice
+// for the same entity and field keeps the last one.
+bool custom_field_batch_write(CustomFieldBatchPtr batch, PGconn *db_conn);
+
+#endif // CUSTOM_FIELDS_H
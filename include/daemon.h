@@ -0,0 +1,11 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <libpq-fe.h>
+
+// Keeps the database connection, curl handle, prepared statements and
+// dimension cache alive and polls every entity on its own interval until
+// SIGTERM or SIGINT. SIGHUP rereads config_path. Returns the exit status.
+int daemon_run(PGconn *db_conn, const char *config_path);
+
+#endif // DAEMON_H
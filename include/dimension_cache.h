@@ -0,0 +1,12 @@
+#ifndef DIMENSION_CACHE_H
+#define DIMENSION_CACHE_H
+
+// Process-wide cache of resolved dimension ids, keyed by dimension name plus
+// the natural key values that were passed to get_or_create_*. Dimensions are
+// insert-only, so a cached id never goes stale while the connection lives.
+
+int dimension_cache_get(const char *dimension, const char *const *args, int arg_count);  // 0 on a miss
+void dimension_cache_put(const char *dimension, const char *const *args, int arg_count, int id);
+void dimension_cache_clear(void);
+
+#endif // DIMENSION_CACHE_H
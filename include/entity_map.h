@@ -0,0 +1,90 @@
+#ifndef ENTITY_MAP_H
+#define ENTITY_MAP_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+#include "json_decoder.h"
+
+// Declarative mapping from a Repsly export endpoint onto one of our tables.
+// Every mapped entity goes through the same pipeline:
+//
+//   fetch page -> decode records -> resolve dimensions (cached) -> bulk upsert
+//
+// so a new endpoint only needs a mapping table, not another copy of client.c.
+
+#define MAX_MAPPED_COLUMNS 24
+#define MAX_RESOLVER_ARGS 3
+
+// Resolvers turn one or more decoded source values into a dimension id.
+// They return the id, 0 when the referenced row doesn't exist (the column is
+// written as NULL) or -1 on a database error (the page is abandoned).
+typedef int (*DimensionResolver)(PGconn *conn, const char *const *args);
+
+typedef struct {
+    const char *column;                           // target column
+    FieldType type;                               // how the source field(s) are decoded
+    const char *json_fields[MAX_RESOLVER_ARGS];   // plain columns use only the first
+    DimensionResolver resolver;                   // NULL for plain columns
+    bool key;                                     // part of the ON CONFLICT target
+} ColumnMapping;
+
+typedef struct {
+    const char *entity_name;    // key in meta.last_processed
+    const char *endpoint;       // Repsly export endpoint
+    const char *array_field;    // array holding the page's records, e.g. "Visits"
+    const char *table;          // target table
+    const char *cursor_field;   // MetaCollectionResult field the cursor follows, NULL if unpaged
+    const ColumnMapping *columns;
+    int column_count;
+    const char *partition_column; // date column the table is partitioned on by month, NULL if it isn't
+} EntityMapping;
+
+// Whether column c identifies a record. The partition column is part of the
+// ON CONFLICT target, since a partitioned table's keys must include it, but a
+// record whose date changes is still the same record: it is found by the
+// other keys and moved to its new partition.
+bool entity_mapping_record_key(const EntityMapping *mapping, int c);
+
+bool entity_fetch_and_insert(PGconn *db_conn, const EntityMapping *mapping, long last_cursor);
+
+// The two halves of entity_fetch_and_insert, for pages that were fetched
+// earlier (see spool.h). root stays owned by the caller.
+bool entity_load_page(PGconn *db_conn, const EntityMapping *mapping, json_t *root, long last_cursor);
+long entity_page_cursor(const EntityMapping *mapping, json_t *root, long last_cursor);
+
+// entity_load_page in stages, for callers that overlap the write with other
+// work (see event_loop.h). prepare decodes and resolves; send queues the rows
+// and cursor on db_conn in pipeline mode followed by a sync and returns 1, or
+// 0 when there is nothing to write, or -1 on failure, after which the
+// connection must be reset (db_reset) to discard the half-queued write;
+// finish exports the rows if the write committed and frees the page.
+typedef struct EntityPage* EntityPagePtr;
+
+EntityPagePtr entity_page_prepare(PGconn *db_conn, const EntityMapping *mapping, json_t *root, long last_cursor);
+int entity_page_send(PGconn *db_conn, EntityPagePtr page);
+void entity_page_finish(EntityPagePtr page, bool committed);
+
+// Streams a prepared page's rows into table with COPY instead of upserting
+// them; table has the mapping's columns, plus cursor_column (if not NULL) for
+// the cursor the page was requested from. meta.last_processed isn't touched.
+bool entity_page_copy(PGconn *db_conn, EntityPagePtr page, const char *table, const char *cursor_column);
+
+// Resolvers shared by the mapping tables
+int resolve_client(PGconn *conn, const char *const *args);         // code, name
+int resolve_representative(PGconn *conn, const char *const *args); // code, name
+int resolve_rep_code(PGconn *conn, const char *const *args);       // code
+int resolve_product(PGconn *conn, const char *const *args);        // code, name
+int resolve_product_group(PGconn *conn, const char *const *args);  // code, name
+int resolve_time(PGconn *conn, const char *const *args);           // timestamp
+int resolve_date(PGconn *conn, const char *const *args);           // date
+int resolve_name(PGconn *conn, const char *const *args);           // full name
+int resolve_note(PGconn *conn, const char *const *args);           // note text
+int resolve_email(PGconn *conn, const char *const *args);          // address
+int resolve_role(PGconn *conn, const char *const *args);           // role name
+int resolve_lat(PGconn *conn, const char *const *args);            // latitude
+int resolve_long(PGconn *conn, const char *const *args);           // longitude
+int resolve_document_type(PGconn *conn, const char *const *args);  // name
+int resolve_document_status(PGconn *conn, const char *const *args);// name
+int resolve_visit(PGconn *conn, const char *const *args);          // Repsly VisitID, lookup only
+
+#endif // ENTITY_MAP_H
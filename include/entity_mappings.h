@@ -0,0 +1,26 @@
+#ifndef ENTITY_MAPPINGS_H
+#define ENTITY_MAPPINGS_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+#include "entity_map.h"
+
+// Each mapped entity gets its mapping table plus the loader entry points
+#define DECLARE_MAPPED_ENTITY(entity) \
+    extern const EntityMapping entity##_mapping; \
+    bool entity##_fetch_and_insert(PGconn *db_conn, long last_cursor); \
+    bool entity##_load_page(PGconn *db_conn, json_t *root, long last_cursor); \
+    long entity##_page_cursor(json_t *root, long last_cursor);
+
+DECLARE_MAPPED_ENTITY(visits)
+DECLARE_MAPPED_ENTITY(purchaseorders)
+DECLARE_MAPPED_ENTITY(retailaudits)
+DECLARE_MAPPED_ENTITY(products)
+DECLARE_MAPPED_ENTITY(photos)
+DECLARE_MAPPED_ENTITY(dailyworkingtime)
+DECLARE_MAPPED_ENTITY(visitschedules)
+DECLARE_MAPPED_ENTITY(users)
+DECLARE_MAPPED_ENTITY(reps)
+DECLARE_MAPPED_ENTITY(documenttypes)
+
+#endif // ENTITY_MAPPINGS_H
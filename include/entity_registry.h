@@ -0,0 +1,35 @@
+#ifndef ENTITY_REGISTRY_H
+#define ENTITY_REGISTRY_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+#include <jansson.h>
+#include "entity_map.h"
+
+typedef struct {
+    const char *name;
+    const char *endpoint;
+    bool (*fetch_and_insert)(PGconn *db_conn, long last_id_or_timestamp);
+
+    // Loading a page that was fetched earlier, and the cursor that follows it
+    bool (*load_page)(PGconn *db_conn, json_t *root, long last_id_or_timestamp);
+    long (*page_cursor)(json_t *root, long last_id_or_timestamp);
+
+    // Loading a page from its response text without a DOM (see json_scan.h);
+    // NULL where only load_page is available. Also reports the cursor after
+    // the page and how many records it held.
+    bool (*load_text)(PGconn *db_conn, char *text, size_t length, long last_id_or_timestamp, long *next_cursor,
+                      size_t *records);
+
+    // Set for entities loaded through a mapping table, NULL for hand-written loaders
+    const EntityMapping *mapping;
+
+    // Names of the entities to sync first, NULL-terminated; NULL if none
+    const char *const *dependencies;
+} EntityInfo;
+
+// Every entity the mirror knows how to sync, in sync order
+const EntityInfo *entity_registry(int *count);
+const EntityInfo *entity_registry_find(const char *name);
+
+#endif // ENTITY_REGISTRY_H
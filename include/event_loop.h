@@ -0,0 +1,19 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+#include "entity_registry.h"
+
+// Syncs entities from a single thread that waits on every socket at once.
+// Each entity keeps one API request in flight on a shared curl multi handle,
+// asking for its next page as soon as the previous one names its cursor,
+// while finished pages are written to the database in pipeline mode on the
+// same thread. Downloads for all entities therefore overlap with each other
+// and with the writes, instead of every page waiting for the one before it.
+//
+// Returns false if any entity stopped early; its cursor stays at the last
+// page that was committed.
+bool event_loop_sync(PGconn *db_conn, const EntityInfo *const *entities, int count);
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,28 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// 64-bit FNV-1a content hashes. A record's fingerprint covers only the fields
+// we actually mirror, so a re-sent record with the same fingerprint can be
+// skipped without touching the database.
+
+typedef uint64_t Fingerprint;
+
+#define FINGERPRINT_STR_SIZE 21
+
+Fingerprint fingerprint_init(void);
+Fingerprint fingerprint_add_str(Fingerprint fp, const char *value);
+Fingerprint fingerprint_add_int(Fingerprint fp, long value);
+Fingerprint fingerprint_add_double(Fingerprint fp, double value);
+Fingerprint fingerprint_add_bool(Fingerprint fp, bool value);
+Fingerprint fingerprint_add_fingerprint(Fingerprint fp, Fingerprint other);
+
+// Fingerprints are stored in BIGINT columns, so they round-trip through the
+// signed 64-bit text representation.
+void fingerprint_to_string(Fingerprint fp, char *buf, size_t buf_size);
+Fingerprint fingerprint_from_string(const char *str);
+
+#endif // FINGERPRINT_H
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <libpq-fe.h>
+#include <jansson.h>
 
 typedef struct FormData* FormDataPtr;
 FormDataPtr form_create(void);
@@ -12,11 +13,36 @@ void form_set_visit_id(FormDataPtr form, int visit_id);
 void form_set_time_id(FormDataPtr form, int time_id);
 void form_set_signature_url(FormDataPtr form, const char* signature_url);
 
+// Source values as exported by Repsly
+void form_set_form_id(FormDataPtr form, long repsly_form_id);
+void form_set_client_code(FormDataPtr form, const char* client_code);
+void form_set_client_name(FormDataPtr form, const char* client_name);
+void form_set_date_and_time(FormDataPtr form, const char* date_and_time);
+void form_set_rep_code(FormDataPtr form, const char* rep_code);
+void form_set_rep_name(FormDataPtr form, const char* rep_name);
+void form_set_street_address(FormDataPtr form, const char* street_address);
+void form_set_zip(FormDataPtr form, const char* zip);
+void form_set_zip_ext(FormDataPtr form, const char* zip_ext);
+void form_set_city(FormDataPtr form, const char* city);
+void form_set_state(FormDataPtr form, const char* state);
+void form_set_country(FormDataPtr form, const char* country);
+void form_set_email(FormDataPtr form, const char* email);
+void form_set_phone(FormDataPtr form, const char* phone);
+void form_set_mobile(FormDataPtr form, const char* mobile);
+void form_set_territory(FormDataPtr form, const char* territory);
+void form_set_longitude(FormDataPtr form, double longitude);
+void form_set_latitude(FormDataPtr form, double latitude);
+void form_set_visit_start(FormDataPtr form, const char* visit_start);
+void form_set_visit_end(FormDataPtr form, const char* visit_end);
+
 void form_add_item(FormDataPtr form, const char* field, const char* value);
 
 bool form_insert(PGconn *db_conn, FormDataPtr form);
 bool form_fetch_and_insert(PGconn *db_conn, long last_form_id);
+bool form_load_page(PGconn *db_conn, json_t *root, long last_form_id);
+long form_page_cursor(json_t *root, long last_form_id);
 int form_get_id(FormDataPtr form);
+long form_get_repsly_id(FormDataPtr form);
 void form_free(FormDataPtr form);
 
-#endif // FORM_H
\ No newline at end of file
+#endif // FORM_H
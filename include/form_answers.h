@@ -0,0 +1,32 @@
+#ifndef FORM_ANSWERS_H
+#define FORM_ANSWERS_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+
+// Form answers live in field_ops.forms.answers, one JSONB document per form
+// keyed by question. Two optional extras sit on top of it:
+//
+// - REPSLY_FORM_INDEX_FIELDS, a comma-separated list of questions, gets an
+//   expression index on (answers ->> question) for each entry.
+// - REPSLY_FORM_TEMPLATES=1 keeps one view per form template in the
+//   form_templates schema, with every question as a typed column, so Power BI
+//   can read answers as plain columns. A view is rebuilt when a question it
+//   doesn't have yet shows up. Questions too long for an identifier, or
+//   named like the view's own columns, get a shortened name with a hash.
+
+// Creates the configured expression indexes, once per process
+bool form_answers_ensure_indexes(PGconn *db_conn);
+
+// Called for each written form with the questions it answered
+bool form_answers_note_template(PGconn *db_conn, const char *template_name, const char *const *fields,
+                                int field_count);
+
+// Rebuilds the views that got new questions, once per page. A view that
+// fails stays due and is tried again with the next page.
+bool form_answers_flush_templates(PGconn *db_conn);
+
+// Drops what is known about the current database's indexes and views
+void form_answers_forget(void);
+
+#endif // FORM_ANSWERS_H
@@ -0,0 +1,26 @@
+#ifndef JSON_ARENA_H
+#define JSON_ARENA_H
+
+#include <stddef.h>
+#include <jansson.h>
+
+// Page arenas for jansson. A page parsed through json_arena_load gets its
+// nodes and strings by bumping a pointer through 2 MB chunks of its own
+// instead of one malloc each. Freeing one of them only counts it, and the
+// chunks go back to a shared pool, all at once, when the last has been
+// freed, which json_decref(root) does for a page nobody kept a piece of.
+// Pages of a megabyte or more ask for transparent huge pages.
+//
+// Chunks come from one reserved stretch of address space, so telling arena
+// memory from heap memory is a range check. Values created any other way,
+// and allocations too large for a chunk, still use malloc. A few spare
+// chunks are kept resident; the rest are handed back to the kernel, so a
+// long daemon run holds only what its pages in flight need.
+//
+// Any thread may parse; the arena being filled is per thread. Set
+// REPSLY_JSON_ARENA=0 to parse with plain malloc.
+
+// json_loadb, with the result in a fresh arena
+json_t *json_arena_load(const char *text, size_t length, json_error_t *error);
+
+#endif // JSON_ARENA_H
@@ -0,0 +1,55 @@
+#ifndef JSON_DECODER_H
+#define JSON_DECODER_H
+
+#include <stddef.h>
+#include <jansson.h>
+
+// Single-pass decoding of Repsly records. Instead of one json_object_get (one
+// hash + probe) per mapped field, a decoder walks a record's members once and
+// dispatches each key through a perfect hash of the field names it expects,
+// built once when the decoder is created.
+
+#define JSON_VALUE_SCRATCH_SIZE 32
+
+typedef enum {
+    FIELD_TEXT,
+    FIELD_INTEGER,
+    FIELD_REAL,
+    FIELD_BOOL,
+    FIELD_TIMESTAMP,   // "/Date(ms)/", ISO or epoch values (see temporal.h), written as ISO text
+    FIELD_DATE
+} FieldType;
+
+typedef struct JsonDecoder* JsonDecoderPtr;
+
+// Field i of field_names is delivered in slots[i] by json_decoder_decode.
+// name (e.g. "visits") labels the decoder's log lines and must outlive it.
+JsonDecoderPtr json_decoder_create(const char *name, const char *const *field_names, int field_count);
+void json_decoder_free(JsonDecoderPtr decoder);
+
+int json_decoder_field_count(JsonDecoderPtr decoder);
+
+// Fills slots (field_count entries) with the record's values, NULL for fields
+// the record doesn't carry. Returns the number of members that matched none of
+// the expected names; those are also added to the decoder's running total.
+int json_decoder_decode(JsonDecoderPtr decoder, json_t *object, json_t **slots);
+long json_decoder_unknown_count(JsonDecoderPtr decoder);
+
+// The field a key of length bytes (not NUL-terminated) names, or -1; for
+// decoding from other representations (see json_scan.h)
+int json_decoder_lookup(JsonDecoderPtr decoder, const char *key, size_t length);
+void json_decoder_add_unknown(JsonDecoderPtr decoder, int unknown);
+
+// json_value_text of slots[field], as filled by json_decoder_decode. A date
+// or timestamp that doesn't parse comes back NULL like a missing one, but is
+// also added to the decoder's running total of rejected values and, for the
+// first few, logged with the field and the raw value.
+const char *json_decoder_text(JsonDecoderPtr decoder, json_t **slots, int field, FieldType type, char *scratch);
+long json_decoder_rejected_count(JsonDecoderPtr decoder);
+
+// Renders a decoded value as the text we bind to Postgres. Strings are
+// returned in place; numbers, booleans and Repsly dates are formatted into
+// scratch (JSON_VALUE_SCRATCH_SIZE bytes). NULL for missing or null values.
+const char *json_value_text(json_t *value, FieldType type, char *scratch);
+
+#endif // JSON_DECODER_H
@@ -0,0 +1,60 @@
+#ifndef JSON_SCAN_H
+#define JSON_SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "json_decoder.h"
+
+// On-demand reading of a response body, as an alternative to building a
+// jansson DOM for it. One pass over the text, 64 bytes at a time with
+// AVX2 or SSE2 where the CPU has them (plain C otherwise), finds every
+// structural character, string and scalar outside of strings; after that,
+// walking to a member is a few index lookups and a value is a view into the
+// text itself. Nothing is allocated per value.
+//
+// Only bracket nesting and string termination are checked up front. Values
+// are read where they stand, so a record malformed in some other way reads
+// as missing or null fields rather than failing the page.
+//
+// Positions in the index are ints; -1 means "not there".
+
+typedef struct JsonScan* JsonScanPtr;
+
+typedef struct {
+    char *data;       // string contents (without quotes), or the literal text
+    size_t length;
+    char kind;        // '"', '{', '[', 't', 'f', 'n', or the first character of a number; 0 if missing
+    int index;        // where the value is in the scan, to walk into objects and arrays
+} JsonView;
+
+// Indexes text, which must hold length bytes followed by a NUL and stay alive
+// (and writable) as long as the scan. NULL if the text isn't one well-nested
+// JSON value.
+JsonScanPtr json_scan_create(char *text, size_t length);
+void json_scan_free(JsonScanPtr scan);
+
+int json_scan_root(JsonScanPtr scan);
+
+// Members of an object are visited by key, elements of an array directly:
+// json_scan_first gives the first, json_scan_next the one after it.
+int json_scan_first(JsonScanPtr scan, int container);
+int json_scan_next(JsonScanPtr scan, int item);
+int json_scan_value(JsonScanPtr scan, int key);
+int json_scan_member(JsonScanPtr scan, int object, const char *key);
+size_t json_scan_count(JsonScanPtr scan, int container);
+
+JsonView json_scan_view(JsonScanPtr scan, int value);
+
+// json_decoder_decode over the scan: slots (field_count entries) get views of
+// the object's values, kind 0 for fields it doesn't carry
+int json_scan_decode(JsonScanPtr scan, int object, JsonDecoderPtr decoder, JsonView *slots);
+
+// json_value_text for a view. Strings are unescaped and NUL-terminated in
+// the text itself, where they stay rendered; other values go to scratch
+// (JSON_VALUE_SCRATCH_SIZE bytes). Safe to call from several threads on
+// different values of one scan.
+const char *json_view_text(JsonView *view, FieldType type, char *scratch);
+long long json_view_integer(const JsonView *view);
+bool json_view_true(const JsonView *view);
+
+#endif // JSON_SCAN_H
@@ -0,0 +1,39 @@
+#ifndef LEASES_H
+#define LEASES_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+#include "entity_registry.h"
+
+// Entity leases in meta.leases, so several mirror instances on one database
+// split the entities between them instead of each syncing all of them. Off
+// unless REPSLY_LEASES=1.
+//
+// An instance syncs an entity only while it holds that entity's lease, and
+// releases it once the entity is caught up, so the next round goes to
+// whichever instance gets there first. A lease lasts REPSLY_LEASE_SECONDS
+// (default 60) and is renewed every third of that by a heartbeat thread,
+// on a connection of its own to each database the instance holds leases in,
+// so long syncs keep it. An instance that dies
+// stops renewing and its leases are free to take once they expire. Holders
+// are named by REPSLY_INSTANCE_ID, or hostname:pid; an instance restarted
+// under the same id takes its leases straight back.
+//
+// Expiry is judged by the database clock, so the machines' clocks don't
+// need to agree.
+
+bool leases_enabled(void);
+
+// True if this instance holds the lease now, or leases are off
+bool lease_acquire(PGconn *db_conn, const char *name);
+void lease_release(PGconn *db_conn, const char *name);
+
+// Keeps the entities whose leases were acquired, in order, and returns how
+// many that is; lease_release_entities gives them back
+int lease_acquire_entities(PGconn *db_conn, const EntityInfo **entities, int count);
+void lease_release_entities(PGconn *db_conn, const EntityInfo *const *entities, int count);
+
+// Stops the heartbeat and releases every lease this instance still holds
+void leases_shutdown(PGconn *db_conn);
+
+#endif // LEASES_H
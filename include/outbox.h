@@ -0,0 +1,13 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+
+// The change feed (sql/outbox.sql) is written by triggers on the mirrored
+// tables. This records that table (e.g. "field_ops.visits") was rewritten
+// with its triggers off, so consumers reread all of it. A no-op if the feed
+// isn't installed. Runs in the caller's transaction if there is one.
+bool outbox_record_reload(PGconn *db_conn, const char *table);
+
+#endif // OUTBOX_H
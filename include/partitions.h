@@ -0,0 +1,24 @@
+#ifndef PARTITIONS_H
+#define PARTITIONS_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+
+// Monthly range partitions of the fact tables (field_ops.visits,
+// field_ops.forms, sales.purchase_order_items, inventory.pricelist_items).
+// Each table has a DEFAULT partition in the schema; the mirror creates
+// <table>_yYYYYmMM partitions for the months it is about to write into, plus
+// REPSLY_PARTITION_MONTHS_AHEAD months (default 2) past the current one, so
+// rows are routed straight into their month. A partition can't be created
+// once the default holds rows for its range, which is why loaders call this
+// before writing rather than after.
+
+// Makes sure the month of date ("YYYY-MM-DD...", or NULL for today) has a
+// partition. Tables that aren't partitioned and unparseable dates are no-ops.
+// Must not be called inside a transaction that should survive a failure.
+bool partition_ensure(PGconn *db_conn, const char *table, const char *date);
+
+// Drops the known partitions, before switching databases
+void partitions_forget(void);
+
+#endif // PARTITIONS_H
@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 #include <libpq-fe.h>
+#include <jansson.h>
+#include "fingerprint.h"
 
 typedef struct PricelistData* PricelistDataPtr;
 
@@ -19,11 +21,14 @@ void pricelist_add_item(PricelistDataPtr pricelist, const char* product_code, co
                         int min_quantity, int max_quantity);
 
 bool pricelist_fetch_and_insert(PGconn *db_conn, long last_processed_id);
+bool pricelist_load_page(PGconn *db_conn, json_t *root, long last_processed_id);
+long pricelist_page_cursor(json_t *root, long last_processed_id);
 bool pricelist_insert(PGconn *db_conn, PricelistDataPtr pricelist);
 bool pricelist_update(PGconn *db_conn, PricelistDataPtr pricelist);
 
 
 int pricelist_get_id(PricelistDataPtr pricelist);
+Fingerprint pricelist_get_content_hash(PricelistDataPtr pricelist);
 
 void pricelist_free(PricelistDataPtr pricelist);
 
@@ -0,0 +1,15 @@
+#ifndef ROLLUPS_H
+#define ROLLUPS_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+
+// The rollups schema (sql/rollups.sql) is kept current by triggers on the
+// fact tables as pages are written. This recomputes the rollups fed by table
+// (e.g. "field_ops.visits") from scratch, or all of them when table is NULL,
+// for when they have drifted or their triggers were bypassed. Writes to the
+// source tables wait until it finishes. Runs in the caller's transaction if
+// there is one, and does nothing where sql/rollups.sql isn't installed.
+bool rollups_rebuild(PGconn *db_conn, const char *table);
+
+#endif // ROLLUPS_H
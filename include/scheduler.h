@@ -0,0 +1,31 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include <signal.h>
+#include <libpq-fe.h>
+#include "entity_registry.h"
+
+// Drains entities one page at a time through their load_page, keeping each
+// cursor in memory instead of reading meta.last_processed back after every
+// page. Cursors are read once per process, or once per run with leases (see
+// leases.h) since another instance may have moved them.
+//
+// An entity runs once the entities it depends on (EntityInfo.dependencies)
+// that are part of the same run have settled. Among the ready ones, the one
+// expected to finish soonest goes first: its page count from the previous
+// run times its mean page latency. An entity is drained when a page doesn't
+// advance its cursor, or holds fewer records than the fullest page it has
+// returned, which saves the empty fetch that would otherwise end it.
+
+typedef struct Scheduler* SchedulerPtr;
+
+SchedulerPtr scheduler_create(const EntityInfo *entities, int count);
+void scheduler_free(SchedulerPtr scheduler);
+
+// Syncs the entities with due[i] set (every entity if due is NULL) until each
+// is drained or has failed. Stops between pages once *stop is set (stop may
+// be NULL). Returns false if any entity failed.
+bool scheduler_run(SchedulerPtr scheduler, PGconn *db_conn, const bool *due, const volatile sig_atomic_t *stop);
+
+#endif // SCHEDULER_H
@@ -0,0 +1,50 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Durable queue of fetched API pages between the fetch and load sides.
+//
+// Pages are appended to memory-mapped segment files (segment-<seq>) in the
+// spool directory, each record checksummed and synced before it becomes
+// visible. The load side reads from the position in the "committed" file and
+// only moves it forward once a page is in the database, so after a crash or a
+// database outage loading resumes where it stopped without downloading again.
+// Fully loaded segments are deleted.
+//
+// One thread appends and one thread reads; the two may run concurrently.
+
+typedef struct Spool* SpoolPtr;
+
+typedef struct {
+    const char *entity_name;
+    long request_cursor;   // cursor the page was requested with
+    long next_cursor;      // cursor the page advances to
+    const char *data;      // page body, NUL-terminated
+    size_t length;
+} SpoolRecord;
+
+SpoolPtr spool_open(const char *dir);
+void spool_close(SpoolPtr spool);
+
+bool spool_append(SpoolPtr spool, const char *entity_name, long request_cursor, long next_cursor,
+                  const char *data, size_t length);
+
+// Where fetching should continue for an entity: the furthest cursor already
+// spooled but not yet loaded, or fallback if that is further.
+long spool_fetch_cursor(SpoolPtr spool, const char *entity_name, long fallback);
+
+// Forgets what was spooled for an entity beyond cursor, so fetching restarts
+// there once the pages past it have been skipped.
+void spool_rewind_cursor(SpoolPtr spool, const char *entity_name, long cursor);
+
+// Returns the oldest page not yet committed, waiting up to timeout_ms for one
+// to arrive. The record stays valid until spool_commit or spool_close, and
+// the same record is returned again until it is committed.
+bool spool_next(SpoolPtr spool, SpoolRecord *record, int timeout_ms);
+
+// Marks the record last returned by spool_next as loaded.
+bool spool_commit(SpoolPtr spool);
+
+#endif // SPOOL_H
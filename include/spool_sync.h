@@ -0,0 +1,17 @@
+#ifndef SPOOL_SYNC_H
+#define SPOOL_SYNC_H
+
+#include <stdbool.h>
+#include <libpq-fe.h>
+#include "entity_registry.h"
+#include "spool.h"
+
+// Syncs entities through the spool. A fetch thread pages through each entity
+// and appends every page to the spool while the calling thread loads pages out
+// of it, so a slow or unavailable database never holds up downloading.
+//
+// Returns false when loading stopped early; whatever was fetched stays
+// spooled and is loaded first on the next call, even after a restart.
+bool spool_sync(PGconn *db_conn, SpoolPtr spool, const EntityInfo *const *entities, int count);
+
+#endif // SPOOL_SYNC_H
@@ -0,0 +1,43 @@
+#ifndef SQL_STATS_H
+#define SQL_STATS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <libpq-fe.h>
+
+// Synchronous statements run through these wrappers instead of PQexec*.
+// Each call is counted under its tag (the caller's __func__, or a literal),
+// timed into a per-tag latency histogram and traced (see trace.h).
+//
+// A statement slower than REPSLY_SLOW_SQL_MS (default 1000, 0 turns it off)
+// is run again under EXPLAIN (ANALYZE, BUFFERS) and the plan is stored in
+// meta.slow_statements, at most once a minute per tag. The rerun is rolled
+// back (to a savepoint if the caller is inside a transaction), so only
+// sequence values it drew are lost.
+//
+// Tags must outlive the process. All calls come from the thread that owns
+// the connection.
+
+PGresult *sql_exec(PGconn *conn, const char *tag, const char *command);
+PGresult *sql_exec_params(PGconn *conn, const char *tag, const char *query, int n_params,
+                          const char *const *param_values, const int *param_lengths, const int *param_formats);
+// stmt_name was prepared from query, which is what gets explained
+PGresult *sql_exec_prepared(PGconn *conn, const char *tag, const char *stmt_name, const char *query, int n_params,
+                            const char *const *param_values, const int *param_lengths, const int *param_formats);
+
+// Pipeline mode: sql_send_params queues a statement, and every result read
+// back, the sync included, goes through sql_pipeline_result, which counts it
+// against the statement it answers. Latencies run from queueing to result,
+// so they include the wait behind earlier statements. Pipelined statements
+// aren't explained. sql_pipeline_discard drops what is still outstanding
+// once a pipeline is over or abandoned.
+bool sql_send_params(PGconn *conn, const char *tag, const char *query, int n_params,
+                     const char *const *param_values, const int *param_lengths, const int *param_formats);
+void sql_pipeline_result(PGresult *result);
+void sql_pipeline_discard(void);
+
+// Per-tag counts and latency percentiles, slowest total first. main prints
+// this at exit when REPSLY_SQL_STATS is set.
+void sql_stats_report(FILE *out);
+
+#endif // SQL_STATS_H
@@ -0,0 +1,33 @@
+#ifndef SQL_TEXT_H
+#define SQL_TEXT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <libpq-fe.h>
+
+// Statement text built up piece by piece. Starts zeroed; the caller frees
+// data. Once an append fails the text stays failed, so a statement can be
+// assembled first and checked once.
+struct SqlText {
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+};
+
+// Both return false once the text has failed
+bool sql_append(struct SqlText *sql, const char *text);
+// A quoted identifier or literal, as escaped by libpq
+bool sql_append_escaped(struct SqlText *sql, PGconn *db_conn, const char *text, bool identifier);
+
+// Elements of a Postgres array literal, for passing a batch as one text
+// parameter: the caller appends the braces. Text is double-quoted with " and
+// \ escaped; NULL stays bare.
+bool sql_append_array_int(struct SqlText *sql, int value);
+bool sql_append_array_text(struct SqlText *sql, const char *value);
+
+// Runs a statement that returns no rows through sql_exec and logs it if it
+// fails. tag must outlive the process (see sql_stats.h).
+bool sql_run(PGconn *db_conn, const char *tag, const char *sql);
+
+#endif // SQL_TEXT_H
@@ -0,0 +1,40 @@
+#ifndef TEMPORAL_H
+#define TEMPORAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "json_decoder.h"
+
+// Repsly dates and timestamps decoded in place, without allocating or going
+// through libc's time functions. Values count from 2000-01-01, the epoch
+// Postgres uses on the wire: microseconds for FIELD_TIMESTAMP, days for
+// FIELD_DATE (a timestamp read as a date keeps its day).
+//
+// Accepted:
+//   "/Date(1428570000000+0200)/"   UTC milliseconds; the offset only names
+//                                  the rep's zone and is ignored
+//   1428570000, 1428570000000      epoch seconds, or milliseconds when the
+//                                  number is too large to be seconds
+//   "2015-04-09", "2015-04-09T09:00", "2015-04-09 09:00:00.123456Z"
+//                                  ISO-8601; a zone suffix is accepted and
+//                                  dropped, as a timestamp column would
+//
+// Anything else, including impossible dates and years outside 1-9999, is
+// rejected so it never reaches the database.
+
+#define TEMPORAL_TEXT_SIZE 27   // "YYYY-MM-DD HH:MM:SS.ffffff"
+#define TEMPORAL_BINARY_SIZE 8
+
+bool temporal_parse(const char *text, FieldType type, int64_t *value);
+bool temporal_decode(json_t *json, FieldType type, int64_t *value);
+bool temporal_from_epoch(int64_t epoch, FieldType type, int64_t *value);   // seconds or milliseconds
+
+// Writes value as Postgres prints it ("YYYY-MM-DD" or "YYYY-MM-DD HH:MM:SS",
+// with fractional seconds only if there are any) and returns out
+const char *temporal_format(int64_t value, FieldType type, char *out);
+
+// Writes value in the binary format of a timestamp or date parameter and
+// returns its length
+int temporal_binary(int64_t value, FieldType type, char *out);
+
+#endif // TEMPORAL_H
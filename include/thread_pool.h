@@ -0,0 +1,30 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+
+// Fixed set of worker threads with one work deque each. A run is split into
+// index ranges spread across the deques; a worker drains its own deque from
+// the back and, once empty, steals from the front of the others, so uneven
+// records (a 40-field form next to a 3-field one) don't leave cores idle.
+//
+// Tasks write their result into slot i of a caller-owned array, which keeps
+// the output in the original record order regardless of who ran what.
+
+typedef struct ThreadPool* ThreadPoolPtr;
+typedef void (*ThreadPoolTask)(void *context, size_t index);
+
+ThreadPoolPtr thread_pool_create(int worker_count);
+void thread_pool_free(ThreadPoolPtr pool);
+int thread_pool_worker_count(ThreadPoolPtr pool);
+
+// Runs task(context, i) for every i in [0, count) and returns once all of
+// them have finished. Not reentrant: one run at a time per pool.
+void thread_pool_run(ThreadPoolPtr pool, size_t count, ThreadPoolTask task, void *context);
+
+// Process-wide pool for record decoding, sized from REPSLY_DECODE_THREADS or
+// the number of online cores. Create and free it from the main thread.
+ThreadPoolPtr thread_pool_shared(void);
+void thread_pool_shared_free(void);
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,27 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Span tracing, off unless REPSLY_TRACE names a file. Each thread records
+// finished spans into its own ring of REPSLY_TRACE_EVENTS entries (default
+// 65536; the oldest are overwritten), so recording takes no lock. The rings
+// are written out by trace_shutdown as Chrome trace JSON, which
+// chrome://tracing and ui.perfetto.dev open directly.
+//
+//   TraceSpan span = trace_begin();
+//   ...
+//   trace_end(span, "api_fetch", endpoint);
+//
+// name must outlive the process (a literal or __func__); detail is copied and
+// may be NULL.
+
+typedef uint64_t TraceSpan;   // start time in ns, 0 while tracing is off
+
+TraceSpan trace_begin(void);
+void trace_end(TraceSpan span, const char *name, const char *detail);
+
+// Writes the trace file. Call once the other threads have stopped recording.
+void trace_shutdown(void);
+
+#endif // TRACE_H
@@ -0,0 +1,735 @@
+#include "../include/accounts.h"
+#include "../include/api.h"
+#include "../include/json_arena.h"
+#include "../include/config.h"
+#include "../include/core_operations.h"
+#include "../include/entity_registry.h"
+#include "../include/columnar_export.h"
+#include "../include/asset_mirror.h"
+#include "../include/dimension_cache.h"
+#include "../include/address_resolver.h"
+#include "../include/client.h"
+#include "../include/partitions.h"
+#include "../include/form_answers.h"
+#include "../include/leases.h"
+#include "../include/trace.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <jansson.h>
+
+#define MAX_ACCOUNTS 32
+#define MAX_FETCH_WORKERS 32
+#define DEFAULT_FETCH_WORKERS 4
+#define DEFAULT_CONNECTIONS 2
+#define DEFAULT_QUEUED_PAGES 16
+#define DEFAULT_POLL_INTERVAL 300
+#define STOP_CHECK_MS 1000
+
+struct AccountEntity {
+    const EntityInfo *info;
+    int *dependencies;      // indexes of the entities to sync first
+    int dependency_count;
+    long cursor;
+    bool busy;      // a page is being fetched or waits to be loaded
+    bool done;      // caught up, failed or leased elsewhere, for this round
+    bool leased;    // only touched by the loading thread
+};
+
+struct Account {
+    char name[64];
+    char database[128];
+    ApiCredentialsPtr credentials;
+    long request_spacing;   // ms between requests, 0 for no limit
+    long next_request;      // earliest now_ms() for the next one
+    struct AccountEntity *entities;
+    int entity_count;
+    int next_entity;
+    bool started;           // cursors read and leases taken this round
+    PGconn *conn;
+    long last_used;
+};
+
+struct FetchedPage {
+    struct Account *account;
+    struct AccountEntity *entity;
+    long cursor;
+    json_t *root;           // parsed unless the entity has load_text
+    char *text;             // the response itself if it does
+    size_t length;          // root and text are both NULL if the fetch failed
+    struct FetchedPage *next;
+};
+
+struct AccountPool {
+    struct Account accounts[MAX_ACCOUNTS];
+    int account_count;
+    int next_account;
+    int max_connections;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_changed;    // an entity became free, or the pool is finishing
+    pthread_cond_t page_ready;
+    struct FetchedPage *head;
+    struct FetchedPage *tail;
+    int pending;            // pages being fetched or waiting to be loaded
+    int max_pending;
+    bool finished;
+
+    // Account whose database the process-wide caches describe
+    struct Account *cached;
+    long use_counter;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void timed_wait(pthread_cond_t *cond, pthread_mutex_t *lock, long timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(cond, lock, &deadline);
+}
+
+static char *trim(char *text) {
+    while (*text == ' ' || *text == '\t') {
+        text++;
+    }
+    size_t len = strlen(text);
+    while (len > 0 && (text[len - 1] == ' ' || text[len - 1] == '\t')) {
+        text[--len] = '\0';
+    }
+    return text;
+}
+
+bool accounts_configured(const char *config_path) {
+    MirrorConfigPtr config = config_load(config_path);
+    if (!config) {
+        return false;
+    }
+    const char *names = config_get_string(config, "accounts", "");
+    bool configured = strspn(names, " \t,") < strlen(names);
+    config_free(config);
+    return configured;
+}
+
+
+// Setup
+
+static const char *account_setting(MirrorConfigPtr config, const char *account, const char *setting) {
+    char key[128];
+    snprintf(key, sizeof(key), "account.%s.%s", account, setting);
+    return config_get_string(config, key, NULL);
+}
+
+static bool account_init(struct Account *account, MirrorConfigPtr config, const char *name) {
+    snprintf(account->name, sizeof(account->name), "%s", name);
+
+    const char *username = account_setting(config, name, "username");
+    const char *password = account_setting(config, name, "password");
+    if (!username || !password) {
+        fprintf(stderr, "Account %s has no username or password\n", name);
+        return false;
+    }
+    account->credentials = api_credentials_create(username, password);
+    if (!account->credentials) {
+        fprintf(stderr, "Failed to set up credentials for account %s\n", name);
+        return false;
+    }
+
+    const char *database = account_setting(config, name, "database");
+    if (database) {
+        snprintf(account->database, sizeof(account->database), "%s", database);
+    } else {
+        const char *base = getenv("REPSLY_DB_NAME");
+        snprintf(account->database, sizeof(account->database), "%s_%s", base ? base : "repsly", name);
+    }
+
+    char key[128];
+    snprintf(key, sizeof(key), "account.%s.requests_per_minute", name);
+    long per_minute = config_get_long(config, key, config_get_long(config, "accounts.requests_per_minute", 0));
+    account->request_spacing = per_minute > 0 ? 60000L / per_minute : 0;
+
+    int count;
+    const EntityInfo *entities = entity_registry(&count);
+    account->entities = calloc((size_t)count, sizeof(struct AccountEntity));
+    if (!account->entities) {
+        return false;
+    }
+    account->entity_count = count;
+    for (int i = 0; i < count; i++) {
+        struct AccountEntity *entity = &account->entities[i];
+        entity->info = &entities[i];
+        entity->done = true;
+        if (!entities[i].dependencies) {
+            continue;
+        }
+
+        int named = 0;
+        while (entities[i].dependencies[named]) {
+            named++;
+        }
+        entity->dependencies = calloc((size_t)named, sizeof(int));
+        if (!entity->dependencies) {
+            return false;
+        }
+        for (int d = 0; d < named; d++) {
+            for (int j = 0; j < count; j++) {
+                if (j != i && strcmp(entities[j].name, entities[i].dependencies[d]) == 0) {
+                    entity->dependencies[entity->dependency_count++] = j;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static bool pool_load_accounts(struct AccountPool *pool, MirrorConfigPtr config) {
+    char *names = strdup(config_get_string(config, "accounts", ""));
+    if (!names) {
+        return false;
+    }
+
+    bool success = true;
+    char *saveptr;
+    for (char *name = strtok_r(names, ",", &saveptr); name && success; name = strtok_r(NULL, ",", &saveptr)) {
+        name = trim(name);
+        if (!*name) {
+            continue;
+        }
+        if (pool->account_count == MAX_ACCOUNTS) {
+            fprintf(stderr, "More than %d accounts configured\n", MAX_ACCOUNTS);
+            success = false;
+            break;
+        }
+        success = account_init(&pool->accounts[pool->account_count++], config, name);
+    }
+
+    free(names);
+    return success && pool->account_count > 0;
+}
+
+
+// Fetching
+
+// The response text of one page, NULL if the fetch failed
+static char *fetch_page(struct Account *account, const EntityInfo *entity, long cursor, size_t *length) {
+    ApiRequestPtr request = api_request_create_as(account->credentials, entity->endpoint, cursor, NULL);
+    if (!request) {
+        return NULL;
+    }
+
+    TraceSpan span = trace_begin();
+    CURLcode res = curl_easy_perform(api_request_handle(request));
+    trace_end(span, "api_fetch", entity->endpoint);
+    char *body = res == CURLE_OK ? api_request_take_body(request, length) : NULL;
+    if (res != CURLE_OK) {
+        fprintf(stderr, "curl_easy_perform() failed for account %s: %s\n", account->name, curl_easy_strerror(res));
+    }
+    api_request_free(request);
+    return body;
+}
+
+// Frees body
+static json_t *parse_page(struct Account *account, const EntityInfo *entity, char *body, size_t length) {
+    if (!body) {
+        return NULL;
+    }
+
+    json_error_t error;
+    TraceSpan span = trace_begin();
+    json_t *root = json_arena_load(body, length, &error);
+    trace_end(span, "json_parse", entity->endpoint);
+    free(body);
+    if (!root) {
+        fprintf(stderr, "JSON parsing error in %s page of account %s: %s\n", entity->name, account->name, error.text);
+    }
+    return root;
+}
+
+// Ready once the entities it depends on are caught up, so their pages are
+// loaded before its first one is fetched
+static bool entity_ready(const struct Account *account, const struct AccountEntity *entity) {
+    for (int d = 0; d < entity->dependency_count; d++) {
+        const struct AccountEntity *dependency = &account->entities[entity->dependencies[d]];
+        if (dependency->busy || !dependency->done) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Next entity to fetch, taking accounts in turn. Returns false with *wait_ms
+// set when the only accounts with work are holding back for their limit.
+static bool pool_next_task(struct AccountPool *pool, struct Account **account_out,
+                           struct AccountEntity **entity_out, long *wait_ms) {
+    long now = now_ms();
+    *wait_ms = 0;
+
+    for (int a = 0; a < pool->account_count; a++) {
+        int account_index = (pool->next_account + a) % pool->account_count;
+        struct Account *account = &pool->accounts[account_index];
+
+        for (int e = 0; e < account->entity_count; e++) {
+            int entity_index = (account->next_entity + e) % account->entity_count;
+            struct AccountEntity *entity = &account->entities[entity_index];
+            if (entity->busy || entity->done || !entity_ready(account, entity)) {
+                continue;
+            }
+
+            if (account->next_request > now) {
+                long wait = account->next_request - now;
+                if (*wait_ms == 0 || wait < *wait_ms) {
+                    *wait_ms = wait;
+                }
+                break;
+            }
+
+            pool->next_account = (account_index + 1) % pool->account_count;
+            account->next_entity = (entity_index + 1) % account->entity_count;
+            account->next_request = now + account->request_spacing;
+            *account_out = account;
+            *entity_out = entity;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *fetch_worker(void *arg) {
+    struct AccountPool *pool = (struct AccountPool *)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->finished) {
+        struct Account *account;
+        struct AccountEntity *entity;
+        long wait_ms = 0;
+        if (pool->pending >= pool->max_pending || !pool_next_task(pool, &account, &entity, &wait_ms)) {
+            if (wait_ms > 0) {
+                timed_wait(&pool->work_changed, &pool->lock, wait_ms);
+            } else {
+                pthread_cond_wait(&pool->work_changed, &pool->lock);
+            }
+            continue;
+        }
+
+        entity->busy = true;
+        pool->pending++;
+        long cursor = entity->cursor;
+        pthread_mutex_unlock(&pool->lock);
+
+        struct FetchedPage *page = calloc(1, sizeof(struct FetchedPage));
+        size_t length = 0;
+        char *text = fetch_page(account, entity->info, cursor, &length);
+        json_t *root = NULL;
+        if (!entity->info->load_text) {
+            root = parse_page(account, entity->info, text, length);
+            text = NULL;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (!page) {
+            json_decref(root);
+            free(text);
+            entity->busy = false;
+            entity->done = true;
+            pool->pending--;
+            pthread_cond_signal(&pool->page_ready);
+            continue;
+        }
+        *page = (struct FetchedPage){account, entity, cursor, root, text, length, NULL};
+        if (pool->tail) {
+            pool->tail->next = page;
+        } else {
+            pool->head = page;
+        }
+        pool->tail = page;
+        pthread_cond_signal(&pool->page_ready);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+// Loading
+
+static bool account_idle(const struct Account *account) {
+    for (int i = 0; i < account->entity_count; i++) {
+        if (account->entities[i].busy || !account->entities[i].done) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void account_disconnect(struct Account *account) {
+    if (account->conn) {
+        db_disconnect(account->conn);
+        account->conn = NULL;
+    }
+}
+
+static PGconn *account_connection(struct AccountPool *pool, struct Account *account) {
+    if (account->conn && PQstatus(account->conn) != CONNECTION_OK) {
+        account_disconnect(account);
+    }
+
+    if (!account->conn) {
+        while (true) {
+            struct Account *oldest = NULL;
+            int open = 0;
+            for (int i = 0; i < pool->account_count; i++) {
+                struct Account *other = &pool->accounts[i];
+                if (other->conn) {
+                    open++;
+                    if (!oldest || other->last_used < oldest->last_used) {
+                        oldest = other;
+                    }
+                }
+            }
+            if (open < pool->max_connections || !oldest) {
+                break;
+            }
+            account_disconnect(oldest);
+        }
+
+        account->conn = db_connect_to(account->database);
+        if (!account->conn) {
+            fprintf(stderr, "Failed to connect to %s for account %s\n", account->database, account->name);
+            return NULL;
+        }
+    }
+
+    account->last_used = ++pool->use_counter;
+    return account->conn;
+}
+
+// Everything cached about one database is dropped before loading into another
+static void pool_use_account(struct AccountPool *pool, struct Account *account) {
+    if (pool->cached == account) {
+        return;
+    }
+    dimension_cache_clear();
+    address_resolver_forget();
+    client_fingerprints_forget();
+    partitions_forget();
+    form_answers_forget();
+    if (!export_set_scope(account->name)) {
+        fprintf(stderr, "Failed to flush the columnar export before account %s\n", account->name);
+    }
+    pool->cached = account;
+}
+
+// A page of the account being loaded if there is one. Otherwise waits for
+// that account's fetches in flight unless the queue is full, then takes the
+// oldest page of any account.
+static struct FetchedPage *pool_take_page(struct AccountPool *pool) {
+    struct FetchedPage **link = &pool->head;
+    struct FetchedPage *previous = NULL;
+    for (; *link; previous = *link, link = &(*link)->next) {
+        if ((*link)->account == pool->cached) {
+            break;
+        }
+    }
+
+    if (!*link) {
+        if (!pool->head || (pool->cached && !account_idle(pool->cached) && pool->pending < pool->max_pending)) {
+            return NULL;
+        }
+        link = &pool->head;
+        previous = NULL;
+    }
+
+    struct FetchedPage *page = *link;
+    *link = page->next;
+    if (pool->tail == page) {
+        pool->tail = previous;
+    }
+    return page;
+}
+
+// Gives back the leases of entities that stopped early
+static void account_finish(struct Account *account) {
+    bool connected = account->conn && PQstatus(account->conn) == CONNECTION_OK;
+    for (int i = 0; i < account->entity_count; i++) {
+        if (account->entities[i].leased && connected) {
+            lease_release(account->conn, account->entities[i].info->name);
+        }
+        account->entities[i].leased = false;
+    }
+    if (!stop_requested && connected) {
+        asset_mirror_run(account->conn);
+        fprintf(stderr, "Account %s is caught up\n", account->name);
+    }
+    account_disconnect(account);
+}
+
+// Runs the first time an account is scheduled in a round: reads its cursors
+// and takes the leases of the entities it syncs
+static bool account_start(struct AccountPool *pool, struct Account *account) {
+    PGconn *conn = account_connection(pool, account);
+    if (!conn) {
+        return false;
+    }
+
+    bool syncing = false;
+    for (int i = 0; i < account->entity_count; i++) {
+        struct AccountEntity *entity = &account->entities[i];
+        entity->leased = lease_acquire(conn, entity->info->name);
+        long cursor = entity->leased ? get_last_processed(conn, entity->info->name) : 0;
+        syncing = syncing || entity->leased;
+
+        pthread_mutex_lock(&pool->lock);
+        entity->cursor = cursor;
+        entity->done = !entity->leased;
+        pthread_cond_broadcast(&pool->work_changed);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (!syncing) {
+        account_disconnect(account);
+    }
+    return true;
+}
+
+static bool load_page(struct AccountPool *pool, struct FetchedPage *page) {
+    struct Account *account = page->account;
+    const EntityInfo *info = page->entity->info;
+
+    bool loaded = false;
+    long next_cursor = page->cursor;
+    if ((page->root || page->text) && !stop_requested) {
+        PGconn *conn = account_connection(pool, account);
+        if (conn) {
+            pool_use_account(pool, account);
+            if (page->text) {
+                size_t records;
+                loaded = info->load_text(conn, page->text, page->length, page->cursor, &next_cursor, &records);
+            } else {
+                next_cursor = info->page_cursor(page->root, page->cursor);
+                loaded = info->load_page(conn, page->root, page->cursor);
+            }
+            if (!loaded) {
+                fprintf(stderr, "Failed to load %s page of account %s\n", info->name, account->name);
+            }
+        }
+    }
+    json_decref(page->root);
+    free(page->text);
+
+    pthread_mutex_lock(&pool->lock);
+    struct AccountEntity *entity = page->entity;
+    entity->busy = false;
+    if (loaded && next_cursor > page->cursor) {
+        entity->cursor = next_cursor;
+    } else {
+        entity->done = true;
+    }
+    pool->pending--;
+    bool drained = entity->done;
+    bool finished = account_idle(account);
+    pthread_cond_broadcast(&pool->work_changed);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (drained && entity->leased && account->conn) {
+        lease_release(account->conn, info->name);
+        entity->leased = false;
+    }
+    if (finished) {
+        account_finish(account);
+    }
+    free(page);
+    return loaded;
+}
+
+static bool pool_syncing(const struct AccountPool *pool) {
+    for (int a = 0; a < pool->account_count; a++) {
+        if (!account_idle(&pool->accounts[a])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// An account not yet started this round, while fewer than
+// accounts.connections accounts are syncing
+static struct Account *pool_next_account(struct AccountPool *pool) {
+    struct Account *next = NULL;
+    int syncing = 0;
+    for (int a = 0; a < pool->account_count; a++) {
+        struct Account *account = &pool->accounts[a];
+        if (!account->started) {
+            next = next ? next : account;
+        } else if (!account_idle(account)) {
+            syncing++;
+        }
+    }
+    return syncing < pool->max_connections ? next : NULL;
+}
+
+// Starts accounts as there is room for them and loads pages until all are
+// caught up
+static bool pool_run_round(struct AccountPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    for (int a = 0; a < pool->account_count; a++) {
+        pool->accounts[a].started = false;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    bool success = true;
+    while (true) {
+        struct Account *account = NULL;
+        struct FetchedPage *page = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        while (true) {
+            if (stop_requested) {
+                for (int a = 0; a < pool->account_count; a++) {
+                    for (int i = 0; i < pool->accounts[a].entity_count; i++) {
+                        pool->accounts[a].entities[i].done = true;
+                    }
+                }
+            } else {
+                account = pool_next_account(pool);
+            }
+            if (account || (page = pool_take_page(pool)) || !pool_syncing(pool)) {
+                break;
+            }
+            timed_wait(&pool->page_ready, &pool->lock, STOP_CHECK_MS);
+        }
+        if (account) {
+            account->started = true;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (account) {
+            success = account_start(pool, account) && success;
+        } else if (page) {
+            success = load_page(pool, page) && success;
+        } else {
+            break;
+        }
+    }
+
+    // Accounts stopped with no page in flight still hold leases
+    for (int a = 0; a < pool->account_count; a++) {
+        if (pool->accounts[a].conn) {
+            account_finish(&pool->accounts[a]);
+        }
+    }
+    export_flush_all();
+    return success && !stop_requested;
+}
+
+static void pool_free(struct AccountPool *pool) {
+    for (int a = 0; a < pool->account_count; a++) {
+        account_disconnect(&pool->accounts[a]);
+        api_credentials_free(pool->accounts[a].credentials);
+        for (int i = 0; i < pool->accounts[a].entity_count; i++) {
+            free(pool->accounts[a].entities[i].dependencies);
+        }
+        free(pool->accounts[a].entities);
+    }
+}
+
+int accounts_run(const char *config_path, bool repeat) {
+    MirrorConfigPtr config = config_load(config_path);
+    if (!config) {
+        fprintf(stderr, "Failed to allocate config\n");
+        return 1;
+    }
+
+    struct AccountPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_changed, NULL);
+    pthread_cond_init(&pool.page_ready, NULL);
+
+    long workers = config_get_long(config, "accounts.fetch_workers", DEFAULT_FETCH_WORKERS);
+    long connections = config_get_long(config, "accounts.connections", DEFAULT_CONNECTIONS);
+    long queued = config_get_long(config, "accounts.queued_pages", DEFAULT_QUEUED_PAGES);
+    long interval = config_get_long(config, "interval.default", DEFAULT_POLL_INTERVAL);
+    workers = workers < 1 ? 1 : workers > MAX_FETCH_WORKERS ? MAX_FETCH_WORKERS : workers;
+    pool.max_connections = connections < 1 ? 1 : (int)connections;
+    pool.max_pending = queued < 1 ? 1 : (int)queued;
+    if (interval <= 0) {
+        interval = DEFAULT_POLL_INTERVAL;
+    }
+
+    if (!pool_load_accounts(&pool, config)) {
+        pool_free(&pool);
+        config_free(config);
+        return 1;
+    }
+    config_free(config);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = handle_stop;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    // Workers inherit a mask without the stop signals, so they interrupt
+    // this thread's sleep between rounds
+    sigset_t stop_signals, previous_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &previous_mask);
+
+    pthread_t threads[MAX_FETCH_WORKERS];
+    int started = 0;
+    for (; started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, fetch_worker, &pool) != 0) {
+            fprintf(stderr, "Failed to start fetch worker\n");
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+
+    fprintf(stderr, "Mirroring %d accounts with %d fetch workers\n", pool.account_count, started);
+    int status = 0;
+    if (started > 0) {
+        do {
+            status = pool_run_round(&pool) ? 0 : 1;
+            for (unsigned int left = (unsigned int)interval; repeat && left > 0 && !stop_requested; ) {
+                left = sleep(left);
+            }
+        } while (repeat && !stop_requested);
+    } else {
+        status = 1;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.finished = true;
+    pthread_cond_broadcast(&pool.work_changed);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pool_free(&pool);
+    pthread_cond_destroy(&pool.page_ready);
+    pthread_cond_destroy(&pool.work_changed);
+    pthread_mutex_destroy(&pool.lock);
+    return status;
+}
@@ -0,0 +1,480 @@
+#include "../include/address_resolver.h"
+#include "../include/sql_stats.h"
+#include "../include/sql_text.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NAME_SIZE 256   // VARCHAR(255)
+#define CODE_SIZE 21    // VARCHAR(20)
+
+enum AddressLevel {
+    LEVEL_COUNTRY,
+    LEVEL_STATE,
+    LEVEL_CITY,
+    LEVEL_ZIP,
+    LEVEL_STREET,
+    LEVEL_COUNT
+};
+
+// Each level loads as (id, parent id, name, ext) ordered by id, and creates
+// from unnest($1 names, $2 parent ids, $3 exts) returning (ordinality, id)
+struct LevelQueries {
+    const char *table;
+    int create_params;
+    const char *load_query;
+    const char *create_query;
+};
+
+static const struct LevelQueries level_queries[LEVEL_COUNT] = {
+    [LEVEL_COUNTRY] = {"geography.countries", 1,
+        "SELECT country_id, 0, COALESCE(name, ''), '' FROM geography.countries ORDER BY 1",
+        "WITH input AS (SELECT * FROM unnest($1::text[]) WITH ORDINALITY AS i(name, slot)), "
+        "created AS ("
+        "    INSERT INTO geography.countries (name) SELECT name FROM input "
+        "    ON CONFLICT (name) DO UPDATE SET name = EXCLUDED.name "
+        "    RETURNING country_id, name"
+        ") "
+        "SELECT input.slot, created.country_id FROM input JOIN created ON created.name = input.name"},
+    [LEVEL_STATE] = {"geography.states", 2,
+        "SELECT state_id, country_id, COALESCE(name, ''), '' FROM geography.states "
+        "WHERE country_id IS NOT NULL ORDER BY 1",
+        "WITH input AS (SELECT * FROM unnest($1::text[], $2::int[]) WITH ORDINALITY AS i(name, parent, slot)), "
+        "created AS ("
+        "    INSERT INTO geography.states (name, country_id) SELECT name, parent FROM input "
+        "    ON CONFLICT (name, country_id) DO UPDATE SET name = EXCLUDED.name "
+        "    RETURNING state_id, name, country_id"
+        ") "
+        "SELECT input.slot, created.state_id FROM input "
+        "JOIN created ON created.name = input.name AND created.country_id = input.parent"},
+    [LEVEL_CITY] = {"geography.cities", 2,
+        "SELECT city_id, state_id, COALESCE(name, ''), '' FROM geography.cities "
+        "WHERE state_id IS NOT NULL ORDER BY 1",
+        "WITH input AS (SELECT * FROM unnest($1::text[], $2::int[]) WITH ORDINALITY AS i(name, parent, slot)), "
+        "created AS ("
+        "    INSERT INTO geography.cities (name, state_id) SELECT name, parent FROM input "
+        "    ON CONFLICT (name, state_id) DO UPDATE SET name = EXCLUDED.name "
+        "    RETURNING city_id, name, state_id"
+        ") "
+        "SELECT input.slot, created.city_id FROM input "
+        "JOIN created ON created.name = input.name AND created.state_id = input.parent"},
+    [LEVEL_ZIP] = {"geography.zip_codes", 3,
+        "SELECT zip_code_id, city_id, COALESCE(code, ''), COALESCE(ext, '') FROM geography.zip_codes "
+        "WHERE city_id IS NOT NULL ORDER BY 1",
+        "WITH input AS ("
+        "    SELECT * FROM unnest($1::text[], $2::int[], $3::text[]) WITH ORDINALITY AS i(code, parent, ext, slot)"
+        "), "
+        "created AS ("
+        "    INSERT INTO geography.zip_codes (code, ext, city_id) SELECT code, ext, parent FROM input "
+        "    ON CONFLICT (code, ext, city_id) DO UPDATE SET code = EXCLUDED.code "
+        "    RETURNING zip_code_id, code, ext, city_id"
+        ") "
+        "SELECT input.slot, created.zip_code_id FROM input "
+        "JOIN created ON created.code = input.code AND created.ext = input.ext AND created.city_id = input.parent"},
+    [LEVEL_STREET] = {"core.addresses", 2,
+        "SELECT address_id, zip_code_id, COALESCE(street_address, ''), '' FROM core.addresses "
+        "WHERE zip_code_id IS NOT NULL ORDER BY 1",
+        "WITH input AS (SELECT * FROM unnest($1::text[], $2::int[]) WITH ORDINALITY AS i(name, parent, slot)), "
+        "created AS ("
+        "    INSERT INTO core.addresses (street_address, zip_code_id) SELECT name, parent FROM input "
+        "    ON CONFLICT (street_address, zip_code_id) DO UPDATE SET street_address = EXCLUDED.street_address "
+        "    RETURNING address_id, street_address, zip_code_id"
+        ") "
+        "SELECT input.slot, created.address_id FROM input "
+        "JOIN created ON created.street_address = input.name AND created.zip_code_id = input.parent"},
+};
+
+// Node 0 is the root; every other node is one row at the level below its
+// parent's. Children are found through one hash table keyed by (parent, key).
+struct TrieNode {
+    int parent;
+    int id;         // 0 until the row exists
+    bool queued;    // already in the statement being built
+    char *key;      // folded name (and ext), for matching
+    char *name;     // as stored
+    char *ext;      // zip codes only
+};
+
+static struct TrieNode *nodes;
+static int node_count;
+static int node_capacity;
+static int *edges;              // node indices; 0 marks an empty slot
+static size_t edge_capacity;
+static bool loaded;
+
+struct AddressBatch {
+    int (*paths)[LEVEL_COUNT];  // node at each level, per added address
+    size_t count;
+    size_t capacity;
+};
+
+
+// Canonical text
+
+enum TextCase {
+    CASE_FOLD,      // lower case, for keys
+    CASE_TITLE,     // all lower case input is title cased, anything else kept
+    CASE_UPPER
+};
+
+static bool word_start(const char *text, const char *p) {
+    return p == text || p[-1] == ' ' || p[-1] == '-' || p[-1] == '/' || p[-1] == '.' || p[-1] == '(';
+}
+
+// Trims and collapses whitespace runs to one space. Only ASCII letters
+// change case; UTF-8 sequences pass through.
+static void canonical_text(const char *text, enum TextCase mode, char *out, size_t size) {
+    size_t n = 0;
+    bool space = false;
+    for (const char *p = text ? text : ""; *p && n + 1 < size; p++) {
+        if (isspace((unsigned char)*p)) {
+            space = n > 0;
+            continue;
+        }
+        if (space) {
+            out[n++] = ' ';
+            space = false;
+            if (n + 1 == size) {
+                break;
+            }
+        }
+        out[n++] = *p;
+    }
+    out[n] = '\0';
+
+    bool has_upper = false;
+    for (char *p = out; *p && mode == CASE_TITLE; p++) {
+        has_upper = has_upper || (*p >= 'A' && *p <= 'Z');
+    }
+    for (char *p = out; *p; p++) {
+        if (mode == CASE_FOLD && *p >= 'A' && *p <= 'Z') {
+            *p = (char)(*p - 'A' + 'a');
+        } else if ((mode == CASE_UPPER || (mode == CASE_TITLE && !has_upper && word_start(out, p))) &&
+                   *p >= 'a' && *p <= 'z') {
+            *p = (char)(*p - 'a' + 'A');
+        }
+    }
+}
+
+static void node_key(const char *name, const char *ext, char *key, size_t size) {
+    canonical_text(name, CASE_FOLD, key, size);
+    if (ext) {
+        size_t n = strlen(key);
+        if (n + 2 < size) {
+            key[n++] = '\x1f';
+            canonical_text(ext, CASE_FOLD, key + n, size - n);
+        }
+    }
+}
+
+
+// Trie
+
+static uint64_t edge_hash(int parent, const char *key) {
+    uint64_t hash = 14695981039346656037u ^ (uint64_t)parent;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211u;
+    }
+    return hash;
+}
+
+static int *edge_slot(int parent, const char *key) {
+    size_t mask = edge_capacity - 1;
+    for (size_t i = edge_hash(parent, key) & mask;; i = (i + 1) & mask) {
+        int node = edges[i];
+        if (node == 0 || (nodes[node].parent == parent && strcmp(nodes[node].key, key) == 0)) {
+            return &edges[i];
+        }
+    }
+}
+
+static bool edges_grow(void) {
+    size_t capacity = edge_capacity ? edge_capacity * 2 : 1024;
+    int *grown = calloc(capacity, sizeof(int));
+    if (!grown) {
+        return false;
+    }
+    free(edges);
+    edges = grown;
+    edge_capacity = capacity;
+    for (int node = 1; node < node_count; node++) {
+        *edge_slot(nodes[node].parent, nodes[node].key) = node;
+    }
+    return true;
+}
+
+static void trie_clear(void) {
+    for (int i = 0; i < node_count; i++) {
+        free(nodes[i].key);
+    }
+    free(nodes);
+    free(edges);
+    nodes = NULL;
+    edges = NULL;
+    node_count = node_capacity = 0;
+    edge_capacity = 0;
+    loaded = false;
+}
+
+void address_resolver_forget(void) {
+    trie_clear();
+}
+
+// The child of parent with key, added with name, ext and id if missing.
+// Returns the node, or -1 if out of memory.
+static int trie_child(int parent, const char *key, const char *name, const char *ext, int id) {
+    if (((size_t)node_count + 1) * 10 > edge_capacity * 7 && !edges_grow()) {
+        return -1;
+    }
+    int *slot = edge_slot(parent, key);
+    if (*slot) {
+        return *slot;
+    }
+
+    if (node_count == node_capacity) {
+        int capacity = node_capacity ? node_capacity * 2 : 1024;
+        struct TrieNode *grown = realloc(nodes, (size_t)capacity * sizeof(struct TrieNode));
+        if (!grown) {
+            return -1;
+        }
+        nodes = grown;
+        node_capacity = capacity;
+    }
+
+    // key, name and ext share one allocation
+    size_t key_length = strlen(key) + 1, name_length = strlen(name) + 1, ext_length = ext ? strlen(ext) + 1 : 0;
+    char *strings = malloc(key_length + name_length + ext_length);
+    if (!strings) {
+        return -1;
+    }
+    memcpy(strings, key, key_length);
+    memcpy(strings + key_length, name, name_length);
+    if (ext) {
+        memcpy(strings + key_length + name_length, ext, ext_length);
+    }
+
+    nodes[node_count] = (struct TrieNode){parent, id, false, strings, strings + key_length,
+                                          ext ? strings + key_length + name_length : NULL};
+    *slot = node_count;
+    return node_count++;
+}
+
+struct IdNode {
+    int id;
+    int node;
+};
+
+static int id_node_compare(const void *a, const void *b) {
+    const struct IdNode *left = a, *right = b;
+    return (left->id > right->id) - (left->id < right->id);
+}
+
+static int id_node_find(const struct IdNode *map, int count, int id) {
+    struct IdNode wanted = {id, 0};
+    const struct IdNode *found = bsearch(&wanted, map, (size_t)count, sizeof(struct IdNode), id_node_compare);
+    return found ? found->node : -1;
+}
+
+// Rows whose parent is missing are left out; a duplicate under one parent
+// (names differing only in case or spacing) resolves to the first row
+static bool trie_load(PGconn *db_conn) {
+    if (loaded) {
+        return true;
+    }
+    trie_clear();
+    if (trie_child(-1, "", "", NULL, 0) != 0) {
+        fprintf(stderr, "Failed to allocate address trie\n");
+        return false;
+    }
+
+    struct IdNode *parents = NULL;
+    int parent_count = 0;
+    bool success = true;
+    for (int level = 0; level < LEVEL_COUNT && success; level++) {
+        PGresult *result = sql_exec(db_conn, __func__, level_queries[level].load_query);
+        if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+            fprintf(stderr, "Loading %s failed: %s", level_queries[level].table, PQerrorMessage(db_conn));
+            PQclear(result);
+            success = false;
+            break;
+        }
+
+        int rows = PQntuples(result);
+        struct IdNode *current = malloc((size_t)(rows ? rows : 1) * sizeof(struct IdNode));
+        int current_count = 0;
+        success = current != NULL;
+        for (int row = 0; row < rows && success; row++) {
+            int parent = level == LEVEL_COUNTRY ? 0 : id_node_find(parents, parent_count,
+                                                                   atoi(PQgetvalue(result, row, 1)));
+            if (parent < 0) {
+                continue;
+            }
+            const char *name = PQgetvalue(result, row, 2);
+            const char *ext = level == LEVEL_ZIP ? PQgetvalue(result, row, 3) : NULL;
+            char key[2 * NAME_SIZE];
+            node_key(name, ext, key, sizeof(key));
+
+            int node = trie_child(parent, key, name, ext, atoi(PQgetvalue(result, row, 0)));
+            success = node >= 0;
+            if (success) {
+                current[current_count++] = (struct IdNode){atoi(PQgetvalue(result, row, 0)), node};
+            }
+        }
+        if (!success) {
+            fprintf(stderr, "Failed to allocate address trie\n");
+        }
+
+        PQclear(result);
+        free(parents);
+        parents = current;
+        parent_count = current_count;
+    }
+    free(parents);
+
+    if (!success) {
+        trie_clear();
+        return false;
+    }
+    loaded = true;
+    return true;
+}
+
+
+
+
+// Batches
+
+AddressBatchPtr address_batch_create(void) {
+    return calloc(1, sizeof(struct AddressBatch));
+}
+
+void address_batch_free(AddressBatchPtr batch) {
+    if (batch) {
+        free(batch->paths);
+        free(batch);
+    }
+}
+
+int address_batch_add(AddressBatchPtr batch, PGconn *db_conn, const char *street, const char *zip,
+                      const char *zip_ext, const char *city, const char *state, const char *country) {
+    if (!trie_load(db_conn)) {
+        return -1;
+    }
+
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : 64;
+        int (*paths)[LEVEL_COUNT] = realloc(batch->paths, capacity * sizeof(*paths));
+        if (!paths) {
+            fprintf(stderr, "Failed to allocate address batch\n");
+            return -1;
+        }
+        batch->paths = paths;
+        batch->capacity = capacity;
+    }
+
+    const char *parts[LEVEL_COUNT] = {country, state, city, zip, street};
+    int *path = batch->paths[batch->count];
+    int parent = 0;
+    for (int level = 0; level < LEVEL_COUNT; level++) {
+        char name[NAME_SIZE], ext[CODE_SIZE], key[2 * NAME_SIZE];
+        if (level == LEVEL_ZIP) {
+            canonical_text(parts[level], CASE_UPPER, name, CODE_SIZE);
+            canonical_text(zip_ext, CASE_UPPER, ext, sizeof(ext));
+        } else {
+            canonical_text(parts[level], CASE_TITLE, name, sizeof(name));
+        }
+        node_key(name, level == LEVEL_ZIP ? ext : NULL, key, sizeof(key));
+
+        parent = trie_child(parent, key, name, level == LEVEL_ZIP ? ext : NULL, 0);
+        if (parent < 0) {
+            fprintf(stderr, "Failed to allocate address trie\n");
+            return -1;
+        }
+        path[level] = parent;
+    }
+    return (int)batch->count++;
+}
+
+// One statement for every node at this level the batch needs and the
+// database doesn't have, under parents that now exist
+static bool create_missing(AddressBatchPtr batch, PGconn *db_conn, int level) {
+    int *pending = malloc((batch->count ? batch->count : 1) * sizeof(int));
+    if (!pending) {
+        fprintf(stderr, "Failed to allocate address batch\n");
+        return false;
+    }
+
+    struct SqlText names = {0}, parents = {0}, exts = {0};
+    bool built = sql_append(&names, "{") && sql_append(&parents, "{") && sql_append(&exts, "{");
+    size_t count = 0;
+    for (size_t i = 0; i < batch->count && built; i++) {
+        struct TrieNode *node = &nodes[batch->paths[i][level]];
+        if (node->id > 0 || node->queued || (level > LEVEL_COUNTRY && nodes[node->parent].id <= 0)) {
+            continue;
+        }
+        node->queued = true;
+        pending[count++] = batch->paths[i][level];
+        built = sql_append_array_text(&names, node->name) && sql_append_array_int(&parents, nodes[node->parent].id) &&
+                sql_append_array_text(&exts, node->ext ? node->ext : "");
+    }
+    built = built && sql_append(&names, "}") && sql_append(&parents, "}") && sql_append(&exts, "}");
+
+    bool success = built;
+    if (!built) {
+        fprintf(stderr, "Failed to allocate %s values\n", level_queries[level].table);
+    } else if (count > 0) {
+        const char *param_values[] = {names.data, parents.data, exts.data};
+        PGresult *result = sql_exec_params(db_conn, level_queries[level].table, level_queries[level].create_query,
+                                           level_queries[level].create_params, param_values, NULL, NULL);
+        success = (PQresultStatus(result) == PGRES_TUPLES_OK);
+        if (!success) {
+            fprintf(stderr, "INSERT INTO %s failed: %s", level_queries[level].table, PQerrorMessage(db_conn));
+        }
+        for (int row = 0; success && row < PQntuples(result); row++) {
+            long slot = atol(PQgetvalue(result, row, 0));
+            if (slot >= 1 && (size_t)slot <= count) {
+                nodes[pending[slot - 1]].id = atoi(PQgetvalue(result, row, 1));
+            }
+        }
+        PQclear(result);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        nodes[pending[i]].queued = false;
+    }
+    free(pending);
+    free(names.data);
+    free(parents.data);
+    free(exts.data);
+    return success;
+}
+
+bool address_batch_resolve(AddressBatchPtr batch, PGconn *db_conn) {
+    bool success = true;
+    for (int level = 0; level < LEVEL_COUNT && success; level++) {
+        success = create_missing(batch, db_conn, level);
+    }
+    return success;
+}
+
+int address_batch_id(AddressBatchPtr batch, int slot) {
+    if (slot < 0 || (size_t)slot >= batch->count) {
+        return -1;
+    }
+    int id = nodes[batch->paths[slot][LEVEL_STREET]].id;
+    return id > 0 ? id : -1;
+}
+
+int address_resolve(PGconn *db_conn, const char *street, const char *zip, const char *zip_ext, const char *city,
+                    const char *state, const char *country) {
+    AddressBatchPtr batch = address_batch_create();
+    if (!batch) {
+        return -1;
+    }
+    int slot = address_batch_add(batch, db_conn, street, zip, zip_ext, city, state, country);
+    int id = (slot >= 0 && address_batch_resolve(batch, db_conn)) ? address_batch_id(batch, slot) : -1;
+    address_batch_free(batch);
+    return id;
+}
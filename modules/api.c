@@ -1,13 +1,19 @@
 #include "../include/api.h"
+#include "../include/json_arena.h"
+#include "../include/trace.h"
 #include <curl/curl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/buffer.h>
 
 static CURL *curl;
+static struct curl_slist *auth_headers = NULL;
+// Requests can be created from several threads (see backfill.c)
+static pthread_mutex_t auth_headers_lock = PTHREAD_MUTEX_INITIALIZER;
 
 struct MemoryStruct {
     char *memory;
@@ -56,19 +62,61 @@ static char* base64_encode(const char *input) {
 void api_init(void) {
     curl_global_init(CURL_GLOBAL_DEFAULT);
     curl = curl_easy_init();
+    if (curl) {
+        // The handle lives for the whole process, so keep the TLS connection
+        // to the API open between polls
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+    }
 }
 
 void api_cleanup(void) {
+    curl_slist_free_all(auth_headers);
+    auth_headers = NULL;
     curl_easy_cleanup(curl);
     curl_global_cleanup();
 }
 
-json_t* api_fetch_data(const char* endpoint, long last_id) {
+static struct curl_slist *build_auth_headers(const char *username, const char *password) {
+    // Set up Basic Auth
+    char auth_string[256];
+    snprintf(auth_string, sizeof(auth_string), "%s:%s", username, password);
+    char *base64_auth = base64_encode(auth_string);
+
+    char auth_header[300];
+    snprintf(auth_header, sizeof(auth_header), "Authorization: Basic %s", base64_auth);
+    free(base64_auth);
+
+    return curl_slist_append(NULL, auth_header);
+}
+
+static struct curl_slist *get_auth_headers(void) {
+    pthread_mutex_lock(&auth_headers_lock);
+    if (!auth_headers) {
+        const char *username = getenv("REPSLY_USERNAME");
+        const char *password = getenv("REPSLY_PASSWORD");
+        if (username && password) {
+            auth_headers = build_auth_headers(username, password);
+        } else {
+            fprintf(stderr, "REPSLY_USERNAME or REPSLY_PASSWORD not set\n");
+        }
+    }
+    struct curl_slist *headers = auth_headers;
+    pthread_mutex_unlock(&auth_headers_lock);
+    return headers;
+}
+
+char* api_fetch_raw(const char* endpoint, long last_id, size_t *length) {
     if (!curl) {
         fprintf(stderr, "CURL not initialized\n");
         return NULL;
     }
 
+    struct curl_slist *headers = get_auth_headers();
+    if (!headers) {
+        return NULL;
+    }
+
     char url[256];
     snprintf(url, sizeof(url), "%s%s/%ld", API_BASE_URL, endpoint, last_id);
 
@@ -77,32 +125,12 @@ json_t* api_fetch_data(const char* endpoint, long last_id) {
     chunk.size = 0;
 
     curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-
-    // Set up Basic Auth
-    const char *username = getenv("REPSLY_USERNAME");
-    const char *password = getenv("REPSLY_PASSWORD");
-    if (!username || !password) {
-        fprintf(stderr, "REPSLY_USERNAME or REPSLY_PASSWORD not set\n");
-        free(chunk.memory);
-        return NULL;
-    }
-
-    char auth_string[256];
-    snprintf(auth_string, sizeof(auth_string), "%s:%s", username, password);
-    char *base64_auth = base64_encode(auth_string);
-
-    char auth_header[300];
-    snprintf(auth_header, sizeof(auth_header), "Authorization: Basic %s", base64_auth);
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, auth_header);
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 
+    TraceSpan span = trace_begin();
     CURLcode res = curl_easy_perform(curl);
-
-    free(base64_auth);
-    curl_slist_free_all(headers);
+    trace_end(span, "api_fetch", endpoint);
 
     if (res != CURLE_OK) {
         fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
@@ -110,11 +138,26 @@ json_t* api_fetch_data(const char* endpoint, long last_id) {
         return NULL;
     }
 
+    if (length) {
+        *length = chunk.size;
+    }
+    return chunk.memory;
+}
+
+json_t* api_fetch_data(const char* endpoint, long last_id) {
+    size_t length;
+    char *body = api_fetch_raw(endpoint, last_id, &length);
+    if (!body) {
+        return NULL;
+    }
+
     json_t *root;
     json_error_t error;
-    root = json_loads(chunk.memory, 0, &error);
+    TraceSpan span = trace_begin();
+    root = json_arena_load(body, length, &error);
+    trace_end(span, "json_parse", endpoint);
 
-    free(chunk.memory);
+    free(body);
 
     if (!root) {
         fprintf(stderr, "JSON parsing error: %s\n", error.text);
@@ -122,4 +165,113 @@ json_t* api_fetch_data(const char* endpoint, long last_id) {
     }
 
     return root;
-}
\ No newline at end of file
+}
+
+
+// Requests for the curl multi interface. Each carries its own easy handle and
+// response buffer; CURLOPT_PRIVATE points back at the request so a finished
+// transfer can be matched to it.
+
+struct ApiRequest {
+    CURL *handle;
+    struct MemoryStruct body;
+    void *user_data;
+};
+
+// Credentials of other accounts (see accounts.h)
+struct ApiCredentials {
+    struct curl_slist *headers;
+};
+
+static ApiRequestPtr request_create(struct curl_slist *headers, const char* endpoint, long last_id,
+                                    void *user_data) {
+    if (!headers) {
+        return NULL;
+    }
+
+    ApiRequestPtr request = calloc(1, sizeof(struct ApiRequest));
+    if (!request) {
+        return NULL;
+    }
+    request->handle = curl_easy_init();
+    request->body.memory = malloc(1);
+    request->user_data = user_data;
+    if (!request->handle || !request->body.memory) {
+        api_request_free(request);
+        return NULL;
+    }
+
+    char url[256];
+    snprintf(url, sizeof(url), "%s%s/%ld", API_BASE_URL, endpoint, last_id);
+
+    curl_easy_setopt(request->handle, CURLOPT_URL, url);
+    curl_easy_setopt(request->handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+    curl_easy_setopt(request->handle, CURLOPT_WRITEDATA, (void *)&request->body);
+    curl_easy_setopt(request->handle, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(request->handle, CURLOPT_PRIVATE, (void *)request);
+    return request;
+}
+
+ApiRequestPtr api_request_create(const char* endpoint, long last_id, void *user_data) {
+    return request_create(get_auth_headers(), endpoint, last_id, user_data);
+}
+
+ApiRequestPtr api_request_create_as(ApiCredentialsPtr credentials, const char* endpoint, long last_id,
+                                    void *user_data) {
+    return request_create(credentials->headers, endpoint, last_id, user_data);
+}
+
+CURL* api_request_handle(ApiRequestPtr request) {
+    return request->handle;
+}
+
+void* api_request_user_data(ApiRequestPtr request) {
+    return request->user_data;
+}
+
+ApiRequestPtr api_request_from_handle(CURL *handle) {
+    ApiRequestPtr request = NULL;
+    curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&request);
+    return request;
+}
+
+char* api_request_take_body(ApiRequestPtr request, size_t *length) {
+    char *body = request->body.memory;
+    if (length) {
+        *length = request->body.size;
+    }
+    request->body.memory = NULL;
+    request->body.size = 0;
+    return body;
+}
+
+void api_request_free(ApiRequestPtr request) {
+    if (!request) {
+        return;
+    }
+    if (request->handle) {
+        curl_easy_cleanup(request->handle);
+    }
+    free(request->body.memory);
+    free(request);
+}
+
+ApiCredentialsPtr api_credentials_create(const char *username, const char *password) {
+    ApiCredentialsPtr credentials = calloc(1, sizeof(struct ApiCredentials));
+    if (!credentials) {
+        return NULL;
+    }
+    credentials->headers = build_auth_headers(username, password);
+    if (!credentials->headers) {
+        free(credentials);
+        return NULL;
+    }
+    return credentials;
+}
+
+void api_credentials_free(ApiCredentialsPtr credentials) {
+    if (credentials) {
+        curl_slist_free_all(credentials->headers);
+        free(credentials);
+    }
+}
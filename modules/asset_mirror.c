@@ -0,0 +1,370 @@
+#include "../include/asset_mirror.h"
+#include "../include/sql_stats.h"
+#include "../include/sql_text.h"
+#include <curl/curl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+
+#define DEFAULT_ASSET_BATCH 500
+#define DEFAULT_ASSET_PARALLEL 8
+#define MAX_ASSET_BYTES (50L * 1024 * 1024)
+#define ASSET_TIMEOUT_SECONDS 120L
+
+struct AssetSource {
+    const char *table;
+    const char *url_column;
+    const char *path_column;
+};
+
+static const struct AssetSource asset_sources[] = {
+    {"field_ops.forms", "signature_url", "signature_path"},
+    {"field_ops.photos", "photo_url", "photo_path"},
+    {"sales.purchase_orders", "signature_url", "signature_path"},
+    {"inventory.products", "image_url", "image_path"},
+};
+
+#define ASSET_SOURCE_COUNT (sizeof(asset_sources) / sizeof(asset_sources[0]))
+
+struct AssetDownload {
+    char *url;
+    const struct AssetSource *source;
+    CURL *handle;
+    char *body;
+    size_t length;
+    bool too_large;
+
+    // Outcome, recorded once every download is done
+    bool attempted;
+    long status;
+    char path[160];                     // empty unless stored
+    char hex[2 * EVP_MAX_MD_SIZE + 1];
+};
+
+static long env_long(const char *name, long default_value) {
+    const char *configured = getenv(name);
+    long value = configured ? atol(configured) : default_value;
+    return value > 0 ? value : default_value;
+}
+
+static size_t asset_write(void *contents, size_t size, size_t nmemb, void *userp) {
+    struct AssetDownload *download = (struct AssetDownload *)userp;
+    size_t n = size * nmemb;
+    if (download->length + n > (size_t)MAX_ASSET_BYTES) {
+        download->too_large = true;
+        return 0;
+    }
+
+    char *body = realloc(download->body, download->length + n + 1);
+    if (!body) {
+        return 0;
+    }
+    memcpy(body + download->length, contents, n);
+    download->body = body;
+    download->length += n;
+    return n;
+}
+
+static bool run_statement(PGconn *db_conn, const char *tag, const char *query, int n_params,
+                          const char *const *param_values) {
+    PGresult *result = sql_exec_params(db_conn, tag, query, n_params, param_values, NULL, NULL);
+    bool success = (PQresultStatus(result) == PGRES_COMMAND_OK);
+    if (!success) {
+        fprintf(stderr, "%s failed: %s", tag, PQerrorMessage(db_conn));
+    }
+    PQclear(result);
+    return success;
+}
+
+// Rows whose URL is already in the store take its path; this also catches
+// rows whose URL changed since their path was set
+static bool adopt_known_paths(PGconn *db_conn, const struct AssetSource *source) {
+    char query[512];
+    snprintf(query, sizeof(query),
+             "UPDATE %s t SET %s = a.path FROM meta.assets a "
+             "WHERE a.url = t.%s AND a.path IS NOT NULL AND t.%s IS DISTINCT FROM a.path",
+             source->table, source->path_column, source->url_column, source->path_column);
+    return run_statement(db_conn, __func__, query, 0, NULL);
+}
+
+static int collect_urls(PGconn *db_conn, const struct AssetSource *source, long batch,
+                        struct AssetDownload **downloads, int *count, int *capacity) {
+    char query[512];
+    snprintf(query, sizeof(query),
+             "SELECT DISTINCT t.%s FROM %s t LEFT JOIN meta.assets a ON a.url = t.%s "
+             "WHERE t.%s <> '' "
+             "AND (a.url IS NULL OR (a.path IS NULL AND a.fetched_at < now() - interval '1 day')) "
+             "LIMIT $1",
+             source->url_column, source->table, source->url_column, source->url_column);
+
+    char limit[24];
+    snprintf(limit, sizeof(limit), "%ld", batch);
+    const char *param_values[] = {limit};
+
+    PGresult *result = sql_exec_params(db_conn, __func__, query, 1, param_values, NULL, NULL);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Reading asset URLs of %s failed: %s", source->table, PQerrorMessage(db_conn));
+        PQclear(result);
+        return -1;
+    }
+
+    int rows = PQntuples(result);
+    for (int row = 0; row < rows; row++) {
+        if (*count == *capacity) {
+            int grown = *capacity ? *capacity * 2 : 64;
+            struct AssetDownload *resized = realloc(*downloads, (size_t)grown * sizeof(struct AssetDownload));
+            if (!resized) {
+                break;
+            }
+            *downloads = resized;
+            *capacity = grown;
+        }
+        char *url = strdup(PQgetvalue(result, row, 0));
+        if (!url) {
+            break;
+        }
+        (*downloads)[(*count)++] = (struct AssetDownload){.url = url, .source = source};
+    }
+
+    PQclear(result);
+    return rows;
+}
+
+static const char *extension_for(const char *content_type) {
+    static const char *const types[][2] = {
+        {"image/jpeg", "jpg"}, {"image/png", "png"}, {"image/gif", "gif"},
+        {"image/webp", "webp"}, {"image/svg+xml", "svg"}, {"application/pdf", "pdf"},
+    };
+    for (size_t i = 0; content_type && i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strncmp(content_type, types[i][0], strlen(types[i][0])) == 0) {
+            return types[i][1];
+        }
+    }
+    return "bin";
+}
+
+// Writes the body under its hash unless an identical file is already there.
+// The file appears under its final name only once complete.
+static bool store_asset(const char *dir, const struct AssetDownload *download, const char *content_type,
+                        char *path, size_t path_size, char *hex) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    if (!EVP_Digest(download->body ? download->body : "", download->length, digest, &digest_length,
+                    EVP_sha256(), NULL)) {
+        return false;
+    }
+    for (unsigned int i = 0; i < digest_length; i++) {
+        snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+    snprintf(path, path_size, "%.2s/%s.%s", hex, hex, extension_for(content_type));
+
+    char full_path[4096];
+    snprintf(full_path, sizeof(full_path), "%s/%s", dir, path);
+    if (access(full_path, F_OK) == 0) {
+        return true;
+    }
+
+    char subdir[4096];
+    snprintf(subdir, sizeof(subdir), "%s/%.2s", dir, hex);
+    if (mkdir(subdir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create %s: %s\n", subdir, strerror(errno));
+        return false;
+    }
+
+    char temp_path[4200];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp.%ld", full_path, (long)getpid());
+    FILE *file = fopen(temp_path, "wb");
+    if (!file) {
+        fprintf(stderr, "Failed to create %s: %s\n", temp_path, strerror(errno));
+        return false;
+    }
+    bool written = fwrite(download->body ? download->body : "", 1, download->length, file) == download->length;
+    written = fclose(file) == 0 && written;
+    if (!written || rename(temp_path, full_path) != 0) {
+        fprintf(stderr, "Failed to store %s: %s\n", full_path, strerror(errno));
+        unlink(temp_path);
+        return false;
+    }
+    return true;
+}
+
+// Every attempt goes into meta.assets in one statement; adopt_known_paths
+// then copies the new paths to each table in one more
+static bool record_assets(PGconn *db_conn, const struct AssetDownload *downloads, int count) {
+    struct SqlText urls = {0}, hexes = {0}, paths = {0}, bytes = {0}, statuses = {0};
+    bool built = sql_append(&urls, "{") && sql_append(&hexes, "{") && sql_append(&paths, "{") &&
+                 sql_append(&bytes, "{") && sql_append(&statuses, "{");
+    int attempted = 0;
+    for (int i = 0; i < count && built; i++) {
+        const struct AssetDownload *download = &downloads[i];
+        if (!download->attempted) {
+            continue;
+        }
+        bool stored = download->path[0] != '\0';
+        char size[24];
+        snprintf(size, sizeof(size), "%zu", download->length);
+        built = sql_append_array_text(&urls, download->url) &&
+                sql_append_array_text(&hexes, stored ? download->hex : NULL) &&
+                sql_append_array_text(&paths, stored ? download->path : NULL) &&
+                sql_append_array_text(&bytes, stored ? size : NULL) &&
+                sql_append_array_int(&statuses, (int)download->status);
+        attempted++;
+    }
+    built = built && sql_append(&urls, "}") && sql_append(&hexes, "}") && sql_append(&paths, "}") &&
+            sql_append(&bytes, "}") && sql_append(&statuses, "}");
+
+    bool success = built;
+    if (built && attempted > 0) {
+        // A URL linked from two tables was downloaded twice; one row keeps it
+        const char *param_values[] = {urls.data, hexes.data, paths.data, bytes.data, statuses.data};
+        success = run_statement(db_conn, __func__,
+                                "INSERT INTO meta.assets (url, sha256, path, bytes, http_status, fetched_at) "
+                                "SELECT DISTINCT ON (u.url) u.url, u.sha256, u.path, u.bytes, u.http_status, now() "
+                                "FROM unnest($1::text[], $2::text[], $3::text[], $4::bigint[], $5::int[]) "
+                                "AS u(url, sha256, path, bytes, http_status) "
+                                "ORDER BY u.url, u.path NULLS LAST "
+                                "ON CONFLICT (url) DO UPDATE SET sha256 = EXCLUDED.sha256, path = EXCLUDED.path, "
+                                "bytes = EXCLUDED.bytes, http_status = EXCLUDED.http_status, "
+                                "fetched_at = EXCLUDED.fetched_at",
+                                5, param_values);
+    } else if (!built) {
+        fprintf(stderr, "Failed to build the asset batch\n");
+    }
+    free(urls.data);
+    free(hexes.data);
+    free(paths.data);
+    free(bytes.data);
+    free(statuses.data);
+
+    for (size_t s = 0; s < ASSET_SOURCE_COUNT && success; s++) {
+        bool stored = false;
+        for (int i = 0; i < count && !stored; i++) {
+            stored = downloads[i].source == &asset_sources[s] && downloads[i].path[0];
+        }
+        success = !stored || adopt_known_paths(db_conn, &asset_sources[s]);
+    }
+    return success;
+}
+
+static void finish_download(const char *dir, struct AssetDownload *download, CURLcode result) {
+    char *content_type = NULL;
+    curl_easy_getinfo(download->handle, CURLINFO_RESPONSE_CODE, &download->status);
+    curl_easy_getinfo(download->handle, CURLINFO_CONTENT_TYPE, &content_type);
+
+    if (result != CURLE_OK) {
+        fprintf(stderr, "Downloading %s failed: %s\n", download->url,
+                download->too_large ? "larger than the asset limit" : curl_easy_strerror(result));
+    } else if (download->status != 200) {
+        fprintf(stderr, "Downloading %s failed: HTTP %ld\n", download->url, download->status);
+    } else if (!store_asset(dir, download, content_type, download->path, sizeof(download->path), download->hex)) {
+        download->path[0] = '\0';
+    }
+
+    download->attempted = true;
+    free(download->body);
+    download->body = NULL;
+}
+
+static bool start_download(CURLM *multi, struct AssetDownload *download) {
+    download->handle = curl_easy_init();
+    if (!download->handle) {
+        return false;
+    }
+    curl_easy_setopt(download->handle, CURLOPT_URL, download->url);
+    curl_easy_setopt(download->handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(download->handle, CURLOPT_TIMEOUT, ASSET_TIMEOUT_SECONDS);
+    curl_easy_setopt(download->handle, CURLOPT_WRITEFUNCTION, asset_write);
+    curl_easy_setopt(download->handle, CURLOPT_WRITEDATA, (void *)download);
+    curl_easy_setopt(download->handle, CURLOPT_PRIVATE, (void *)download);
+    if (curl_multi_add_handle(multi, download->handle) != CURLM_OK) {
+        curl_easy_cleanup(download->handle);
+        download->handle = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Keeps up to parallel transfers running, storing each as it completes
+static void download_all(const char *dir, struct AssetDownload *downloads, int count, long parallel) {
+    CURLM *multi = curl_multi_init();
+    if (!multi) {
+        fprintf(stderr, "Failed to set up asset downloads\n");
+        return;
+    }
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, parallel);
+
+    int next = 0, active = 0;
+    while (next < count || active > 0) {
+        while (active < parallel && next < count) {
+            if (start_download(multi, &downloads[next])) {
+                active++;
+            }
+            next++;
+        }
+
+        int running;
+        curl_multi_perform(multi, &running);
+
+        CURLMsg *message;
+        int remaining;
+        while ((message = curl_multi_info_read(multi, &remaining))) {
+            if (message->msg != CURLMSG_DONE) {
+                continue;
+            }
+            CURL *handle = message->easy_handle;
+            CURLcode result = message->data.result;
+            struct AssetDownload *download = NULL;
+            curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&download);
+
+            finish_download(dir, download, result);
+            curl_multi_remove_handle(multi, handle);
+            curl_easy_cleanup(handle);
+            download->handle = NULL;
+            active--;
+        }
+
+        if (active > 0) {
+            curl_multi_wait(multi, NULL, 0, 1000, NULL);
+        }
+    }
+
+    curl_multi_cleanup(multi);
+}
+
+bool asset_mirror_run(PGconn *db_conn) {
+    const char *dir = getenv("REPSLY_ASSET_DIR");
+    if (!dir || !*dir) {
+        return true;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create asset store %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+
+    long batch = env_long("REPSLY_ASSET_BATCH", DEFAULT_ASSET_BATCH);
+    long parallel = env_long("REPSLY_ASSET_PARALLEL", DEFAULT_ASSET_PARALLEL);
+
+    struct AssetDownload *downloads = NULL;
+    int count = 0, capacity = 0;
+    bool success = true;
+    for (size_t i = 0; i < ASSET_SOURCE_COUNT; i++) {
+        success = adopt_known_paths(db_conn, &asset_sources[i]) && success;
+        success = collect_urls(db_conn, &asset_sources[i], batch, &downloads, &count, &capacity) >= 0 && success;
+    }
+
+    if (count > 0) {
+        printf("Mirroring %d assets into %s\n", count, dir);
+        download_all(dir, downloads, count, parallel);
+        success = record_assets(db_conn, downloads, count) && success;
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(downloads[i].url);
+    }
+    free(downloads);
+    return success;
+}
@@ -0,0 +1,596 @@
+#include "../include/backfill.h"
+#include "../include/api.h"
+#include "../include/json_arena.h"
+#include "../include/config.h"
+#include "../include/core_operations.h"
+#include "../include/entity_registry.h"
+#include "../include/trace.h"
+#include "../include/rollups.h"
+#include "../include/sql_stats.h"
+#include "../include/sql_text.h"
+#include "../include/leases.h"
+#include "../include/outbox.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jansson.h>
+
+#define DEFAULT_RANGES 4
+#define MAX_RANGES 16
+#define MAX_QUEUED_PAGES 32
+#define STAGING_SCHEMA "backfill"
+
+// Work the rows' triggers would otherwise do, run once over the merged rows
+// while those triggers are disabled. The rollup triggers are covered by
+// rebuilding the rollups the table feeds.
+struct TriggerFixup {
+    const char *table;
+    const char *statement;
+};
+
+static const struct TriggerFixup trigger_fixups[] = {
+    // tr_update_visit_duration
+    {"field_ops.visits",
+     "UPDATE field_ops.visits v SET duration_minutes = calculate_visit_duration(v.time_start_id, v.time_end_id) "
+     "FROM " STAGING_SCHEMA ".visits s "
+     "WHERE v.repsly_id = s.repsly_id AND v.visit_date IS NOT DISTINCT FROM s.visit_date"},
+};
+
+#define TRIGGER_FIXUP_COUNT (sizeof(trigger_fixups) / sizeof(trigger_fixups[0]))
+
+
+
+// Fetching
+
+struct QueuedPage {
+    json_t *root;
+    long cursor;
+    long next_cursor;
+};
+
+// Pages of one entity on their way from the range threads to the loader
+struct PageQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct QueuedPage pages[MAX_QUEUED_PAGES];
+    int head;
+    int count;
+    int producers;
+    bool stopped;   // the loader gave up; producers drop what they fetch
+};
+
+struct RangeFetch {
+    const EntityInfo *entity;
+    struct PageQueue *queue;
+    long start;
+    long end;       // stop once a page reaches this cursor, LONG_MAX for the last range
+    bool failed;
+    pthread_t thread;
+};
+
+static bool queue_push(struct PageQueue *queue, struct QueuedPage page) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == MAX_QUEUED_PAGES && !queue->stopped) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    bool accepted = !queue->stopped;
+    if (accepted) {
+        queue->pages[(queue->head + queue->count) % MAX_QUEUED_PAGES] = page;
+        queue->count++;
+        pthread_cond_signal(&queue->not_empty);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return accepted;
+}
+
+// False once the queue is empty and every range has finished
+static bool queue_pop(struct PageQueue *queue, struct QueuedPage *page) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && queue->producers > 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    bool popped = queue->count > 0;
+    if (popped) {
+        *page = queue->pages[queue->head];
+        queue->head = (queue->head + 1) % MAX_QUEUED_PAGES;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return popped;
+}
+
+static void queue_producer_done(struct PageQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->producers--;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void queue_stop(struct PageQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->stopped = true;
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// The shared API handle belongs to the main thread, so each range thread runs
+// its requests on a handle of its own
+static json_t *fetch_page(const EntityInfo *entity, long cursor) {
+    ApiRequestPtr request = api_request_create(entity->endpoint, cursor, NULL);
+    if (!request) {
+        return NULL;
+    }
+
+    TraceSpan span = trace_begin();
+    CURLcode res = curl_easy_perform(api_request_handle(request));
+    trace_end(span, "api_fetch", entity->endpoint);
+    size_t length = 0;
+    char *body = res == CURLE_OK ? api_request_take_body(request, &length) : NULL;
+    if (res != CURLE_OK) {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+    }
+    api_request_free(request);
+    if (!body) {
+        return NULL;
+    }
+
+    json_error_t error;
+    span = trace_begin();
+    json_t *root = json_arena_load(body, length, &error);
+    trace_end(span, "json_parse", entity->endpoint);
+    free(body);
+    if (!root) {
+        fprintf(stderr, "JSON parsing error in %s page: %s\n", entity->name, error.text);
+    }
+    return root;
+}
+
+// A range's last page usually runs past its end into the next range; the
+// overlap is loaded twice and merged away
+static void *range_thread(void *arg) {
+    struct RangeFetch *range = (struct RangeFetch *)arg;
+
+    long cursor = range->start;
+    while (cursor < range->end) {
+        json_t *root = fetch_page(range->entity, cursor);
+        if (!root) {
+            range->failed = true;
+            break;
+        }
+
+        long next_cursor = range->entity->page_cursor(root, cursor);
+        if (!queue_push(range->queue, (struct QueuedPage){root, cursor, next_cursor})) {
+            json_decref(root);
+            break;
+        }
+        if (next_cursor <= cursor) {
+            break;
+        }
+        cursor = next_cursor;
+    }
+
+    queue_producer_done(range->queue);
+    return NULL;
+}
+
+
+// Planning
+
+// 1 if records follow cursor, 0 if none do, -1 if the request failed
+static int probe(const EntityInfo *entity, long cursor, long *next_cursor) {
+    json_t *root = api_fetch_data(entity->endpoint, cursor);
+    if (!root) {
+        return -1;
+    }
+    long next = entity->page_cursor(root, cursor);
+    json_decref(root);
+    if (next_cursor) {
+        *next_cursor = next;
+    }
+    return next > cursor;
+}
+
+// Fills bounds[0..n-1] with the start of each range and returns n, or -1.
+// The highest cursor is bracketed by doubling past the first page, then
+// narrowed by bisection to an eighth of a range.
+static int plan_ranges(const EntityInfo *entity, long start, int wanted, long *bounds) {
+    bounds[0] = start;
+    if (wanted <= 1 || !entity->mapping->cursor_field) {
+        return 1;
+    }
+
+    long first;
+    int found = probe(entity, start, &first);
+    if (found <= 0) {
+        return found < 0 ? -1 : 1;
+    }
+    if ((found = probe(entity, first, NULL)) <= 0) {
+        return found < 0 ? -1 : 1;
+    }
+
+    // Records follow lo, none follow hi
+    long lo = first, hi = LONG_MAX;
+    for (long step = first - start; ; step *= 2) {
+        if (step > LONG_MAX - lo) {
+            break;
+        }
+        if ((found = probe(entity, lo + step, NULL)) < 0) {
+            return -1;
+        }
+        if (!found) {
+            hi = lo + step;
+            break;
+        }
+        lo += step;
+        if (step > LONG_MAX / 2) {
+            break;
+        }
+    }
+
+    long precision = (hi - first) / ((long)wanted * 8);
+    while (hi - lo > (precision > 0 ? precision : 1)) {
+        long mid = lo + (hi - lo) / 2;
+        if ((found = probe(entity, mid, NULL)) < 0) {
+            return -1;
+        }
+        if (found) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    long width = (hi - first) / wanted;
+    if (width <= 0) {
+        return 1;
+    }
+    for (int i = 1; i < wanted; i++) {
+        bounds[i] = first + width * i;
+    }
+    return wanted;
+}
+
+
+// Staging and merging
+
+static bool staging_create(PGconn *db_conn, const EntityMapping *mapping) {
+    struct SqlText sql = {0};
+    sql_append(&sql, "CREATE SCHEMA IF NOT EXISTS " STAGING_SCHEMA "; DROP TABLE IF EXISTS " STAGING_SCHEMA ".");
+    sql_append(&sql, mapping->entity_name);
+    sql_append(&sql, "; CREATE UNLOGGED TABLE " STAGING_SCHEMA ".");
+    sql_append(&sql, mapping->entity_name);
+    sql_append(&sql, " AS SELECT ");
+    for (int c = 0; c < mapping->column_count; c++) {
+        sql_append(&sql, c ? ", " : "");
+        sql_append(&sql, mapping->columns[c].column);
+    }
+    sql_append(&sql, " FROM ");
+    sql_append(&sql, mapping->table);
+    sql_append(&sql, " WITH NO DATA; ALTER TABLE " STAGING_SCHEMA ".");
+    sql_append(&sql, mapping->entity_name);
+    sql_append(&sql, " ADD COLUMN backfill_page BIGINT, ADD COLUMN backfill_seq BIGINT GENERATED ALWAYS AS IDENTITY");
+
+    bool success = !sql.failed && sql_run(db_conn, "backfill staging", sql.data);
+    free(sql.data);
+    return success;
+}
+
+static bool staging_drop(PGconn *db_conn, const EntityMapping *mapping) {
+    char sql[256];
+    snprintf(sql, sizeof(sql), "DROP TABLE IF EXISTS " STAGING_SCHEMA ".%s", mapping->entity_name);
+    return sql_run(db_conn, "backfill drop staging", sql);
+}
+
+// The newest staged copy of each record: the one from the page requested at
+// the highest cursor, last on that page
+static void append_newest_staged(struct SqlText *sql, const EntityMapping *mapping, const char *record_keys,
+                                 const char *columns) {
+    sql_append(sql, "SELECT ");
+    if (*record_keys) {
+        sql_append(sql, "DISTINCT ON (");
+        sql_append(sql, record_keys);
+        sql_append(sql, ") ");
+    }
+    sql_append(sql, columns);
+    sql_append(sql, " FROM " STAGING_SCHEMA ".");
+    sql_append(sql, mapping->entity_name);
+    if (*record_keys) {
+        sql_append(sql, " ORDER BY ");
+        sql_append(sql, record_keys);
+        sql_append(sql, ", backfill_page DESC, backfill_seq DESC");
+    }
+}
+
+static bool move_staged(PGconn *db_conn, const EntityMapping *mapping, const char *record_keys,
+                        const char *record_match) {
+    if (!mapping->partition_column || !*record_keys) {
+        return true;
+    }
+    const char *p = mapping->partition_column;
+
+    struct SqlText sql = {0}, columns = {0};
+    sql_append(&columns, record_keys);
+    sql_append(&columns, ", ");
+    sql_append(&columns, p);
+
+    sql_append(&sql, "UPDATE ");
+    sql_append(&sql, mapping->table);
+    sql_append(&sql, " AS t SET ");
+    sql_append(&sql, p);
+    sql_append(&sql, " = s.");
+    sql_append(&sql, p);
+    sql_append(&sql, " FROM (");
+    append_newest_staged(&sql, mapping, record_keys, columns.data ? columns.data : "");
+    sql_append(&sql, ") AS s WHERE t.");
+    sql_append(&sql, p);
+    sql_append(&sql, " <> s.");
+    sql_append(&sql, p);
+    sql_append(&sql, record_match);
+    sql_append(&sql, " AND NOT EXISTS (SELECT 1 FROM ");
+    sql_append(&sql, mapping->table);
+    sql_append(&sql, " AS t WHERE t.");
+    sql_append(&sql, p);
+    sql_append(&sql, " = s.");
+    sql_append(&sql, p);
+    sql_append(&sql, record_match);
+    sql_append(&sql, ")");
+
+    bool success = !sql.failed && !columns.failed && sql_run(db_conn, "backfill move", sql.data);
+    free(columns.data);
+    free(sql.data);
+    return success;
+}
+
+static bool merge_staged(PGconn *db_conn, const EntityMapping *mapping) {
+    struct SqlText keys = {0}, record_keys = {0}, record_match = {0}, columns = {0}, sql = {0}, updates = {0};
+    for (int c = 0; c < mapping->column_count; c++) {
+        const char *column = mapping->columns[c].column;
+        sql_append(&columns, c ? ", " : "");
+        sql_append(&columns, column);
+        if (entity_mapping_record_key(mapping, c)) {
+            sql_append(&record_keys, record_keys.length ? ", " : "");
+            sql_append(&record_keys, column);
+            sql_append(&record_match, " AND t.");
+            sql_append(&record_match, column);
+            sql_append(&record_match, " = s.");
+            sql_append(&record_match, column);
+        }
+        if (mapping->columns[c].key) {
+            sql_append(&keys, keys.length ? ", " : "");
+            sql_append(&keys, column);
+        } else {
+            sql_append(&updates, updates.length ? ", " : "");
+            sql_append(&updates, column);
+            sql_append(&updates, " = EXCLUDED.");
+            sql_append(&updates, column);
+        }
+    }
+
+    sql_append(&sql, "INSERT INTO ");
+    sql_append(&sql, mapping->table);
+    sql_append(&sql, " (");
+    sql_append(&sql, columns.data ? columns.data : "");
+    sql_append(&sql, ") ");
+    const char *distinct = record_keys.length ? record_keys.data : keys.length ? keys.data : "";
+    append_newest_staged(&sql, mapping, distinct, columns.data ? columns.data : "");
+    if (keys.length) {
+        sql_append(&sql, " ON CONFLICT (");
+        sql_append(&sql, keys.data);
+        sql_append(&sql, updates.length ? ") DO UPDATE SET " : ") DO NOTHING");
+        if (updates.length) {
+            sql_append(&sql, updates.data);
+        }
+    }
+
+    bool success = !sql.failed && !keys.failed && !record_keys.failed && !record_match.failed && !columns.failed &&
+                   !updates.failed &&
+                   move_staged(db_conn, mapping, record_keys.data ? record_keys.data : "",
+                               record_match.data ? record_match.data : "") &&
+                   sql_run(db_conn, "backfill merge", sql.data);
+    free(keys.data);
+    free(record_keys.data);
+    free(record_match.data);
+    free(columns.data);
+    free(updates.data);
+    free(sql.data);
+    return success;
+}
+
+// Secondary indexes and the table's own foreign keys, with the statements
+// that recreate them. Unique indexes stay: the merge's ON CONFLICT needs them.
+// A partitioned table's index definition reads ON ONLY, which would recreate
+// it without its partitions' indexes, so that is taken out.
+static PGresult *secondary_objects(PGconn *db_conn, const char *table) {
+    const char *query =
+        "SELECT 'DROP INDEX ' || indexrelid::regclass::text, "
+        "CASE WHEN c.relkind = 'I' "
+        "THEN regexp_replace(pg_get_indexdef(indexrelid), '^(CREATE INDEX (\"[^\"]*\"|\\S+) ON) ONLY ', '\\1 ') "
+        "ELSE pg_get_indexdef(indexrelid) END "
+        "FROM pg_index JOIN pg_class c ON c.oid = indexrelid WHERE indrelid = $1::regclass AND NOT indisunique "
+        "UNION ALL "
+        "SELECT 'ALTER TABLE ' || $1 || ' DROP CONSTRAINT ' || quote_ident(conname), "
+        "'ALTER TABLE ' || $1 || ' ADD CONSTRAINT ' || quote_ident(conname) || ' ' || pg_get_constraintdef(oid) "
+        "FROM pg_constraint WHERE conrelid = $1::regclass AND contype = 'f' AND conparentid = 0";
+    const char *param_values[] = { table };
+
+    PGresult *result = sql_exec_params(db_conn, __func__, query, 1, param_values, NULL, NULL);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Reading indexes of %s failed: %s", table, PQerrorMessage(db_conn));
+        PQclear(result);
+        return NULL;
+    }
+    return result;
+}
+
+static const struct TriggerFixup *trigger_fixup_find(const char *table) {
+    for (size_t i = 0; i < TRIGGER_FIXUP_COUNT; i++) {
+        if (strcmp(trigger_fixups[i].table, table) == 0) {
+            return &trigger_fixups[i];
+        }
+    }
+    return NULL;
+}
+
+// One transaction, so a failure leaves the table with its indexes, keys and
+// triggers as they were and the cursor where it was
+static bool merge_entity(PGconn *db_conn, const EntityMapping *mapping, long cursor) {
+    PGresult *objects = secondary_objects(db_conn, mapping->table);
+    if (!objects) {
+        return false;
+    }
+    const struct TriggerFixup *fixup = trigger_fixup_find(mapping->table);
+
+    char triggers[256];
+    bool success = sql_run(db_conn, "BEGIN", "BEGIN");
+    for (int i = 0; i < PQntuples(objects) && success; i++) {
+        success = sql_run(db_conn, "backfill drop secondary", PQgetvalue(objects, i, 0));
+    }
+    if (success) {
+        snprintf(triggers, sizeof(triggers), "ALTER TABLE %s DISABLE TRIGGER USER", mapping->table);
+        success = sql_run(db_conn, "backfill triggers", triggers);
+    }
+
+    success = success && merge_staged(db_conn, mapping);
+
+    if (fixup && success) {
+        success = sql_run(db_conn, "backfill fixup", fixup->statement);
+    }
+    if (success) {
+        snprintf(triggers, sizeof(triggers), "ALTER TABLE %s ENABLE TRIGGER USER", mapping->table);
+        success = sql_run(db_conn, "backfill triggers", triggers) && rollups_rebuild(db_conn, mapping->table) &&
+                  outbox_record_reload(db_conn, mapping->table);
+    }
+    for (int i = 0; i < PQntuples(objects) && success; i++) {
+        success = sql_run(db_conn, "backfill recreate secondary", PQgetvalue(objects, i, 1));
+    }
+    success = success && update_last_processed(db_conn, mapping->entity_name, cursor) &&
+              sql_run(db_conn, "COMMIT", "COMMIT");
+
+    if (!success && PQtransactionStatus(db_conn) != PQTRANS_IDLE) {
+        sql_run(db_conn, "ROLLBACK", "ROLLBACK");
+    }
+    PQclear(objects);
+    return success;
+}
+
+
+// Driver
+
+// Loads every page the range threads fetch into staging. Returns the cursor
+// after the last page, or -1 if a page failed to fetch or load.
+static long load_ranges(PGconn *db_conn, const EntityInfo *entity, const long *bounds, int range_count) {
+    char staging[128];
+    snprintf(staging, sizeof(staging), STAGING_SCHEMA ".%s", entity->name);
+
+    struct PageQueue queue = {0};
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.not_empty, NULL);
+    pthread_cond_init(&queue.not_full, NULL);
+
+    struct RangeFetch ranges[MAX_RANGES];
+    int started = 0;
+    bool failed = false;
+    for (int i = 0; i < range_count; i++) {
+        ranges[i] = (struct RangeFetch){entity, &queue, bounds[i], i + 1 < range_count ? bounds[i + 1] : LONG_MAX,
+                                        false, 0};
+        queue.producers++;
+        if (pthread_create(&ranges[i].thread, NULL, range_thread, &ranges[i]) != 0) {
+            fprintf(stderr, "Failed to start %s fetch thread\n", entity->name);
+            queue.producers--;
+            failed = true;
+            break;
+        }
+        started++;
+    }
+    if (failed) {
+        queue_stop(&queue);
+    }
+
+    long cursor = bounds[0];
+    struct QueuedPage queued;
+    while (queue_pop(&queue, &queued)) {
+        if (!failed) {
+            EntityPagePtr page = entity_page_prepare(db_conn, entity->mapping, queued.root, queued.cursor);
+            bool loaded = page && entity_page_copy(db_conn, page, staging, "backfill_page");
+            entity_page_finish(page, loaded);
+            if (!loaded) {
+                failed = true;
+                queue_stop(&queue);
+            } else if (queued.next_cursor > cursor) {
+                cursor = queued.next_cursor;
+            }
+        }
+        json_decref(queued.root);
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(ranges[i].thread, NULL);
+        failed = failed || ranges[i].failed;
+    }
+
+    pthread_cond_destroy(&queue.not_full);
+    pthread_cond_destroy(&queue.not_empty);
+    pthread_mutex_destroy(&queue.lock);
+    return failed ? -1 : cursor;
+}
+
+static bool backfill_entity(PGconn *db_conn, const EntityInfo *entity, int wanted_ranges) {
+    long start = get_last_processed(db_conn, entity->name);
+    long bounds[MAX_RANGES];
+    int range_count = plan_ranges(entity, start, wanted_ranges, bounds);
+    if (range_count < 0) {
+        fprintf(stderr, "Failed to plan %s backfill\n", entity->name);
+        return false;
+    }
+    printf("Backfilling %s from %ld in %d range(s)\n", entity->name, start, range_count);
+
+    if (!staging_create(db_conn, entity->mapping)) {
+        return false;
+    }
+
+    long cursor = load_ranges(db_conn, entity, bounds, range_count);
+    bool success = cursor >= 0 && merge_entity(db_conn, entity->mapping, cursor);
+    if (success) {
+        char analyze[256];
+        snprintf(analyze, sizeof(analyze), "ANALYZE %s", entity->mapping->table);
+        sql_run(db_conn, "backfill analyze", analyze);
+    } else {
+        fprintf(stderr, "Backfill of %s failed, leaving it to the incremental sync\n", entity->name);
+    }
+
+    staging_drop(db_conn, entity->mapping);
+    return success;
+}
+
+bool backfill_run(PGconn *db_conn, const char *config_path) {
+    MirrorConfigPtr config = config_load(config_path);
+    if (!config) {
+        fprintf(stderr, "Failed to allocate config\n");
+        return false;
+    }
+    long wanted = config_get_long(config, "backfill.ranges", DEFAULT_RANGES);
+    config_free(config);
+    if (wanted < 1 || wanted > MAX_RANGES) {
+        wanted = DEFAULT_RANGES;
+    }
+
+    // Seed jansson's hashing before the range threads start parsing
+    json_object_seed(0);
+
+    int num_entities;
+    const EntityInfo *entities = entity_registry(&num_entities);
+
+    bool success = true;
+    for (int i = 0; i < num_entities; i++) {
+        // Instances backfilling side by side take an entity each
+        if (entities[i].mapping && lease_acquire(db_conn, entities[i].name)) {
+            success = backfill_entity(db_conn, &entities[i], (int)wanted) && success;
+            lease_release(db_conn, entities[i].name);
+        }
+    }
+    return success;
+}
@@ -1,10 +1,28 @@
 #include "../include/client.h"
 #include "../include/api.h"
+#include "../include/core_operations.h"
+#include "../include/json_decoder.h"
+#include "../include/json_scan.h"
+#include "../include/thread_pool.h"
+#include "../include/columnar_export.h"
+#include "../include/fingerprint.h"
+#include "../include/custom_fields.h"
+#include "../include/sql_stats.h"
+#include "../include/address_resolver.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <jansson.h>
 
+#define MAX_CLIENT_CUSTOM_FIELDS 50
+#define MAX_CLIENT_PRICE_LISTS 20
+#define CLIENT_FINGERPRINT_INITIAL_SLOTS 1024
+
+struct ClientCustomField {
+    char field[256];
+    char value[1024];
+};
+
 struct ClientData {
     int client_id;
     char code[51];
@@ -18,15 +36,51 @@ struct ClientData {
     int contact_name_id;
     int contact_title_id;
     int name_id;
+
+    char name[256];
+    char tag[256];
+    char territory[81];
+    char rep_code[21];
+    char rep_name[256];
+    char street_address[256];
+    char zip[21];
+    char zip_ext[21];
+    char city[256];
+    char state[256];
+    char country[256];
+    char email[256];
+    char phone[129];
+    char mobile[129];
+    char website[256];
+    char contact_name[256];
+    char contact_title[256];
+    char note[1024];
+    long timestamp;
+    Fingerprint content_hash;
+
+    struct ClientCustomField custom_fields[MAX_CLIENT_CUSTOM_FIELDS];
+    int custom_field_count;
+    char price_lists[MAX_CLIENT_PRICE_LISTS][256];
+    int price_list_count;
 };
 
+// Repsly leaves most optional fields out (or null), so every string setter
+// treats NULL as empty.
+static void client_copy_string(char *dest, size_t dest_size, const char *src) {
+    if (!src) {
+        dest[0] = '\0';
+        return;
+    }
+    strncpy(dest, src, dest_size - 1);
+    dest[dest_size - 1] = '\0';
+}
+
 ClientDataPtr client_create(void) {
     return (ClientDataPtr)calloc(1, sizeof(struct ClientData));
 }
 
 void client_set_code(ClientDataPtr client, const char* code) {
-    strncpy(client->code, code, sizeof(client->code) - 1);
-    client->code[sizeof(client->code) - 1] = '\0';
+    client_copy_string(client->code, sizeof(client->code), code);
 }
 void client_set_active(ClientDataPtr client, bool active) {
     client->active = active;
@@ -49,13 +103,11 @@ void client_set_rep_id(ClientDataPtr client, int rep_id) {
 }
 
 void client_set_account_code(ClientDataPtr client, const char* account_code) {
-    strncpy(client->account_code, account_code, sizeof(client->account_code) - 1);
-    client->account_code[sizeof(client->account_code) - 1] = '\0';
+    client_copy_string(client->account_code, sizeof(client->account_code), account_code);
 }
 
 void client_set_status(ClientDataPtr client, const char* status) {
-    strncpy(client->status, status, sizeof(client->status) - 1);
-    client->status[sizeof(client->status) - 1] = '\0';
+    client_copy_string(client->status, sizeof(client->status), status);
 }
 
 void client_set_contact_name_id(ClientDataPtr client, int contact_name_id) {
@@ -70,8 +122,103 @@ void client_set_name_id(ClientDataPtr client, int name_id) {
     client->name_id = name_id;
 }
 
+void client_set_name(ClientDataPtr client, const char* name) {
+    client_copy_string(client->name, sizeof(client->name), name);
+}
+
+void client_set_tag(ClientDataPtr client, const char* tag) {
+    client_copy_string(client->tag, sizeof(client->tag), tag);
+}
+
+void client_set_territory(ClientDataPtr client, const char* territory) {
+    client_copy_string(client->territory, sizeof(client->territory), territory);
+}
+
+void client_set_rep_code(ClientDataPtr client, const char* rep_code) {
+    client_copy_string(client->rep_code, sizeof(client->rep_code), rep_code);
+}
+
+void client_set_rep_name(ClientDataPtr client, const char* rep_name) {
+    client_copy_string(client->rep_name, sizeof(client->rep_name), rep_name);
+}
+
+void client_set_street_address(ClientDataPtr client, const char* street_address) {
+    client_copy_string(client->street_address, sizeof(client->street_address), street_address);
+}
+
+void client_set_zip(ClientDataPtr client, const char* zip) {
+    client_copy_string(client->zip, sizeof(client->zip), zip);
+}
+
+void client_set_zip_ext(ClientDataPtr client, const char* zip_ext) {
+    client_copy_string(client->zip_ext, sizeof(client->zip_ext), zip_ext);
+}
+
+void client_set_city(ClientDataPtr client, const char* city) {
+    client_copy_string(client->city, sizeof(client->city), city);
+}
+
+void client_set_state(ClientDataPtr client, const char* state) {
+    client_copy_string(client->state, sizeof(client->state), state);
+}
+
+void client_set_country(ClientDataPtr client, const char* country) {
+    client_copy_string(client->country, sizeof(client->country), country);
+}
+
+void client_set_email(ClientDataPtr client, const char* email) {
+    client_copy_string(client->email, sizeof(client->email), email);
+}
+
+void client_set_phone(ClientDataPtr client, const char* phone) {
+    client_copy_string(client->phone, sizeof(client->phone), phone);
+}
+
+void client_set_mobile(ClientDataPtr client, const char* mobile) {
+    client_copy_string(client->mobile, sizeof(client->mobile), mobile);
+}
+
+void client_set_website(ClientDataPtr client, const char* website) {
+    client_copy_string(client->website, sizeof(client->website), website);
+}
+
+void client_set_contact_name(ClientDataPtr client, const char* contact_name) {
+    client_copy_string(client->contact_name, sizeof(client->contact_name), contact_name);
+}
+
+void client_set_contact_title(ClientDataPtr client, const char* contact_title) {
+    client_copy_string(client->contact_title, sizeof(client->contact_title), contact_title);
+}
+
+void client_set_note(ClientDataPtr client, const char* note) {
+    client_copy_string(client->note, sizeof(client->note), note);
+}
+
+void client_set_timestamp(ClientDataPtr client, long timestamp) {
+    client->timestamp = timestamp;
+}
+
+void client_add_custom_field(ClientDataPtr client, const char* field, const char* value) {
+    if (client->custom_field_count < MAX_CLIENT_CUSTOM_FIELDS && field) {
+        struct ClientCustomField *custom_field = &client->custom_fields[client->custom_field_count];
+        client_copy_string(custom_field->field, sizeof(custom_field->field), field);
+        client_copy_string(custom_field->value, sizeof(custom_field->value), value);
+        client->custom_field_count++;
+    }
+}
+
+void client_add_price_list(ClientDataPtr client, const char* price_list_name) {
+    if (client->price_list_count < MAX_CLIENT_PRICE_LISTS && price_list_name) {
+        client_copy_string(client->price_lists[client->price_list_count], sizeof(client->price_lists[0]), price_list_name);
+        client->price_list_count++;
+    }
+}
+
 bool client_insert(PGconn *db_conn, ClientDataPtr client) {
-    int address_id = get_or_create_address(db_conn, client->street_address, client->zip, client->city, client->state, client->country);
+    // client_load_page resolves a page's addresses together beforehand
+    int address_id = client->address_id > 0 ? client->address_id
+        : address_resolve(db_conn, client->street_address, client->zip, client->zip_ext, client->city,
+                          client->state, client->country);
     int contact_id = get_or_create_contact_info(db_conn, client->phone, client->mobile, client->website);
     int territory_id = get_or_create_territory(db_conn, client->territory);
     int rep_id = get_or_create_representative(db_conn, client->rep_code, client->rep_name);
@@ -85,17 +232,32 @@ bool client_insert(PGconn *db_conn, ClientDataPtr client) {
         return false;
     }
 
+    client_set_address_id(client, address_id);
+    client_set_contact_id(client, contact_id);
+    client_set_territory_id(client, territory_id);
+    client_set_rep_id(client, rep_id);
+    client_set_contact_name_id(client, contact_name_id);
+    client_set_contact_title_id(client, contact_title_id);
+    client_set_name_id(client, name_id);
+
+    // Repsly re-sends a client whenever it changes, so the row is updated in place
     const char *insert_client_query = 
         "INSERT INTO sales.clients "
-        "(code, active, address_id, contact_id, territory_id, rep_id, account_code, status, contact_name_id, contact_title_id, name_id) "
-        "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11) "
+        "(code, active, address_id, contact_id, territory_id, rep_id, account_code, status, contact_name_id, contact_title_id, name_id, content_hash) "
+        "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12) "
+        "ON CONFLICT (code) DO UPDATE SET "
+        "active = EXCLUDED.active, address_id = EXCLUDED.address_id, contact_id = EXCLUDED.contact_id, "
+        "territory_id = EXCLUDED.territory_id, rep_id = EXCLUDED.rep_id, account_code = EXCLUDED.account_code, "
+        "status = EXCLUDED.status, contact_name_id = EXCLUDED.contact_name_id, "
+        "contact_title_id = EXCLUDED.contact_title_id, name_id = EXCLUDED.name_id, content_hash = EXCLUDED.content_hash "
         "RETURNING client_id";
 
-    const char *param_values[11];
-    int param_lengths[11];
-    int param_formats[11] = {0};  
+    const char *param_values[12];
+    int param_lengths[12];
+    int param_formats[12] = {0};  
     char active_str[6];
     char id_str[9][20]; 
+    char hash_str[FINGERPRINT_STR_SIZE];
 
     param_values[0] = client->code;
     snprintf(active_str, sizeof(active_str), "%s", client->active ? "true" : "false");
@@ -116,12 +278,16 @@ bool client_insert(PGconn *db_conn, ClientDataPtr client) {
     param_values[9] = id_str[5];
     snprintf(id_str[6], sizeof(id_str[6]), "%d", client->name_id);
     param_values[10] = id_str[6];
+    // Left NULL while the client's custom fields are still to be written
+    fingerprint_to_string(client->content_hash, hash_str, sizeof(hash_str));
+    param_values[11] = client->content_hash ? hash_str : NULL;
 
-    for (int i = 0; i < 11; i++) {
-        param_lengths[i] = strlen(param_values[i]);
+    for (int i = 0; i < 12; i++) {
+        param_lengths[i] = param_values[i] ? strlen(param_values[i]) : 0;
     }
 
-    PGresult *result = PQexecParams(db_conn, insert_client_query, 11, NULL, param_values, param_lengths, param_formats, 0);
+    PGresult *result = sql_exec_params(db_conn, __func__, insert_client_query, 12, param_values, param_lengths,
+                                       param_formats);
 
     if (PQresultStatus(result) != PGRES_TUPLES_OK) {
         fprintf(stderr, "INSERT INTO sales.clients failed: %s", PQerrorMessage(db_conn));
@@ -140,50 +306,326 @@ int client_get_id(ClientDataPtr client) {
     return client->client_id;
 }
 
+long client_get_timestamp(ClientDataPtr client) {
+    return client->timestamp;
+}
+
+// Covers every field that reaches sales.clients, its dimensions, its custom
+// field values or the export; price lists aren't mirrored.
+Fingerprint client_content_hash(ClientDataPtr client) {
+    Fingerprint fp = fingerprint_init();
+    fp = fingerprint_add_str(fp, client->code);
+    fp = fingerprint_add_bool(fp, client->active);
+    fp = fingerprint_add_str(fp, client->name);
+    fp = fingerprint_add_str(fp, client->tag);
+    fp = fingerprint_add_str(fp, client->territory);
+    fp = fingerprint_add_str(fp, client->rep_code);
+    fp = fingerprint_add_str(fp, client->rep_name);
+    fp = fingerprint_add_str(fp, client->street_address);
+    fp = fingerprint_add_str(fp, client->zip);
+    fp = fingerprint_add_str(fp, client->zip_ext);
+    fp = fingerprint_add_str(fp, client->city);
+    fp = fingerprint_add_str(fp, client->state);
+    fp = fingerprint_add_str(fp, client->country);
+    fp = fingerprint_add_str(fp, client->email);
+    fp = fingerprint_add_str(fp, client->phone);
+    fp = fingerprint_add_str(fp, client->mobile);
+    fp = fingerprint_add_str(fp, client->website);
+    fp = fingerprint_add_str(fp, client->contact_name);
+    fp = fingerprint_add_str(fp, client->contact_title);
+    fp = fingerprint_add_str(fp, client->note);
+    fp = fingerprint_add_str(fp, client->status);
+    fp = fingerprint_add_str(fp, client->account_code);
+    for (int i = 0; i < client->custom_field_count; i++) {
+        fp = fingerprint_add_str(fp, client->custom_fields[i].field);
+        fp = fingerprint_add_str(fp, client->custom_fields[i].value);
+    }
+    return fp;
+}
+
+// Last written fingerprint per client code. Filled from sales.clients on
+// first use, so it survives restarts, and kept current as clients are
+// written; a re-sent client whose fingerprint matches is skipped before any
+// of its dimensions are resolved.
+struct ClientFingerprint {
+    Fingerprint key_hash;      // 0 marks an empty slot
+    char code[51];
+    Fingerprint content_hash;
+};
+
+static struct ClientFingerprint *fingerprint_slots;
+static size_t fingerprint_slot_count;
+static size_t fingerprint_count;
+static bool fingerprints_loaded;
+
+static Fingerprint client_code_hash(const char *code) {
+    Fingerprint hash = fingerprint_add_str(fingerprint_init(), code);
+    return hash ? hash : 1;
+}
+
+static struct ClientFingerprint *client_fingerprint_probe(Fingerprint key_hash, const char *code) {
+    size_t mask = fingerprint_slot_count - 1;
+    size_t slot = key_hash & mask;
+    while (fingerprint_slots[slot].key_hash) {
+        if (fingerprint_slots[slot].key_hash == key_hash && strcmp(fingerprint_slots[slot].code, code) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return &fingerprint_slots[slot];
+}
+
+static bool client_fingerprint_grow(void) {
+    size_t new_count = fingerprint_slot_count ? fingerprint_slot_count * 2 : CLIENT_FINGERPRINT_INITIAL_SLOTS;
+    struct ClientFingerprint *new_slots = calloc(new_count, sizeof(struct ClientFingerprint));
+    if (!new_slots) {
+        return false;
+    }
+
+    struct ClientFingerprint *old_slots = fingerprint_slots;
+    size_t old_count = fingerprint_slot_count;
+    fingerprint_slots = new_slots;
+    fingerprint_slot_count = new_count;
+
+    for (size_t i = 0; i < old_count; i++) {
+        if (old_slots[i].key_hash) {
+            *client_fingerprint_probe(old_slots[i].key_hash, old_slots[i].code) = old_slots[i];
+        }
+    }
+
+    free(old_slots);
+    return true;
+}
+
+static void client_fingerprint_put(const char *code, Fingerprint content_hash) {
+    if ((fingerprint_count + 1) * 10 > fingerprint_slot_count * 7 && !client_fingerprint_grow()) {
+        return;
+    }
+
+    Fingerprint key_hash = client_code_hash(code);
+    struct ClientFingerprint *entry = client_fingerprint_probe(key_hash, code);
+    if (!entry->key_hash) {
+        entry->key_hash = key_hash;
+        client_copy_string(entry->code, sizeof(entry->code), code);
+        fingerprint_count++;
+    }
+    entry->content_hash = content_hash;
+}
+
+static bool client_unchanged(ClientDataPtr client) {
+    if (!fingerprint_slots || client->content_hash == 0) {
+        return false;
+    }
+    struct ClientFingerprint *entry = client_fingerprint_probe(client_code_hash(client->code), client->code);
+    return entry->key_hash && entry->content_hash == client->content_hash;
+}
+
+static bool client_fingerprints_load(PGconn *db_conn) {
+    if (fingerprints_loaded) {
+        return true;
+    }
+
+    PGresult *result = sql_exec(db_conn, __func__,
+        "SELECT code, content_hash FROM sales.clients WHERE code IS NOT NULL AND content_hash IS NOT NULL");
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "SELECT FROM sales.clients failed: %s", PQerrorMessage(db_conn));
+        PQclear(result);
+        return false;
+    }
+
+    int rows = PQntuples(result);
+    for (int row = 0; row < rows; row++) {
+        client_fingerprint_put(PQgetvalue(result, row, 0), fingerprint_from_string(PQgetvalue(result, row, 1)));
+    }
+
+    PQclear(result);
+    fingerprints_loaded = true;
+    return true;
+}
+
+void client_fingerprints_forget(void) {
+    free(fingerprint_slots);
+    fingerprint_slots = NULL;
+    fingerprint_slot_count = fingerprint_count = 0;
+    fingerprints_loaded = false;
+}
+
+// Denormalised client row for the columnar export. Client timestamps are
+// Repsly sequence numbers rather than dates, so clients land in the partition
+// of the day they were mirrored.
+static const ExportColumn client_export_columns[] = {
+    {"Code", FIELD_TEXT}, {"Name", FIELD_TEXT}, {"Active", FIELD_BOOL}, {"Tag", FIELD_TEXT},
+    {"Territory", FIELD_TEXT}, {"RepresentativeCode", FIELD_TEXT}, {"RepresentativeName", FIELD_TEXT},
+    {"StreetAddress", FIELD_TEXT}, {"ZIP", FIELD_TEXT}, {"ZIPExt", FIELD_TEXT}, {"City", FIELD_TEXT},
+    {"State", FIELD_TEXT}, {"Country", FIELD_TEXT}, {"Email", FIELD_TEXT}, {"Phone", FIELD_TEXT},
+    {"Mobile", FIELD_TEXT}, {"Website", FIELD_TEXT}, {"ContactName", FIELD_TEXT},
+    {"ContactTitle", FIELD_TEXT}, {"Note", FIELD_TEXT}, {"Status", FIELD_TEXT},
+    {"AccountCode", FIELD_TEXT}, {"TimeStamp", FIELD_INTEGER},
+};
+
+static void client_export(ClientDataPtr client) {
+    ExportDatasetPtr dataset = export_dataset_get("clients", client_export_columns,
+                                                  sizeof(client_export_columns) / sizeof(ExportColumn));
+    if (!dataset) {
+        return;
+    }
+
+    char timestamp[24];
+    snprintf(timestamp, sizeof(timestamp), "%ld", client->timestamp);
+
+    const char *values[] = {
+        client->code, client->name, client->active ? "true" : "false", client->tag,
+        client->territory, client->rep_code, client->rep_name,
+        client->street_address, client->zip, client->zip_ext, client->city,
+        client->state, client->country, client->email, client->phone,
+        client->mobile, client->website, client->contact_name,
+        client->contact_title, client->note, client->status,
+        client->account_code, timestamp,
+    };
+    export_dataset_append(dataset, NULL, client->code, values);
+}
+
 void client_free(ClientDataPtr client) {
     free(client);
 }
 
 
+// Fields we read from a Repsly client record. The enum order is the slot
+// order the decoder fills in.
+enum ClientField {
+    CLIENT_FIELD_CODE,
+    CLIENT_FIELD_ACTIVE,
+    CLIENT_FIELD_NAME,
+    CLIENT_FIELD_TAG,
+    CLIENT_FIELD_TERRITORY,
+    CLIENT_FIELD_REP_CODE,
+    CLIENT_FIELD_REP_NAME,
+    CLIENT_FIELD_STREET_ADDRESS,
+    CLIENT_FIELD_ZIP,
+    CLIENT_FIELD_ZIP_EXT,
+    CLIENT_FIELD_CITY,
+    CLIENT_FIELD_STATE,
+    CLIENT_FIELD_COUNTRY,
+    CLIENT_FIELD_EMAIL,
+    CLIENT_FIELD_PHONE,
+    CLIENT_FIELD_MOBILE,
+    CLIENT_FIELD_WEBSITE,
+    CLIENT_FIELD_CONTACT_NAME,
+    CLIENT_FIELD_CONTACT_TITLE,
+    CLIENT_FIELD_NOTE,
+    CLIENT_FIELD_STATUS,
+    CLIENT_FIELD_ACCOUNT_CODE,
+    CLIENT_FIELD_CUSTOM_FIELDS,
+    CLIENT_FIELD_PRICE_LISTS,
+    CLIENT_FIELD_TIMESTAMP,
+    CLIENT_FIELD_COUNT
+};
+
+static const char *const client_field_names[CLIENT_FIELD_COUNT] = {
+    [CLIENT_FIELD_CODE] = "Code",
+    [CLIENT_FIELD_ACTIVE] = "Active",
+    [CLIENT_FIELD_NAME] = "Name",
+    [CLIENT_FIELD_TAG] = "Tag",
+    [CLIENT_FIELD_TERRITORY] = "Territory",
+    [CLIENT_FIELD_REP_CODE] = "RepresentativeCode",
+    [CLIENT_FIELD_REP_NAME] = "RepresentativeName",
+    [CLIENT_FIELD_STREET_ADDRESS] = "StreetAddress",
+    [CLIENT_FIELD_ZIP] = "ZIP",
+    [CLIENT_FIELD_ZIP_EXT] = "ZIPExt",
+    [CLIENT_FIELD_CITY] = "City",
+    [CLIENT_FIELD_STATE] = "State",
+    [CLIENT_FIELD_COUNTRY] = "Country",
+    [CLIENT_FIELD_EMAIL] = "Email",
+    [CLIENT_FIELD_PHONE] = "Phone",
+    [CLIENT_FIELD_MOBILE] = "Mobile",
+    [CLIENT_FIELD_WEBSITE] = "Website",
+    [CLIENT_FIELD_CONTACT_NAME] = "ContactName",
+    [CLIENT_FIELD_CONTACT_TITLE] = "ContactTitle",
+    [CLIENT_FIELD_NOTE] = "Note",
+    [CLIENT_FIELD_STATUS] = "Status",
+    [CLIENT_FIELD_ACCOUNT_CODE] = "AccountCode",
+    [CLIENT_FIELD_CUSTOM_FIELDS] = "CustomFields",
+    [CLIENT_FIELD_PRICE_LISTS] = "PriceLists",
+    [CLIENT_FIELD_TIMESTAMP] = "TimeStamp",
+};
+
+enum ClientCustomFieldField {
+    CUSTOM_FIELD_FIELD,
+    CUSTOM_FIELD_VALUE,
+    CUSTOM_FIELD_COUNT
+};
+
+static const char *const custom_field_names[CUSTOM_FIELD_COUNT] = {
+    [CUSTOM_FIELD_FIELD] = "Field",
+    [CUSTOM_FIELD_VALUE] = "Value",
+};
+
+static JsonDecoderPtr client_decoder;
+static JsonDecoderPtr custom_field_decoder;
+
+static bool client_decoders_init(void) {
+    if (!client_decoder) {
+        client_decoder = json_decoder_create("clients", client_field_names, CLIENT_FIELD_COUNT);
+    }
+    if (!custom_field_decoder) {
+        custom_field_decoder = json_decoder_create("client custom fields", custom_field_names, CUSTOM_FIELD_COUNT);
+    }
+    return client_decoder && custom_field_decoder;
+}
+
+static const char *client_text(json_t **fields, enum ClientField field, char *scratch) {
+    return json_value_text(fields[field], FIELD_TEXT, scratch);
+}
+
 static ClientDataPtr client_from_json(json_t *client_json) {
     ClientDataPtr client = client_create();
-    
-    client_set_code(client, json_string_value(json_object_get(client_json, "Code")));
-    client_set_active(client, json_is_true(json_object_get(client_json, "Active")));
-    client_set_name_id(client, json_integer_value(json_object_get(client_json, "Name")));
-    client_set_tag(client, json_string_value(json_object_get(client_json, "Tag")));
-    client_set_territory(client, json_string_value(json_object_get(client_json, "Territory")));
-    client_set_rep_code(client, json_string_value(json_object_get(client_json, "RepresentativeCode")));
-    client_set_rep_name(client, json_string_value(json_object_get(client_json, "RepresentativeName")));
-    client_set_street_address(client, json_string_value(json_object_get(client_json, "StreetAddress")));
-    client_set_zip(client, json_string_value(json_object_get(client_json, "ZIP")));
-    client_set_zip_ext(client, json_string_value(json_object_get(client_json, "ZIPExt")));
-    client_set_city(client, json_string_value(json_object_get(client_json, "City")));
-    client_set_state(client, json_string_value(json_object_get(client_json, "State")));
-    client_set_country(client, json_string_value(json_object_get(client_json, "Country")));
-    client_set_email(client, json_string_value(json_object_get(client_json, "Email")));
-    client_set_phone(client, json_string_value(json_object_get(client_json, "Phone")));
-    client_set_mobile(client, json_string_value(json_object_get(client_json, "Mobile")));
-    client_set_website(client, json_string_value(json_object_get(client_json, "Website")));
-    client_set_contact_name(client, json_string_value(json_object_get(client_json, "ContactName")));
-    client_set_contact_title(client, json_string_value(json_object_get(client_json, "ContactTitle")));
-    client_set_note(client, json_string_value(json_object_get(client_json, "Note")));
-    client_set_status(client, json_string_value(json_object_get(client_json, "Status")));
-    client_set_account_code(client, json_string_value(json_object_get(client_json, "AccountCode")));
-
-    json_t *custom_fields = json_object_get(client_json, "CustomFields");
+    if (!client) {
+        return NULL;
+    }
+
+    json_t *fields[CLIENT_FIELD_COUNT];
+    char scratch[JSON_VALUE_SCRATCH_SIZE];
+    json_decoder_decode(client_decoder, client_json, fields);
+
+    client_set_code(client, client_text(fields, CLIENT_FIELD_CODE, scratch));
+    client_set_active(client, json_is_true(fields[CLIENT_FIELD_ACTIVE]));
+    client_set_name(client, client_text(fields, CLIENT_FIELD_NAME, scratch));
+    client_set_tag(client, client_text(fields, CLIENT_FIELD_TAG, scratch));
+    client_set_territory(client, client_text(fields, CLIENT_FIELD_TERRITORY, scratch));
+    client_set_rep_code(client, client_text(fields, CLIENT_FIELD_REP_CODE, scratch));
+    client_set_rep_name(client, client_text(fields, CLIENT_FIELD_REP_NAME, scratch));
+    client_set_street_address(client, client_text(fields, CLIENT_FIELD_STREET_ADDRESS, scratch));
+    client_set_zip(client, client_text(fields, CLIENT_FIELD_ZIP, scratch));
+    client_set_zip_ext(client, client_text(fields, CLIENT_FIELD_ZIP_EXT, scratch));
+    client_set_city(client, client_text(fields, CLIENT_FIELD_CITY, scratch));
+    client_set_state(client, client_text(fields, CLIENT_FIELD_STATE, scratch));
+    client_set_country(client, client_text(fields, CLIENT_FIELD_COUNTRY, scratch));
+    client_set_email(client, client_text(fields, CLIENT_FIELD_EMAIL, scratch));
+    client_set_phone(client, client_text(fields, CLIENT_FIELD_PHONE, scratch));
+    client_set_mobile(client, client_text(fields, CLIENT_FIELD_MOBILE, scratch));
+    client_set_website(client, client_text(fields, CLIENT_FIELD_WEBSITE, scratch));
+    client_set_contact_name(client, client_text(fields, CLIENT_FIELD_CONTACT_NAME, scratch));
+    client_set_contact_title(client, client_text(fields, CLIENT_FIELD_CONTACT_TITLE, scratch));
+    client_set_note(client, client_text(fields, CLIENT_FIELD_NOTE, scratch));
+    client_set_status(client, client_text(fields, CLIENT_FIELD_STATUS, scratch));
+    client_set_account_code(client, client_text(fields, CLIENT_FIELD_ACCOUNT_CODE, scratch));
+    client_set_timestamp(client, (long)json_integer_value(fields[CLIENT_FIELD_TIMESTAMP]));
+
+    json_t *custom_fields = fields[CLIENT_FIELD_CUSTOM_FIELDS];
     if (json_is_array(custom_fields)) {
         size_t index;
         json_t *field;
+        json_t *custom[CUSTOM_FIELD_COUNT];
+        char value_scratch[JSON_VALUE_SCRATCH_SIZE];
         json_array_foreach(custom_fields, index, field) {
-            const char *field_name = json_string_value(json_object_get(field, "Field"));
-            const char *field_value = json_string_value(json_object_get(field, "Value"));
-            client_add_custom_field(client, field_name, field_value);
+            json_decoder_decode(custom_field_decoder, field, custom);
+            client_add_custom_field(client, json_string_value(custom[CUSTOM_FIELD_FIELD]),
+                                    json_value_text(custom[CUSTOM_FIELD_VALUE], FIELD_TEXT, value_scratch));
         }
     }
 
 
-    json_t *price_lists = json_object_get(client_json, "PriceLists");
+    json_t *price_lists = fields[CLIENT_FIELD_PRICE_LISTS];
     if (json_is_array(price_lists)) {
         size_t index;
         json_t *price_list;
@@ -193,36 +635,252 @@ static ClientDataPtr client_from_json(json_t *client_json) {
         }
     }
 
+    client->content_hash = client_content_hash(client);
     return client;
 }
 
+static const char *client_view_text(JsonView *fields, enum ClientField field, char *scratch) {
+    return json_view_text(&fields[field], FIELD_TEXT, scratch);
+}
 
-bool client_fetch_and_insert(PGconn *db_conn, long last_timestamp) {
-    json_t *root = api_fetch_data("clients", last_timestamp);
-    if (!root) {
-        return false;
+// client_from_json over a scanned page
+static ClientDataPtr client_from_scan(JsonScanPtr scan, int record) {
+    ClientDataPtr client = client_create();
+    if (!client) {
+        return NULL;
     }
 
-    json_t *clients = json_object_get(root, "Clients");
-    if (!json_is_array(clients)) {
-        fprintf(stderr, "JSON root is not an array\n");
-        json_decref(root);
+    JsonView fields[CLIENT_FIELD_COUNT];
+    char scratch[JSON_VALUE_SCRATCH_SIZE];
+    json_scan_decode(scan, record, client_decoder, fields);
+
+    client_set_code(client, client_view_text(fields, CLIENT_FIELD_CODE, scratch));
+    client_set_active(client, json_view_true(&fields[CLIENT_FIELD_ACTIVE]));
+    client_set_name(client, client_view_text(fields, CLIENT_FIELD_NAME, scratch));
+    client_set_tag(client, client_view_text(fields, CLIENT_FIELD_TAG, scratch));
+    client_set_territory(client, client_view_text(fields, CLIENT_FIELD_TERRITORY, scratch));
+    client_set_rep_code(client, client_view_text(fields, CLIENT_FIELD_REP_CODE, scratch));
+    client_set_rep_name(client, client_view_text(fields, CLIENT_FIELD_REP_NAME, scratch));
+    client_set_street_address(client, client_view_text(fields, CLIENT_FIELD_STREET_ADDRESS, scratch));
+    client_set_zip(client, client_view_text(fields, CLIENT_FIELD_ZIP, scratch));
+    client_set_zip_ext(client, client_view_text(fields, CLIENT_FIELD_ZIP_EXT, scratch));
+    client_set_city(client, client_view_text(fields, CLIENT_FIELD_CITY, scratch));
+    client_set_state(client, client_view_text(fields, CLIENT_FIELD_STATE, scratch));
+    client_set_country(client, client_view_text(fields, CLIENT_FIELD_COUNTRY, scratch));
+    client_set_email(client, client_view_text(fields, CLIENT_FIELD_EMAIL, scratch));
+    client_set_phone(client, client_view_text(fields, CLIENT_FIELD_PHONE, scratch));
+    client_set_mobile(client, client_view_text(fields, CLIENT_FIELD_MOBILE, scratch));
+    client_set_website(client, client_view_text(fields, CLIENT_FIELD_WEBSITE, scratch));
+    client_set_contact_name(client, client_view_text(fields, CLIENT_FIELD_CONTACT_NAME, scratch));
+    client_set_contact_title(client, client_view_text(fields, CLIENT_FIELD_CONTACT_TITLE, scratch));
+    client_set_note(client, client_view_text(fields, CLIENT_FIELD_NOTE, scratch));
+    client_set_status(client, client_view_text(fields, CLIENT_FIELD_STATUS, scratch));
+    client_set_account_code(client, client_view_text(fields, CLIENT_FIELD_ACCOUNT_CODE, scratch));
+    client_set_timestamp(client, (long)json_view_integer(&fields[CLIENT_FIELD_TIMESTAMP]));
+
+    if (fields[CLIENT_FIELD_CUSTOM_FIELDS].kind == '[') {
+        JsonView custom[CUSTOM_FIELD_COUNT];
+        char value_scratch[JSON_VALUE_SCRATCH_SIZE];
+        for (int field = json_scan_first(scan, fields[CLIENT_FIELD_CUSTOM_FIELDS].index); field >= 0;
+             field = json_scan_next(scan, field)) {
+            json_scan_decode(scan, field, custom_field_decoder, custom);
+            const char *name = custom[CUSTOM_FIELD_FIELD].kind == '"'
+                ? json_view_text(&custom[CUSTOM_FIELD_FIELD], FIELD_TEXT, scratch) : NULL;
+            client_add_custom_field(client, name,
+                                    json_view_text(&custom[CUSTOM_FIELD_VALUE], FIELD_TEXT, value_scratch));
+        }
+    }
+
+    if (fields[CLIENT_FIELD_PRICE_LISTS].kind == '[') {
+        for (int price_list = json_scan_first(scan, fields[CLIENT_FIELD_PRICE_LISTS].index); price_list >= 0;
+             price_list = json_scan_next(scan, price_list)) {
+            JsonView name = json_scan_view(scan, json_scan_member(scan, price_list, "Name"));
+            client_add_price_list(client, name.kind == '"' ? json_view_text(&name, FIELD_TEXT, scratch) : NULL);
+        }
+    }
+
+    client->content_hash = client_content_hash(client);
+    return client;
+}
+
+
+// Decoding runs on the shared pool; each task fills its own slot so the page
+// is written back in Repsly's order.
+struct ClientDecodeBatch {
+    json_t *records;
+    ClientDataPtr *clients;
+};
+
+static void client_decode_task(void *context, size_t index) {
+    struct ClientDecodeBatch *batch = (struct ClientDecodeBatch *)context;
+    batch->clients[index] = client_from_json(json_array_get(batch->records, index));
+}
+
+// Records of a scanned page are disjoint stretches of its text, which is all
+// that rendering writes to
+struct ClientScanBatch {
+    JsonScanPtr scan;
+    int *records;
+    ClientDataPtr *clients;
+};
+
+static void client_scan_task(void *context, size_t index) {
+    struct ClientScanBatch *batch = (struct ClientScanBatch *)context;
+    batch->clients[index] = client_from_scan(batch->scan, batch->records[index]);
+}
+
+bool client_fetch_and_insert(PGconn *db_conn, long last_timestamp) {
+    size_t length;
+    char *text = api_fetch_raw("clients", last_timestamp, &length);
+    if (!text) {
         return false;
     }
 
+    long next_cursor;
+    size_t records;
+    bool success = client_load_text(db_conn, text, length, last_timestamp, &next_cursor, &records);
+    free(text);
+    return success;
+}
+
+long client_page_cursor(json_t *root, long last_timestamp) {
+    long max_timestamp = last_timestamp;
     size_t index;
     json_t *client_json;
+    json_array_foreach(json_object_get(root, "Clients"), index, client_json) {
+        long client_timestamp = (long)json_integer_value(json_object_get(client_json, "TimeStamp"));
+        if (client_timestamp > max_timestamp) {
+            max_timestamp = client_timestamp;
+        }
+    }
+    return max_timestamp;
+}
+
+// Writes a decoded page and frees its clients. unknown_before is the
+// decoder's unmapped field count before the page was decoded.
+// Clients whose custom fields were part of the page's batch, waiting for it
+// to be written before their fingerprints are
+struct PendingFingerprint {
+    int client_id;
+    char code[51];
+    Fingerprint content_hash;
+};
+
+static bool client_fingerprints_store(PGconn *db_conn, const struct PendingFingerprint *pending, size_t count) {
+    if (count == 0) {
+        return true;
+    }
+
+    char *ids = malloc(count * 12 + 3);
+    char *hashes = malloc(count * FINGERPRINT_STR_SIZE + 3);
+    if (!ids || !hashes) {
+        free(ids);
+        free(hashes);
+        return false;
+    }
+
+    size_t ids_length = 0, hashes_length = 0;
+    for (size_t i = 0; i < count; i++) {
+        char hash_str[FINGERPRINT_STR_SIZE];
+        fingerprint_to_string(pending[i].content_hash, hash_str, sizeof(hash_str));
+        ids_length += sprintf(ids + ids_length, "%c%d", i ? ',' : '{', pending[i].client_id);
+        hashes_length += sprintf(hashes + hashes_length, "%c%s", i ? ',' : '{', hash_str);
+    }
+    strcpy(ids + ids_length, "}");
+    strcpy(hashes + hashes_length, "}");
+
+    const char *param_values[2] = {ids, hashes};
+    PGresult *result = sql_exec_params(db_conn, __func__,
+        "UPDATE sales.clients AS c SET content_hash = v.content_hash "
+        "FROM unnest($1::int[], $2::bigint[]) AS v(client_id, content_hash) WHERE c.client_id = v.client_id",
+        2, param_values, NULL, NULL);
+    bool ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+    if (!ok) {
+        fprintf(stderr, "UPDATE sales.clients failed: %s", PQerrorMessage(db_conn));
+    }
+    PQclear(result);
+    free(ids);
+    free(hashes);
+
+    for (size_t i = 0; i < count && ok; i++) {
+        client_fingerprint_put(pending[i].code, pending[i].content_hash);
+    }
+    return ok;
+}
+
+static bool client_write_page(PGconn *db_conn, ClientDataPtr *clients, size_t count, long last_timestamp,
+                              long unknown_before) {
+    // Without the stored fingerprints every client is simply written
+    client_fingerprints_load(db_conn);
+
+    // Addresses of the clients that changed go through the resolver as one
+    // batch; any it can't resolve are retried one by one in client_insert
+    AddressBatchPtr addresses = address_batch_create();
+    int *address_slots = calloc(count ? count : 1, sizeof(int));
+    for (size_t index = 0; index < count && addresses && address_slots; index++) {
+        ClientDataPtr client = clients[index];
+        address_slots[index] = (client && !client_unchanged(client))
+            ? address_batch_add(addresses, db_conn, client->street_address, client->zip, client->zip_ext,
+                                client->city, client->state, client->country)
+            : -1;
+    }
+    if (addresses && address_slots && !address_batch_resolve(addresses, db_conn)) {
+        fprintf(stderr, "Failed to resolve client addresses\n");
+    }
+
+    CustomFieldBatchPtr custom_fields = custom_field_batch_create("client");
+    struct PendingFingerprint *pending = calloc(count ? count : 1, sizeof(struct PendingFingerprint));
+    size_t pending_count = 0;
+    bool batch_ready = custom_fields && pending;
+    bool fields_ok = true;
+
     long max_timestamp = last_timestamp;
-    json_array_foreach(clients, index, client_json) {
-        ClientDataPtr client = client_from_json(client_json);
-        
-        if (!client_insert(db_conn, client)) {
-            fprintf(stderr, "Failed to insert client\n");
-            client_free(client);
+    size_t unchanged = 0;
+    for (size_t index = 0; index < count; index++) {
+        ClientDataPtr client = clients[index];
+        if (!client) {
             continue;
         }
 
-        long client_timestamp = json_integer_value(json_object_get(client_json, "TimeStamp"));
+        if (addresses && address_slots) {
+            client_set_address_id(client, address_batch_id(addresses, address_slots[index]));
+        }
+
+        // A client with custom fields is written without its fingerprint, which
+        // follows once they are stored too; otherwise a failed batch would
+        // leave it looking unchanged
+        Fingerprint content_hash = client->content_hash;
+        bool deferred = client->custom_field_count > 0;
+
+        if (client_unchanged(client)) {
+            unchanged++;
+        } else {
+            if (deferred) {
+                client->content_hash = 0;
+            }
+            if (!client_insert(db_conn, client)) {
+                fprintf(stderr, "Failed to insert client\n");
+                client_free(client);
+                continue;
+            }
+
+            client_export(client);
+            if (!deferred) {
+                client_fingerprint_put(client->code, content_hash);
+            } else if (batch_ready) {
+                pending[pending_count].client_id = client->client_id;
+                client_copy_string(pending[pending_count].code, sizeof(pending[pending_count].code), client->code);
+                pending[pending_count].content_hash = content_hash;
+                pending_count++;
+            }
+            for (int i = 0; i < client->custom_field_count; i++) {
+                fields_ok = fields_ok && batch_ready &&
+                            custom_field_batch_add(custom_fields, db_conn, client->client_id,
+                                                   client->custom_fields[i].field, client->custom_fields[i].value);
+            }
+        }
+
+        long client_timestamp = client_get_timestamp(client);
         if (client_timestamp > max_timestamp) {
             max_timestamp = client_timestamp;
         }
@@ -230,11 +888,113 @@ bool client_fetch_and_insert(PGconn *db_conn, long last_timestamp) {
         client_free(client);
     }
 
-    json_decref(root);
+    free(address_slots);
+    address_batch_free(addresses);
+
+    // Every custom field value on the page goes in with one statement. If it
+    // fails the page does, and its clients are written again next time.
+    fields_ok = fields_ok && (!batch_ready || (custom_field_batch_write(custom_fields, db_conn) &&
+                                               client_fingerprints_store(db_conn, pending, pending_count)));
+    custom_field_batch_free(custom_fields);
+    free(pending);
+    if (!fields_ok) {
+        fprintf(stderr, "Failed to write client custom fields\n");
+        return false;
+    }
+
+    if (unchanged > 0) {
+        fprintf(stderr, "clients: skipped %zu unchanged of %zu\n", unchanged, count);
+    }
+
+    // Fields Repsly sends that we don't mirror; a jump here usually means the
+    // export format grew something worth mapping.
+    long unknown_fields = json_decoder_unknown_count(client_decoder) - unknown_before;
+    if (unknown_fields > 0) {
+        fprintf(stderr, "clients: %ld unmapped fields on this page\n", unknown_fields);
+    }
 
     if (!update_last_processed(db_conn, "clients", max_timestamp)) {
         fprintf(stderr, "Failed to update last processed timestamp for clients\n");
     }
 
     return true;
-}
\ No newline at end of file
+}
+bool client_load_page(PGconn *db_conn, json_t *root, long last_timestamp) {
+    json_t *clients = json_object_get(root, "Clients");
+    if (!json_is_array(clients)) {
+        fprintf(stderr, "JSON root is not an array\n");
+        return false;
+    }
+
+    if (!client_decoders_init()) {
+        return false;
+    }
+
+    long unknown_before = json_decoder_unknown_count(client_decoder);
+
+    size_t count = json_array_size(clients);
+    struct ClientDecodeBatch batch = {clients, calloc(count ? count : 1, sizeof(ClientDataPtr))};
+    if (!batch.clients) {
+        fprintf(stderr, "Failed to allocate client batch\n");
+        return false;
+    }
+    thread_pool_run(thread_pool_shared(), count, client_decode_task, &batch);
+
+    bool success = client_write_page(db_conn, batch.clients, count, last_timestamp, unknown_before);
+    free(batch.clients);
+    return success;
+}
+
+bool client_load_text(PGconn *db_conn, char *text, size_t length, long last_timestamp, long *next_cursor,
+                      size_t *records) {
+    JsonScanPtr scan = json_scan_create(text, length);
+    if (!scan) {
+        fprintf(stderr, "Failed to parse clients page\n");
+        return false;
+    }
+
+    int clients = json_scan_member(scan, json_scan_root(scan), "Clients");
+    if (json_scan_view(scan, clients).kind != '[') {
+        fprintf(stderr, "JSON root is not an array\n");
+        json_scan_free(scan);
+        return false;
+    }
+
+    if (!client_decoders_init()) {
+        json_scan_free(scan);
+        return false;
+    }
+
+    long unknown_before = json_decoder_unknown_count(client_decoder);
+
+    size_t count = json_scan_count(scan, clients);
+    struct ClientScanBatch batch = {scan, calloc(count ? count : 1, sizeof(int)),
+                                    calloc(count ? count : 1, sizeof(ClientDataPtr))};
+    if (!batch.records || !batch.clients) {
+        fprintf(stderr, "Failed to allocate client batch\n");
+        free(batch.records);
+        free(batch.clients);
+        json_scan_free(scan);
+        return false;
+    }
+    size_t index = 0;
+    for (int record = json_scan_first(scan, clients); record >= 0; record = json_scan_next(scan, record)) {
+        batch.records[index++] = record;
+    }
+    thread_pool_run(thread_pool_shared(), count, client_scan_task, &batch);
+
+    // The cursor covers every record on the page, as client_page_cursor does
+    *next_cursor = last_timestamp;
+    for (index = 0; index < count; index++) {
+        if (batch.clients[index] && batch.clients[index]->timestamp > *next_cursor) {
+            *next_cursor = batch.clients[index]->timestamp;
+        }
+    }
+    *records = count;
+
+    bool success = client_write_page(db_conn, batch.clients, count, last_timestamp, unknown_before);
+    free(batch.records);
+    free(batch.clients);
+    json_scan_free(scan);
+    return success;
+}
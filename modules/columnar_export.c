@@ -0,0 +1,782 @@
+#include "../include/columnar_export.h"
+#include "../include/temporal.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define MAX_EXPORT_DATASETS 32
+#define EXPORT_ROWS_PER_FILE 250000
+#define PARTITION_DATE_SIZE 11
+#define PG_EPOCH_UNIX_DAYS 10957           // 2000-01-01 in days since 1970-01-01
+#define PG_EPOCH_UNIX_MS 946684800000LL
+#define RECORD_COLUMNS 2                   // RecordKey, RecordVersion
+
+// Parquet enums (parquet.thrift)
+#define PARQUET_BOOLEAN 0
+#define PARQUET_INT32 1
+#define PARQUET_INT64 2
+#define PARQUET_DOUBLE 5
+#define PARQUET_BYTE_ARRAY 6
+
+#define PARQUET_OPTIONAL 1
+
+#define PARQUET_UTF8 0
+#define PARQUET_DATE 6
+#define PARQUET_TIMESTAMP_MILLIS 9
+
+#define PARQUET_PLAIN 0
+#define PARQUET_RLE 3
+#define PARQUET_GZIP 2
+#define PARQUET_DATA_PAGE 0
+
+// Thrift compact protocol type ids
+#define THRIFT_I32 5
+#define THRIFT_I64 6
+#define THRIFT_BINARY 8
+#define THRIFT_LIST 9
+#define THRIFT_STRUCT 12
+#define THRIFT_MAX_DEPTH 8
+
+
+// Growable byte buffer. Allocation failures are sticky, so encoders can write
+// freely and check once at the end.
+
+struct ByteBuffer {
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+    bool failed;
+};
+
+static void buf_put(struct ByteBuffer *buf, const void *data, size_t n) {
+    if (buf->failed) {
+        return;
+    }
+    if (buf->len + n > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 256;
+        while (buf->len + n > capacity) {
+            capacity *= 2;
+        }
+        uint8_t *grown = realloc(buf->data, capacity);
+        if (!grown) {
+            buf->failed = true;
+            return;
+        }
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->len, data, n);
+    buf->len += n;
+}
+
+static void buf_byte(struct ByteBuffer *buf, uint8_t byte) {
+    buf_put(buf, &byte, 1);
+}
+
+static void buf_varint(struct ByteBuffer *buf, uint64_t value) {
+    while (value >= 0x80) {
+        buf_byte(buf, (uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    buf_byte(buf, (uint8_t)value);
+}
+
+static void buf_le32(struct ByteBuffer *buf, uint32_t value) {
+    uint8_t bytes[4] = {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24)};
+    buf_put(buf, bytes, 4);
+}
+
+static void buf_le64(struct ByteBuffer *buf, uint64_t value) {
+    buf_le32(buf, (uint32_t)value);
+    buf_le32(buf, (uint32_t)(value >> 32));
+}
+
+static void buf_free(struct ByteBuffer *buf) {
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+
+// Thrift compact protocol, just enough for the Parquet footer and page headers
+
+struct ThriftWriter {
+    struct ByteBuffer *buf;
+    int16_t last_field[THRIFT_MAX_DEPTH];
+    int depth;
+};
+
+static void thrift_field(struct ThriftWriter *w, int16_t id, uint8_t type) {
+    int delta = id - w->last_field[w->depth];
+    if (delta > 0 && delta <= 15) {
+        buf_byte(w->buf, (uint8_t)((delta << 4) | type));
+    } else {
+        buf_byte(w->buf, type);
+        buf_varint(w->buf, (uint16_t)((id << 1) ^ (id >> 15)));
+    }
+    w->last_field[w->depth] = id;
+}
+
+static void thrift_i32_value(struct ThriftWriter *w, int32_t value) {
+    buf_varint(w->buf, (uint32_t)(((uint32_t)value << 1) ^ (uint32_t)(value >> 31)));
+}
+
+static void thrift_i32(struct ThriftWriter *w, int16_t id, int32_t value) {
+    thrift_field(w, id, THRIFT_I32);
+    thrift_i32_value(w, value);
+}
+
+static void thrift_i64(struct ThriftWriter *w, int16_t id, int64_t value) {
+    thrift_field(w, id, THRIFT_I64);
+    buf_varint(w->buf, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static void thrift_string_value(struct ThriftWriter *w, const char *text) {
+    size_t n = strlen(text);
+    buf_varint(w->buf, n);
+    buf_put(w->buf, text, n);
+}
+
+static void thrift_string(struct ThriftWriter *w, int16_t id, const char *text) {
+    thrift_field(w, id, THRIFT_BINARY);
+    thrift_string_value(w, text);
+}
+
+static void thrift_list(struct ThriftWriter *w, int16_t id, uint8_t element_type, int size) {
+    thrift_field(w, id, THRIFT_LIST);
+    if (size < 15) {
+        buf_byte(w->buf, (uint8_t)((size << 4) | element_type));
+    } else {
+        buf_byte(w->buf, 0xf0 | element_type);
+        buf_varint(w->buf, (uint64_t)size);
+    }
+}
+
+// Opens a struct, either as field id of the enclosing struct or (id 0) as a
+// list element
+static void thrift_struct_begin(struct ThriftWriter *w, int16_t id) {
+    if (id) {
+        thrift_field(w, id, THRIFT_STRUCT);
+    }
+    w->last_field[++w->depth] = 0;
+}
+
+static void thrift_struct_end(struct ThriftWriter *w) {
+    buf_byte(w->buf, 0);
+    w->depth--;
+}
+
+
+// Buffered rows. Each column keeps one definition level byte per row and the
+// PLAIN encoding of its non-null values; booleans are stored a byte apiece and
+// bit-packed when the page is written.
+
+struct ColumnData {
+    struct ByteBuffer defs;
+    struct ByteBuffer values;
+};
+
+struct ExportPartition {
+    char date[PARTITION_DATE_SIZE];
+    size_t row_count;
+    struct ColumnData *columns;
+};
+
+struct ExportDataset {
+    char *name;
+    char **column_names;
+    FieldType *column_types;
+    int column_count;          // the caller's columns, then RECORD_COLUMNS
+    char *last_key;
+    char last_version[24];
+    struct ExportPartition *partitions;
+    int partition_count;
+    int partition_capacity;
+    int files_written;
+};
+
+static struct ExportDataset *datasets[MAX_EXPORT_DATASETS];
+static int dataset_count = 0;
+static const char *export_dir = NULL;
+static bool export_dir_checked = false;
+static char export_scope[128];
+static time_t run_started = 0;
+
+static void partition_release(struct ExportDataset *dataset, struct ExportPartition *partition) {
+    for (int c = 0; c < dataset->column_count; c++) {
+        buf_free(&partition->columns[c].defs);
+        buf_free(&partition->columns[c].values);
+    }
+    free(partition->columns);
+    partition->columns = NULL;
+}
+
+static void dataset_free(struct ExportDataset *dataset) {
+    for (int p = 0; p < dataset->partition_count; p++) {
+        partition_release(dataset, &dataset->partitions[p]);
+    }
+    free(dataset->partitions);
+    for (int c = 0; c < dataset->column_count; c++) {
+        free(dataset->column_names[c]);
+    }
+    free(dataset->column_names);
+    free(dataset->column_types);
+    free(dataset->last_key);
+    free(dataset->name);
+    free(dataset);
+}
+
+ExportDatasetPtr export_dataset_get(const char *name, const ExportColumn *columns, int column_count) {
+    if (!export_dir_checked) {
+        export_dir = getenv("REPSLY_EXPORT_DIR");
+        if (export_dir && !*export_dir) {
+            export_dir = NULL;
+        }
+        export_dir_checked = true;
+        run_started = time(NULL);
+    }
+    if (!export_dir) {
+        return NULL;
+    }
+
+    for (int i = 0; i < dataset_count; i++) {
+        if (strcmp(datasets[i]->name, name) == 0) {
+            return datasets[i];
+        }
+    }
+
+    if (dataset_count == MAX_EXPORT_DATASETS) {
+        fprintf(stderr, "Too many export datasets\n");
+        return NULL;
+    }
+
+    struct ExportDataset *dataset = calloc(1, sizeof(struct ExportDataset));
+    if (!dataset) {
+        return NULL;
+    }
+    dataset->name = strdup(name);
+    dataset->column_names = calloc(column_count + RECORD_COLUMNS, sizeof(char *));
+    dataset->column_types = calloc(column_count + RECORD_COLUMNS, sizeof(FieldType));
+    if (!dataset->name || !dataset->column_names || !dataset->column_types) {
+        dataset_free(dataset);
+        return NULL;
+    }
+    dataset->column_count = column_count + RECORD_COLUMNS;
+    for (int c = 0; c < dataset->column_count; c++) {
+        const ExportColumn record_columns[RECORD_COLUMNS] = {{"RecordKey", FIELD_TEXT}, {"RecordVersion", FIELD_INTEGER}};
+        const ExportColumn *column = c < column_count ? &columns[c] : &record_columns[c - column_count];
+        dataset->column_names[c] = strdup(column->name);
+        dataset->column_types[c] = column->type;
+        if (!dataset->column_names[c]) {
+            dataset_free(dataset);
+            return NULL;
+        }
+    }
+
+    datasets[dataset_count++] = dataset;
+    return dataset;
+}
+
+
+// Value encoding
+
+static bool parse_date(const char *text, int *year, int *month, int *day) {
+    return text && sscanf(text, "%4d-%2d-%2d", year, month, day) == 3 &&
+           *month >= 1 && *month <= 12 && *day >= 1 && *day <= 31;
+}
+
+// Appends the PLAIN encoding of value; returns false when it doesn't parse as
+// the column's type, in which case the value is exported as null.
+static bool encode_value(struct ByteBuffer *buf, FieldType type, const char *value) {
+    char *end;
+    switch (type) {
+        case FIELD_INTEGER: {
+            long long number = strtoll(value, &end, 10);
+            if (end == value) {
+                return false;
+            }
+            buf_le64(buf, (uint64_t)number);
+            return true;
+        }
+        case FIELD_REAL: {
+            double number = strtod(value, &end);
+            if (end == value) {
+                return false;
+            }
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            buf_le64(buf, bits);
+            return true;
+        }
+        case FIELD_BOOL:
+            buf_byte(buf, strcmp(value, "true") == 0 || strcmp(value, "t") == 0 || strcmp(value, "1") == 0);
+            return true;
+        // Parquet counts from 1970, temporal.h from 2000
+        case FIELD_TIMESTAMP: {
+            int64_t usec;
+            if (!temporal_parse(value, FIELD_TIMESTAMP, &usec)) {
+                return false;
+            }
+            buf_le64(buf, (uint64_t)(usec / 1000 + PG_EPOCH_UNIX_MS));
+            return true;
+        }
+        case FIELD_DATE: {
+            int64_t days;
+            if (!temporal_parse(value, FIELD_DATE, &days)) {
+                return false;
+            }
+            buf_le32(buf, (uint32_t)(days + PG_EPOCH_UNIX_DAYS));
+            return true;
+        }
+        case FIELD_TEXT:
+        default: {
+            size_t n = strlen(value);
+            buf_le32(buf, (uint32_t)n);
+            buf_put(buf, value, n);
+            return true;
+        }
+    }
+}
+
+
+// Partitions
+
+static void partition_key(const char *partition_date, char *key) {
+    int year, month, day;
+    if (parse_date(partition_date, &year, &month, &day)) {
+        snprintf(key, PARTITION_DATE_SIZE, "%04d-%02d-%02d", year, month, day);
+        return;
+    }
+
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(key, PARTITION_DATE_SIZE, "%Y-%m-%d", &tm);
+}
+
+static struct ExportPartition *partition_get(struct ExportDataset *dataset, const char *key) {
+    for (int p = 0; p < dataset->partition_count; p++) {
+        if (strcmp(dataset->partitions[p].date, key) == 0) {
+            return &dataset->partitions[p];
+        }
+    }
+
+    if (dataset->partition_count == dataset->partition_capacity) {
+        int capacity = dataset->partition_capacity ? dataset->partition_capacity * 2 : 8;
+        struct ExportPartition *grown = realloc(dataset->partitions, capacity * sizeof(struct ExportPartition));
+        if (!grown) {
+            return NULL;
+        }
+        dataset->partitions = grown;
+        dataset->partition_capacity = capacity;
+    }
+
+    struct ExportPartition *partition = &dataset->partitions[dataset->partition_count];
+    memset(partition, 0, sizeof(*partition));
+    memcpy(partition->date, key, PARTITION_DATE_SIZE);
+    partition->columns = calloc(dataset->column_count, sizeof(struct ColumnData));
+    if (!partition->columns) {
+        return NULL;
+    }
+    dataset->partition_count++;
+    return partition;
+}
+
+static void partition_reset(struct ExportDataset *dataset, struct ExportPartition *partition) {
+    for (int c = 0; c < dataset->column_count; c++) {
+        partition->columns[c].defs.len = 0;
+        partition->columns[c].values.len = 0;
+    }
+    partition->row_count = 0;
+}
+
+
+// Parquet file writing
+
+static int parquet_physical_type(FieldType type) {
+    switch (type) {
+        case FIELD_INTEGER: return PARQUET_INT64;
+        case FIELD_REAL: return PARQUET_DOUBLE;
+        case FIELD_BOOL: return PARQUET_BOOLEAN;
+        case FIELD_TIMESTAMP: return PARQUET_INT64;
+        case FIELD_DATE: return PARQUET_INT32;
+        case FIELD_TEXT:
+        default: return PARQUET_BYTE_ARRAY;
+    }
+}
+
+static int parquet_converted_type(FieldType type) {
+    switch (type) {
+        case FIELD_TEXT: return PARQUET_UTF8;
+        case FIELD_TIMESTAMP: return PARQUET_TIMESTAMP_MILLIS;
+        case FIELD_DATE: return PARQUET_DATE;
+        default: return -1;
+    }
+}
+
+// Definition levels as an RLE/bit-packed hybrid (bit width 1), using RLE runs only
+static void encode_definition_levels(struct ByteBuffer *out, const struct ByteBuffer *defs) {
+    struct ByteBuffer runs = {0};
+    size_t i = 0;
+    while (i < defs->len) {
+        size_t run = 1;
+        while (i + run < defs->len && defs->data[i + run] == defs->data[i]) {
+            run++;
+        }
+        buf_varint(&runs, (uint64_t)run << 1);
+        buf_byte(&runs, defs->data[i]);
+        i += run;
+    }
+
+    buf_le32(out, (uint32_t)runs.len);
+    buf_put(out, runs.data, runs.len);
+    out->failed = out->failed || runs.failed;
+    buf_free(&runs);
+}
+
+static void encode_page_values(struct ByteBuffer *out, FieldType type, const struct ByteBuffer *values) {
+    if (type != FIELD_BOOL) {
+        buf_put(out, values->data, values->len);
+        return;
+    }
+
+    for (size_t i = 0; i < values->len; i += 8) {
+        uint8_t packed = 0;
+        for (size_t bit = 0; bit < 8 && i + bit < values->len; bit++) {
+            packed |= (uint8_t)(values->data[i + bit] << bit);
+        }
+        buf_byte(out, packed);
+    }
+}
+
+static bool gzip_compress(const struct ByteBuffer *in, struct ByteBuffer *out) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+
+    size_t bound = deflateBound(&stream, in->len);
+    out->len = 0;
+    if (out->capacity < bound) {
+        uint8_t *grown = realloc(out->data, bound);
+        if (!grown) {
+            deflateEnd(&stream);
+            return false;
+        }
+        out->data = grown;
+        out->capacity = bound;
+    }
+
+    stream.next_in = in->data;
+    stream.avail_in = (uInt)in->len;
+    stream.next_out = out->data;
+    stream.avail_out = (uInt)bound;
+
+    int status = deflate(&stream, Z_FINISH);
+    out->len = stream.total_out;
+    deflateEnd(&stream);
+    return status == Z_STREAM_END;
+}
+
+struct ChunkInfo {
+    int64_t offset;
+    int64_t uncompressed_size;
+    int64_t compressed_size;
+};
+
+static bool write_column_chunk(struct ByteBuffer *file, const struct ExportPartition *partition, int c,
+                               FieldType type, struct ChunkInfo *info) {
+    const struct ColumnData *column = &partition->columns[c];
+
+    struct ByteBuffer page = {0};
+    struct ByteBuffer compressed = {0};
+    struct ByteBuffer header = {0};
+
+    encode_definition_levels(&page, &column->defs);
+    encode_page_values(&page, type, &column->values);
+
+    bool ok = !page.failed && gzip_compress(&page, &compressed);
+    if (ok) {
+        struct ThriftWriter w = {&header, {0}, 0};
+        thrift_i32(&w, 1, PARQUET_DATA_PAGE);
+        thrift_i32(&w, 2, (int32_t)page.len);
+        thrift_i32(&w, 3, (int32_t)compressed.len);
+        thrift_struct_begin(&w, 5);
+        thrift_i32(&w, 1, (int32_t)partition->row_count);
+        thrift_i32(&w, 2, PARQUET_PLAIN);
+        thrift_i32(&w, 3, PARQUET_RLE);
+        thrift_i32(&w, 4, PARQUET_RLE);
+        thrift_struct_end(&w);
+        buf_byte(&header, 0);
+
+        info->offset = (int64_t)file->len;
+        info->uncompressed_size = (int64_t)(header.len + page.len);
+        info->compressed_size = (int64_t)(header.len + compressed.len);
+
+        buf_put(file, header.data, header.len);
+        buf_put(file, compressed.data, compressed.len);
+        ok = !header.failed && !file->failed;
+    }
+
+    buf_free(&page);
+    buf_free(&compressed);
+    buf_free(&header);
+    return ok;
+}
+
+static void write_footer(struct ByteBuffer *file, const struct ExportDataset *dataset,
+                         const struct ExportPartition *partition, const struct ChunkInfo *chunks) {
+    struct ByteBuffer meta = {0};
+    struct ThriftWriter w = {&meta, {0}, 0};
+
+    thrift_i32(&w, 1, 1);
+
+    thrift_list(&w, 2, THRIFT_STRUCT, dataset->column_count + 1);
+    thrift_struct_begin(&w, 0);
+    thrift_string(&w, 4, "schema");
+    thrift_i32(&w, 5, dataset->column_count);
+    thrift_struct_end(&w);
+    for (int c = 0; c < dataset->column_count; c++) {
+        FieldType type = dataset->column_types[c];
+        thrift_struct_begin(&w, 0);
+        thrift_i32(&w, 1, parquet_physical_type(type));
+        thrift_i32(&w, 3, PARQUET_OPTIONAL);
+        thrift_string(&w, 4, dataset->column_names[c]);
+        if (parquet_converted_type(type) >= 0) {
+            thrift_i32(&w, 6, parquet_converted_type(type));
+        }
+        thrift_struct_end(&w);
+    }
+
+    thrift_i64(&w, 3, (int64_t)partition->row_count);
+
+    int64_t total_size = 0;
+    for (int c = 0; c < dataset->column_count; c++) {
+        total_size += chunks[c].uncompressed_size;
+    }
+
+    thrift_list(&w, 4, THRIFT_STRUCT, 1);
+    thrift_struct_begin(&w, 0);
+    thrift_list(&w, 1, THRIFT_STRUCT, dataset->column_count);
+    for (int c = 0; c < dataset->column_count; c++) {
+        thrift_struct_begin(&w, 0);
+        thrift_i64(&w, 2, chunks[c].offset);
+        thrift_struct_begin(&w, 3);
+        thrift_i32(&w, 1, parquet_physical_type(dataset->column_types[c]));
+        thrift_list(&w, 2, THRIFT_I32, 2);
+        thrift_i32_value(&w, PARQUET_PLAIN);
+        thrift_i32_value(&w, PARQUET_RLE);
+        thrift_list(&w, 3, THRIFT_BINARY, 1);
+        thrift_string_value(&w, dataset->column_names[c]);
+        thrift_i32(&w, 4, PARQUET_GZIP);
+        thrift_i64(&w, 5, (int64_t)partition->row_count);
+        thrift_i64(&w, 6, chunks[c].uncompressed_size);
+        thrift_i64(&w, 7, chunks[c].compressed_size);
+        thrift_i64(&w, 9, chunks[c].offset);
+        thrift_struct_end(&w);
+        thrift_struct_end(&w);
+    }
+    thrift_i64(&w, 2, total_size);
+    thrift_i64(&w, 3, (int64_t)partition->row_count);
+    thrift_struct_end(&w);
+
+    thrift_string(&w, 6, "repsly_mirror");
+    buf_byte(&meta, 0);
+
+    buf_put(file, meta.data, meta.len);
+    buf_le32(file, (uint32_t)meta.len);
+    buf_put(file, "PAR1", 4);
+    file->failed = file->failed || meta.failed;
+    buf_free(&meta);
+}
+
+static bool make_directory(const char *path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Writes to a hidden temporary name first, so readers scanning the partition
+// never pick up a half-written file.
+static bool write_file(const char *dir, const char *file_name, const struct ByteBuffer *file) {
+    char temp_path[1024];
+    char final_path[1024];
+    snprintf(temp_path, sizeof(temp_path), "%s/.%s.tmp", dir, file_name);
+    snprintf(final_path, sizeof(final_path), "%s/%s", dir, file_name);
+
+    FILE *out = fopen(temp_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Failed to open %s: %s\n", temp_path, strerror(errno));
+        return false;
+    }
+
+    bool ok = fwrite(file->data, 1, file->len, out) == file->len;
+    ok = (fclose(out) == 0) && ok;
+    if (ok && rename(temp_path, final_path) != 0) {
+        fprintf(stderr, "Failed to rename %s: %s\n", temp_path, strerror(errno));
+        ok = false;
+    }
+    if (!ok) {
+        unlink(temp_path);
+    }
+    return ok;
+}
+
+static bool partition_write(struct ExportDataset *dataset, struct ExportPartition *partition) {
+    if (partition->row_count == 0) {
+        return true;
+    }
+
+    char scope_dir[400];
+    char dataset_dir[512];
+    char partition_dir[600];
+    snprintf(scope_dir, sizeof(scope_dir), "%s%s%s", export_dir, export_scope[0] ? "/" : "", export_scope);
+    snprintf(dataset_dir, sizeof(dataset_dir), "%s/%s", scope_dir, dataset->name);
+    snprintf(partition_dir, sizeof(partition_dir), "%s/date=%s", dataset_dir, partition->date);
+    if (!make_directory(export_dir) || !make_directory(scope_dir) || !make_directory(dataset_dir) ||
+        !make_directory(partition_dir)) {
+        return false;
+    }
+
+    struct ChunkInfo *chunks = calloc(dataset->column_count, sizeof(struct ChunkInfo));
+    struct ByteBuffer file = {0};
+    if (!chunks) {
+        return false;
+    }
+
+    buf_put(&file, "PAR1", 4);
+    bool ok = true;
+    for (int c = 0; c < dataset->column_count && ok; c++) {
+        ok = write_column_chunk(&file, partition, c, dataset->column_types[c], &chunks[c]);
+    }
+    if (ok) {
+        write_footer(&file, dataset, partition, chunks);
+        ok = !file.failed;
+    }
+
+    if (ok) {
+        char file_name[128];
+        snprintf(file_name, sizeof(file_name), "part-%ld-%ld-%d.parquet",
+                 (long)run_started, (long)getpid(), dataset->files_written++);
+        ok = write_file(partition_dir, file_name, &file);
+    } else {
+        fprintf(stderr, "Failed to encode %s partition %s\n", dataset->name, partition->date);
+    }
+
+    free(chunks);
+    buf_free(&file);
+    partition_reset(dataset, partition);
+    return ok;
+}
+
+// Microseconds since 1970, kept strictly increasing within the process so
+// two exports of a record never share a version
+static void next_version(char *version, size_t size) {
+    static long long last_version;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long micros = (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+    last_version = micros > last_version ? micros : last_version + 1;
+    snprintf(version, size, "%lld", last_version);
+}
+
+bool export_dataset_append(ExportDatasetPtr dataset, const char *partition_date, const char *key,
+                           const char *const *values) {
+    if (!dataset) {
+        return true;
+    }
+
+    key = key ? key : "";
+    if (!dataset->last_key || strcmp(dataset->last_key, key) != 0) {
+        char *copy = strdup(key);
+        if (!copy) {
+            return false;
+        }
+        free(dataset->last_key);
+        dataset->last_key = copy;
+        next_version(dataset->last_version, sizeof(dataset->last_version));
+    }
+    int value_count = dataset->column_count - RECORD_COLUMNS;
+
+    char date[PARTITION_DATE_SIZE];
+    partition_key(partition_date, date);
+    struct ExportPartition *partition = partition_get(dataset, date);
+    if (!partition) {
+        fprintf(stderr, "Failed to allocate %s partition %s\n", dataset->name, date);
+        return false;
+    }
+
+    bool ok = true;
+    for (int c = 0; c < dataset->column_count; c++) {
+        struct ColumnData *column = &partition->columns[c];
+        const char *value = c < value_count ? values[c] : c == value_count ? key : dataset->last_version;
+        bool defined = value && encode_value(&column->values, dataset->column_types[c], value);
+        buf_byte(&column->defs, defined ? 1 : 0);
+        ok = ok && !column->defs.failed && !column->values.failed;
+    }
+    if (!ok) {
+        fprintf(stderr, "Out of memory buffering %s export\n", dataset->name);
+        partition_reset(dataset, partition);
+        return false;
+    }
+
+    partition->row_count++;
+    if (partition->row_count >= EXPORT_ROWS_PER_FILE) {
+        return partition_write(dataset, partition);
+    }
+    return true;
+}
+
+// Partitions are dropped once written; a long-running daemon sees a new date
+// every day and shouldn't keep buffers for all of them.
+bool export_flush_all(void) {
+    bool ok = true;
+    for (int i = 0; i < dataset_count; i++) {
+        struct ExportDataset *dataset = datasets[i];
+        for (int p = 0; p < dataset->partition_count; p++) {
+            ok = partition_write(dataset, &dataset->partitions[p]) && ok;
+            partition_release(dataset, &dataset->partitions[p]);
+        }
+        dataset->partition_count = 0;
+    }
+    return ok;
+}
+
+bool export_set_scope(const char *scope) {
+    scope = scope ? scope : "";
+    if (strcmp(export_scope, scope) == 0) {
+        return true;
+    }
+
+    bool ok = export_flush_all();
+    snprintf(export_scope, sizeof(export_scope), "%s", scope);
+    for (char *c = export_scope; *c; c++) {
+        if (*c == '/' || (c == export_scope && *c == '.')) {
+            *c = '_';
+        }
+    }
+
+    // Versions are per record, and a key means a different record in another scope
+    for (int i = 0; i < dataset_count; i++) {
+        free(datasets[i]->last_key);
+        datasets[i]->last_key = NULL;
+    }
+    return ok;
+}
+
+void export_shutdown(void) {
+    export_flush_all();
+    for (int i = 0; i < dataset_count; i++) {
+        dataset_free(datasets[i]);
+        datasets[i] = NULL;
+    }
+    dataset_count = 0;
+}
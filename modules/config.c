@@ -0,0 +1,141 @@
+#include "../include/config.h"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define MAX_CONFIG_LINE 1024
+
+struct ConfigEntry {
+    char *key;
+    char *value;
+};
+
+struct MirrorConfig {
+    struct ConfigEntry *entries;
+    int count;
+    int capacity;
+};
+
+static char *trim(char *text) {
+    while (isspace((unsigned char)*text)) {
+        text++;
+    }
+    char *end = text + strlen(text);
+    while (end > text && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return text;
+}
+
+static bool config_set(MirrorConfigPtr config, const char *key, const char *value) {
+    for (int i = 0; i < config->count; i++) {
+        if (strcmp(config->entries[i].key, key) == 0) {
+            char *copy = strdup(value);
+            if (!copy) {
+                return false;
+            }
+            free(config->entries[i].value);
+            config->entries[i].value = copy;
+            return true;
+        }
+    }
+
+    if (config->count == config->capacity) {
+        int capacity = config->capacity ? config->capacity * 2 : 16;
+        struct ConfigEntry *entries = realloc(config->entries, capacity * sizeof(struct ConfigEntry));
+        if (!entries) {
+            return false;
+        }
+        config->entries = entries;
+        config->capacity = capacity;
+    }
+
+    struct ConfigEntry *entry = &config->entries[config->count];
+    entry->key = strdup(key);
+    entry->value = strdup(value);
+    if (!entry->key || !entry->value) {
+        free(entry->key);
+        free(entry->value);
+        return false;
+    }
+    config->count++;
+    return true;
+}
+
+MirrorConfigPtr config_load(const char *path) {
+    MirrorConfigPtr config = calloc(1, sizeof(struct MirrorConfig));
+    if (!config || !path) {
+        return config;
+    }
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Could not open config %s, using defaults\n", path);
+        return config;
+    }
+
+    char line[MAX_CONFIG_LINE];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_no++;
+        char *text = trim(line);
+        if (*text == '\0' || *text == '#') {
+            continue;
+        }
+
+        char *equals = strchr(text, '=');
+        if (!equals) {
+            fprintf(stderr, "%s:%d: expected key = value\n", path, line_no);
+            continue;
+        }
+
+        *equals = '\0';
+        if (!config_set(config, trim(text), trim(equals + 1))) {
+            fprintf(stderr, "%s:%d: out of memory\n", path, line_no);
+            break;
+        }
+    }
+
+    fclose(file);
+    return config;
+}
+
+void config_free(MirrorConfigPtr config) {
+    if (!config) {
+        return;
+    }
+    for (int i = 0; i < config->count; i++) {
+        free(config->entries[i].key);
+        free(config->entries[i].value);
+    }
+    free(config->entries);
+    free(config);
+}
+
+const char *config_get_string(MirrorConfigPtr config, const char *key, const char *default_value) {
+    if (config) {
+        for (int i = 0; i < config->count; i++) {
+            if (strcmp(config->entries[i].key, key) == 0) {
+                return config->entries[i].value;
+            }
+        }
+    }
+    return default_value;
+}
+
+long config_get_long(MirrorConfigPtr config, const char *key, long default_value) {
+    const char *value = config_get_string(config, key, NULL);
+    if (!value) {
+        return default_value;
+    }
+
+    char *end;
+    long result = strtol(value, &end, 10);
+    if (end == value || *end != '\0') {
+        fprintf(stderr, "Config %s = %s is not a number, using %ld\n", key, value, default_value);
+        return default_value;
+    }
+    return result;
+}
@@ -1,13 +1,18 @@
 #include "core_operations.h"
+#include "sql_stats.h"
+#include "temporal.h"
 #include <libpq-fe.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 PGconn* db_connect(void) {
+    return db_connect_to(getenv("REPSLY_DB_NAME"));
+}
+
+PGconn* db_connect_to(const char *dbname) {
     const char *host = getenv("REPSLY_DB_HOST");
     const char *port = getenv("REPSLY_DB_PORT");
-    const char *dbname = getenv("REPSLY_DB_NAME");
     const char *user = getenv("REPSLY_DB_USER");
     const char *password = getenv("REPSLY_DB_PASSWORD");
 
@@ -32,7 +37,10 @@ PGconn* db_connect(void) {
     return conn;
 }
 
+static void forget_prepared_statements(void);
+
 void db_disconnect(PGconn *conn) {
+    forget_prepared_statements();
     if (conn) {
         PQfinish(conn);
     }
@@ -40,15 +48,92 @@ void db_disconnect(PGconn *conn) {
 
 // Unified cursor handling to modularize the helper functions a bit further...
 
-static int execute_int_query(PGconn *conn, const char *query, int n_params, const char **param_values) {
-    int param_lengths[n_params];
-    int param_formats[n_params];
-    for (int i = 0; i < n_params; i++) {
-        param_lengths[i] = strlen(param_values[i]);
-        param_formats[i] = 0;  // text format
+// The get_or_create_* lookups run once per dimension miss for the life of the
+// process, so each query text is prepared on first use and executed by name
+// afterwards. Statements are keyed by the address of the query literal and
+// belong to one connection; db_ensure_connected forgets them after a reset.
+
+#define MAX_PREPARED_STATEMENTS 64
+
+struct PreparedStatement {
+    const char *query;
+    char name[16];
+};
+
+static struct PreparedStatement prepared[MAX_PREPARED_STATEMENTS];
+static int prepared_count = 0;
+static PGconn *prepared_conn = NULL;
+
+static void forget_prepared_statements(void) {
+    prepared_count = 0;
+    prepared_conn = NULL;
+}
+
+static const char *prepare_statement(PGconn *conn, const char *query, int n_params) {
+    if (conn != prepared_conn) {
+        forget_prepared_statements();
+        prepared_conn = conn;
+        // A connection used before (accounts.h switches between several)
+        // may still hold core_N under another query
+        PQclear(PQexec(conn, "DEALLOCATE ALL"));
+    }
+
+    for (int i = 0; i < prepared_count; i++) {
+        if (prepared[i].query == query) {
+            return prepared[i].name;
+        }
+    }
+
+    if (prepared_count == MAX_PREPARED_STATEMENTS) {
+        return NULL;
+    }
+
+    struct PreparedStatement *stmt = &prepared[prepared_count];
+    snprintf(stmt->name, sizeof(stmt->name), "core_%d", prepared_count);
+
+    PGresult *res = PQprepare(conn, stmt->name, query, n_params, NULL);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "Prepare failed: %s", PQerrorMessage(conn));
+        PQclear(res);
+        return NULL;
+    }
+    PQclear(res);
+
+    stmt->query = query;
+    prepared_count++;
+    return stmt->name;
+}
+
+void db_reset(PGconn *conn) {
+    forget_prepared_statements();
+    PQreset(conn);
+}
+
+bool db_ensure_connected(PGconn *conn) {
+    if (PQstatus(conn) == CONNECTION_OK) {
+        return true;
+    }
+
+    fprintf(stderr, "Database connection lost, reconnecting\n");
+    db_reset(conn);
+
+    if (PQstatus(conn) != CONNECTION_OK) {
+        fprintf(stderr, "Reconnect failed: %s", PQerrorMessage(conn));
+        return false;
     }
+    return true;
+}
+
+// tag names the caller in traces and statement statistics. Lengths and
+// formats are only needed for binary parameters; each binary one must be cast
+// in query, since statements are prepared without parameter types.
+static int execute_bound_int_query(PGconn *conn, const char *tag, const char *query, int n_params,
+                                   const char **param_values, const int *param_lengths, const int *param_formats) {
+    const char *stmt_name = prepare_statement(conn, query, n_params);
 
-    PGresult *res = PQexecParams(conn, query, n_params, NULL, param_values, param_lengths, param_formats, 0);
+    PGresult *res = stmt_name
+        ? sql_exec_prepared(conn, tag, stmt_name, query, n_params, param_values, param_lengths, param_formats)
+        : sql_exec_params(conn, tag, query, n_params, param_values, param_lengths, param_formats);
 
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         fprintf(stderr, "Query failed: %s", PQerrorMessage(conn));
@@ -65,6 +150,30 @@ static int execute_int_query(PGconn *conn, const char *query, int n_params, cons
     return result;
 }
 
+// Text parameters are NUL-terminated, so libpq needs no lengths or formats
+static int execute_int_query(PGconn *conn, const char *tag, const char *query, int n_params,
+                             const char **param_values) {
+    return execute_bound_int_query(conn, tag, query, n_params, param_values, NULL, NULL);
+}
+
+// A timestamp or date as a binary parameter; NULL text binds NULL. Returns
+// false if the text isn't a date temporal_parse accepts.
+static bool bind_temporal(const char *text, FieldType type, char *binary, const char **value, int *length) {
+    int64_t decoded;
+    *value = NULL;
+    *length = 0;
+    if (!text) {
+        return true;
+    }
+    if (!temporal_parse(text, type, &decoded)) {
+        fprintf(stderr, "Malformed %s \"%s\"\n", type == FIELD_DATE ? "date" : "timestamp", text);
+        return false;
+    }
+    *length = temporal_binary(decoded, type, binary);
+    *value = binary;
+    return true;
+}
+
 
 // These are to help us with referential integrity. The basic idea of an UPSERT is to:
 
@@ -75,24 +184,6 @@ static int execute_int_query(PGconn *conn, const char *query, int n_params, cons
 // The premise here is to cut down on as much redundant data as possible!
 
 
-int get_or_create_address(PGconn *conn, const char *street, const char *zip, const char *city, const char *state, const char *country) {
-    const char *query =
-        "WITH new_address AS ("
-        "    INSERT INTO core.addresses (street_address, zip_code, city, state, country) "
-        "    VALUES ($1, $2, $3, $4, $5) "
-        "    ON CONFLICT (street_address, zip_code, city, state, country) DO NOTHING "
-        "    RETURNING address_id"
-        ")"
-        "SELECT address_id FROM new_address "
-        "UNION ALL "
-        "SELECT address_id FROM core.addresses "
-        "WHERE street_address = $1 AND zip_code = $2 AND city = $3 AND state = $4 AND country = $5 "
-        "LIMIT 1";
-
-    const char *param_values[] = {street, zip, city, state, country};
-    return execute_int_query(conn, query, 5, param_values);
-}
-
 int get_or_create_contact_info(PGconn *conn, const char *phone, const char *mobile, const char *website) {
     const char *query =
         "WITH new_contact AS ("
@@ -108,7 +199,7 @@ int get_or_create_contact_info(PGconn *conn, const char *phone, const char *mobi
         "LIMIT 1";
 
     const char *param_values[] = {phone, mobile, website};
-    return execute_int_query(conn, query, 3, param_values);
+    return execute_int_query(conn, __func__, query, 3, param_values);
 }
 
 int get_or_create_territory(PGconn *conn, const char *territory_name) {
@@ -126,7 +217,7 @@ int get_or_create_territory(PGconn *conn, const char *territory_name) {
         "LIMIT 1";
 
     const char *param_values[] = {territory_name};
-    return execute_int_query(conn, query, 1, param_values);
+    return execute_int_query(conn, __func__, query, 1, param_values);
 }
 
 int get_or_create_representative(PGconn *conn, const char *rep_code, const char *rep_name) {
@@ -144,7 +235,7 @@ int get_or_create_representative(PGconn *conn, const char *rep_code, const char
         "LIMIT 1";
 
     const char *param_values[] = {rep_code, rep_name};
-    return execute_int_query(conn, query, 2, param_values);
+    return execute_int_query(conn, __func__, query, 2, param_values);
 }
 
 int get_or_create_name(PGconn *conn, const char *name) {
@@ -162,33 +253,45 @@ int get_or_create_name(PGconn *conn, const char *name) {
         "LIMIT 1";
 
     const char *param_values[] = {name};
-    return execute_int_query(conn, query, 1, param_values);
+    return execute_int_query(conn, __func__, query, 1, param_values);
 }
 
 int get_or_create_visit(PGconn *conn, const char *visit_start, const char *visit_end, const char *rep_code, const char *client_code) {
+    // Visits are partitioned by visit_date, so no unique key on (start, rep,
+    // client) can exist; the existing visit is looked up first instead
     const char *query =
-        "WITH new_visit AS ("
-        "    INSERT INTO field_ops.visits (time_start_id, time_end_id, rep_id, client_id) "
-        "    VALUES ("
+        "WITH existing AS ("
+        "    SELECT v.visit_id FROM field_ops.visits v "
+        "    JOIN meta.time ts ON v.time_start_id = ts.time_id "
+        "    JOIN field_ops.representatives r ON v.rep_id = r.rep_id "
+        "    JOIN sales.clients c ON v.client_id = c.client_id "
+        "    WHERE ts.timestamp = $1::timestamp AND r.rep_code = $3 AND c.code = $4 "
+        "    LIMIT 1"
+        "), new_visit AS ("
+        "    INSERT INTO field_ops.visits (time_start_id, time_end_id, rep_id, client_id, visit_date) "
+        "    SELECT "
         "        (SELECT time_id FROM meta.time WHERE timestamp = $1::timestamp), "
         "        (SELECT time_id FROM meta.time WHERE timestamp = $2::timestamp), "
         "        (SELECT rep_id FROM field_ops.representatives WHERE rep_code = $3), "
-        "        (SELECT client_id FROM sales.clients WHERE code = $4)"
-        "    ) "
-        "    ON CONFLICT (time_start_id, rep_id, client_id) DO NOTHING "
+        "        (SELECT client_id FROM sales.clients WHERE code = $4), "
+        "        COALESCE($1::timestamp::date, CURRENT_DATE) "
+        "    WHERE NOT EXISTS (SELECT 1 FROM existing) "
         "    RETURNING visit_id"
         ")"
-        "SELECT visit_id FROM new_visit "
+        "SELECT visit_id FROM existing "
         "UNION ALL "
-        "SELECT v.visit_id FROM field_ops.visits v "
-        "JOIN meta.time ts ON v.time_start_id = ts.time_id "
-        "JOIN field_ops.representatives r ON v.rep_id = r.rep_id "
-        "JOIN sales.clients c ON v.client_id = c.client_id "
-        "WHERE ts.timestamp = $1::timestamp AND r.rep_code = $3 AND c.code = $4 "
+        "SELECT visit_id FROM new_visit "
         "LIMIT 1";
 
-    const char *param_values[] = {visit_start, visit_end, rep_code, client_code};
-    return execute_int_query(conn, query, 4, param_values);
+    char binary[2][TEMPORAL_BINARY_SIZE];
+    const char *param_values[] = {NULL, NULL, rep_code, client_code};
+    int param_lengths[4] = {0};
+    int param_formats[] = {1, 1, 0, 0};
+    if (!bind_temporal(visit_start, FIELD_TIMESTAMP, binary[0], &param_values[0], &param_lengths[0]) ||
+        !bind_temporal(visit_end, FIELD_TIMESTAMP, binary[1], &param_values[1], &param_lengths[1])) {
+        return -1;
+    }
+    return execute_bound_int_query(conn, __func__, query, 4, param_values, param_lengths, param_formats);
 }
 
 int get_or_create_time(PGconn *conn, const char *timestamp) {
@@ -205,8 +308,14 @@ int get_or_create_time(PGconn *conn, const char *timestamp) {
         "WHERE timestamp = $1::timestamp "
         "LIMIT 1";
 
-    const char *param_values[] = {timestamp};
-    return execute_int_query(conn, query, 1, param_values);
+    char binary[TEMPORAL_BINARY_SIZE];
+    const char *param_values[1];
+    int param_lengths[1];
+    int param_formats[] = {1};
+    if (!bind_temporal(timestamp, FIELD_TIMESTAMP, binary, &param_values[0], &param_lengths[0])) {
+        return -1;
+    }
+    return execute_bound_int_query(conn, __func__, query, 1, param_values, param_lengths, param_formats);
 }
 
 int get_or_create_date(PGconn *conn, const char *date) {
@@ -223,8 +332,14 @@ int get_or_create_date(PGconn *conn, const char *date) {
         "WHERE date = $1::date "
         "LIMIT 1";
 
-    const char *param_values[] = {date};
-    return execute_int_query(conn, query, 1, param_values);
+    char binary[TEMPORAL_BINARY_SIZE];
+    const char *param_values[1];
+    int param_lengths[1];
+    int param_formats[] = {1};
+    if (!bind_temporal(date, FIELD_DATE, binary, &param_values[0], &param_lengths[0])) {
+        return -1;
+    }
+    return execute_bound_int_query(conn, __func__, query, 1, param_values, param_lengths, param_formats);
 }
 
 int get_or_create_note(PGconn *conn, const char *note_text) {
@@ -242,7 +357,7 @@ int get_or_create_note(PGconn *conn, const char *note_text) {
         "LIMIT 1";
 
     const char *param_values[] = {note_text};
-    return execute_int_query(conn, query, 1, param_values);
+    return execute_int_query(conn, __func__, query, 1, param_values);
 }
 
 int get_or_create_lat(PGconn *conn, double latitude) {
@@ -263,7 +378,7 @@ int get_or_create_lat(PGconn *conn, double latitude) {
         "LIMIT 1";
 
     const char *param_values[] = {lat_str};
-    return execute_int_query(conn, query, 1, param_values);
+    return execute_int_query(conn, __func__, query, 1, param_values);
 }
 
 int get_or_create_long(PGconn *conn, double longitude) {
@@ -284,7 +399,7 @@ int get_or_create_long(PGconn *conn, double longitude) {
         "LIMIT 1";
 
     const char *param_values[] = {long_str};
-    return execute_int_query(conn, query, 1, param_values);
+    return execute_int_query(conn, __func__, query, 1, param_values);
 }
 
 
@@ -305,7 +420,7 @@ int get_or_create_product(PGconn *conn, const char *product_code, const char *pr
         "LIMIT 1";
 
     const char *param_values[] = {product_code, product_name};
-    return execute_int_query(conn, query, 2, param_values);
+    return execute_int_query(conn, __func__, query, 2, param_values);
 }
 
 int get_or_create_client(PGconn *conn, const char *client_code, const char *client_name) {
@@ -323,7 +438,157 @@ int get_or_create_client(PGconn *conn, const char *client_code, const char *clie
         "LIMIT 1";
 
     const char *param_values[] = {client_code, client_name};
-    return execute_int_query(conn, query, 2, param_values);
+    return execute_int_query(conn, __func__, query, 2, param_values);
+}
+
+int get_or_create_product_group(PGconn *conn, const char *group_code, const char *group_name) {
+    const char *query =
+        "WITH new_group AS ("
+        "    INSERT INTO inventory.product_groups (code, name) "
+        "    VALUES ($1, $2) "
+        "    ON CONFLICT (code) DO NOTHING "
+        "    RETURNING group_id"
+        ")"
+        "SELECT group_id FROM new_group "
+        "UNION ALL "
+        "SELECT group_id FROM inventory.product_groups "
+        "WHERE code = $1 "
+        "LIMIT 1";
+
+    const char *param_values[] = {group_code, group_name ? group_name : ""};
+    return execute_int_query(conn, __func__, query, 2, param_values);
+}
+
+
+// Reps, users and documents
+
+int get_or_create_rep_code(PGconn *conn, const char *rep_code) {
+    const char *query =
+        "WITH new_code AS ("
+        "    INSERT INTO field_ops.rep_code (rep_code) "
+        "    VALUES ($1) "
+        "    ON CONFLICT (rep_code) DO NOTHING "
+        "    RETURNING rep_code_id"
+        ")"
+        "SELECT rep_code_id FROM new_code "
+        "UNION ALL "
+        "SELECT rep_code_id FROM field_ops.rep_code "
+        "WHERE rep_code = $1 "
+        "LIMIT 1";
+
+    const char *param_values[] = {rep_code};
+    return execute_int_query(conn, __func__, query, 1, param_values);
+}
+
+int get_or_create_email(PGconn *conn, const char *email_address) {
+    const char *query =
+        "WITH new_email AS ("
+        "    INSERT INTO core.emails (email_address) "
+        "    VALUES ($1) "
+        "    ON CONFLICT (email_address) DO NOTHING "
+        "    RETURNING email_id"
+        ")"
+        "SELECT email_id FROM new_email "
+        "UNION ALL "
+        "SELECT email_id FROM core.emails "
+        "WHERE email_address = $1 "
+        "LIMIT 1";
+
+    const char *param_values[] = {email_address};
+    return execute_int_query(conn, __func__, query, 1, param_values);
+}
+
+int get_or_create_role(PGconn *conn, const char *role_name) {
+    const char *query =
+        "WITH new_role AS ("
+        "    INSERT INTO core.roles (role_name) "
+        "    VALUES ($1) "
+        "    ON CONFLICT (role_name) DO NOTHING "
+        "    RETURNING role_id"
+        ")"
+        "SELECT role_id FROM new_role "
+        "UNION ALL "
+        "SELECT role_id FROM core.roles "
+        "WHERE role_name = $1 "
+        "LIMIT 1";
+
+    const char *param_values[] = {role_name};
+    return execute_int_query(conn, __func__, query, 1, param_values);
+}
+
+int get_or_create_document_type(PGconn *conn, const char *document_type_name) {
+    const char *query =
+        "WITH new_type AS ("
+        "    INSERT INTO sales.document_types (name) "
+        "    VALUES ($1) "
+        "    ON CONFLICT (name) DO NOTHING "
+        "    RETURNING document_type_id"
+        ")"
+        "SELECT document_type_id FROM new_type "
+        "UNION ALL "
+        "SELECT document_type_id FROM sales.document_types "
+        "WHERE name = $1 "
+        "LIMIT 1";
+
+    const char *param_values[] = {document_type_name};
+    return execute_int_query(conn, __func__, query, 1, param_values);
+}
+
+int get_or_create_document_status(PGconn *conn, const char *document_status_name) {
+    const char *query =
+        "WITH new_status AS ("
+        "    INSERT INTO sales.document_statuses (name) "
+        "    VALUES ($1) "
+        "    ON CONFLICT (name) DO NOTHING "
+        "    RETURNING document_status_id"
+        ")"
+        "SELECT document_status_id FROM new_status "
+        "UNION ALL "
+        "SELECT document_status_id FROM sales.document_statuses "
+        "WHERE name = $1 "
+        "LIMIT 1";
+
+    const char *param_values[] = {document_status_name};
+    return execute_int_query(conn, __func__, query, 1, param_values);
+}
+
+int get_or_create_custom_field(PGconn *conn, const char *entity_type, const char *field_name) {
+    const char *query =
+        "WITH new_field AS ("
+        "    INSERT INTO meta.custom_fields (entity_type, field_name) "
+        "    VALUES ($1, $2) "
+        "    ON CONFLICT (entity_type, field_name) DO NOTHING "
+        "    RETURNING field_id"
+        ")"
+        "SELECT field_id FROM new_field "
+        "UNION ALL "
+        "SELECT field_id FROM meta.custom_fields "
+        "WHERE entity_type = $1 AND field_name = $2 "
+        "LIMIT 1";
+
+    const char *param_values[] = {entity_type, field_name};
+    return execute_int_query(conn, __func__, query, 2, param_values);
+}
+
+int find_visit_by_repsly_id(PGconn *conn, const char *repsly_visit_id) {
+    // repsly_id is kept unique across partitions (see entity_rows_move); the
+    // order only settles rows duplicated before that was the case
+    const char *query =
+        "SELECT visit_id FROM field_ops.visits WHERE repsly_id = $1::bigint ORDER BY visit_date DESC LIMIT 1";
+
+    const char *param_values[] = {repsly_visit_id};
+    PGresult *res = sql_exec_params(conn, __func__, query, 1, param_values, NULL, NULL);
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Query failed: %s", PQerrorMessage(conn));
+        PQclear(res);
+        return -1;
+    }
+
+    int visit_id = PQntuples(res) > 0 ? atoi(PQgetvalue(res, 0, 0)) : 0;
+
+    PQclear(res);
+    return visit_id;
 }
 
 
@@ -336,7 +601,7 @@ long get_last_processed(PGconn *conn, const char *entity_name) {
     int param_lengths[] = { strlen(entity_name) };
     int param_formats[] = { 0 };  // text format
 
-    PGresult *res = PQexecParams(conn, query, 1, NULL, param_values, param_lengths, param_formats, 0);
+    PGresult *res = sql_exec_params(conn, __func__, query, 1, param_values, param_lengths, param_formats);
 
     long result = 0;
     if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) > 0) {
@@ -349,13 +614,15 @@ long get_last_processed(PGconn *conn, const char *entity_name) {
     return result;
 }
 
-bool update_last_processed(PGconn *conn, const char *entity_name, long last_value) {
-    const char *query = 
-        "INSERT INTO meta.last_processed (entity_name, last_value) "
-        "VALUES ($1, $2) "
-        "ON CONFLICT (entity_name) DO UPDATE "
-        "SET last_value = EXCLUDED.last_value";
+// Cursors only move forward: an instance that loses its lease mid-page can't
+// undo what the new holder has loaded since
+static const char *update_last_processed_query =
+    "INSERT INTO meta.last_processed (entity_name, last_value) "
+    "VALUES ($1, $2) "
+    "ON CONFLICT (entity_name) DO UPDATE "
+    "SET last_value = GREATEST(meta.last_processed.last_value, EXCLUDED.last_value)";
 
+bool update_last_processed(PGconn *conn, const char *entity_name, long last_value) {
     char value_str[21];
     snprintf(value_str, sizeof(value_str), "%ld", last_value);
 
@@ -363,7 +630,8 @@ bool update_last_processed(PGconn *conn, const char *entity_name, long last_valu
     int param_lengths[] = { strlen(entity_name), strlen(value_str) };
     int param_formats[] = { 0, 0 };  // text format
 
-    PGresult *res = PQexecParams(conn, query, 2, NULL, param_values, param_lengths, param_formats, 0);
+    PGresult *res = sql_exec_params(conn, __func__, update_last_processed_query, 2, param_values, param_lengths,
+                                    param_formats);
 
     bool success = (PQresultStatus(res) == PGRES_COMMAND_OK);
     if (!success) {
@@ -372,4 +640,16 @@ bool update_last_processed(PGconn *conn, const char *entity_name, long last_valu
 
     PQclear(res);
     return success;
-}
\ No newline at end of file
+}
+
+bool send_update_last_processed(PGconn *conn, const char *entity_name, long last_value) {
+    char value_str[21];
+    snprintf(value_str, sizeof(value_str), "%ld", last_value);
+
+    const char *param_values[] = { entity_name, value_str };
+    if (!sql_send_params(conn, __func__, update_last_processed_query, 2, param_values, NULL, NULL)) {
+        fprintf(stderr, "Failed to queue last processed for %s: %s", entity_name, PQerrorMessage(conn));
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,132 @@
+#include "../include/custom_fields.h"
+#include "../include/core_operations.h"
+#include "../include/dimension_cache.h"
+#include "../include/sql_stats.h"
+#include "../include/sql_text.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct CustomFieldValue {
+    int field_id;
+    int entity_id;
+    char *value;
+};
+
+struct CustomFieldBatch {
+    char entity_type[51];
+    struct CustomFieldValue *values;
+    size_t count;
+    size_t capacity;
+};
+
+CustomFieldBatchPtr custom_field_batch_create(const char *entity_type) {
+    CustomFieldBatchPtr batch = calloc(1, sizeof(struct CustomFieldBatch));
+    if (!batch) {
+        return NULL;
+    }
+    strncpy(batch->entity_type, entity_type, sizeof(batch->entity_type) - 1);
+    return batch;
+}
+
+static void custom_field_batch_clear(CustomFieldBatchPtr batch) {
+    for (size_t i = 0; i < batch->count; i++) {
+        free(batch->values[i].value);
+    }
+    batch->count = 0;
+}
+
+void custom_field_batch_free(CustomFieldBatchPtr batch) {
+    if (!batch) {
+        return;
+    }
+    custom_field_batch_clear(batch);
+    free(batch->values);
+    free(batch);
+}
+
+static int custom_field_resolve(PGconn *db_conn, const char *entity_type, const char *field_name) {
+    const char *args[] = {entity_type, field_name};
+    int id = dimension_cache_get("custom_field", args, 2);
+    if (!id) {
+        id = get_or_create_custom_field(db_conn, entity_type, field_name);
+        dimension_cache_put("custom_field", args, 2, id);
+    }
+    return id;
+}
+
+bool custom_field_batch_add(CustomFieldBatchPtr batch, PGconn *db_conn, int entity_id, const char *field_name,
+                            const char *value) {
+    if (!field_name || !*field_name) {
+        return true;
+    }
+
+    int field_id = custom_field_resolve(db_conn, batch->entity_type, field_name);
+    if (field_id <= 0) {
+        fprintf(stderr, "Failed to resolve %s custom field %s\n", batch->entity_type, field_name);
+        return false;
+    }
+
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : 64;
+        struct CustomFieldValue *values = realloc(batch->values, capacity * sizeof(struct CustomFieldValue));
+        if (!values) {
+            fprintf(stderr, "Failed to allocate custom field batch\n");
+            return false;
+        }
+        batch->values = values;
+        batch->capacity = capacity;
+    }
+
+    char *copy = value ? strdup(value) : NULL;
+    if (value && !copy) {
+        return false;
+    }
+    batch->values[batch->count++] = (struct CustomFieldValue){field_id, entity_id, copy};
+    return true;
+}
+
+bool custom_field_batch_write(CustomFieldBatchPtr batch, PGconn *db_conn) {
+    if (batch->count == 0) {
+        return true;
+    }
+
+    // DISTINCT ON keeps the last value per (field, entity), since one upsert
+    // can't touch the same row twice
+    const char *query =
+        "INSERT INTO meta.custom_field_values (field_id, entity_id, value) "
+        "SELECT DISTINCT ON (field_id, entity_id) field_id, entity_id, value "
+        "FROM unnest($1::int[], $2::int[], $3::text[]) WITH ORDINALITY AS v(field_id, entity_id, value, n) "
+        "ORDER BY field_id, entity_id, n DESC "
+        "ON CONFLICT (field_id, entity_id) DO UPDATE SET value = EXCLUDED.value";
+
+    struct SqlText field_ids = {0}, entity_ids = {0}, values = {0};
+    bool built = sql_append(&field_ids, "{") && sql_append(&entity_ids, "{") &&
+                 sql_append(&values, "{");
+    for (size_t i = 0; i < batch->count && built; i++) {
+        built = sql_append_array_int(&field_ids, batch->values[i].field_id) &&
+                sql_append_array_int(&entity_ids, batch->values[i].entity_id) &&
+                sql_append_array_text(&values, batch->values[i].value);
+    }
+    built = built && sql_append(&field_ids, "}") && sql_append(&entity_ids, "}") &&
+            sql_append(&values, "}");
+
+    bool success = false;
+    if (!built) {
+        fprintf(stderr, "Failed to allocate %s custom field values\n", batch->entity_type);
+    } else {
+        const char *param_values[] = {field_ids.data, entity_ids.data, values.data};
+        PGresult *result = sql_exec_params(db_conn, __func__, query, 3, param_values, NULL, NULL);
+        success = (PQresultStatus(result) == PGRES_COMMAND_OK);
+        if (!success) {
+            fprintf(stderr, "INSERT INTO meta.custom_field_values failed: %s", PQerrorMessage(db_conn));
+        }
+        PQclear(result);
+    }
+
+    free(field_ids.data);
+    free(entity_ids.data);
+    free(values.data);
+    custom_field_batch_clear(batch);
+    return success;
+}
@@ -0,0 +1,198 @@
+#include "../include/daemon.h"
+#include "../include/config.h"
+#include "../include/entity_registry.h"
+#include "../include/core_operations.h"
+#include "../include/columnar_export.h"
+#include "../include/spool_sync.h"
+#include "../include/event_loop.h"
+#include "../include/asset_mirror.h"
+#include "../include/leases.h"
+#include "../include/scheduler.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_POLL_INTERVAL 300
+#define RECONNECT_RETRY_INTERVAL 30
+
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t reload_requested = 0;
+
+static void handle_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static void handle_reload(int sig) {
+    (void)sig;
+    reload_requested = 1;
+}
+
+static void install_signal_handlers(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+
+    // No SA_RESTART, so a signal cuts the idle sleep short
+    action.sa_handler = handle_stop;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    action.sa_handler = handle_reload;
+    sigaction(SIGHUP, &action, NULL);
+}
+
+static long entity_interval(MirrorConfigPtr config, const char *entity_name) {
+    char key[64];
+    snprintf(key, sizeof(key), "interval.%s", entity_name);
+
+    long interval = config_get_long(config, key,
+                                    config_get_long(config, "interval.default", DEFAULT_POLL_INTERVAL));
+    return interval > 0 ? interval : DEFAULT_POLL_INTERVAL;
+}
+
+static void load_intervals(MirrorConfigPtr config, const EntityInfo *entities, int count, long *intervals) {
+    for (int i = 0; i < count; i++) {
+        intervals[i] = entity_interval(config, entities[i].name);
+    }
+}
+
+int daemon_run(PGconn *db_conn, const char *config_path) {
+    int count;
+    const EntityInfo *entities = entity_registry(&count);
+
+    long intervals[count];
+    time_t next_due[count];
+
+    MirrorConfigPtr config = config_load(config_path);
+    if (!config) {
+        fprintf(stderr, "Failed to allocate config\n");
+        return 1;
+    }
+    load_intervals(config, entities, count, intervals);
+
+    time_t now = time(NULL);
+    for (int i = 0; i < count; i++) {
+        next_due[i] = now;
+    }
+
+    SpoolPtr spool = NULL;
+    const char *spool_dir = getenv("REPSLY_SPOOL_DIR");
+    if (spool_dir && *spool_dir) {
+        spool = spool_open(spool_dir);
+        if (!spool) {
+            config_free(config);
+            return 1;
+        }
+    }
+
+    // Keeps cursors and page timings between rounds
+    SchedulerPtr scheduler = scheduler_create(entities, count);
+    if (!scheduler) {
+        fprintf(stderr, "Failed to allocate scheduler\n");
+        spool_close(spool);
+        config_free(config);
+        return 1;
+    }
+
+    install_signal_handlers();
+    fprintf(stderr, "Daemon started with %d entities\n", count);
+
+    while (!stop_requested) {
+        if (reload_requested) {
+            reload_requested = 0;
+            MirrorConfigPtr reloaded = config_load(config_path);
+            if (reloaded) {
+                config_free(config);
+                config = reloaded;
+                load_intervals(config, entities, count, intervals);
+
+                // A shortened interval takes effect now rather than after the old one
+                now = time(NULL);
+                for (int i = 0; i < count; i++) {
+                    if (next_due[i] > now + intervals[i]) {
+                        next_due[i] = now + intervals[i];
+                    }
+                }
+                fprintf(stderr, "Configuration reloaded from %s\n", config_path ? config_path : "(defaults)");
+            }
+        }
+
+        now = time(NULL);
+        time_t earliest = next_due[0];
+        for (int i = 1; i < count; i++) {
+            if (next_due[i] < earliest) {
+                earliest = next_due[i];
+            }
+        }
+
+        if (earliest > now) {
+            sleep((unsigned int)(earliest - now));
+            continue;
+        }
+
+        if (spool || config_get_long(config, "event_loop", 0)) {
+            // The spool keeps fetching through a database outage; whatever
+            // couldn't be loaded goes in first on the next round. The event
+            // loop syncs everything that is due at once.
+            const EntityInfo *due[count];
+            int due_count = 0;
+            for (int i = 0; i < count; i++) {
+                if (next_due[i] <= now) {
+                    due[due_count++] = &entities[i];
+                }
+            }
+
+            int held = lease_acquire_entities(db_conn, due, due_count);
+            bool loaded = spool ? spool_sync(db_conn, spool, due, held)
+                                : event_loop_sync(db_conn, due, held);
+            lease_release_entities(db_conn, due, held);
+            export_flush_all();
+            if (loaded) {
+                asset_mirror_run(db_conn);
+            }
+            for (int i = 0; i < count; i++) {
+                if (next_due[i] <= now) {
+                    next_due[i] = time(NULL) + (loaded ? intervals[i] : RECONNECT_RETRY_INTERVAL);
+                }
+            }
+            continue;
+        }
+
+        if (!db_ensure_connected(db_conn)) {
+            for (int i = 0; i < count; i++) {
+                if (next_due[i] <= now) {
+                    next_due[i] = now + RECONNECT_RETRY_INTERVAL;
+                }
+            }
+            continue;
+        }
+
+        // Entities that aren't due stay untouched until their interval is up
+        bool due[count];
+        for (int i = 0; i < count; i++) {
+            due[i] = next_due[i] <= now;
+        }
+        scheduler_run(scheduler, db_conn, due, &stop_requested);
+        export_flush_all();
+        for (int i = 0; i < count; i++) {
+            if (due[i]) {
+                next_due[i] = time(NULL) + intervals[i];
+            }
+        }
+
+        // Images the round's rows link to
+        if (!stop_requested && PQstatus(db_conn) == CONNECTION_OK) {
+            asset_mirror_run(db_conn);
+        }
+    }
+
+    fprintf(stderr, "Daemon stopping\n");
+    scheduler_free(scheduler);
+    spool_close(spool);
+    config_free(config);
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include "../include/dimension_cache.h"
+#include "../include/fingerprint.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define DIMENSION_CACHE_INITIAL_SLOTS 1024
+
+struct DimensionCacheEntry {
+    Fingerprint hash;
+    char *key;
+    int id;
+};
+
+static struct DimensionCacheEntry *slots;
+static size_t slot_count;
+static size_t entry_count;
+
+// Keys are "dimension\x1farg\x1farg..." with NULL args spelled as \x1e, so
+// the full key can be compared on a hash match.
+static char *dimension_cache_key(const char *dimension, const char *const *args, int arg_count) {
+    size_t len = strlen(dimension) + 1;
+    for (int i = 0; i < arg_count; i++) {
+        len += (args[i] ? strlen(args[i]) : 1) + 1;
+    }
+
+    char *key = malloc(len);
+    if (!key) {
+        return NULL;
+    }
+
+    char *p = key;
+    size_t n = strlen(dimension);
+    memcpy(p, dimension, n);
+    p += n;
+    for (int i = 0; i < arg_count; i++) {
+        *p++ = '\x1f';
+        if (args[i]) {
+            n = strlen(args[i]);
+            memcpy(p, args[i], n);
+            p += n;
+        } else {
+            *p++ = '\x1e';
+        }
+    }
+    *p = '\0';
+    return key;
+}
+
+static struct DimensionCacheEntry *dimension_cache_probe(Fingerprint hash, const char *key) {
+    size_t mask = slot_count - 1;
+    size_t slot = hash & mask;
+    while (slots[slot].key) {
+        if (slots[slot].hash == hash && strcmp(slots[slot].key, key) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return &slots[slot];
+}
+
+static bool dimension_cache_grow(void) {
+    size_t new_count = slot_count ? slot_count * 2 : DIMENSION_CACHE_INITIAL_SLOTS;
+    struct DimensionCacheEntry *new_slots = calloc(new_count, sizeof(struct DimensionCacheEntry));
+    if (!new_slots) {
+        return false;
+    }
+
+    struct DimensionCacheEntry *old_slots = slots;
+    size_t old_count = slot_count;
+    slots = new_slots;
+    slot_count = new_count;
+
+    for (size_t i = 0; i < old_count; i++) {
+        if (old_slots[i].key) {
+            *dimension_cache_probe(old_slots[i].hash, old_slots[i].key) = old_slots[i];
+        }
+    }
+
+    free(old_slots);
+    return true;
+}
+
+int dimension_cache_get(const char *dimension, const char *const *args, int arg_count) {
+    if (!slots) {
+        return 0;
+    }
+
+    char *key = dimension_cache_key(dimension, args, arg_count);
+    if (!key) {
+        return 0;
+    }
+
+    struct DimensionCacheEntry *entry = dimension_cache_probe(fingerprint_add_str(fingerprint_init(), key), key);
+    int id = entry->key ? entry->id : 0;
+
+    free(key);
+    return id;
+}
+
+void dimension_cache_put(const char *dimension, const char *const *args, int arg_count, int id) {
+    if (id <= 0) {
+        return;
+    }
+    if ((entry_count + 1) * 10 > slot_count * 7 && !dimension_cache_grow()) {
+        fprintf(stderr, "Dimension cache is full, not caching %s\n", dimension);
+        return;
+    }
+
+    char *key = dimension_cache_key(dimension, args, arg_count);
+    if (!key) {
+        return;
+    }
+
+    Fingerprint hash = fingerprint_add_str(fingerprint_init(), key);
+    struct DimensionCacheEntry *entry = dimension_cache_probe(hash, key);
+    if (entry->key) {
+        entry->id = id;
+        free(key);
+        return;
+    }
+
+    entry->hash = hash;
+    entry->key = key;
+    entry->id = id;
+    entry_count++;
+}
+
+void dimension_cache_clear(void) {
+    for (size_t i = 0; i < slot_count; i++) {
+        free(slots[i].key);
+    }
+    free(slots);
+    slots = NULL;
+    slot_count = 0;
+    entry_count = 0;
+}
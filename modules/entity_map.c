@@ -0,0 +1,995 @@
+#include "../include/entity_map.h"
+#include "../include/api.h"
+#include "../include/core_operations.h"
+#include "../include/dimension_cache.h"
+#include "../include/fingerprint.h"
+#include "../include/thread_pool.h"
+#include "../include/columnar_export.h"
+#include "../include/partitions.h"
+#include "../include/trace.h"
+#include "../include/sql_stats.h"
+#include "../include/sql_text.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <jansson.h>
+
+#define MAX_BIND_PARAMS 65535
+#define MAX_ROWS_PER_STATEMENT 1000
+
+// One decoded record. Text values point straight into the page's JSON, which
+// outlives the row; everything that needs formatting lands in scratch.
+// Dimension columns keep their decoded resolver arguments until resolution
+// replaces them with an id.
+struct EntityRow {
+    const char *values[MAX_MAPPED_COLUMNS];
+    char scratch[MAX_MAPPED_COLUMNS][JSON_VALUE_SCRATCH_SIZE];
+    const char *args[MAX_MAPPED_COLUMNS][MAX_RESOLVER_ARGS];
+    char arg_scratch[MAX_MAPPED_COLUMNS][MAX_RESOLVER_ARGS][JSON_VALUE_SCRATCH_SIZE];
+    bool skip;  // superseded by a later record with the same key on this page
+};
+
+
+// Decoding
+
+// Each mapping gets a single-pass decoder over the distinct source fields its
+// columns read, built the first time the mapping is used.
+#define MAX_MAPPING_DECODERS 32
+
+struct MappingDecoder {
+    const EntityMapping *mapping;
+    JsonDecoderPtr decoder;
+    const char *field_names[MAX_MAPPED_COLUMNS * MAX_RESOLVER_ARGS];
+    int field_count;
+    int slots[MAX_MAPPED_COLUMNS][MAX_RESOLVER_ARGS];   // column arg -> decoder slot
+
+    // The columnar export is denormalised: one column per source field, read
+    // back from the first column argument that decodes it
+    ExportColumn export_columns[MAX_MAPPED_COLUMNS * MAX_RESOLVER_ARGS];
+    int export_sources[MAX_MAPPED_COLUMNS * MAX_RESOLVER_ARGS][2];
+    int partition_field;   // first timestamp/date field, -1 if none
+
+    // Statement tags (see sql_stats.h), e.g. "field_ops.visits upsert"
+    char upsert_tag[96];
+    char move_tag[96];
+    char date_tag[96];
+};
+
+static struct MappingDecoder mapping_decoders[MAX_MAPPING_DECODERS];
+static int mapping_decoder_count;
+
+static struct MappingDecoder *mapping_decoder_get(const EntityMapping *mapping) {
+    for (int i = 0; i < mapping_decoder_count; i++) {
+        if (mapping_decoders[i].mapping == mapping) {
+            return &mapping_decoders[i];
+        }
+    }
+
+    if (mapping_decoder_count == MAX_MAPPING_DECODERS) {
+        fprintf(stderr, "Too many entity mappings\n");
+        return NULL;
+    }
+
+    struct MappingDecoder *md = &mapping_decoders[mapping_decoder_count];
+    int field_count = 0;
+    for (int c = 0; c < mapping->column_count; c++) {
+        for (int a = 0; a < MAX_RESOLVER_ARGS; a++) {
+            const char *field = mapping->columns[c].json_fields[a];
+            md->slots[c][a] = -1;
+            if (!field) {
+                continue;
+            }
+
+            int slot = 0;
+            while (slot < field_count && strcmp(md->field_names[slot], field) != 0) {
+                slot++;
+            }
+            if (slot == field_count) {
+                md->field_names[field_count] = field;
+                md->export_columns[field_count].name = field;
+                md->export_columns[field_count].type = mapping->columns[c].type;
+                md->export_sources[field_count][0] = c;
+                md->export_sources[field_count][1] = a;
+                field_count++;
+            }
+            md->slots[c][a] = slot;
+        }
+    }
+
+    md->field_count = field_count;
+    snprintf(md->upsert_tag, sizeof(md->upsert_tag), "%s upsert", mapping->table);
+    snprintf(md->move_tag, sizeof(md->move_tag), "%s move", mapping->table);
+    snprintf(md->date_tag, sizeof(md->date_tag), "%s stored date", mapping->table);
+    md->partition_field = -1;
+    for (int f = 0; f < field_count && md->partition_field < 0; f++) {
+        if (md->export_columns[f].type == FIELD_TIMESTAMP || md->export_columns[f].type == FIELD_DATE) {
+            md->partition_field = f;
+        }
+    }
+
+    md->decoder = json_decoder_create(mapping->entity_name, md->field_names, field_count);
+    if (!md->decoder) {
+        return NULL;
+    }
+
+    md->mapping = mapping;
+    mapping_decoder_count++;
+    return md;
+}
+
+// Pure decoding, no database access: safe to run on the decode pool.
+static void entity_row_decode(const EntityMapping *mapping, struct MappingDecoder *md, json_t *record,
+                              struct EntityRow *row) {
+    json_t *fields[MAX_MAPPED_COLUMNS * MAX_RESOLVER_ARGS];
+    json_decoder_decode(md->decoder, record, fields);
+
+    for (int c = 0; c < mapping->column_count; c++) {
+        const ColumnMapping *column = &mapping->columns[c];
+
+        if (!column->resolver) {
+            row->values[c] = json_decoder_text(md->decoder, fields, md->slots[c][0], column->type, row->scratch[c]);
+            continue;
+        }
+
+        for (int a = 0; a < MAX_RESOLVER_ARGS && md->slots[c][a] >= 0; a++) {
+            row->args[c][a] = json_decoder_text(md->decoder, fields, md->slots[c][a], column->type,
+                                                row->arg_scratch[c][a]);
+        }
+    }
+}
+
+struct EntityDecodeBatch {
+    const EntityMapping *mapping;
+    struct MappingDecoder *md;
+    json_t *records;
+    struct EntityRow *rows;
+};
+
+static void entity_decode_task(void *context, size_t index) {
+    struct EntityDecodeBatch *batch = (struct EntityDecodeBatch *)context;
+    entity_row_decode(batch->mapping, batch->md, json_array_get(batch->records, index), &batch->rows[index]);
+}
+
+// Resolution goes through the database (and the single-threaded dimension
+// cache), so it stays on the loader thread.
+static bool entity_row_resolve(const EntityMapping *mapping, struct EntityRow *row, PGconn *db_conn) {
+    for (int c = 0; c < mapping->column_count; c++) {
+        const ColumnMapping *column = &mapping->columns[c];
+        if (!column->resolver) {
+            continue;
+        }
+
+        // A missing natural key means there is nothing to reference
+        if (!row->args[c][0]) {
+            row->values[c] = NULL;
+            continue;
+        }
+
+        int id = column->resolver(db_conn, row->args[c]);
+        if (id < 0) {
+            fprintf(stderr, "Failed to resolve %s for %s\n", column->column, mapping->entity_name);
+            return false;
+        }
+
+        if (id == 0) {
+            row->values[c] = NULL;
+        } else {
+            snprintf(row->scratch[c], JSON_VALUE_SCRATCH_SIZE, "%d", id);
+            row->values[c] = row->scratch[c];
+        }
+    }
+
+    return true;
+}
+
+bool entity_mapping_record_key(const EntityMapping *mapping, int c) {
+    return mapping->columns[c].key &&
+           (!mapping->partition_column || strcmp(mapping->columns[c].column, mapping->partition_column) != 0);
+}
+
+// Values compared as the database would see them, NULL only equal to NULL
+static bool same_value(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static bool same_record(const EntityMapping *mapping, const struct EntityRow *a, const struct EntityRow *b) {
+    for (int c = 0; c < mapping->column_count; c++) {
+        if (entity_mapping_record_key(mapping, c) && !same_value(a->values[c], b->values[c])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ON CONFLICT DO UPDATE refuses to touch the same row twice in one statement,
+// so when a page carries the same record more than once only the last one is
+// kept. Rows whose key hashes collide are only merged if the keys match.
+static void entity_rows_dedupe(const EntityMapping *mapping, struct EntityRow *rows, size_t row_count) {
+    bool has_key = false;
+    for (int c = 0; c < mapping->column_count; c++) {
+        has_key = has_key || entity_mapping_record_key(mapping, c);
+    }
+    if (!has_key || row_count < 2) {
+        return;
+    }
+
+    size_t slot_count = 16;
+    while (slot_count < row_count * 2) {
+        slot_count <<= 1;
+    }
+    size_t mask = slot_count - 1;
+
+    Fingerprint *hashes = malloc(row_count * sizeof(Fingerprint));
+    long *slots = malloc(slot_count * sizeof(long));
+    if (!hashes || !slots) {
+        free(hashes);
+        free(slots);
+        return;
+    }
+    memset(slots, -1, slot_count * sizeof(long));
+
+    for (size_t r = 0; r < row_count; r++) {
+        Fingerprint fp = fingerprint_init();
+        for (int c = 0; c < mapping->column_count; c++) {
+            if (entity_mapping_record_key(mapping, c)) {
+                fp = fingerprint_add_str(fp, rows[r].values[c]);
+            }
+        }
+        hashes[r] = fp;
+
+        size_t slot = fp & mask;
+        while (slots[slot] >= 0 &&
+               (hashes[slots[slot]] != fp || !same_record(mapping, &rows[slots[slot]], &rows[r]))) {
+            slot = (slot + 1) & mask;
+        }
+        if (slots[slot] >= 0) {
+            rows[slots[slot]].skip = true;
+        }
+        slots[slot] = (long)r;
+    }
+
+    free(hashes);
+    free(slots);
+}
+
+
+// Bulk write
+
+// Builds "INSERT INTO t (cols) VALUES ($1, ...), ... ON CONFLICT (keys) DO UPDATE ..."
+// for row_count rows.
+static bool build_upsert(const EntityMapping *mapping, size_t row_count, struct SqlText *sql) {
+    char placeholder[16];
+    bool ok = sql_append(sql, "INSERT INTO ") && sql_append(sql, mapping->table) && sql_append(sql, " (");
+
+    for (int c = 0; c < mapping->column_count && ok; c++) {
+        ok = sql_append(sql, c ? ", " : "") && sql_append(sql, mapping->columns[c].column);
+    }
+    ok = ok && sql_append(sql, ") VALUES ");
+
+    int param = 1;
+    for (size_t r = 0; r < row_count && ok; r++) {
+        ok = sql_append(sql, r ? ", (" : "(");
+        for (int c = 0; c < mapping->column_count && ok; c++) {
+            snprintf(placeholder, sizeof(placeholder), "%s$%d", c ? ", " : "", param++);
+            ok = sql_append(sql, placeholder);
+        }
+        ok = ok && sql_append(sql, ")");
+    }
+
+    bool has_key = false;
+    bool has_update = false;
+    for (int c = 0; c < mapping->column_count; c++) {
+        has_key = has_key || mapping->columns[c].key;
+        has_update = has_update || !mapping->columns[c].key;
+    }
+    if (!has_key || !ok) {
+        return ok;
+    }
+
+    ok = sql_append(sql, " ON CONFLICT (");
+    bool first = true;
+    for (int c = 0; c < mapping->column_count && ok; c++) {
+        if (mapping->columns[c].key) {
+            ok = sql_append(sql, first ? "" : ", ") && sql_append(sql, mapping->columns[c].column);
+            first = false;
+        }
+    }
+
+    if (!has_update) {
+        return ok && sql_append(sql, ") DO NOTHING");
+    }
+
+    ok = ok && sql_append(sql, ") DO UPDATE SET ");
+    first = true;
+    for (int c = 0; c < mapping->column_count && ok; c++) {
+        if (!mapping->columns[c].key) {
+            ok = sql_append(sql, first ? "" : ", ") && sql_append(sql, mapping->columns[c].column) &&
+                 sql_append(sql, " = EXCLUDED.") && sql_append(sql, mapping->columns[c].column);
+            first = false;
+        }
+    }
+    return ok;
+}
+
+// Moves rows whose partition date changed into their new partition ahead of
+// the upsert, which would otherwise add a second row for the record. Moving
+// keeps the row's serial id, which other tables refer to. The rows go in as a
+// JSON array so the table's own row type gives each value its column type.
+static bool entity_rows_move(PGconn *db_conn, const struct MappingDecoder *md, const char **param_values,
+                             size_t batch, bool send) {
+    const EntityMapping *mapping = md->mapping;
+    bool has_key = false;
+    for (int c = 0; c < mapping->column_count; c++) {
+        has_key = has_key || entity_mapping_record_key(mapping, c);
+    }
+    if (!mapping->partition_column || !has_key) {
+        return true;
+    }
+
+    json_t *moved = json_array();
+    bool ok = moved != NULL;
+    for (size_t b = 0; b < batch && ok; b++) {
+        json_t *row = json_object();
+        ok = row && json_array_append_new(moved, row) == 0;
+        for (int c = 0; c < mapping->column_count && ok; c++) {
+            const char *value = param_values[b * mapping->column_count + c];
+            if (mapping->columns[c].key) {
+                ok = json_object_set_new(row, mapping->columns[c].column, value ? json_string(value) : json_null()) == 0;
+            }
+        }
+    }
+    char *rows = ok ? json_dumps(moved, JSON_COMPACT) : NULL;
+    json_decref(moved);
+
+    const char *p = mapping->partition_column;
+    struct SqlText sql = {0};
+    struct SqlText same = {0};
+    ok = rows && sql_append(&sql, "UPDATE ") && sql_append(&sql, mapping->table) && sql_append(&sql, " AS t SET ") &&
+         sql_append(&sql, p) && sql_append(&sql, " = v.") && sql_append(&sql, p) &&
+         sql_append(&sql, " FROM jsonb_populate_recordset(NULL::") && sql_append(&sql, mapping->table) &&
+         sql_append(&sql, ", $1::jsonb) AS v WHERE t.") && sql_append(&sql, p) && sql_append(&sql, " <> v.") &&
+         sql_append(&sql, p);
+    for (int c = 0; c < mapping->column_count && ok; c++) {
+        if (entity_mapping_record_key(mapping, c)) {
+            const char *column = mapping->columns[c].column;
+            ok = sql_append(&sql, " AND t.") && sql_append(&sql, column) && sql_append(&sql, " = v.") &&
+                 sql_append(&sql, column) && sql_append(&same, " AND n.") && sql_append(&same, column) &&
+                 sql_append(&same, " = v.") && sql_append(&same, column);
+        }
+    }
+    // A record already at its new date is left to the upsert
+    ok = ok && sql_append(&sql, " AND NOT EXISTS (SELECT 1 FROM ") && sql_append(&sql, mapping->table) &&
+         sql_append(&sql, " AS n WHERE n.") && sql_append(&sql, p) && sql_append(&sql, " = v.") &&
+         sql_append(&sql, p) && sql_append(&sql, same.data) && sql_append(&sql, ")");
+    free(same.data);
+
+    const char *params[] = {rows};
+    if (!ok) {
+        fprintf(stderr, "Failed to build partition move for %s\n", mapping->entity_name);
+    } else if (send) {
+        ok = sql_send_params(db_conn, md->move_tag, sql.data, 1, params, NULL, NULL);
+        if (!ok) {
+            fprintf(stderr, "Failed to queue UPDATE %s: %s", mapping->table, PQerrorMessage(db_conn));
+        }
+    } else {
+        PGresult *result = sql_exec_params(db_conn, md->move_tag, sql.data, 1, params, NULL, NULL);
+        ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+        if (!ok) {
+            fprintf(stderr, "UPDATE %s failed: %s", mapping->table, PQerrorMessage(db_conn));
+        }
+        PQclear(result);
+    }
+
+    free(sql.data);
+    free(rows);
+    return ok;
+}
+
+// Writes the rows in chunks of one multi-row statement each. With send set the
+// statements are only queued (pipeline mode) and their results are left to
+// the caller.
+static bool entity_rows_write(PGconn *db_conn, const struct MappingDecoder *md, struct EntityRow *rows,
+                              size_t row_count, bool send) {
+    const EntityMapping *mapping = md->mapping;
+    size_t rows_per_statement = MAX_BIND_PARAMS / mapping->column_count;
+    if (rows_per_statement > MAX_ROWS_PER_STATEMENT) {
+        rows_per_statement = MAX_ROWS_PER_STATEMENT;
+    }
+
+    const char **param_values = malloc(rows_per_statement * mapping->column_count * sizeof(char *));
+    if (!param_values) {
+        fprintf(stderr, "Failed to allocate parameters for %s\n", mapping->entity_name);
+        return false;
+    }
+
+    bool success = true;
+    size_t r = 0;
+    while (r < row_count && success) {
+        size_t batch = 0;
+        for (; r < row_count && batch < rows_per_statement; r++) {
+            if (rows[r].skip) {
+                continue;
+            }
+            memcpy(&param_values[batch * mapping->column_count], rows[r].values, mapping->column_count * sizeof(char *));
+            batch++;
+        }
+        if (batch == 0) {
+            break;
+        }
+
+        if (!entity_rows_move(db_conn, md, param_values, batch, send)) {
+            success = false;
+            break;
+        }
+
+        struct SqlText sql = {0};
+        if (!build_upsert(mapping, batch, &sql)) {
+            fprintf(stderr, "Failed to build statement for %s\n", mapping->entity_name);
+            free(sql.data);
+            success = false;
+            break;
+        }
+
+        if (send) {
+            if (!sql_send_params(db_conn, md->upsert_tag, sql.data, (int)(batch * mapping->column_count),
+                                 param_values, NULL, NULL)) {
+                fprintf(stderr, "Failed to queue INSERT INTO %s: %s", mapping->table, PQerrorMessage(db_conn));
+                success = false;
+            }
+        } else {
+            PGresult *result = sql_exec_params(db_conn, md->upsert_tag, sql.data, (int)(batch * mapping->column_count),
+                                               param_values, NULL, NULL);
+            if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+                fprintf(stderr, "INSERT INTO %s failed: %s", mapping->table, PQerrorMessage(db_conn));
+                success = false;
+            }
+            PQclear(result);
+        }
+
+        free(sql.data);
+    }
+
+    free(param_values);
+    return success;
+}
+
+// Hands the committed rows to the columnar export, source values rather than
+// resolved ids, partitioned by the record's first timestamp or date and keyed
+// by the columns that identify it.
+static void entity_rows_export(const EntityMapping *mapping, struct MappingDecoder *md,
+                               struct EntityRow *rows, size_t row_count) {
+    ExportDatasetPtr dataset = export_dataset_get(mapping->entity_name, md->export_columns, md->field_count);
+    if (!dataset) {
+        return;
+    }
+
+    const char *values[MAX_MAPPED_COLUMNS * MAX_RESOLVER_ARGS];
+    char key[512];
+    for (size_t r = 0; r < row_count; r++) {
+        if (rows[r].skip) {
+            continue;
+        }
+
+        size_t key_length = 0;
+        key[0] = '\0';
+        for (int c = 0; c < mapping->column_count; c++) {
+            if (entity_mapping_record_key(mapping, c) && key_length < sizeof(key)) {
+                key_length += snprintf(key + key_length, sizeof(key) - key_length, "%s%s",
+                                       key_length ? "|" : "", rows[r].values[c] ? rows[r].values[c] : "");
+            }
+        }
+
+        for (int f = 0; f < md->field_count; f++) {
+            int c = md->export_sources[f][0];
+            int a = md->export_sources[f][1];
+            values[f] = mapping->columns[c].resolver ? rows[r].args[c][a] : rows[r].values[c];
+        }
+
+        const char *partition = md->partition_field >= 0 ? values[md->partition_field] : NULL;
+        if (!export_dataset_append(dataset, partition, key, values)) {
+            return;
+        }
+    }
+}
+
+
+// Pipeline
+
+bool entity_fetch_and_insert(PGconn *db_conn, const EntityMapping *mapping, long last_cursor) {
+    json_t *root = api_fetch_data(mapping->endpoint, mapping->cursor_field ? last_cursor : 0);
+    if (!root) {
+        return false;
+    }
+
+    bool success = entity_load_page(db_conn, mapping, root, last_cursor);
+    json_decref(root);
+    return success;
+}
+
+long entity_page_cursor(const EntityMapping *mapping, json_t *root, long last_cursor) {
+    if (!mapping->cursor_field) {
+        return last_cursor;
+    }
+
+    json_t *meta = json_object_get(root, "MetaCollectionResult");
+    long page_cursor = (long)json_integer_value(json_object_get(meta, mapping->cursor_field));
+    return page_cursor > last_cursor ? page_cursor : last_cursor;
+}
+
+static int partition_column_index(const EntityMapping *mapping) {
+    for (int c = 0; c < mapping->column_count && mapping->partition_column; c++) {
+        if (strcmp(mapping->columns[c].column, mapping->partition_column) == 0) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+// The partition column is NOT NULL, and one row without it would fail the
+// whole statement and hold the cursor on its page for good. A record without
+// a usable date keeps the one it was stored with, or else gets today's, the
+// same as an undated form.
+static bool entity_rows_fill_partition_dates(PGconn *db_conn, const struct MappingDecoder *md,
+                                             struct EntityRow *rows, size_t row_count) {
+    const EntityMapping *mapping = md->mapping;
+    int column = partition_column_index(mapping);
+    if (column < 0) {
+        return true;
+    }
+
+    struct SqlText sql = {0};
+    int key_count = 0;
+    bool ok = sql_append(&sql, "SELECT max(") && sql_append(&sql, mapping->partition_column) &&
+              sql_append(&sql, ")::text FROM ") && sql_append(&sql, mapping->table);
+    for (int c = 0; c < mapping->column_count && ok; c++) {
+        if (entity_mapping_record_key(mapping, c)) {
+            char placeholder[16];
+            snprintf(placeholder, sizeof(placeholder), " = $%d", ++key_count);
+            ok = sql_append(&sql, key_count == 1 ? " WHERE " : " AND ") && sql_append(&sql, mapping->columns[c].column) &&
+                 sql_append(&sql, placeholder);
+        }
+    }
+
+    for (size_t r = 0; r < row_count && ok; r++) {
+        if (rows[r].skip || rows[r].values[column]) {
+            continue;
+        }
+
+        const char *params[MAX_MAPPED_COLUMNS];
+        const char *record = "?";
+        bool keyed = key_count > 0;
+        for (int c = 0, k = 0; c < mapping->column_count; c++) {
+            if (entity_mapping_record_key(mapping, c)) {
+                params[k++] = rows[r].values[c];
+                keyed = keyed && rows[r].values[c];
+                record = k == 1 && rows[r].values[c] ? rows[r].values[c] : record;
+            }
+        }
+
+        char *date = rows[r].scratch[column];
+        date[0] = '\0';
+        if (keyed) {
+            PGresult *result = sql_exec_params(db_conn, md->date_tag, sql.data, key_count, params, NULL, NULL);
+            ok = PQresultStatus(result) == PGRES_TUPLES_OK;
+            if (!ok) {
+                fprintf(stderr, "Looking up stored %s of %s failed: %s", mapping->partition_column,
+                        mapping->entity_name, PQerrorMessage(db_conn));
+            } else if (!PQgetisnull(result, 0, 0)) {
+                snprintf(date, JSON_VALUE_SCRATCH_SIZE, "%s", PQgetvalue(result, 0, 0));
+            }
+            PQclear(result);
+        }
+        if (!date[0]) {
+            time_t now = time(NULL);
+            struct tm today;
+            localtime_r(&now, &today);
+            strftime(date, JSON_VALUE_SCRATCH_SIZE, "%Y-%m-%d", &today);
+        }
+        rows[r].values[column] = date;
+        fprintf(stderr, "%s %s has no usable %s, writing it as %s\n", mapping->entity_name, record,
+                mapping->partition_column, date);
+    }
+
+    free(sql.data);
+    return ok;
+}
+
+// Creates the month partitions a page is about to write into, before the
+// write's transaction starts so a failure can't abort it
+static void entity_rows_ensure_partitions(PGconn *db_conn, const EntityMapping *mapping, struct EntityRow *rows,
+                                          size_t row_count) {
+    int column = partition_column_index(mapping);
+    if (column < 0) {
+        return;
+    }
+
+    // Pages are usually in date order, so checking only on a change of month
+    // keeps this to a handful of calls
+    const char *last = NULL;
+    for (size_t r = 0; r < row_count; r++) {
+        const char *date = rows[r].values[column];
+        if (rows[r].skip || !date) {
+            continue;
+        }
+        if (!last || strncmp(last, date, 7) != 0) {
+            partition_ensure(db_conn, mapping->table, date);
+            last = date;
+        }
+    }
+}
+
+// A page between decoding and its write: rows point into root, which the page
+// holds a reference to until it is finished.
+struct EntityPage {
+    const EntityMapping *mapping;
+    struct MappingDecoder *md;
+    json_t *root;
+    struct EntityRow *rows;
+    size_t row_count;
+    long last_cursor;
+    long new_cursor;
+};
+
+EntityPagePtr entity_page_prepare(PGconn *db_conn, const EntityMapping *mapping, json_t *root, long last_cursor) {
+    if (mapping->column_count > MAX_MAPPED_COLUMNS) {
+        fprintf(stderr, "Mapping for %s has too many columns\n", mapping->entity_name);
+        return NULL;
+    }
+
+    struct MappingDecoder *md = mapping_decoder_get(mapping);
+    if (!md) {
+        return NULL;
+    }
+
+    json_t *records = json_is_array(root) ? root : json_object_get(root, mapping->array_field);
+    if (!json_is_array(records)) {
+        fprintf(stderr, "No %s array in %s response\n", mapping->array_field, mapping->endpoint);
+        return NULL;
+    }
+
+    EntityPagePtr page = calloc(1, sizeof(struct EntityPage));
+    if (!page) {
+        fprintf(stderr, "Failed to allocate page for %s\n", mapping->entity_name);
+        return NULL;
+    }
+    page->mapping = mapping;
+    page->md = md;
+    page->root = json_incref(root);
+    page->row_count = json_array_size(records);
+    page->last_cursor = last_cursor;
+    page->new_cursor = entity_page_cursor(mapping, root, last_cursor);
+
+    if (page->row_count == 0) {
+        return page;
+    }
+
+    page->rows = calloc(page->row_count, sizeof(struct EntityRow));
+    if (!page->rows) {
+        fprintf(stderr, "Failed to allocate rows for %s\n", mapping->entity_name);
+        entity_page_finish(page, false);
+        return NULL;
+    }
+
+    struct EntityDecodeBatch batch = {mapping, md, records, page->rows};
+    long rejected_before = json_decoder_rejected_count(md->decoder);
+    TraceSpan span = trace_begin();
+    thread_pool_run(thread_pool_shared(), page->row_count, entity_decode_task, &batch);
+    trace_end(span, "decode", mapping->entity_name);
+
+    long rejected = json_decoder_rejected_count(md->decoder) - rejected_before;
+    if (rejected > 0) {
+        fprintf(stderr, "%s: %ld malformed dates written as NULL on this page\n", mapping->entity_name, rejected);
+    }
+
+    span = trace_begin();
+    for (size_t index = 0; index < page->row_count; index++) {
+        if (!entity_row_resolve(mapping, &page->rows[index], db_conn)) {
+            entity_page_finish(page, false);
+            return NULL;
+        }
+    }
+    trace_end(span, "resolve", mapping->entity_name);
+
+    entity_rows_dedupe(mapping, page->rows, page->row_count);
+    if (!entity_rows_fill_partition_dates(db_conn, md, page->rows, page->row_count)) {
+        entity_page_finish(page, false);
+        return NULL;
+    }
+    entity_rows_ensure_partitions(db_conn, mapping, page->rows, page->row_count);
+    return page;
+}
+
+// Without BEGIN/COMMIT everything queued before the sync runs as one implicit
+// transaction, so the rows and the cursor still commit or fail together.
+int entity_page_send(PGconn *db_conn, EntityPagePtr page) {
+    if (page->row_count == 0 && page->new_cursor == page->last_cursor) {
+        return 0;
+    }
+
+    if (!PQenterPipelineMode(db_conn)) {
+        fprintf(stderr, "Failed to enter pipeline mode: %s", PQerrorMessage(db_conn));
+        return -1;
+    }
+
+    bool queued = entity_rows_write(db_conn, page->md, page->rows, page->row_count, true) &&
+                  (page->new_cursor == page->last_cursor ||
+                   send_update_last_processed(db_conn, page->mapping->entity_name, page->new_cursor));
+
+    // No sync after a partial queue: the implicit transaction never commits
+    if (!queued || !PQpipelineSync(db_conn)) {
+        fprintf(stderr, "Failed to queue %s page: %s", page->mapping->entity_name, PQerrorMessage(db_conn));
+        return -1;
+    }
+    return 1;
+}
+
+// COPY text format: backslash, tab, newline and carriage return are escaped,
+// NULL is \N
+static bool copy_append_value(struct SqlText *buf, const char *value) {
+    if (!value) {
+        return sql_append(buf, "\\N");
+    }
+
+    char escaped[2 * JSON_VALUE_SCRATCH_SIZE];
+    size_t n = 0;
+    for (const char *p = value; *p; p++) {
+        if (n + 3 > sizeof(escaped)) {
+            escaped[n] = '\0';
+            if (!sql_append(buf, escaped)) {
+                return false;
+            }
+            n = 0;
+        }
+        switch (*p) {
+            case '\\': escaped[n++] = '\\'; escaped[n++] = '\\'; break;
+            case '\t': escaped[n++] = '\\'; escaped[n++] = 't'; break;
+            case '\n': escaped[n++] = '\\'; escaped[n++] = 'n'; break;
+            case '\r': escaped[n++] = '\\'; escaped[n++] = 'r'; break;
+            default:   escaped[n++] = *p; break;
+        }
+    }
+    escaped[n] = '\0';
+    return sql_append(buf, escaped);
+}
+
+bool entity_page_copy(PGconn *db_conn, EntityPagePtr page, const char *table, const char *cursor_column) {
+    const EntityMapping *mapping = page->mapping;
+
+    char page_cursor[24];
+    snprintf(page_cursor, sizeof(page_cursor), "\t%ld", page->last_cursor);
+
+    struct SqlText data = {0};
+    bool ok = true;
+    size_t copied = 0;
+    for (size_t r = 0; r < page->row_count && ok; r++) {
+        if (page->rows[r].skip) {
+            continue;
+        }
+        for (int c = 0; c < mapping->column_count && ok; c++) {
+            ok = (c == 0 || sql_append(&data, "\t")) && copy_append_value(&data, page->rows[r].values[c]);
+        }
+        ok = ok && (!cursor_column || sql_append(&data, page_cursor)) && sql_append(&data, "\n");
+        copied++;
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to build COPY data for %s\n", mapping->entity_name);
+        free(data.data);
+        return false;
+    }
+    if (copied == 0) {
+        return true;
+    }
+
+    struct SqlText sql = {0};
+    ok = sql_append(&sql, "COPY ") && sql_append(&sql, table) && sql_append(&sql, " (");
+    for (int c = 0; c < mapping->column_count && ok; c++) {
+        ok = sql_append(&sql, c ? ", " : "") && sql_append(&sql, mapping->columns[c].column);
+    }
+    if (cursor_column) {
+        ok = ok && sql_append(&sql, ", ") && sql_append(&sql, cursor_column);
+    }
+    ok = ok && sql_append(&sql, ") FROM STDIN");
+
+    TraceSpan span = trace_begin();
+    PGresult *result = ok ? sql_exec(db_conn, "copy", sql.data) : NULL;
+    bool success = (PQresultStatus(result) == PGRES_COPY_IN);
+    PQclear(result);
+    if (success) {
+        success = PQputCopyData(db_conn, data.data, (int)data.length) == 1;
+        success = PQputCopyEnd(db_conn, success ? NULL : "failed to send rows") == 1 && success;
+        while ((result = PQgetResult(db_conn)) != NULL) {
+            success = success && PQresultStatus(result) == PGRES_COMMAND_OK;
+            PQclear(result);
+        }
+    }
+    trace_end(span, "copy", table);
+    if (!success) {
+        fprintf(stderr, "COPY into %s failed: %s", table, PQerrorMessage(db_conn));
+    }
+
+    free(sql.data);
+    free(data.data);
+    return success;
+}
+
+void entity_page_finish(EntityPagePtr page, bool committed) {
+    if (!page) {
+        return;
+    }
+    if (committed && page->rows) {
+        entity_rows_export(page->mapping, page->md, page->rows, page->row_count);
+    }
+    free(page->rows);
+    json_decref(page->root);
+    free(page);
+}
+
+bool entity_load_page(PGconn *db_conn, const EntityMapping *mapping, json_t *root, long last_cursor) {
+    EntityPagePtr page = entity_page_prepare(db_conn, mapping, root, last_cursor);
+    if (!page) {
+        return false;
+    }
+
+    if (page->row_count == 0) {
+        entity_page_finish(page, false);
+        return true;
+    }
+
+    // The cursor moves in the same transaction as the rows it covers
+    bool success = sql_run(db_conn, "BEGIN", "BEGIN") &&
+                   entity_rows_write(db_conn, page->md, page->rows, page->row_count, false) &&
+                   (page->new_cursor == last_cursor || update_last_processed(db_conn, mapping->entity_name, page->new_cursor)) &&
+                   sql_run(db_conn, "COMMIT", "COMMIT");
+
+    if (!success && PQtransactionStatus(db_conn) != PQTRANS_IDLE) {
+        sql_run(db_conn, "ROLLBACK", "ROLLBACK");
+    }
+
+    entity_page_finish(page, success);
+    return success;
+}
+
+
+// Resolvers. Each checks the dimension cache before going to the database,
+// so a page full of the same rep or client costs one round trip, not one per row.
+
+int resolve_client(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("client", args, 1);
+    if (!id) {
+        id = get_or_create_client(conn, args[0], args[1] ? args[1] : "");
+        dimension_cache_put("client", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_representative(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("representative", args, 1);
+    if (!id) {
+        id = get_or_create_representative(conn, args[0], args[1] ? args[1] : "");
+        dimension_cache_put("representative", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_rep_code(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("rep_code", args, 1);
+    if (!id) {
+        id = get_or_create_rep_code(conn, args[0]);
+        dimension_cache_put("rep_code", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_product(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("product", args, 1);
+    if (!id) {
+        id = get_or_create_product(conn, args[0], args[1] ? args[1] : "");
+        dimension_cache_put("product", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_product_group(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("product_group", args, 1);
+    if (!id) {
+        id = get_or_create_product_group(conn, args[0], args[1]);
+        dimension_cache_put("product_group", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_time(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("time", args, 1);
+    if (!id) {
+        id = get_or_create_time(conn, args[0]);
+        dimension_cache_put("time", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_date(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("date", args, 1);
+    if (!id) {
+        id = get_or_create_date(conn, args[0]);
+        dimension_cache_put("date", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_name(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("name", args, 1);
+    if (!id) {
+        id = get_or_create_name(conn, args[0]);
+        dimension_cache_put("name", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_note(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("note", args, 1);
+    if (!id) {
+        id = get_or_create_note(conn, args[0]);
+        dimension_cache_put("note", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_email(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("email", args, 1);
+    if (!id) {
+        id = get_or_create_email(conn, args[0]);
+        dimension_cache_put("email", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_role(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("role", args, 1);
+    if (!id) {
+        id = get_or_create_role(conn, args[0]);
+        dimension_cache_put("role", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_lat(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("lat", args, 1);
+    if (!id) {
+        id = get_or_create_lat(conn, atof(args[0]));
+        dimension_cache_put("lat", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_long(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("long", args, 1);
+    if (!id) {
+        id = get_or_create_long(conn, atof(args[0]));
+        dimension_cache_put("long", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_document_type(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("document_type", args, 1);
+    if (!id) {
+        id = get_or_create_document_type(conn, args[0]);
+        dimension_cache_put("document_type", args, 1, id);
+    }
+    return id;
+}
+
+int resolve_document_status(PGconn *conn, const char *const *args) {
+    int id = dimension_cache_get("document_status", args, 1);
+    if (!id) {
+        id = get_or_create_document_status(conn, args[0]);
+        dimension_cache_put("document_status", args, 1, id);
+    }
+    return id;
+}
+
+// Not cached: a visit that hasn't been mirrored yet will be on a later page.
+int resolve_visit(PGconn *conn, const char *const *args) {
+    return find_visit_by_repsly_id(conn, args[0]);
+}
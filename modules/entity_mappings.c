@@ -0,0 +1,231 @@
+#include "../include/entity_mappings.h"
+#include <stddef.h>
+
+// Column mappings for the Repsly export endpoints that don't need a
+// hand-written loader. Field names follow the Repsly v3 export documentation.
+// Nested collections (purchase order lines, retail audit items) aren't
+// mapped here yet.
+
+#define COLUMN_COUNT(columns) ((int)(sizeof(columns) / sizeof((columns)[0])))
+
+#define MAPPED_ENTITY_FETCH(entity) \
+    bool entity##_fetch_and_insert(PGconn *db_conn, long last_cursor) { \
+        return entity_fetch_and_insert(db_conn, &entity##_mapping, last_cursor); \
+    } \
+    bool entity##_load_page(PGconn *db_conn, json_t *root, long last_cursor) { \
+        return entity_load_page(db_conn, &entity##_mapping, root, last_cursor); \
+    } \
+    long entity##_page_cursor(json_t *root, long last_cursor) { \
+        return entity_page_cursor(&entity##_mapping, root, last_cursor); \
+    }
+
+
+// Visits
+
+static const ColumnMapping visits_columns[] = {
+    {"repsly_id",                FIELD_INTEGER,   {"VisitID"},                                  NULL,                   true},
+    {"client_id",                FIELD_TEXT,      {"ClientCode", "ClientName"},                 resolve_client,         false},
+    {"rep_id",                   FIELD_TEXT,      {"RepresentativeCode", "RepresentativeName"}, resolve_representative, false},
+    {"time_start_id",            FIELD_TIMESTAMP, {"DateAndTimeStart"},                         resolve_time,           false},
+    {"time_end_id",              FIELD_TIMESTAMP, {"DateAndTimeEnd"},                           resolve_time,           false},
+    // Partition key; listed after time_start_id so the export keeps the full timestamp
+    {"visit_date",               FIELD_DATE,      {"DateAndTimeStart"},                         NULL,                   true},
+    {"explicit_check_in",        FIELD_BOOL,      {"ExplicitCheckIn"},                          NULL,                   false},
+    {"lat_start_id",             FIELD_REAL,      {"LatitudeStart"},                            resolve_lat,            false},
+    {"long_start_id",            FIELD_REAL,      {"LongitudeStart"},                           resolve_long,           false},
+    {"lat_end_id",               FIELD_REAL,      {"LatitudeEnd"},                              resolve_lat,            false},
+    {"long_end_id",              FIELD_REAL,      {"LongitudeEnd"},                             resolve_long,           false},
+    {"precision_start",          FIELD_INTEGER,   {"PrecisionStart"},                           NULL,                   false},
+    {"precision_end",            FIELD_INTEGER,   {"PrecisionEnd"},                             NULL,                   false},
+    {"visit_status_by_schedule", FIELD_INTEGER,   {"VisitStatusBySchedule"},                    NULL,                   false},
+    {"visit_ended",              FIELD_BOOL,      {"VisitEnded"},                               NULL,                   false},
+};
+
+const EntityMapping visits_mapping = {
+    "visits", "visits", "Visits", "field_ops.visits", "LastTimeStamp",
+    visits_columns, COLUMN_COUNT(visits_columns), "visit_date"
+};
+
+
+// Purchase orders
+
+static const ColumnMapping purchaseorders_columns[] = {
+    {"document_no",              FIELD_TEXT,      {"DocumentNo"},                               NULL,                    true},
+    {"transaction_type",         FIELD_TEXT,      {"TransactionType"},                          NULL,                    false},
+    {"document_type_id",         FIELD_TEXT,      {"DocumentTypeName"},                         resolve_document_type,   false},
+    {"document_status_id",       FIELD_TEXT,      {"DocumentStatus"},                           resolve_document_status, false},
+    {"time_id",                  FIELD_TIMESTAMP, {"DateAndTime"},                              resolve_time,            false},
+    {"client_id",                FIELD_TEXT,      {"ClientCode", "ClientName"},                 resolve_client,          false},
+    {"document_date_id",         FIELD_DATE,      {"DocumentDate"},                             resolve_date,            false},
+    {"due_date_id",              FIELD_DATE,      {"DueDate"},                                  resolve_date,            false},
+    {"rep_id",                   FIELD_TEXT,      {"RepresentativeCode", "RepresentativeName"}, resolve_representative,  false},
+    {"signature_url",            FIELD_TEXT,      {"SignatureURL"},                             NULL,                    false},
+    {"note_id",                  FIELD_TEXT,      {"Note"},                                     resolve_note,            false},
+    {"taxable",                  FIELD_BOOL,      {"Taxable"},                                  NULL,                    false},
+    {"visit_id",                 FIELD_INTEGER,   {"VisitID"},                                  resolve_visit,           false},
+    {"original_document_number", FIELD_TEXT,      {"OriginalDocumentNumber"},                   NULL,                    false},
+};
+
+const EntityMapping purchaseorders_mapping = {
+    "purchaseorders", "purchaseorders", "PurchaseOrders", "sales.purchase_orders", "LastID",
+    purchaseorders_columns, COLUMN_COUNT(purchaseorders_columns), NULL
+};
+
+
+// Retail audits
+
+static const ColumnMapping retailaudits_columns[] = {
+    {"repsly_id", FIELD_INTEGER,   {"RetailAuditID"},                            NULL,                   true},
+    {"name",      FIELD_TEXT,      {"RetailAuditName"},                          NULL,                   false},
+    {"cancelled", FIELD_BOOL,      {"Cancelled"},                                NULL,                   false},
+    {"client_id", FIELD_TEXT,      {"ClientCode", "ClientName"},                 resolve_client,         false},
+    {"time_id",   FIELD_TIMESTAMP, {"DateAndTime"},                              resolve_time,           false},
+    {"rep_id",    FIELD_TEXT,      {"RepresentativeCode", "RepresentativeName"}, resolve_representative, false},
+    {"visit_id",  FIELD_INTEGER,   {"VisitID"},                                  resolve_visit,          false},
+    {"note_id",   FIELD_TEXT,      {"Note"},                                     resolve_note,           false},
+};
+
+const EntityMapping retailaudits_mapping = {
+    "retailaudits", "retailaudits", "RetailAudits", "field_ops.retail_audits", "LastID",
+    retailaudits_columns, COLUMN_COUNT(retailaudits_columns), NULL
+};
+
+
+// Products
+
+static const ColumnMapping products_columns[] = {
+    {"code",       FIELD_TEXT, {"Code"},                                   NULL,                  true},
+    {"name",       FIELD_TEXT, {"Name"},                                   NULL,                  false},
+    {"group_id",   FIELD_TEXT, {"ProductGroupCode", "ProductGroupName"},   resolve_product_group, false},
+    {"active",     FIELD_BOOL, {"Active"},                                 NULL,                  false},
+    {"unit_price", FIELD_REAL, {"UnitPrice"},                              NULL,                  false},
+    {"ean",        FIELD_TEXT, {"EAN"},                                    NULL,                  false},
+    {"note_id",    FIELD_TEXT, {"Note"},                                   resolve_note,          false},
+    {"image_url",  FIELD_TEXT, {"ImageUrl"},                               NULL,                  false},
+};
+
+const EntityMapping products_mapping = {
+    "products", "products", "Products", "inventory.products", "LastID",
+    products_columns, COLUMN_COUNT(products_columns), NULL
+};
+
+
+// Photos
+
+static const ColumnMapping photos_columns[] = {
+    {"repsly_id", FIELD_INTEGER,   {"PhotoID"},                                  NULL,                   true},
+    {"visit_id",  FIELD_INTEGER,   {"VisitID"},                                  resolve_visit,          false},
+    {"client_id", FIELD_TEXT,      {"ClientCode", "ClientName"},                 resolve_client,         false},
+    {"rep_id",    FIELD_TEXT,      {"RepresentativeCode", "RepresentativeName"}, resolve_representative, false},
+    {"note",      FIELD_TEXT,      {"Note"},                                     NULL,                   false},
+    {"date_time", FIELD_TIMESTAMP, {"DateAndTime"},                              NULL,                   false},
+    {"photo_url", FIELD_TEXT,      {"PhotoURL"},                                 NULL,                   false},
+};
+
+const EntityMapping photos_mapping = {
+    "photos", "photos", "Photos", "field_ops.photos", "LastID",
+    photos_columns, COLUMN_COUNT(photos_columns), NULL
+};
+
+
+// Daily working time
+
+static const ColumnMapping dailyworkingtime_columns[] = {
+    {"repsly_id",           FIELD_INTEGER,   {"DailyWorkingTimeID"},                       NULL,                   true},
+    {"rep_id",              FIELD_TEXT,      {"RepresentativeCode", "RepresentativeName"}, resolve_representative, false},
+    {"date_id",             FIELD_DATE,      {"Date"},                                     resolve_date,           false},
+    {"time_start_id",       FIELD_TIMESTAMP, {"DateAndTimeStart"},                         resolve_time,           false},
+    {"time_end_id",         FIELD_TIMESTAMP, {"DateAndTimeEnd"},                           resolve_time,           false},
+    {"lat_start_id",        FIELD_REAL,      {"LatitudeStart"},                            resolve_lat,            false},
+    {"long_start_id",       FIELD_REAL,      {"LongitudeStart"},                           resolve_long,           false},
+    {"lat_end_id",          FIELD_REAL,      {"LatitudeEnd"},                              resolve_lat,            false},
+    {"long_end_id",         FIELD_REAL,      {"LongitudeEnd"},                             resolve_long,           false},
+    {"note_id",             FIELD_TEXT,      {"Note"},                                     resolve_note,           false},
+    {"no_of_visits",        FIELD_INTEGER,   {"NoOfVisits"},                               NULL,                   false},
+    {"min_of_visits",       FIELD_TIMESTAMP, {"MinOfVisits"},                              resolve_time,           false},
+    {"max_of_visits",       FIELD_TIMESTAMP, {"MaxOfVisits"},                              resolve_time,           false},
+    {"min_max_visits_time", FIELD_INTEGER,   {"MinMaxVisitsTime"},                         NULL,                   false},
+    {"time_at_client",      FIELD_INTEGER,   {"TimeAtClient"},                             NULL,                   false},
+    {"time_at_travel",      FIELD_INTEGER,   {"TimeAtTravel"},                             NULL,                   false},
+};
+
+const EntityMapping dailyworkingtime_mapping = {
+    "dailyworkingtime", "dailyworkingtime", "DailyWorkingTime", "field_ops.daily_working_time", "LastID",
+    dailyworkingtime_columns, COLUMN_COUNT(dailyworkingtime_columns), NULL
+};
+
+
+// Visit schedules
+
+static const ColumnMapping visitschedules_columns[] = {
+    {"rep_id",           FIELD_TEXT,      {"RepresentativeCode", "RepresentativeName"}, resolve_representative, true},
+    {"client_id",        FIELD_TEXT,      {"ClientCode", "ClientName"},                 resolve_client,         true},
+    {"schedule_time_id", FIELD_TIMESTAMP, {"ScheduleDateAndTime"},                      resolve_time,           true},
+    {"visit_note_id",    FIELD_TEXT,      {"VisitNote"},                                resolve_note,           false},
+    {"due_date_id",      FIELD_DATE,      {"DueDate"},                                  resolve_date,           false},
+};
+
+const EntityMapping visitschedules_mapping = {
+    "visitschedules", "visitschedules", "VisitSchedules", "field_ops.visit_schedules", NULL,
+    visitschedules_columns, COLUMN_COUNT(visitschedules_columns), NULL
+};
+
+
+// Users
+
+static const ColumnMapping users_columns[] = {
+    {"code",               FIELD_TEXT, {"Code"},             NULL,          true},
+    {"active",             FIELD_BOOL, {"Active"},           NULL,          false},
+    {"note_id",            FIELD_TEXT, {"Note"},             resolve_note,  false},
+    {"phone",              FIELD_TEXT, {"Phone"},            NULL,          false},
+    {"send_email_enabled", FIELD_BOOL, {"SendEmailEnabled"}, NULL,          false},
+    {"email_id",           FIELD_TEXT, {"Email"},            resolve_email, false},
+    {"role_id",            FIELD_TEXT, {"Role"},             resolve_role,  false},
+    {"name_id",            FIELD_TEXT, {"Name"},             resolve_name,  false},
+};
+
+const EntityMapping users_mapping = {
+    "users", "users", "Users", "user_mgmt.users", "LastTimeStamp",
+    users_columns, COLUMN_COUNT(users_columns), NULL
+};
+
+
+// Representatives
+
+static const ColumnMapping reps_columns[] = {
+    {"rep_code_id", FIELD_TEXT, {"Code"},   resolve_rep_code, true},
+    {"active",      FIELD_BOOL, {"Active"}, NULL,             false},
+    {"note_id",     FIELD_TEXT, {"Note"},   resolve_note,     false},
+    {"email_id",    FIELD_TEXT, {"Email"},  resolve_email,    false},
+    {"name_id",     FIELD_TEXT, {"Name"},   resolve_name,     false},
+};
+
+const EntityMapping reps_mapping = {
+    "reps", "representatives", "Representatives", "field_ops.representatives", NULL,
+    reps_columns, COLUMN_COUNT(reps_columns), NULL
+};
+
+
+// Document types
+
+static const ColumnMapping documenttypes_columns[] = {
+    {"name",              FIELD_TEXT, {"DocumentTypeName"},             NULL, true},
+    {"attribute_caption", FIELD_TEXT, {"DocumentItemAttributeCaption"}, NULL, false},
+};
+
+const EntityMapping documenttypes_mapping = {
+    "documenttypes", "documenttypes", "DocumentTypes", "sales.document_types", NULL,
+    documenttypes_columns, COLUMN_COUNT(documenttypes_columns), NULL
+};
+
+
+MAPPED_ENTITY_FETCH(visits)
+MAPPED_ENTITY_FETCH(purchaseorders)
+MAPPED_ENTITY_FETCH(retailaudits)
+MAPPED_ENTITY_FETCH(products)
+MAPPED_ENTITY_FETCH(photos)
+MAPPED_ENTITY_FETCH(dailyworkingtime)
+MAPPED_ENTITY_FETCH(visitschedules)
+MAPPED_ENTITY_FETCH(users)
+MAPPED_ENTITY_FETCH(reps)
+MAPPED_ENTITY_FETCH(documenttypes)
@@ -0,0 +1,52 @@
+#include "../include/entity_registry.h"
+#include "../include/client.h"
+#include "../include/form.h"
+#include "../include/pricelist.h"
+#include "../include/entity_mappings.h"
+#include <string.h>
+
+#define ENTITY(name, endpoint, prefix, dependencies) \
+    {name, endpoint, prefix##_fetch_and_insert, prefix##_load_page, prefix##_page_cursor, NULL, NULL, dependencies}
+#define SCANNED_ENTITY(name, endpoint, prefix, dependencies) \
+    {name, endpoint, prefix##_fetch_and_insert, prefix##_load_page, prefix##_page_cursor, prefix##_load_text, NULL, \
+     dependencies}
+#define MAPPED_ENTITY(name, endpoint, prefix, dependencies) \
+    {name, endpoint, prefix##_fetch_and_insert, prefix##_load_page, prefix##_page_cursor, NULL, &prefix##_mapping, \
+     dependencies}
+#define AFTER(...) ((const char *const[]){__VA_ARGS__, NULL})
+
+// Dependencies are the entities whose rows a loader resolves against. Visits
+// are only looked up, so a form or photo loaded before its visit is stored
+// without it; clients, reps and the rest would be created as bare stubs.
+static const EntityInfo entities[] = {
+    SCANNED_ENTITY("clients", "clients", client, AFTER("reps")),
+    ENTITY("forms", "forms", form, AFTER("visits", "clients", "reps")),
+    ENTITY("pricelists", "pricelists", pricelist, AFTER("products", "clients")),
+    //ENTITY("clientnotes", "clientnotes", clientnotes, NULL),
+    MAPPED_ENTITY("visits", "visits", visits, AFTER("clients", "reps")),
+    MAPPED_ENTITY("purchaseorders", "purchaseorders", purchaseorders, AFTER("visits", "clients", "reps", "documenttypes")),
+    MAPPED_ENTITY("retailaudits", "retailaudits", retailaudits, AFTER("visits", "clients", "reps")),
+    MAPPED_ENTITY("products", "products", products, NULL),
+    //ENTITY("pricelistitems", "pricelistitems", pricelistitems, NULL),
+    MAPPED_ENTITY("photos", "photos", photos, AFTER("visits", "clients", "reps")),
+    MAPPED_ENTITY("dailyworkingtime", "dailyworkingtime", dailyworkingtime, AFTER("reps")),
+    MAPPED_ENTITY("visitschedules", "visitschedules", visitschedules, AFTER("clients", "reps")),
+    //ENTITY("visitrealizations", "visitrealizations", visitrealizations, NULL),
+    MAPPED_ENTITY("users", "users", users, NULL),
+    MAPPED_ENTITY("reps", "representatives", reps, NULL),
+    MAPPED_ENTITY("documenttypes", "documenttypes", documenttypes, NULL),
+};
+
+const EntityInfo *entity_registry(int *count) {
+    *count = sizeof(entities) / sizeof(EntityInfo);
+    return entities;
+}
+
+const EntityInfo *entity_registry_find(const char *name) {
+    for (size_t i = 0; i < sizeof(entities) / sizeof(EntityInfo); i++) {
+        if (strcmp(entities[i].name, name) == 0) {
+            return &entities[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,442 @@
+#include "../include/event_loop.h"
+#include "../include/api.h"
+#include "../include/json_arena.h"
+#include "../include/core_operations.h"
+#include "../include/sql_stats.h"
+#include "../include/trace.h"
+#include <curl/curl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+#include <jansson.h>
+
+// Fetched pages waiting for the database, counting requests in flight, so a
+// slow database holds back downloading instead of piling pages up in memory
+#define MAX_QUEUED_PAGES 32
+#define MAX_EVENTS 64
+
+struct LoopEntity {
+    const EntityInfo *info;
+    ApiRequestPtr request;   // in flight, or NULL
+    long request_cursor;
+    TraceSpan request_span;
+    long next_cursor;        // what the next request asks for
+    bool fetch_done;
+    bool failed;             // later pages are dropped so the cursor can't skip one
+};
+
+struct LoopPage {
+    struct LoopEntity *entity;
+    json_t *root;
+    long cursor;
+};
+
+struct EventLoop {
+    int epoll_fd;
+    CURLM *multi;
+    long curl_deadline;      // monotonic ms, -1 when curl wants no timeout
+    int in_flight;
+
+    struct LoopPage queue[MAX_QUEUED_PAGES];
+    int queue_head;
+    int queue_count;
+
+    PGconn *db_conn;
+    int db_fd;               // registered while a write is in flight, else -1
+    EntityPagePtr db_page;
+    TraceSpan db_span;
+    struct LoopEntity *db_entity;
+    bool db_write_failed;
+    bool db_lost;
+};
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static int on_curl_socket(CURL *easy, curl_socket_t socket, int what, void *user_data, void *socket_data) {
+    (void)easy;
+    struct EventLoop *loop = (struct EventLoop *)user_data;
+
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, socket, NULL);
+        return 0;
+    }
+
+    struct epoll_event event = {0};
+    event.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+    event.data.fd = socket;
+
+    // socket_data marks sockets already added; curl may reuse a descriptor
+    // number after closing it without telling us, hence the EEXIST fallback
+    if (socket_data) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, socket, &event);
+    } else {
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, socket, &event) != 0 && errno == EEXIST) {
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, socket, &event);
+        }
+        curl_multi_assign(loop->multi, socket, loop);
+    }
+    return 0;
+}
+
+static int on_curl_timer(CURLM *multi, long timeout_ms, void *user_data) {
+    (void)multi;
+    struct EventLoop *loop = (struct EventLoop *)user_data;
+    loop->curl_deadline = timeout_ms < 0 ? -1 : now_ms() + timeout_ms;
+    return 0;
+}
+
+static void start_request(struct EventLoop *loop, struct LoopEntity *entity) {
+    ApiRequestPtr request = api_request_create(entity->info->endpoint, entity->next_cursor, entity);
+    if (!request || curl_multi_add_handle(loop->multi, api_request_handle(request)) != CURLM_OK) {
+        fprintf(stderr, "Failed to start request for %s\n", entity->info->name);
+        api_request_free(request);
+        entity->failed = true;
+        return;
+    }
+    entity->request = request;
+    entity->request_cursor = entity->next_cursor;
+    entity->request_span = trace_begin();
+    loop->in_flight++;
+}
+
+static void collect_transfers(struct EventLoop *loop) {
+    CURLMsg *message;
+    int remaining;
+
+    while ((message = curl_multi_info_read(loop->multi, &remaining))) {
+        if (message->msg != CURLMSG_DONE) {
+            continue;
+        }
+
+        CURL *handle = message->easy_handle;
+        CURLcode result = message->data.result;
+        ApiRequestPtr request = api_request_from_handle(handle);
+        struct LoopEntity *entity = (struct LoopEntity *)api_request_user_data(request);
+
+        curl_multi_remove_handle(loop->multi, handle);
+        size_t length = 0;
+        char *body = api_request_take_body(request, &length);
+        api_request_free(request);
+        entity->request = NULL;
+        loop->in_flight--;
+        trace_end(entity->request_span, "api_fetch", entity->info->endpoint);
+
+        if (result != CURLE_OK) {
+            fprintf(stderr, "Request for %s failed: %s\n", entity->info->name, curl_easy_strerror(result));
+            entity->failed = true;
+        }
+        if (entity->failed) {
+            free(body);
+            continue;
+        }
+
+        json_error_t error;
+        TraceSpan parse_span = trace_begin();
+        json_t *root = json_arena_load(body, length, &error);
+        trace_end(parse_span, "json_parse", entity->info->endpoint);
+        free(body);
+        if (!root) {
+            fprintf(stderr, "JSON parsing error in %s page: %s\n", entity->info->name, error.text);
+            entity->failed = true;
+            continue;
+        }
+
+        long next_cursor = entity->info->page_cursor(root, entity->request_cursor);
+        if (next_cursor > entity->request_cursor) {
+            entity->next_cursor = next_cursor;
+        } else {
+            entity->fetch_done = true;
+        }
+
+        int tail = (loop->queue_head + loop->queue_count) % MAX_QUEUED_PAGES;
+        loop->queue[tail] = (struct LoopPage){entity, root, entity->request_cursor};
+        loop->queue_count++;
+    }
+}
+
+static void watch_db(struct EventLoop *loop, bool want_write) {
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    event.data.fd = loop->db_fd;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, loop->db_fd, &event);
+}
+
+// After a failed write the connection may be mid-pipeline or gone; either way
+// a reset leaves it usable for the next page, or tells us the database is down.
+static void recover_db(struct EventLoop *loop) {
+    db_reset(loop->db_conn);
+    if (PQstatus(loop->db_conn) != CONNECTION_OK) {
+        fprintf(stderr, "Database unavailable, stopping event loop sync\n");
+        loop->db_lost = true;
+        return;
+    }
+    PQsetnonblocking(loop->db_conn, 1);
+}
+
+static void finish_write(struct EventLoop *loop, bool committed) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->db_fd, NULL);
+    loop->db_fd = -1;
+    sql_pipeline_discard();
+
+    if (!PQexitPipelineMode(loop->db_conn) || PQstatus(loop->db_conn) != CONNECTION_OK) {
+        recover_db(loop);
+    }
+    if (!committed) {
+        loop->db_entity->failed = true;
+    }
+    trace_end(loop->db_span, "pipeline_write", loop->db_entity->info->name);
+
+    entity_page_finish(loop->db_page, committed);
+    loop->db_page = NULL;
+    loop->db_entity = NULL;
+}
+
+// Hands queued pages to the database until one is left writing in the
+// background. Hand-written loaders have no pipelined path and run inline.
+static void start_writes(struct EventLoop *loop) {
+    while (!loop->db_page && loop->queue_count > 0) {
+        struct LoopPage page = loop->queue[loop->queue_head];
+        loop->queue_head = (loop->queue_head + 1) % MAX_QUEUED_PAGES;
+        loop->queue_count--;
+
+        struct LoopEntity *entity = page.entity;
+        if (entity->failed || loop->db_lost) {
+            json_decref(page.root);
+            continue;
+        }
+
+        const EntityMapping *mapping = entity->info->mapping;
+        if (!mapping) {
+            if (!entity->info->load_page(loop->db_conn, page.root, page.cursor)) {
+                fprintf(stderr, "Failed to load %s page\n", entity->info->name);
+                entity->failed = true;
+                if (PQstatus(loop->db_conn) != CONNECTION_OK) {
+                    recover_db(loop);
+                }
+            }
+            json_decref(page.root);
+            continue;
+        }
+
+        EntityPagePtr prepared = entity_page_prepare(loop->db_conn, mapping, page.root, page.cursor);
+        json_decref(page.root);
+        if (!prepared) {
+            fprintf(stderr, "Failed to prepare %s page\n", entity->info->name);
+            entity->failed = true;
+            continue;
+        }
+
+        TraceSpan span = trace_begin();
+        int sent = entity_page_send(loop->db_conn, prepared);
+        if (sent <= 0) {
+            sql_pipeline_discard();
+            entity_page_finish(prepared, sent == 0);
+            if (sent < 0) {
+                entity->failed = true;
+                recover_db(loop);
+            }
+            continue;
+        }
+
+        loop->db_page = prepared;
+        loop->db_entity = entity;
+        loop->db_span = span;
+        loop->db_write_failed = false;
+        loop->db_fd = PQsocket(loop->db_conn);
+
+        int flushed = PQflush(loop->db_conn);
+        struct epoll_event event = {0};
+        event.events = EPOLLIN | (flushed == 1 ? EPOLLOUT : 0);
+        event.data.fd = loop->db_fd;
+        if (flushed < 0 || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->db_fd, &event) != 0) {
+            fprintf(stderr, "Failed to send %s page: %s", entity->info->name, PQerrorMessage(loop->db_conn));
+            finish_write(loop, false);
+        }
+    }
+}
+
+static void handle_db_event(struct EventLoop *loop, uint32_t events) {
+    if (events & EPOLLOUT) {
+        int flushed = PQflush(loop->db_conn);
+        if (flushed < 0) {
+            fprintf(stderr, "Failed to send %s page: %s", loop->db_entity->info->name, PQerrorMessage(loop->db_conn));
+            finish_write(loop, false);
+            return;
+        }
+        if (flushed == 0) {
+            watch_db(loop, false);
+        }
+    }
+
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        return;
+    }
+
+    if (!PQconsumeInput(loop->db_conn)) {
+        fprintf(stderr, "Lost database connection writing %s page: %s", loop->db_entity->info->name,
+                PQerrorMessage(loop->db_conn));
+        finish_write(loop, false);
+        return;
+    }
+
+    // Each statement's results end with a NULL; the sync result ends the page
+    while (!PQisBusy(loop->db_conn)) {
+        PGresult *result = PQgetResult(loop->db_conn);
+        if (!result) {
+            continue;
+        }
+
+        sql_pipeline_result(result);
+        ExecStatusType status = PQresultStatus(result);
+        if (status == PGRES_FATAL_ERROR) {
+            fprintf(stderr, "Write of %s page failed: %s", loop->db_entity->info->name,
+                    PQresultErrorMessage(result));
+            loop->db_write_failed = true;
+        } else if (status == PGRES_PIPELINE_ABORTED) {
+            loop->db_write_failed = true;
+        }
+        PQclear(result);
+
+        if (status == PGRES_PIPELINE_SYNC) {
+            finish_write(loop, !loop->db_write_failed);
+            return;
+        }
+    }
+}
+
+static bool fetch_pending(const struct EventLoop *loop, const struct LoopEntity *entities, int count) {
+    if (loop->db_lost) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!entities[i].fetch_done && !entities[i].failed) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool event_loop_sync(PGconn *db_conn, const EntityInfo *const *entities, int count) {
+    if (!db_ensure_connected(db_conn)) {
+        return false;
+    }
+
+    struct LoopEntity loop_entities[count];
+    for (int i = 0; i < count; i++) {
+        loop_entities[i] = (struct LoopEntity){entities[i], NULL, 0, 0,
+                                               get_last_processed(db_conn, entities[i]->name), false, false};
+    }
+
+    struct EventLoop loop = {0};
+    loop.db_conn = db_conn;
+    loop.db_fd = -1;
+    loop.curl_deadline = -1;
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop.multi = curl_multi_init();
+    if (loop.epoll_fd < 0 || !loop.multi) {
+        fprintf(stderr, "Failed to set up event loop\n");
+        if (loop.epoll_fd >= 0) {
+            close(loop.epoll_fd);
+        }
+        curl_multi_cleanup(loop.multi);
+        return false;
+    }
+
+    curl_multi_setopt(loop.multi, CURLMOPT_SOCKETFUNCTION, on_curl_socket);
+    curl_multi_setopt(loop.multi, CURLMOPT_SOCKETDATA, &loop);
+    curl_multi_setopt(loop.multi, CURLMOPT_TIMERFUNCTION, on_curl_timer);
+    curl_multi_setopt(loop.multi, CURLMOPT_TIMERDATA, &loop);
+
+    PQsetnonblocking(db_conn, 1);
+
+    bool loop_error = false;
+    while (true) {
+        for (int i = 0; i < count && !loop.db_lost; i++) {
+            struct LoopEntity *entity = &loop_entities[i];
+            if (!entity->request && !entity->fetch_done && !entity->failed &&
+                loop.queue_count + loop.in_flight < MAX_QUEUED_PAGES) {
+                start_request(&loop, entity);
+            }
+        }
+
+        start_writes(&loop);
+
+        if (loop.in_flight == 0 && !loop.db_page) {
+            if (loop.queue_count == 0 && !fetch_pending(&loop, loop_entities, count)) {
+                break;
+            }
+            continue;
+        }
+
+        int timeout = -1;
+        if (loop.curl_deadline >= 0) {
+            long remaining = loop.curl_deadline - now_ms();
+            timeout = remaining > 0 ? (int)remaining : 0;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        int ready = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            loop_error = true;
+            break;
+        }
+
+        int running;
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.fd == loop.db_fd) {
+                handle_db_event(&loop, events[i].events);
+                continue;
+            }
+
+            int action = ((events[i].events & EPOLLIN) ? CURL_CSELECT_IN : 0) |
+                         ((events[i].events & EPOLLOUT) ? CURL_CSELECT_OUT : 0) |
+                         ((events[i].events & (EPOLLERR | EPOLLHUP)) ? CURL_CSELECT_ERR : 0);
+            curl_multi_socket_action(loop.multi, events[i].data.fd, action, &running);
+        }
+
+        if (loop.curl_deadline >= 0 && now_ms() >= loop.curl_deadline) {
+            loop.curl_deadline = -1;
+            curl_multi_socket_action(loop.multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        }
+
+        collect_transfers(&loop);
+    }
+
+    // Only an epoll failure leaves work behind
+    for (int i = 0; i < count; i++) {
+        if (loop_entities[i].request) {
+            curl_multi_remove_handle(loop.multi, api_request_handle(loop_entities[i].request));
+            api_request_free(loop_entities[i].request);
+        }
+    }
+    while (loop.queue_count > 0) {
+        json_decref(loop.queue[loop.queue_head].root);
+        loop.queue_head = (loop.queue_head + 1) % MAX_QUEUED_PAGES;
+        loop.queue_count--;
+    }
+    if (loop.db_page) {
+        entity_page_finish(loop.db_page, false);
+        db_reset(db_conn);
+    }
+
+    curl_multi_cleanup(loop.multi);
+    close(loop.epoll_fd);
+    PQsetnonblocking(db_conn, 0);
+
+    bool success = !loop_error && !loop.db_lost;
+    for (int i = 0; i < count; i++) {
+        success = success && !loop_entities[i].failed;
+    }
+    return success;
+}
@@ -0,0 +1,64 @@
+#include "../include/fingerprint.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static Fingerprint fingerprint_add_bytes(Fingerprint fp, const void *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        fp ^= bytes[i];
+        fp *= FNV_PRIME;
+    }
+    return fp;
+}
+
+Fingerprint fingerprint_init(void) {
+    return FNV_OFFSET_BASIS;
+}
+
+// Every value is followed by a separator byte so that ("ab", "c") and
+// ("a", "bc") don't hash the same. NULL gets its own marker so it stays
+// distinct from the empty string.
+Fingerprint fingerprint_add_str(Fingerprint fp, const char *value) {
+    if (!value) {
+        const unsigned char null_marker[] = {0xff, 0x00};
+        return fingerprint_add_bytes(fp, null_marker, sizeof(null_marker));
+    }
+    return fingerprint_add_bytes(fp, value, strlen(value) + 1);
+}
+
+Fingerprint fingerprint_add_int(Fingerprint fp, long value) {
+    int64_t v = (int64_t)value;
+    return fingerprint_add_bytes(fp, &v, sizeof(v));
+}
+
+Fingerprint fingerprint_add_double(Fingerprint fp, double value) {
+    // -0.0 and 0.0 compare equal but have different bit patterns
+    if (value == 0.0) {
+        value = 0.0;
+    }
+    return fingerprint_add_bytes(fp, &value, sizeof(value));
+}
+
+Fingerprint fingerprint_add_bool(Fingerprint fp, bool value) {
+    unsigned char b = value ? 1 : 0;
+    return fingerprint_add_bytes(fp, &b, sizeof(b));
+}
+
+Fingerprint fingerprint_add_fingerprint(Fingerprint fp, Fingerprint other) {
+    return fingerprint_add_bytes(fp, &other, sizeof(other));
+}
+
+void fingerprint_to_string(Fingerprint fp, char *buf, size_t buf_size) {
+    snprintf(buf, buf_size, "%lld", (long long)(int64_t)fp);
+}
+
+Fingerprint fingerprint_from_string(const char *str) {
+    if (!str || !*str) {
+        return 0;
+    }
+    return (Fingerprint)(int64_t)strtoll(str, NULL, 10);
+}
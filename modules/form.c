@@ -1,5 +1,13 @@
 #include "../include/form.h"
 #include "../include/api.h"
+#include "../include/core_operations.h"
+#include "../include/json_decoder.h"
+#include "../include/thread_pool.h"
+#include "../include/columnar_export.h"
+#include "../include/form_answers.h"
+#include "../include/partitions.h"
+#include "../include/sql_stats.h"
+#include "../include/temporal.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -20,15 +28,47 @@ struct FormData {
     char signature_url[512];
     struct FormItem items[MAX_FORM_ITEMS];
     int item_count;
+    char *answers;   // every answer as one JSON object keyed by question
+
+    long repsly_form_id;
+    char client_code[51];
+    char client_name[256];
+    char date_and_time[32];
+    char rep_code[21];
+    char rep_name[256];
+    char street_address[256];
+    char zip[21];
+    char zip_ext[21];
+    char city[256];
+    char state[256];
+    char country[256];
+    char email[256];
+    char phone[129];
+    char mobile[129];
+    char territory[81];
+    double longitude;
+    double latitude;
+    char visit_start[32];
+    char visit_end[32];
 };
 
+// Repsly leaves most optional fields out (or null), so every string setter
+// treats NULL as empty.
+static void form_copy_string(char *dest, size_t dest_size, const char *src) {
+    if (!src) {
+        dest[0] = '\0';
+        return;
+    }
+    strncpy(dest, src, dest_size - 1);
+    dest[dest_size - 1] = '\0';
+}
+
 FormDataPtr form_create(void) {
     return (FormDataPtr)calloc(1, sizeof(struct FormData));
 }
 
 void form_set_name(FormDataPtr form, const char* name) {
-    strncpy(form->name, name, sizeof(form->name) - 1);
-    form->name[sizeof(form->name) - 1] = '\0';
+    form_copy_string(form->name, sizeof(form->name), name);
 }
 
 void form_set_visit_id(FormDataPtr form, int visit_id) {
@@ -40,20 +80,118 @@ void form_set_time_id(FormDataPtr form, int time_id) {
 }
 
 void form_set_signature_url(FormDataPtr form, const char* signature_url) {
-    strncpy(form->signature_url, signature_url, sizeof(form->signature_url) - 1);
-    form->signature_url[sizeof(form->signature_url) - 1] = '\0';
+    form_copy_string(form->signature_url, sizeof(form->signature_url), signature_url);
+}
+
+void form_set_form_id(FormDataPtr form, long repsly_form_id) {
+    form->repsly_form_id = repsly_form_id;
+}
+
+void form_set_client_code(FormDataPtr form, const char* client_code) {
+    form_copy_string(form->client_code, sizeof(form->client_code), client_code);
+}
+
+void form_set_client_name(FormDataPtr form, const char* client_name) {
+    form_copy_string(form->client_name, sizeof(form->client_name), client_name);
+}
+
+void form_set_date_and_time(FormDataPtr form, const char* date_and_time) {
+    form_copy_string(form->date_and_time, sizeof(form->date_and_time), date_and_time);
+}
+
+void form_set_rep_code(FormDataPtr form, const char* rep_code) {
+    form_copy_string(form->rep_code, sizeof(form->rep_code), rep_code);
+}
+
+void form_set_rep_name(FormDataPtr form, const char* rep_name) {
+    form_copy_string(form->rep_name, sizeof(form->rep_name), rep_name);
+}
+
+void form_set_street_address(FormDataPtr form, const char* street_address) {
+    form_copy_string(form->street_address, sizeof(form->street_address), street_address);
+}
+
+void form_set_zip(FormDataPtr form, const char* zip) {
+    form_copy_string(form->zip, sizeof(form->zip), zip);
+}
+
+void form_set_zip_ext(FormDataPtr form, const char* zip_ext) {
+    form_copy_string(form->zip_ext, sizeof(form->zip_ext), zip_ext);
+}
+
+void form_set_city(FormDataPtr form, const char* city) {
+    form_copy_string(form->city, sizeof(form->city), city);
+}
+
+void form_set_state(FormDataPtr form, const char* state) {
+    form_copy_string(form->state, sizeof(form->state), state);
+}
+
+void form_set_country(FormDataPtr form, const char* country) {
+    form_copy_string(form->country, sizeof(form->country), country);
+}
+
+void form_set_email(FormDataPtr form, const char* email) {
+    form_copy_string(form->email, sizeof(form->email), email);
+}
+
+void form_set_phone(FormDataPtr form, const char* phone) {
+    form_copy_string(form->phone, sizeof(form->phone), phone);
+}
+
+void form_set_mobile(FormDataPtr form, const char* mobile) {
+    form_copy_string(form->mobile, sizeof(form->mobile), mobile);
+}
+
+void form_set_territory(FormDataPtr form, const char* territory) {
+    form_copy_string(form->territory, sizeof(form->territory), territory);
+}
+
+void form_set_visit_start(FormDataPtr form, const char* visit_start) {
+    form_copy_string(form->visit_start, sizeof(form->visit_start), visit_start);
+}
+
+void form_set_visit_end(FormDataPtr form, const char* visit_end) {
+    form_copy_string(form->visit_end, sizeof(form->visit_end), visit_end);
+}
+
+void form_set_longitude(FormDataPtr form, double longitude) {
+    form->longitude = longitude;
+}
+
+void form_set_latitude(FormDataPtr form, double latitude) {
+    form->latitude = latitude;
 }
 
 void form_add_item(FormDataPtr form, const char* field, const char* value) {
-    if (form->item_count < MAX_FORM_ITEMS) {
-        strncpy(form->items[form->item_count].field, field, sizeof(form->items[form->item_count].field) - 1);
-        form->items[form->item_count].field[sizeof(form->items[form->item_count].field) - 1] = '\0';
-        strncpy(form->items[form->item_count].value, value, sizeof(form->items[form->item_count].value) - 1);
-        form->items[form->item_count].value[sizeof(form->items[form->item_count].value) - 1] = '\0';
+    if (form->item_count < MAX_FORM_ITEMS && field) {
+        form_copy_string(form->items[form->item_count].field, sizeof(form->items[form->item_count].field), field);
+        form_copy_string(form->items[form->item_count].value, sizeof(form->items[form->item_count].value), value);
         form->item_count++;
     }
 }
 
+// A form whose date changed is moved to its new partition before the upsert,
+// which would otherwise store it twice; moving keeps its form_id
+static bool form_move(PGconn *db_conn, const char *repsly_id, const char *date_binary, int date_length) {
+    const char *query =
+        "UPDATE field_ops.forms SET form_date = $2::timestamp::date "
+        "WHERE repsly_id = $1::bigint AND form_date <> $2::timestamp::date "
+        "AND NOT EXISTS (SELECT 1 FROM field_ops.forms WHERE repsly_id = $1::bigint AND form_date = $2::timestamp::date)";
+
+    const char *param_values[] = {repsly_id, date_binary};
+    int param_lengths[] = {(int)strlen(repsly_id), date_length};
+    int param_formats[] = {0, 1};
+    PGresult *result = sql_exec_params(db_conn, __func__, query, 2, param_values, param_lengths, param_formats);
+
+    bool success = PQresultStatus(result) == PGRES_COMMAND_OK;
+    if (!success) {
+        fprintf(stderr, "UPDATE field_ops.forms failed: %s", PQerrorMessage(db_conn));
+    }
+    PQclear(result);
+    return success;
+}
+
 bool form_insert(PGconn *db_conn, FormDataPtr form) {
     int visit_id = get_or_create_visit(db_conn, form->visit_start, form->visit_end, form->rep_code, form->client_code);
 
@@ -62,29 +200,55 @@ bool form_insert(PGconn *db_conn, FormDataPtr form) {
         return false;
     }
 
+    form_set_visit_id(form, visit_id);
+    partition_ensure(db_conn, "field_ops.forms", form->date_and_time);
+
+    // The answers go in with the header, one row per form. Forms are
+    // partitioned by month of form_date; an undated form keeps the date it was
+    // first stored with, or counts as today's when it is new.
     const char *insert_form_query = 
-        "INSERT INTO field_operations.forms "
-        "(name, visit_id, date_time, signature_url) "
-        "VALUES ($1, $2, $3, $4) "
+        "INSERT INTO field_ops.forms "
+        "(repsly_id, name, visit_id, date_time, form_date, signature_url, answers) "
+        "VALUES ($1, $2, $3, $4::timestamp, COALESCE($4::timestamp::date, "
+        "(SELECT max(form_date) FROM field_ops.forms WHERE repsly_id = $1), CURRENT_DATE), $5, $6::jsonb) "
+        "ON CONFLICT (repsly_id, form_date) DO UPDATE SET "
+        "name = EXCLUDED.name, visit_id = EXCLUDED.visit_id, date_time = EXCLUDED.date_time, "
+        "signature_url = EXCLUDED.signature_url, answers = EXCLUDED.answers "
         "RETURNING form_id";
 
-    const char *param_values[4];
-    int param_lengths[4];
-    int param_formats[4] = {0}; 
+    const char *param_values[6];
+    int param_lengths[6];
+    int param_formats[6] = {0}; 
     char id_str[2][20];  
+    char date_binary[TEMPORAL_BINARY_SIZE];
+    int64_t date_time;
 
-    param_values[0] = form->name;
+    snprintf(id_str[1], sizeof(id_str[1]), "%ld", form->repsly_form_id);
+    param_values[0] = id_str[1];
+    param_values[1] = form->name;
     snprintf(id_str[0], sizeof(id_str[0]), "%d", form->visit_id);
-    param_values[1] = id_str[0];
-    snprintf(id_str[1], sizeof(id_str[1]), "%d", form->time_id);
-    param_values[2] = id_str[1];
-    param_values[3] = form->signature_url;
+    param_values[2] = id_str[0];
+    param_values[3] = NULL;
+    param_values[4] = form->signature_url;
+    param_values[5] = form->answers ? form->answers : "{}";
 
-    for (int i = 0; i < 4; i++) {
-        param_lengths[i] = strlen(param_values[i]);
+    for (int i = 0; i < 6; i++) {
+        param_lengths[i] = param_values[i] ? strlen(param_values[i]) : 0;
     }
 
-    PGresult *result = PQexecParams(db_conn, insert_form_query, 4, NULL, param_values, param_lengths, param_formats, 0);
+    // date_time goes over as a binary timestamp
+    param_formats[3] = 1;
+    if (temporal_parse(form->date_and_time, FIELD_TIMESTAMP, &date_time)) {
+        param_lengths[3] = temporal_binary(date_time, FIELD_TIMESTAMP, date_binary);
+        param_values[3] = date_binary;
+    }
+
+    if (param_values[3] && !form_move(db_conn, param_values[0], param_values[3], param_lengths[3])) {
+        return false;
+    }
+
+    PGresult *result = sql_exec_params(db_conn, __func__, insert_form_query, 6, param_values, param_lengths,
+                                       param_formats);
 
     if (PQresultStatus(result) != PGRES_TUPLES_OK) {
         fprintf(stderr, "INSERT INTO field_ops.forms failed: %s", PQerrorMessage(db_conn));
@@ -96,117 +260,295 @@ bool form_insert(PGconn *db_conn, FormDataPtr form) {
     form->form_id = atoi(form_id_str);
 
     PQclear(result);
+    return true;
+}
 
-    const char *insert_item_query = 
-        "INSERT INTO field_ops.form_items "
-        "(form_id, field, value) "
-        "VALUES ($1, $2, $3)";
+int form_get_id(FormDataPtr form) {
+    return form->form_id;
+}
 
-    for (int i = 0; i < form->item_count; i++) {
-        const char *item_param_values[3];
-        int item_param_lengths[3];
-        int item_param_formats[3] = {0}; 
+long form_get_repsly_id(FormDataPtr form) {
+    return form->repsly_form_id;
+}
 
-        snprintf(id_str[0], sizeof(id_str[0]), "%d", form->form_id);
-        item_param_values[0] = id_str[0];
-        item_param_values[1] = form->items[i].field;
-        item_param_values[2] = form->items[i].value;
+void form_free(FormDataPtr form) {
+    if (form) {
+        free(form->answers);
+    }
+    free(form);
+}
 
-        for (int j = 0; j < 3; j++) {
-            item_param_lengths[j] = strlen(item_param_values[j]);
-        }
+// Fields we read from a Repsly form record, in decoder slot order
+enum FormField {
+    FORM_FIELD_NAME,
+    FORM_FIELD_FORM_ID,
+    FORM_FIELD_CLIENT_CODE,
+    FORM_FIELD_CLIENT_NAME,
+    FORM_FIELD_DATE_AND_TIME,
+    FORM_FIELD_REP_CODE,
+    FORM_FIELD_REP_NAME,
+    FORM_FIELD_STREET_ADDRESS,
+    FORM_FIELD_ZIP,
+    FORM_FIELD_ZIP_EXT,
+    FORM_FIELD_CITY,
+    FORM_FIELD_STATE,
+    FORM_FIELD_COUNTRY,
+    FORM_FIELD_EMAIL,
+    FORM_FIELD_PHONE,
+    FORM_FIELD_MOBILE,
+    FORM_FIELD_TERRITORY,
+    FORM_FIELD_LONGITUDE,
+    FORM_FIELD_LATITUDE,
+    FORM_FIELD_SIGNATURE_URL,
+    FORM_FIELD_VISIT_START,
+    FORM_FIELD_VISIT_END,
+    FORM_FIELD_VISIT_ID,
+    FORM_FIELD_ITEMS,
+    FORM_FIELD_COUNT
+};
 
-        PGresult *item_result = PQexecParams(db_conn, insert_item_query, 3, NULL, item_param_values, item_param_lengths, item_param_formats, 0);
+static const char *const form_field_names[FORM_FIELD_COUNT] = {
+    [FORM_FIELD_NAME] = "FormName",
+    [FORM_FIELD_FORM_ID] = "FormID",
+    [FORM_FIELD_CLIENT_CODE] = "ClientCode",
+    [FORM_FIELD_CLIENT_NAME] = "ClientName",
+    [FORM_FIELD_DATE_AND_TIME] = "DateAndTime",
+    [FORM_FIELD_REP_CODE] = "RepresentativeCode",
+    [FORM_FIELD_REP_NAME] = "RepresentativeName",
+    [FORM_FIELD_STREET_ADDRESS] = "StreetAddress",
+    [FORM_FIELD_ZIP] = "ZIP",
+    [FORM_FIELD_ZIP_EXT] = "ZIPExt",
+    [FORM_FIELD_CITY] = "City",
+    [FORM_FIELD_STATE] = "State",
+    [FORM_FIELD_COUNTRY] = "Country",
+    [FORM_FIELD_EMAIL] = "Email",
+    [FORM_FIELD_PHONE] = "Phone",
+    [FORM_FIELD_MOBILE] = "Mobile",
+    [FORM_FIELD_TERRITORY] = "Territory",
+    [FORM_FIELD_LONGITUDE] = "Longitude",
+    [FORM_FIELD_LATITUDE] = "Latitude",
+    [FORM_FIELD_SIGNATURE_URL] = "SignatureURL",
+    [FORM_FIELD_VISIT_START] = "VisitStart",
+    [FORM_FIELD_VISIT_END] = "VisitEnd",
+    [FORM_FIELD_VISIT_ID] = "VisitID",
+    [FORM_FIELD_ITEMS] = "Item",
+};
 
-        if (PQresultStatus(item_result) != PGRES_COMMAND_OK) {
-            fprintf(stderr, "INSERT INTO field_ops.form_items failed: %s", PQerrorMessage(db_conn));
-            PQclear(item_result);
-            return false;
-        }
+enum FormItemField {
+    FORM_ITEM_FIELD,
+    FORM_ITEM_VALUE,
+    FORM_ITEM_COUNT
+};
 
-        PQclear(item_result);
-    }
+static const char *const form_item_names[FORM_ITEM_COUNT] = {
+    [FORM_ITEM_FIELD] = "Field",
+    [FORM_ITEM_VALUE] = "Value",
+};
 
-    return true;
-}
+static JsonDecoderPtr form_decoder;
+static JsonDecoderPtr form_item_decoder;
 
-int form_get_id(FormDataPtr form) {
-    return form->form_id;
+static bool form_decoders_init(void) {
+    if (!form_decoder) {
+        form_decoder = json_decoder_create("forms", form_field_names, FORM_FIELD_COUNT);
+    }
+    if (!form_item_decoder) {
+        form_item_decoder = json_decoder_create("form items", form_item_names, FORM_ITEM_COUNT);
+    }
+    return form_decoder && form_item_decoder;
 }
 
-void form_free(FormDataPtr form) {
-    free(form);
+static const char *form_text(json_t **fields, enum FormField field, FieldType type, char *scratch) {
+    return json_decoder_text(form_decoder, fields, field, type, scratch);
 }
 
 static FormDataPtr form_from_json(json_t *form_json) {
     FormDataPtr form = form_create();
-    
-    form_set_name(form, json_string_value(json_object_get(form_json, "FormName")));
-    form_set_form_id(form, json_integer_value(json_object_get(form_json, "FormID")));
-    form_set_client_code(form, json_string_value(json_object_get(form_json, "ClientCode")));
-    form_set_client_name(form, json_string_value(json_object_get(form_json, "ClientName")));
-    form_set_date_and_time(form, json_integer_value(json_object_get(form_json, "DateAndTime")));
-    form_set_rep_code(form, json_string_value(json_object_get(form_json, "RepresentativeCode")));
-    form_set_rep_name(form, json_string_value(json_object_get(form_json, "RepresentativeName")));
-    form_set_street_address(form, json_string_value(json_object_get(form_json, "StreetAddress")));
-    form_set_zip(form, json_string_value(json_object_get(form_json, "ZIP")));
-    form_set_zip_ext(form, json_string_value(json_object_get(form_json, "ZIPExt")));
-    form_set_city(form, json_string_value(json_object_get(form_json, "City")));
-    form_set_state(form, json_string_value(json_object_get(form_json, "State")));
-    form_set_country(form, json_string_value(json_object_get(form_json, "Country")));
-    form_set_email(form, json_string_value(json_object_get(form_json, "Email")));
-    form_set_phone(form, json_string_value(json_object_get(form_json, "Phone")));
-    form_set_mobile(form, json_string_value(json_object_get(form_json, "Mobile")));
-    form_set_territory(form, json_string_value(json_object_get(form_json, "Territory")));
-    form_set_longitude(form, json_real_value(json_object_get(form_json, "Longitude")));
-    form_set_latitude(form, json_real_value(json_object_get(form_json, "Latitude")));
-    form_set_signature_url(form, json_string_value(json_object_get(form_json, "SignatureURL")));
-    form_set_visit_start(form, json_integer_value(json_object_get(form_json, "VisitStart")));
-    form_set_visit_end(form, json_integer_value(json_object_get(form_json, "VisitEnd")));
-    form_set_visit_id(form, json_integer_value(json_object_get(form_json, "VisitID")));
-
-    // Parse and add form items
-    json_t *items = json_object_get(form_json, "Item");
+    if (!form) {
+        return NULL;
+    }
+
+    json_t *fields[FORM_FIELD_COUNT];
+    char scratch[JSON_VALUE_SCRATCH_SIZE];
+    json_decoder_decode(form_decoder, form_json, fields);
+
+    form_set_name(form, form_text(fields, FORM_FIELD_NAME, FIELD_TEXT, scratch));
+    form_set_form_id(form, (long)json_integer_value(fields[FORM_FIELD_FORM_ID]));
+    form_set_client_code(form, form_text(fields, FORM_FIELD_CLIENT_CODE, FIELD_TEXT, scratch));
+    form_set_client_name(form, form_text(fields, FORM_FIELD_CLIENT_NAME, FIELD_TEXT, scratch));
+    form_set_date_and_time(form, form_text(fields, FORM_FIELD_DATE_AND_TIME, FIELD_TIMESTAMP, scratch));
+    form_set_rep_code(form, form_text(fields, FORM_FIELD_REP_CODE, FIELD_TEXT, scratch));
+    form_set_rep_name(form, form_text(fields, FORM_FIELD_REP_NAME, FIELD_TEXT, scratch));
+    form_set_street_address(form, form_text(fields, FORM_FIELD_STREET_ADDRESS, FIELD_TEXT, scratch));
+    form_set_zip(form, form_text(fields, FORM_FIELD_ZIP, FIELD_TEXT, scratch));
+    form_set_zip_ext(form, form_text(fields, FORM_FIELD_ZIP_EXT, FIELD_TEXT, scratch));
+    form_set_city(form, form_text(fields, FORM_FIELD_CITY, FIELD_TEXT, scratch));
+    form_set_state(form, form_text(fields, FORM_FIELD_STATE, FIELD_TEXT, scratch));
+    form_set_country(form, form_text(fields, FORM_FIELD_COUNTRY, FIELD_TEXT, scratch));
+    form_set_email(form, form_text(fields, FORM_FIELD_EMAIL, FIELD_TEXT, scratch));
+    form_set_phone(form, form_text(fields, FORM_FIELD_PHONE, FIELD_TEXT, scratch));
+    form_set_mobile(form, form_text(fields, FORM_FIELD_MOBILE, FIELD_TEXT, scratch));
+    form_set_territory(form, form_text(fields, FORM_FIELD_TERRITORY, FIELD_TEXT, scratch));
+    form_set_longitude(form, json_number_value(fields[FORM_FIELD_LONGITUDE]));
+    form_set_latitude(form, json_number_value(fields[FORM_FIELD_LATITUDE]));
+    form_set_signature_url(form, form_text(fields, FORM_FIELD_SIGNATURE_URL, FIELD_TEXT, scratch));
+    form_set_visit_start(form, form_text(fields, FORM_FIELD_VISIT_START, FIELD_TIMESTAMP, scratch));
+    form_set_visit_end(form, form_text(fields, FORM_FIELD_VISIT_END, FIELD_TIMESTAMP, scratch));
+    form_set_visit_id(form, (int)json_integer_value(fields[FORM_FIELD_VISIT_ID]));
+
+    // Parse and add form items. The answers document keeps each value as
+    // Repsly sent it, so numbers and booleans stay typed in the JSONB.
+    json_t *items = fields[FORM_FIELD_ITEMS];
+    json_t *answers = json_object();
     if (json_is_array(items)) {
         size_t item_index;
         json_t *item;
+        json_t *item_fields[FORM_ITEM_COUNT];
         json_array_foreach(items, item_index, item) {
-            const char *field = json_string_value(json_object_get(item, "Field"));
-            const char *value = json_string_value(json_object_get(item, "Value"));
-            form_add_item(form, field, value);
+            json_decoder_decode(form_item_decoder, item, item_fields);
+            const char *field = json_string_value(item_fields[FORM_ITEM_FIELD]);
+            form_add_item(form, field, json_value_text(item_fields[FORM_ITEM_VALUE], FIELD_TEXT, scratch));
+            if (answers && field) {
+                json_object_set(answers, field, item_fields[FORM_ITEM_VALUE] ? item_fields[FORM_ITEM_VALUE] : json_null());
+            }
         }
     }
+    if (answers) {
+        form->answers = json_dumps(answers, JSON_COMPACT);
+        json_decref(answers);
+    }
     
     return form;
 }
 
+// Decoding runs on the shared pool; each task fills its own slot so the page
+// is written back in Repsly's order.
+struct FormDecodeBatch {
+    json_t *records;
+    FormDataPtr *forms;
+};
+
+static void form_decode_task(void *context, size_t index) {
+    struct FormDecodeBatch *batch = (struct FormDecodeBatch *)context;
+    batch->forms[index] = form_from_json(json_array_get(batch->records, index));
+}
+
+// Form answers exported one row per item, flattened with the form header and
+// partitioned by the form's date
+static const ExportColumn form_item_export_columns[] = {
+    {"FormID", FIELD_INTEGER}, {"FormName", FIELD_TEXT}, {"ClientCode", FIELD_TEXT},
+    {"ClientName", FIELD_TEXT}, {"RepresentativeCode", FIELD_TEXT}, {"RepresentativeName", FIELD_TEXT},
+    {"DateAndTime", FIELD_TIMESTAMP}, {"Field", FIELD_TEXT}, {"Value", FIELD_TEXT},
+};
+
+static void form_export(FormDataPtr form) {
+    ExportDatasetPtr dataset = export_dataset_get("form_items", form_item_export_columns,
+                                                  sizeof(form_item_export_columns) / sizeof(ExportColumn));
+    if (!dataset) {
+        return;
+    }
+
+    char form_id[24];
+    snprintf(form_id, sizeof(form_id), "%ld", form->repsly_form_id);
+    const char *date_and_time = form->date_and_time[0] ? form->date_and_time : NULL;
+
+    for (int i = 0; i < form->item_count; i++) {
+        const char *values[] = {
+            form_id, form->name, form->client_code,
+            form->client_name, form->rep_code, form->rep_name,
+            date_and_time, form->items[i].field, form->items[i].value,
+        };
+        if (!export_dataset_append(dataset, date_and_time, form_id, values)) {
+            return;
+        }
+    }
+}
+
 bool form_fetch_and_insert(PGconn *db_conn, long last_form_id) {
     json_t *root = api_fetch_data("forms", last_form_id);
     if (!root) {
         return false;
     }
 
+    bool success = form_load_page(db_conn, root, last_form_id);
+    json_decref(root);
+    return success;
+}
+
+long form_page_cursor(json_t *root, long last_form_id) {
+    long max_form_id = last_form_id;
+    size_t index;
+    json_t *form_json;
+    json_array_foreach(json_object_get(root, "Forms"), index, form_json) {
+        long form_id = (long)json_integer_value(json_object_get(form_json, "FormID"));
+        if (form_id > max_form_id) {
+            max_form_id = form_id;
+        }
+    }
+    return max_form_id;
+}
+
+bool form_load_page(PGconn *db_conn, json_t *root, long last_form_id) {
     json_t *forms = json_object_get(root, "Forms");
     if (!json_is_array(forms)) {
         fprintf(stderr, "JSON root is not an array\n");
-        json_decref(root);
         return false;
     }
 
-    size_t index;
-    json_t *form_json;
-    json_array_foreach(forms, index, form_json) {
-        FormDataPtr form = form_from_json(form_json);
-        
+    if (!form_decoders_init()) {
+        return false;
+    }
+
+    size_t count = json_array_size(forms);
+    struct FormDecodeBatch batch = {forms, calloc(count ? count : 1, sizeof(FormDataPtr))};
+    if (!batch.forms) {
+        fprintf(stderr, "Failed to allocate form batch\n");
+        return false;
+    }
+    thread_pool_run(thread_pool_shared(), count, form_decode_task, &batch);
+
+    form_answers_ensure_indexes(db_conn);
+
+    long max_form_id = last_form_id;
+    for (size_t index = 0; index < count; index++) {
+        FormDataPtr form = batch.forms[index];
+        if (!form) {
+            continue;
+        }
+
         if (!form_insert(db_conn, form)) {
             fprintf(stderr, "Failed to insert form\n");
             form_free(form);
             continue;
         }
 
+        form_export(form);
+
+        const char *questions[MAX_FORM_ITEMS];
+        for (int i = 0; i < form->item_count; i++) {
+            questions[i] = form->items[i].field;
+        }
+        if (!form_answers_note_template(db_conn, form->name, questions, form->item_count)) {
+            fprintf(stderr, "Failed to track form template %s\n", form->name);
+        }
+
+        if (form_get_repsly_id(form) > max_form_id) {
+            max_form_id = form_get_repsly_id(form);
+        }
+
         form_free(form);
     }
 
-    json_decref(root);
+    free(batch.forms);
+
+    if (!form_answers_flush_templates(db_conn)) {
+        fprintf(stderr, "Failed to rebuild form template views\n");
+    }
+
+    // Without this the forms cursor never moves and every run starts over
+    if (max_form_id > last_form_id && !update_last_processed(db_conn, "forms", max_form_id)) {
+        fprintf(stderr, "Failed to update last processed ID for forms\n");
+    }
+
     return true;
-}
\ No newline at end of file
+}
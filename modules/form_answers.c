@@ -0,0 +1,291 @@
+#include "../include/form_answers.h"
+#include "../include/fingerprint.h"
+#include "../include/sql_stats.h"
+#include "../include/sql_text.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FORM_VIEW_SCHEMA "form_templates"
+#define FORM_COLUMN_SIZE 64              // NAMEDATALEN
+#define FORM_COLUMN_PREFIX 46            // what's kept of a long question, before its hash
+
+// Columns each template's view already has, so a view is only rebuilt when a
+// form brings a new question. Views are rebuilt once per page, in
+// form_answers_flush_templates.
+struct FormTemplate {
+    char *name;
+    char **fields;
+    int field_count;
+    bool dirty;
+    struct FormTemplate *next;
+};
+
+static struct FormTemplate *templates;
+static bool indexes_ensured;
+
+bool form_answers_ensure_indexes(PGconn *db_conn) {
+    const char *configured = getenv("REPSLY_FORM_INDEX_FIELDS");
+    if (indexes_ensured || !configured || !*configured) {
+        return true;
+    }
+
+    char *fields = strdup(configured);
+    if (!fields) {
+        return false;
+    }
+
+    bool success = true;
+    char *saveptr;
+    for (char *field = strtok_r(fields, ",", &saveptr); field; field = strtok_r(NULL, ",", &saveptr)) {
+        while (*field == ' ') {
+            field++;
+        }
+        size_t len = strlen(field);
+        while (len > 0 && field[len - 1] == ' ') {
+            field[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+
+        // Questions can be long and contain anything, so the index is named
+        // after a hash of the question instead
+        char index_name[48];
+        snprintf(index_name, sizeof(index_name), "idx_forms_answer_%016llx",
+                 (unsigned long long)fingerprint_add_str(fingerprint_init(), field));
+
+        struct SqlText sql = {0};
+        sql_append(&sql, "CREATE INDEX IF NOT EXISTS ");
+        sql_append(&sql, index_name);
+        sql_append(&sql, " ON field_ops.forms ((answers ->> ");
+        sql_append_escaped(&sql, db_conn, field, false);
+        sql_append(&sql, "))");
+
+        success = !sql.failed && sql_run(db_conn, "form answer index", sql.data) && success;
+        free(sql.data);
+    }
+
+    free(fields);
+    indexes_ensured = success;
+    return success;
+}
+
+static bool form_tables_enabled(void) {
+    const char *enabled = getenv("REPSLY_FORM_TEMPLATES");
+    return enabled && *enabled && strcmp(enabled, "0") != 0;
+}
+
+static struct FormTemplate *template_find(const char *name) {
+    for (struct FormTemplate *t = templates; t; t = t->next) {
+        if (strcmp(t->name, name) == 0) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// A question's column in its view. Questions that would be truncated, that
+// are empty, or that clash with the view's own columns get a prefix of the
+// question and a hash of all of it instead, which stays unique and within
+// the 63 bytes Postgres keeps of an identifier.
+static void template_column_name(const char *question, char *column) {
+    static const char *const reserved[] = {"form_id", "FormID", "visit_id", "date_time"};
+
+    size_t length = strlen(question);
+    bool usable = length > 0 && length < FORM_COLUMN_SIZE;
+    for (size_t i = 0; i < sizeof(reserved) / sizeof(reserved[0]) && usable; i++) {
+        usable = strcmp(question, reserved[i]) != 0;
+    }
+    if (usable) {
+        memcpy(column, question, length + 1);
+        return;
+    }
+
+    // Cut on a UTF-8 character boundary
+    size_t prefix = length < FORM_COLUMN_PREFIX ? length : FORM_COLUMN_PREFIX;
+    while (prefix > 0 && prefix < length && ((unsigned char)question[prefix] & 0xC0) == 0x80) {
+        prefix--;
+    }
+    snprintf(column, FORM_COLUMN_SIZE, "%.*s_%016llx", (int)prefix, question,
+             (unsigned long long)fingerprint_add_str(fingerprint_init(), question));
+}
+
+static bool template_has_field(const struct FormTemplate *t, const char *field) {
+    char column[FORM_COLUMN_SIZE];
+    template_column_name(field, column);
+    for (int i = 0; i < t->field_count; i++) {
+        if (strcmp(t->fields[i], column) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void template_clear_fields(struct FormTemplate *t) {
+    for (int i = 0; i < t->field_count; i++) {
+        free(t->fields[i]);
+    }
+    free(t->fields);
+    t->fields = NULL;
+    t->field_count = 0;
+}
+
+// Reads the columns of a view, either the one already in the database or the
+// answer keys across all stored forms, which are turned into column names.
+static bool template_load_fields(struct FormTemplate *t, PGresult *result, bool questions) {
+    template_clear_fields(t);
+
+    int rows = PQntuples(result);
+    t->fields = calloc(rows > 0 ? rows : 1, sizeof(char *));
+    if (!t->fields) {
+        return false;
+    }
+    for (int row = 0; row < rows; row++) {
+        char column[FORM_COLUMN_SIZE];
+        if (questions) {
+            template_column_name(PQgetvalue(result, row, 0), column);
+        }
+        t->fields[row] = strdup(questions ? column : PQgetvalue(result, row, 0));
+        if (!t->fields[row]) {
+            return false;
+        }
+        t->field_count++;
+    }
+    return true;
+}
+
+static bool template_read_view(PGconn *db_conn, struct FormTemplate *t) {
+    const char *query =
+        "SELECT column_name FROM information_schema.columns "
+        "WHERE table_schema = '" FORM_VIEW_SCHEMA "' AND table_name = $1";
+    const char *param_values[] = { t->name };
+
+    PGresult *result = sql_exec_params(db_conn, __func__, query, 1, param_values, NULL, NULL);
+    bool success = PQresultStatus(result) == PGRES_TUPLES_OK && template_load_fields(t, result, false);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Reading form template view %s failed: %s", t->name, PQerrorMessage(db_conn));
+    }
+    PQclear(result);
+    return success;
+}
+
+// A question becomes a numeric or boolean column only if every stored answer
+// to it reads as one; anything else stays text. The casts are guarded, so an
+// answer written after the view that doesn't fit its column reads as NULL
+// instead of breaking every query on the view.
+static bool template_rebuild_view(PGconn *db_conn, struct FormTemplate *t) {
+    const char *query =
+        "SELECT key, CASE "
+        "WHEN bool_and(value #>> '{}' ~ '^-?[0-9]+(\\.[0-9]+)?$') THEN 'numeric' "
+        "WHEN bool_and(value #>> '{}' IN ('true', 'false')) THEN 'boolean' "
+        "ELSE 'text' END "
+        "FROM field_ops.forms, jsonb_each(answers) "
+        "WHERE name = $1 AND jsonb_typeof(value) <> 'null' "
+        "GROUP BY key ORDER BY key";
+    const char *param_values[] = { t->name };
+
+    PGresult *result = sql_exec_params(db_conn, __func__, query, 1, param_values, NULL, NULL);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Reading answers of form template %s failed: %s", t->name, PQerrorMessage(db_conn));
+        PQclear(result);
+        return false;
+    }
+
+    struct SqlText sql = {0};
+    sql_append(&sql, "BEGIN; DROP VIEW IF EXISTS " FORM_VIEW_SCHEMA ".");
+    sql_append_escaped(&sql, db_conn, t->name, true);
+    sql_append(&sql, "; CREATE VIEW " FORM_VIEW_SCHEMA ".");
+    sql_append_escaped(&sql, db_conn, t->name, true);
+    sql_append(&sql, " AS SELECT form_id, repsly_id AS \"FormID\", visit_id, date_time");
+
+    int rows = PQntuples(result);
+    for (int row = 0; row < rows; row++) {
+        const char *key = PQgetvalue(result, row, 0);
+        const char *type = PQgetvalue(result, row, 1);
+        char column[FORM_COLUMN_SIZE];
+        template_column_name(key, column);
+
+        if (strcmp(type, "text") == 0) {
+            sql_append(&sql, ", answers ->> ");
+            sql_append_escaped(&sql, db_conn, key, false);
+        } else {
+            sql_append(&sql, ", CASE WHEN answers ->> ");
+            sql_append_escaped(&sql, db_conn, key, false);
+            sql_append(&sql, strcmp(type, "numeric") == 0 ? " ~ '^-?[0-9]+(\\.[0-9]+)?$'" : " IN ('true', 'false')");
+            sql_append(&sql, " THEN (answers ->> ");
+            sql_append_escaped(&sql, db_conn, key, false);
+            sql_append(&sql, ")::");
+            sql_append(&sql, type);
+            sql_append(&sql, " END");
+        }
+        sql_append(&sql, " AS ");
+        sql_append_escaped(&sql, db_conn, column, true);
+    }
+    sql_append(&sql, " FROM field_ops.forms WHERE name = ");
+    sql_append_escaped(&sql, db_conn, t->name, false);
+    sql_append(&sql, "; COMMIT");
+
+    bool success = !sql.failed && sql_run(db_conn, "form template view", sql.data);
+    if (!success && PQtransactionStatus(db_conn) != PQTRANS_IDLE) {
+        sql_run(db_conn, "ROLLBACK", "ROLLBACK");
+    }
+    if (success) {
+        success = template_load_fields(t, result, true);
+    }
+
+    free(sql.data);
+    PQclear(result);
+    return success;
+}
+
+bool form_answers_note_template(PGconn *db_conn, const char *template_name, const char *const *fields,
+                                int field_count) {
+    if (!template_name || !*template_name || !form_tables_enabled()) {
+        return true;
+    }
+
+    struct FormTemplate *t = template_find(template_name);
+    if (!t) {
+        t = calloc(1, sizeof(struct FormTemplate));
+        if (!t || !(t->name = strdup(template_name))) {
+            free(t);
+            return false;
+        }
+        if (!sql_run(db_conn, "form template schema", "CREATE SCHEMA IF NOT EXISTS " FORM_VIEW_SCHEMA) || !template_read_view(db_conn, t)) {
+            template_clear_fields(t);
+            free(t->name);
+            free(t);
+            return false;
+        }
+        t->next = templates;
+        templates = t;
+    }
+
+    for (int i = 0; i < field_count && !t->dirty; i++) {
+        t->dirty = !template_has_field(t, fields[i]);
+    }
+    return true;
+}
+
+bool form_answers_flush_templates(PGconn *db_conn) {
+    bool success = true;
+    for (struct FormTemplate *t = templates; t; t = t->next) {
+        if (t->dirty && template_rebuild_view(db_conn, t)) {
+            t->dirty = false;
+        }
+        success = success && !t->dirty;
+    }
+    return success;
+}
+
+void form_answers_forget(void) {
+    while (templates) {
+        struct FormTemplate *t = templates;
+        templates = t->next;
+        template_clear_fields(t);
+        free(t->name);
+        free(t);
+    }
+    indexes_ensured = false;
+}
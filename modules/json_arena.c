@@ -0,0 +1,202 @@
+#include "../include/json_arena.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define ARENA_CHUNK_SIZE (2UL << 20)              // one huge page
+#define ARENA_CHUNK_COUNT 2048                    // 4 GB of address space, committed only as used
+#define ARENA_ALIGNMENT 16
+#define ARENA_LARGE_ALLOCATION (ARENA_CHUNK_SIZE / 8)
+#define ARENA_RESIDENT_CHUNKS 16
+#define ARENA_HUGE_PAGE_BYTES (1UL << 20)
+
+struct JsonArena {
+    char *cursor;
+    char *limit;
+    int chunks;            // newest chunk; chunk_next links the older ones
+    bool huge;
+    long allocated;        // only the parsing thread touches this
+    atomic_long freed;
+    atomic_long expected;  // allocated, once parsing is over
+    atomic_bool recycled;
+};
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static bool arena_enabled;
+static char *region;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static int chunk_next[ARENA_CHUNK_COUNT];   // free list or arena chain, whichever the chunk is on
+static bool chunk_huge[ARENA_CHUNK_COUNT];
+static int resident_chunks = -1;
+static int resident_count;
+static int released_chunks = -1;            // never touched, or handed back to the kernel
+
+static _Thread_local struct JsonArena *current_arena;
+
+static char *chunk_base(int chunk) {
+    return region + (size_t)chunk * ARENA_CHUNK_SIZE;
+}
+
+static int arena_take_chunk(void) {
+    pthread_mutex_lock(&pool_lock);
+    int chunk = resident_chunks;
+    if (chunk >= 0) {
+        resident_chunks = chunk_next[chunk];
+        resident_count--;
+    } else if ((chunk = released_chunks) >= 0) {
+        released_chunks = chunk_next[chunk];
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return chunk;
+}
+
+static void arena_recycle(struct JsonArena *arena) {
+    if (atomic_exchange(&arena->recycled, true)) {
+        return;
+    }
+
+    // The arena lives in one of these chunks, so nothing reads it past here
+    int chunk = arena->chunks;
+    pthread_mutex_lock(&pool_lock);
+    while (chunk >= 0) {
+        int next = chunk_next[chunk];
+        if (resident_count < ARENA_RESIDENT_CHUNKS) {
+            chunk_next[chunk] = resident_chunks;
+            resident_chunks = chunk;
+            resident_count++;
+        } else {
+            madvise(chunk_base(chunk), ARENA_CHUNK_SIZE, MADV_DONTNEED);
+            chunk_next[chunk] = released_chunks;
+            released_chunks = chunk;
+        }
+        chunk = next;
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// Every chunk starts with a pointer to its arena, padded to ARENA_ALIGNMENT
+static void arena_attach(struct JsonArena *arena, int chunk, size_t used) {
+    char *base = chunk_base(chunk);
+#ifdef MADV_HUGEPAGE
+    if (arena->huge && !chunk_huge[chunk]) {
+        madvise(base, ARENA_CHUNK_SIZE, MADV_HUGEPAGE);
+        chunk_huge[chunk] = true;
+    }
+#endif
+    *(struct JsonArena **)base = arena;
+    chunk_next[chunk] = arena->chunks;
+    arena->chunks = chunk;
+    arena->cursor = base + used;
+    arena->limit = base + ARENA_CHUNK_SIZE;
+}
+
+static struct JsonArena *arena_create(bool huge) {
+    int chunk = arena_take_chunk();
+    if (chunk < 0) {
+        return NULL;
+    }
+
+    struct JsonArena *arena = (struct JsonArena *)(chunk_base(chunk) + ARENA_ALIGNMENT);
+    arena->chunks = -1;
+    arena->huge = huge;
+    arena->allocated = 0;
+    atomic_init(&arena->freed, 0);
+    atomic_init(&arena->expected, -1);
+    atomic_init(&arena->recycled, false);
+
+    size_t header = (sizeof(struct JsonArena) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    arena_attach(arena, chunk, ARENA_ALIGNMENT + header);
+    return arena;
+}
+
+// Whichever of the last free and the end of parsing comes second hands the
+// chunks back
+static void arena_seal(struct JsonArena *arena) {
+    atomic_store(&arena->expected, arena->allocated);
+    if (atomic_load(&arena->freed) == arena->allocated) {
+        arena_recycle(arena);
+    }
+}
+
+static void *arena_malloc(size_t size) {
+    struct JsonArena *arena = current_arena;
+    if (!arena || size > ARENA_LARGE_ALLOCATION) {
+        return malloc(size);
+    }
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if ((size_t)(arena->limit - arena->cursor) < size) {
+        int chunk = arena_take_chunk();
+        if (chunk < 0) {
+            return malloc(size);
+        }
+        arena_attach(arena, chunk, ARENA_ALIGNMENT);
+    }
+
+    void *block = arena->cursor;
+    arena->cursor += size;
+    arena->allocated++;
+    return block;
+}
+
+static void arena_free(void *block) {
+    uintptr_t address = (uintptr_t)block;
+    uintptr_t start = (uintptr_t)region;
+    if (!region || address < start || address >= start + ARENA_CHUNK_COUNT * ARENA_CHUNK_SIZE) {
+        free(block);
+        return;
+    }
+
+    struct JsonArena *arena = *(struct JsonArena **)(start + ((address - start) & ~(ARENA_CHUNK_SIZE - 1)));
+    if (atomic_fetch_add(&arena->freed, 1) + 1 == atomic_load(&arena->expected)) {
+        arena_recycle(arena);
+    }
+}
+
+// Installed on first use. Values allocated before then were malloc'ed, and
+// arena_free passes anything outside the region to free, so either set of
+// functions can release what the other allocated.
+static void arena_init(void) {
+    const char *enabled = getenv("REPSLY_JSON_ARENA");
+    if (enabled && strcmp(enabled, "0") == 0) {
+        return;
+    }
+
+    // Reserved one chunk over so the region can start on a chunk boundary
+    size_t size = ARENA_CHUNK_COUNT * ARENA_CHUNK_SIZE + ARENA_CHUNK_SIZE;
+    void *reserved = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+        fprintf(stderr, "Failed to reserve JSON arena, parsing with malloc\n");
+        return;
+    }
+    region = (char *)(((uintptr_t)reserved + ARENA_CHUNK_SIZE - 1) & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1));
+
+    for (int chunk = ARENA_CHUNK_COUNT - 1; chunk >= 0; chunk--) {
+        chunk_next[chunk] = released_chunks;
+        released_chunks = chunk;
+    }
+    json_set_alloc_funcs(arena_malloc, arena_free);
+    arena_enabled = true;
+}
+
+json_t *json_arena_load(const char *text, size_t length, json_error_t *error) {
+    pthread_once(&arena_once, arena_init);
+    struct JsonArena *arena = arena_enabled ? arena_create(length >= ARENA_HUGE_PAGE_BYTES) : NULL;
+    if (!arena) {
+        return json_loadb(text, length, 0, error);
+    }
+
+    struct JsonArena *outer = current_arena;
+    current_arena = arena;
+    json_t *root = json_loadb(text, length, 0, error);
+    current_arena = outer;
+
+    arena_seal(arena);
+    return root;
+}
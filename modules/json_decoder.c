@@ -0,0 +1,207 @@
+#include "../include/json_decoder.h"
+#include "../include/temporal.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define MAX_SEED_ATTEMPTS 4096
+#define MAX_LOGGED_REJECTS 10       // per decoder; later ones are only counted
+
+struct JsonDecoder {
+    const char *name;
+    const char *const *field_names;
+    int field_count;
+    uint32_t seed;
+    size_t mask;
+    int *table;            // perfect hash slot -> field index, -1 when empty
+    atomic_long unknown_fields;
+    atomic_long rejected_values;
+};
+
+static uint32_t field_hash(const char *key, size_t length, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    const unsigned char *p = (const unsigned char *)key;
+    for (size_t i = 0; i < length; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    // FNV's low bits mix poorly on short keys; fold the high half back in
+    return h ^ (h >> 15);
+}
+
+// Searches for a seed under which every field name lands in its own slot.
+// The table starts at twice the field count and doubles if no seed works.
+static bool build_perfect_hash(JsonDecoderPtr decoder) {
+    size_t size = 8;
+    while (size < (size_t)decoder->field_count * 2) {
+        size <<= 1;
+    }
+
+    for (; size <= (size_t)decoder->field_count * 64; size <<= 1) {
+        int *table = malloc(size * sizeof(int));
+        if (!table) {
+            return false;
+        }
+
+        for (uint32_t seed = 1; seed <= MAX_SEED_ATTEMPTS; seed++) {
+            memset(table, -1, size * sizeof(int));
+
+            bool collision = false;
+            for (int i = 0; i < decoder->field_count && !collision; i++) {
+                const char *name = decoder->field_names[i];
+                size_t slot = field_hash(name, strlen(name), seed) & (size - 1);
+                collision = table[slot] >= 0;
+                table[slot] = i;
+            }
+
+            if (!collision) {
+                decoder->seed = seed;
+                decoder->mask = size - 1;
+                decoder->table = table;
+                return true;
+            }
+        }
+
+        free(table);
+    }
+
+    return false;
+}
+
+JsonDecoderPtr json_decoder_create(const char *name, const char *const *field_names, int field_count) {
+    JsonDecoderPtr decoder = calloc(1, sizeof(struct JsonDecoder));
+    if (!decoder) {
+        return NULL;
+    }
+
+    decoder->name = name;
+    decoder->field_names = field_names;
+    decoder->field_count = field_count;
+    atomic_init(&decoder->unknown_fields, 0);
+    atomic_init(&decoder->rejected_values, 0);
+
+    if (!build_perfect_hash(decoder)) {
+        fprintf(stderr, "Failed to build a perfect hash for %d fields\n", field_count);
+        free(decoder);
+        return NULL;
+    }
+
+    return decoder;
+}
+
+void json_decoder_free(JsonDecoderPtr decoder) {
+    if (decoder) {
+        free(decoder->table);
+        free(decoder);
+    }
+}
+
+int json_decoder_field_count(JsonDecoderPtr decoder) {
+    return decoder->field_count;
+}
+
+int json_decoder_lookup(JsonDecoderPtr decoder, const char *key, size_t length) {
+    int field = decoder->table[field_hash(key, length, decoder->seed) & decoder->mask];
+    if (field < 0) {
+        return -1;
+    }
+    const char *name = decoder->field_names[field];
+    return strncmp(name, key, length) == 0 && name[length] == '\0' ? field : -1;
+}
+
+void json_decoder_add_unknown(JsonDecoderPtr decoder, int unknown) {
+    if (unknown) {
+        atomic_fetch_add_explicit(&decoder->unknown_fields, unknown, memory_order_relaxed);
+    }
+}
+
+int json_decoder_decode(JsonDecoderPtr decoder, json_t *object, json_t **slots) {
+    memset(slots, 0, decoder->field_count * sizeof(json_t *));
+    if (!json_is_object(object)) {
+        return 0;
+    }
+
+    int unknown = 0;
+    const char *key;
+    json_t *value;
+    json_object_foreach(object, key, value) {
+        int field = json_decoder_lookup(decoder, key, strlen(key));
+        if (field >= 0) {
+            slots[field] = value;
+        } else {
+            unknown++;
+        }
+    }
+
+    json_decoder_add_unknown(decoder, unknown);
+    return unknown;
+}
+
+long json_decoder_unknown_count(JsonDecoderPtr decoder) {
+    return atomic_load_explicit(&decoder->unknown_fields, memory_order_relaxed);
+}
+
+const char *json_decoder_text(JsonDecoderPtr decoder, json_t **slots, int field, FieldType type, char *scratch) {
+    json_t *value = slots[field];
+    const char *text = json_value_text(value, type, scratch);
+    if (text || !value || json_is_null(value) || (type != FIELD_TIMESTAMP && type != FIELD_DATE)) {
+        return text;
+    }
+
+    long rejected = atomic_fetch_add_explicit(&decoder->rejected_values, 1, memory_order_relaxed) + 1;
+    if (rejected <= MAX_LOGGED_REJECTS) {
+        char *raw = json_dumps(value, JSON_ENCODE_ANY);
+        fprintf(stderr, "%s: malformed %s %s written as NULL%s\n", decoder->name, decoder->field_names[field],
+                raw ? raw : "?", rejected == MAX_LOGGED_REJECTS ? " (further ones are only counted)" : "");
+        free(raw);
+    }
+    return NULL;
+}
+
+long json_decoder_rejected_count(JsonDecoderPtr decoder) {
+    return atomic_load_explicit(&decoder->rejected_values, memory_order_relaxed);
+}
+
+
+// Value rendering
+
+// Dates are decoded natively (see temporal.h) and rewritten in the form
+// Postgres prints them, so a malformed one is dropped here instead of failing
+// the statement it would have been bound to; json_decoder_text reports it
+static const char *temporal_text(json_t *value, FieldType type, char *scratch) {
+    int64_t decoded;
+    if (!temporal_decode(value, type, &decoded)) {
+        return NULL;
+    }
+    return temporal_format(decoded, type, scratch);
+}
+
+const char *json_value_text(json_t *value, FieldType type, char *scratch) {
+    if (!value || json_is_null(value)) {
+        return NULL;
+    }
+
+    if (type == FIELD_TIMESTAMP || type == FIELD_DATE) {
+        return temporal_text(value, type, scratch);
+    }
+
+    if (json_is_string(value)) {
+        return json_string_value(value);
+    }
+    if (json_is_integer(value)) {
+        snprintf(scratch, JSON_VALUE_SCRATCH_SIZE, "%lld", (long long)json_integer_value(value));
+        return scratch;
+    }
+    if (json_is_real(value)) {
+        snprintf(scratch, JSON_VALUE_SCRATCH_SIZE, type == FIELD_INTEGER ? "%.0f" : "%.17g", json_real_value(value));
+        return scratch;
+    }
+    if (json_is_boolean(value)) {
+        return json_is_true(value) ? "true" : "false";
+    }
+
+    return NULL;
+}
@@ -0,0 +1,599 @@
+#include "../include/json_scan.h"
+#include "../include/temporal.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define SCAN_BLOCK 64
+
+struct JsonScan {
+    char *text;
+    size_t length;
+    uint32_t *positions;   // index of structurals, strings and scalars; positions[count] = length
+    uint32_t *skip;        // index entry just past each value
+    int count;
+};
+
+// One 64-byte block, a bit per byte
+struct BlockMasks {
+    uint64_t backslash;
+    uint64_t quote;
+    uint64_t whitespace;
+    uint64_t structural;   // { } [ ] : ,
+};
+
+// What carries from one block into the next
+struct ScanState {
+    uint64_t escaped;      // the first byte of the next block is escaped
+    uint64_t in_string;    // all ones while inside a string
+    uint64_t scalar;       // the previous block ended in a scalar
+};
+
+typedef void (*ClassifyFunc)(const uint8_t *block, struct BlockMasks *masks);
+typedef uint64_t (*PrefixXorFunc)(uint64_t bits);
+
+#if !defined(__x86_64__)
+static void classify_scalar(const uint8_t *block, struct BlockMasks *masks) {
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < SCAN_BLOCK; i++) {
+        uint64_t bit = 1ULL << i;
+        uint8_t c = block[i];
+        if (c == '\\') {
+            masks->backslash |= bit;
+        } else if (c == '"') {
+            masks->quote |= bit;
+        } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            masks->whitespace |= bit;
+        } else if ((c | 0x20) == '{' || (c | 0x20) == '}' || c == ':' || c == ',') {
+            masks->structural |= bit;
+        }
+    }
+}
+#endif
+
+// Running XOR from the low bit up: set from each opening quote up to (not
+// including) its closing one
+static uint64_t prefix_xor_scalar(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+#if defined(__x86_64__)
+// SSE2 is part of x86-64, so this needs no check
+static void classify_sse2(const uint8_t *block, struct BlockMasks *masks) {
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i carriage = _mm_set1_epi8('\r');
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i comma = _mm_set1_epi8(',');
+
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < SCAN_BLOCK; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(block + i));
+        __m128i folded = _mm_or_si128(chunk, lower);
+        __m128i white = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(chunk, newline), _mm_cmpeq_epi8(chunk, carriage)));
+        __m128i structural = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close)),
+                                          _mm_or_si128(_mm_cmpeq_epi8(chunk, colon), _mm_cmpeq_epi8(chunk, comma)));
+
+        masks->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, backslash)) << i;
+        masks->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, quote)) << i;
+        masks->whitespace |= (uint64_t)(uint16_t)_mm_movemask_epi8(white) << i;
+        masks->structural |= (uint64_t)(uint16_t)_mm_movemask_epi8(structural) << i;
+    }
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const uint8_t *block, struct BlockMasks *masks) {
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i carriage = _mm256_set1_epi8('\r');
+    const __m256i lower = _mm256_set1_epi8(0x20);
+    const __m256i open = _mm256_set1_epi8('{');
+    const __m256i close = _mm256_set1_epi8('}');
+    const __m256i colon = _mm256_set1_epi8(':');
+    const __m256i comma = _mm256_set1_epi8(',');
+
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < SCAN_BLOCK; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(block + i));
+        __m256i folded = _mm256_or_si256(chunk, lower);
+        __m256i white = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space), _mm256_cmpeq_epi8(chunk, tab)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, newline), _mm256_cmpeq_epi8(chunk, carriage)));
+        __m256i structural = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(folded, open), _mm256_cmpeq_epi8(folded, close)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, colon), _mm256_cmpeq_epi8(chunk, comma)));
+
+        masks->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, backslash)) << i;
+        masks->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, quote)) << i;
+        masks->whitespace |= (uint64_t)(uint32_t)_mm256_movemask_epi8(white) << i;
+        masks->structural |= (uint64_t)(uint32_t)_mm256_movemask_epi8(structural) << i;
+    }
+}
+
+// Carry-less multiply by all ones is the same running XOR in one instruction
+__attribute__((target("pclmul")))
+static uint64_t prefix_xor_clmul(uint64_t bits) {
+    __m128i product = _mm_clmulepi64_si128(_mm_set_epi64x(0, (long long)bits), _mm_set1_epi8((char)0xFF), 0);
+    return (uint64_t)_mm_cvtsi128_si64(product);
+}
+#endif
+
+// Bytes escaped by a backslash: the byte after each odd-length run of
+// backslashes. Runs are told apart by whether they start on an even or an
+// odd bit, with the carry of one addition per block doing the counting.
+static inline uint64_t escaped_bytes(uint64_t backslash, struct ScanState *state) {
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    backslash &= ~state->escaped;
+    uint64_t follows_escape = backslash << 1 | state->escaped;
+    uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    unsigned long long even_sequences;
+    state->escaped = __builtin_uaddll_overflow(odd_starts, backslash, &even_sequences);
+    uint64_t invert = (uint64_t)even_sequences << 1;
+    return (even_bits ^ invert) & follows_escape;
+}
+
+static bool scan_reserve(struct JsonScan *scan, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return true;
+    }
+    size_t grown = *capacity * 2 > needed ? *capacity * 2 : needed;
+    uint32_t *positions = realloc(scan->positions, grown * sizeof(uint32_t));
+    if (!positions) {
+        return false;
+    }
+    scan->positions = positions;
+    *capacity = grown;
+    return true;
+}
+
+// Stage one: the index. Opening quotes stand for their strings and the
+// first byte of each number or literal for the scalar; everything inside
+// strings is masked out.
+static inline __attribute__((always_inline))
+bool scan_index(struct JsonScan *scan, ClassifyFunc classify, PrefixXorFunc prefix_xor) {
+    size_t capacity = scan->length / 8 + SCAN_BLOCK + 1;
+    scan->positions = malloc(capacity * sizeof(uint32_t));
+    if (!scan->positions) {
+        return false;
+    }
+
+    const uint8_t *text = (const uint8_t *)scan->text;
+    struct ScanState state = {0, 0, 0};
+    uint8_t tail[SCAN_BLOCK];
+    size_t count = 0;
+
+    for (size_t offset = 0; offset < scan->length; offset += SCAN_BLOCK) {
+        const uint8_t *block = text + offset;
+        if (scan->length - offset < SCAN_BLOCK) {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, block, scan->length - offset);
+            block = tail;
+        }
+
+        struct BlockMasks masks;
+        classify(block, &masks);
+
+        uint64_t quote = masks.quote & ~escaped_bytes(masks.backslash, &state);
+        uint64_t in_string = prefix_xor(quote) ^ state.in_string;
+        state.in_string = (uint64_t)((int64_t)in_string >> 63);
+
+        uint64_t scalar = ~(masks.structural | masks.whitespace | quote);
+        uint64_t scalar_starts = scalar & ~(scalar << 1 | state.scalar);
+        state.scalar = scalar >> 63;
+
+        // Interiors and closing quotes
+        uint64_t string_tail = in_string ^ quote;
+        uint64_t bits = (masks.structural | scalar_starts | quote) & ~string_tail;
+
+        if (!scan_reserve(scan, &capacity, count + SCAN_BLOCK + 1)) {
+            return false;
+        }
+        while (bits) {
+            scan->positions[count++] = (uint32_t)(offset + (size_t)__builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+    }
+
+    if (state.in_string) {
+        fprintf(stderr, "JSON scan: unterminated string\n");
+        return false;
+    }
+    scan->positions[count] = (uint32_t)scan->length;
+    scan->count = (int)count;
+    return true;
+}
+
+#if defined(__x86_64__)
+static bool scan_index_sse2(struct JsonScan *scan) {
+    return scan_index(scan, classify_sse2, prefix_xor_scalar);
+}
+
+__attribute__((target("avx2,pclmul")))
+static bool scan_index_avx2(struct JsonScan *scan) {
+    return scan_index(scan, classify_avx2, prefix_xor_clmul);
+}
+#endif
+
+static bool scan_build_index(struct JsonScan *scan) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("pclmul")) {
+        return scan_index_avx2(scan);
+    }
+    return scan_index_sse2(scan);
+#else
+    return scan_index(scan, classify_scalar, prefix_xor_scalar);
+#endif
+}
+
+static char scan_char(const struct JsonScan *scan, int index) {
+    return scan->text[scan->positions[index]];
+}
+
+// Stage two: pairs each bracket with its match, so a value of any size is
+// stepped over in one lookup
+static bool scan_nest(struct JsonScan *scan) {
+    scan->skip = malloc(((size_t)scan->count + 1) * sizeof(uint32_t));
+    int *open = malloc(((size_t)scan->count + 1) * sizeof(int));
+    if (!scan->skip || !open) {
+        free(open);
+        return false;
+    }
+
+    int depth = 0;
+    bool nested = true;
+    for (int i = 0; i < scan->count && nested; i++) {
+        char c = scan_char(scan, i);
+        scan->skip[i] = (uint32_t)i + 1;
+        if (c == '{' || c == '[') {
+            open[depth++] = i;
+        } else if (c == '}' || c == ']') {
+            nested = depth > 0 && scan_char(scan, open[depth - 1]) == (c == '}' ? '{' : '[');
+            if (nested) {
+                scan->skip[open[--depth]] = (uint32_t)i + 1;
+            }
+        }
+    }
+    free(open);
+
+    if (!nested || depth != 0 || scan->count == 0 || scan->skip[0] != (uint32_t)scan->count) {
+        fprintf(stderr, "JSON scan: brackets don't nest into one value\n");
+        return false;
+    }
+    scan->skip[scan->count] = (uint32_t)scan->count;
+    return true;
+}
+
+JsonScanPtr json_scan_create(char *text, size_t length) {
+    if (!text || length >= UINT32_MAX) {
+        return NULL;
+    }
+    JsonScanPtr scan = calloc(1, sizeof(struct JsonScan));
+    if (!scan) {
+        return NULL;
+    }
+    scan->text = text;
+    scan->length = length;
+
+    if (!scan_build_index(scan) || !scan_nest(scan)) {
+        json_scan_free(scan);
+        return NULL;
+    }
+    return scan;
+}
+
+void json_scan_free(JsonScanPtr scan) {
+    if (!scan) {
+        return;
+    }
+    free(scan->positions);
+    free(scan->skip);
+    free(scan);
+}
+
+int json_scan_root(JsonScanPtr scan) {
+    return scan->count > 0 ? 0 : -1;
+}
+
+static bool is_value_start(char c) {
+    return c != ',' && c != ':' && c != '}' && c != ']' && c != '\0';
+}
+
+int json_scan_first(JsonScanPtr scan, int container) {
+    if (container < 0 || container >= scan->count) {
+        return -1;
+    }
+    char c = scan_char(scan, container);
+    if ((c != '{' && c != '[') || (int)scan->skip[container] == container + 2) {
+        return -1;
+    }
+    return container + 1;
+}
+
+int json_scan_value(JsonScanPtr scan, int key) {
+    if (key < 0 || key + 2 >= scan->count || scan_char(scan, key) != '"' || scan_char(scan, key + 1) != ':'
+        || !is_value_start(scan_char(scan, key + 2))) {
+        return -1;
+    }
+    return key + 2;
+}
+
+int json_scan_next(JsonScanPtr scan, int item) {
+    if (item < 0 || item >= scan->count) {
+        return -1;
+    }
+    int value = scan_char(scan, item + 1) == ':' ? json_scan_value(scan, item) : item;
+    if (value < 0) {
+        return -1;
+    }
+    int after = (int)scan->skip[value];
+    if (after >= scan->count || scan_char(scan, after) != ',' || after + 1 >= scan->count) {
+        return -1;
+    }
+    return after + 1;
+}
+
+size_t json_scan_count(JsonScanPtr scan, int container) {
+    size_t count = 0;
+    for (int item = json_scan_first(scan, container); item >= 0; item = json_scan_next(scan, item)) {
+        count++;
+    }
+    return count;
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+JsonView json_scan_view(JsonScanPtr scan, int value) {
+    JsonView view = {NULL, 0, 0, -1};
+    if (value < 0 || value >= scan->count) {
+        return view;
+    }
+
+    size_t start = scan->positions[value];
+    char c = scan->text[start];
+    if (!is_value_start(c)) {
+        return view;
+    }
+
+    if (c == '{' || c == '[') {
+        view.data = scan->text + start;
+        view.length = scan->positions[scan->skip[value] - 1] - start + 1;
+        view.kind = c;
+        view.index = value;
+        return view;
+    }
+
+    // Only whitespace separates a value from the index entry after it; a
+    // string already rendered ends in a NUL where its closing quote was
+    size_t end = scan->positions[value + 1];
+    while (end > start + 1 && is_space(scan->text[end - 1])) {
+        end--;
+    }
+    if (c == '"') {
+        if (end < start + 2 || (scan->text[end - 1] != '"' && scan->text[end - 1] != '\0')) {
+            return view;
+        }
+        view.data = scan->text + start + 1;
+        view.length = end - start - 2;
+    } else {
+        view.data = scan->text + start;
+        view.length = end - start;
+    }
+    view.kind = c;
+    view.index = value;
+    return view;
+}
+
+int json_scan_member(JsonScanPtr scan, int object, const char *key) {
+    if (object < 0 || scan_char(scan, object) != '{') {
+        return -1;
+    }
+    size_t key_length = strlen(key);
+    for (int item = json_scan_first(scan, object); item >= 0; item = json_scan_next(scan, item)) {
+        JsonView name = json_scan_view(scan, item);
+        if (name.kind == '"' && name.length == key_length && memcmp(name.data, key, key_length) == 0) {
+            return json_scan_value(scan, item);
+        }
+    }
+    return -1;
+}
+
+int json_scan_decode(JsonScanPtr scan, int object, JsonDecoderPtr decoder, JsonView *slots) {
+    for (int i = 0; i < json_decoder_field_count(decoder); i++) {
+        slots[i] = json_scan_view(scan, -1);
+    }
+    if (object < 0 || scan_char(scan, object) != '{') {
+        return 0;
+    }
+
+    int unknown = 0;
+    for (int item = json_scan_first(scan, object); item >= 0; item = json_scan_next(scan, item)) {
+        JsonView name = json_scan_view(scan, item);
+        int field = name.kind == '"' ? json_decoder_lookup(decoder, name.data, name.length) : -1;
+        if (field >= 0) {
+            slots[field] = json_scan_view(scan, json_scan_value(scan, item));
+        } else {
+            unknown++;
+        }
+    }
+
+    json_decoder_add_unknown(decoder, unknown);
+    return unknown;
+}
+
+static int hex_value(const char *hex) {
+    int value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = hex[i];
+        int digit = c >= '0' && c <= '9' ? c - '0'
+                  : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10
+                  : -1;
+        if (digit < 0) {
+            return -1;
+        }
+        value = value * 16 + digit;
+    }
+    return value;
+}
+
+static char *utf8_put(char *out, unsigned long code) {
+    if (code < 0x80) {
+        *out++ = (char)code;
+    } else if (code < 0x800) {
+        *out++ = (char)(0xC0 | code >> 6);
+        *out++ = (char)(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        *out++ = (char)(0xE0 | code >> 12);
+        *out++ = (char)(0x80 | (code >> 6 & 0x3F));
+        *out++ = (char)(0x80 | (code & 0x3F));
+    } else {
+        *out++ = (char)(0xF0 | code >> 18);
+        *out++ = (char)(0x80 | (code >> 12 & 0x3F));
+        *out++ = (char)(0x80 | (code >> 6 & 0x3F));
+        *out++ = (char)(0x80 | (code & 0x3F));
+    }
+    return out;
+}
+
+// Escapes always shrink, so the string is rewritten over itself. One that
+// holds a NUL short of its length was rewritten before.
+static char *string_text(JsonView *view) {
+    char *data = view->data;
+    size_t length = strnlen(data, view->length);
+    if (length < view->length) {
+        return data;
+    }
+
+    char *in = memchr(data, '\\', length);
+    if (!in) {
+        data[length] = '\0';
+        return data;
+    }
+
+    char *out = in;
+    const char *end = data + length;
+    while (in < end) {
+        if (*in != '\\') {
+            *out++ = *in++;
+            continue;
+        }
+        if (in + 1 >= end) {
+            break;
+        }
+        char c = in[1];
+        in += 2;
+        switch (c) {
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': {
+                int code = end - in >= 4 ? hex_value(in) : -1;
+                if (code < 0) {
+                    break;
+                }
+                in += 4;
+                unsigned long point = (unsigned long)code;
+                if (code >= 0xD800 && code <= 0xDBFF) {
+                    int low = end - in >= 6 && in[0] == '\\' && in[1] == 'u' ? hex_value(in + 2) : -1;
+                    if (low >= 0xDC00 && low <= 0xDFFF) {
+                        point = 0x10000 + ((unsigned long)(code - 0xD800) << 10) + (unsigned long)(low - 0xDC00);
+                        in += 6;
+                    } else {
+                        point = 0xFFFD;
+                    }
+                } else if (code >= 0xDC00 && code <= 0xDFFF) {
+                    point = 0xFFFD;
+                }
+                // Postgres text can't hold a NUL
+                if (point != 0) {
+                    out = utf8_put(out, point);
+                }
+                break;
+            }
+            default: *out++ = c; break;   // \" \\ \/
+        }
+    }
+    *out = '\0';
+    return data;
+}
+
+static bool is_number(const JsonView *view) {
+    return view->kind == '-' || (view->kind >= '0' && view->kind <= '9');
+}
+
+static bool is_integer(const JsonView *view) {
+    return is_number(view) && !memchr(view->data, '.', view->length) && !memchr(view->data, 'e', view->length)
+        && !memchr(view->data, 'E', view->length);
+}
+
+// Numbers aren't NUL-terminated, but the byte after one is never a digit
+long long json_view_integer(const JsonView *view) {
+    return is_integer(view) ? strtoll(view->data, NULL, 10) : 0;
+}
+
+bool json_view_true(const JsonView *view) {
+    return view->kind == 't';
+}
+
+static const char *temporal_view_text(JsonView *view, FieldType type, char *scratch) {
+    int64_t decoded;
+    bool valid = false;
+    if (view->kind == '"') {
+        valid = temporal_parse(string_text(view), type, &decoded);
+    } else if (is_integer(view)) {
+        valid = temporal_from_epoch((int64_t)strtoll(view->data, NULL, 10), type, &decoded);
+    }
+    return valid ? temporal_format(decoded, type, scratch) : NULL;
+}
+
+const char *json_view_text(JsonView *view, FieldType type, char *scratch) {
+    if (!view || view->kind == 0 || view->kind == 'n') {
+        return NULL;
+    }
+
+    if (type == FIELD_TIMESTAMP || type == FIELD_DATE) {
+        return temporal_view_text(view, type, scratch);
+    }
+
+    if (view->kind == '"') {
+        return string_text(view);
+    }
+    if (is_integer(view)) {
+        snprintf(scratch, JSON_VALUE_SCRATCH_SIZE, "%lld", strtoll(view->data, NULL, 10));
+        return scratch;
+    }
+    if (is_number(view)) {
+        snprintf(scratch, JSON_VALUE_SCRATCH_SIZE, type == FIELD_INTEGER ? "%.0f" : "%.17g",
+                 strtod(view->data, NULL));
+        return scratch;
+    }
+    if (view->kind == 't' || view->kind == 'f') {
+        return view->kind == 't' ? "true" : "false";
+    }
+
+    return NULL;
+}
@@ -0,0 +1,246 @@
+#include "../include/leases.h"
+#include "../include/core_operations.h"
+#include "../include/sql_stats.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_LEASE_SECONDS 60
+#define MAX_LEASE_DATABASES 32
+
+static const char *const acquire_query =
+    "INSERT INTO meta.leases (name, holder, expires_at) "
+    "VALUES ($1, $2, now() + $3::int * interval '1 second') "
+    "ON CONFLICT (name) DO UPDATE SET holder = EXCLUDED.holder, expires_at = EXCLUDED.expires_at, "
+    "acquired_at = CASE WHEN meta.leases.holder = EXCLUDED.holder THEN meta.leases.acquired_at ELSE now() END "
+    "WHERE meta.leases.holder = EXCLUDED.holder OR meta.leases.expires_at < now() "
+    "RETURNING name";
+
+static const char *const renew_query =
+    "UPDATE meta.leases SET expires_at = now() + $2::int * interval '1 second' WHERE holder = $1";
+
+static char holder[128];
+static char lease_seconds[16];
+
+// Heartbeat, started with the first lease
+static pthread_mutex_t heartbeat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t heartbeat_stop = PTHREAD_COND_INITIALIZER;
+static pthread_t heartbeat_thread;
+static bool heartbeat_running;
+static bool heartbeat_stopping;
+
+// Databases this instance took leases in; the heartbeat renews each on a
+// connection of its own and forgets one once nothing in it is held.
+// acquired counts leases taken, so one taken during a renewal keeps it.
+struct LeaseDatabase {
+    char name[128];
+    unsigned long acquired;
+    PGconn *conn;           // the heartbeat thread's
+};
+
+static struct LeaseDatabase lease_databases[MAX_LEASE_DATABASES];
+static int lease_database_count;
+
+bool leases_enabled(void) {
+    const char *enabled = getenv("REPSLY_LEASES");
+    return enabled && *enabled && strcmp(enabled, "0") != 0;
+}
+
+static long lease_duration(void) {
+    const char *configured = getenv("REPSLY_LEASE_SECONDS");
+    long seconds = configured ? atol(configured) : DEFAULT_LEASE_SECONDS;
+    return seconds >= 3 ? seconds : DEFAULT_LEASE_SECONDS;
+}
+
+static void leases_init(void) {
+    if (holder[0]) {
+        return;
+    }
+    const char *id = getenv("REPSLY_INSTANCE_ID");
+    if (id && *id) {
+        snprintf(holder, sizeof(holder), "%s", id);
+    } else {
+        char host[64] = "localhost";
+        gethostname(host, sizeof(host) - 1);
+        snprintf(holder, sizeof(holder), "%s:%ld", host, (long)getpid());
+    }
+    snprintf(lease_seconds, sizeof(lease_seconds), "%ld", lease_duration());
+}
+
+// Returns false once the database holds none of this instance's leases
+static bool heartbeat_renew(struct LeaseDatabase *database) {
+    if (!database->conn) {
+        database->conn = db_connect_to(database->name);
+    } else if (PQstatus(database->conn) != CONNECTION_OK) {
+        PQreset(database->conn);
+    }
+    if (!database->conn || PQstatus(database->conn) != CONNECTION_OK) {
+        return true;
+    }
+
+    const char *param_values[] = {holder, lease_seconds};
+    PGresult *result = PQexecParams(database->conn, renew_query, 2, NULL, param_values, NULL, NULL, 0);
+    bool held = true;
+    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "Renewing leases in %s failed: %s", database->name, PQerrorMessage(database->conn));
+    } else {
+        held = atol(PQcmdTuples(result)) > 0;
+    }
+    PQclear(result);
+    return held;
+}
+
+// Runs on connections of its own so a long page load on the main one can't
+// hold up a renewal
+static void *heartbeat_main(void *arg) {
+    (void)arg;
+    long interval_ms = lease_duration() * 1000 / 3;
+
+    pthread_mutex_lock(&heartbeat_lock);
+    while (!heartbeat_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval_ms / 1000;
+        deadline.tv_nsec += (interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&heartbeat_stop, &heartbeat_lock, &deadline);
+        if (heartbeat_stopping) {
+            break;
+        }
+
+        for (int i = 0; i < lease_database_count; ) {
+            struct LeaseDatabase *database = &lease_databases[i];
+            unsigned long acquired = database->acquired;
+            pthread_mutex_unlock(&heartbeat_lock);
+            bool held = heartbeat_renew(database);
+            pthread_mutex_lock(&heartbeat_lock);
+
+            if (held || database->acquired != acquired) {
+                i++;
+                continue;
+            }
+            if (database->conn) {
+                PQfinish(database->conn);
+            }
+            *database = lease_databases[--lease_database_count];
+        }
+    }
+
+    for (int i = 0; i < lease_database_count; i++) {
+        if (lease_databases[i].conn) {
+            PQfinish(lease_databases[i].conn);
+            lease_databases[i].conn = NULL;
+        }
+    }
+    pthread_mutex_unlock(&heartbeat_lock);
+    return NULL;
+}
+
+static void heartbeat_start(const char *database_name) {
+    pthread_mutex_lock(&heartbeat_lock);
+    int d = 0;
+    while (d < lease_database_count && strcmp(lease_databases[d].name, database_name) != 0) {
+        d++;
+    }
+    if (d == lease_database_count && d < MAX_LEASE_DATABASES) {
+        lease_databases[d] = (struct LeaseDatabase){.acquired = 0, .conn = NULL};
+        snprintf(lease_databases[d].name, sizeof(lease_databases[d].name), "%s", database_name);
+        lease_database_count++;
+    }
+    if (d < lease_database_count) {
+        lease_databases[d].acquired++;
+    } else {
+        fprintf(stderr, "Leases in more than %d databases; %s won't be renewed\n", MAX_LEASE_DATABASES,
+                database_name);
+    }
+
+    if (!heartbeat_running) {
+        heartbeat_stopping = false;
+        heartbeat_running = pthread_create(&heartbeat_thread, NULL, heartbeat_main, NULL) == 0;
+        if (!heartbeat_running) {
+            fprintf(stderr, "Failed to start lease heartbeat\n");
+        }
+    }
+    pthread_mutex_unlock(&heartbeat_lock);
+}
+
+bool lease_acquire(PGconn *db_conn, const char *name) {
+    if (!leases_enabled()) {
+        return true;
+    }
+    leases_init();
+
+    const char *param_values[] = {name, holder, lease_seconds};
+    PGresult *result = sql_exec_params(db_conn, __func__, acquire_query, 3, param_values, NULL, NULL);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Acquiring lease on %s failed: %s", name, PQerrorMessage(db_conn));
+        PQclear(result);
+        return false;
+    }
+
+    bool acquired = PQntuples(result) > 0;
+    PQclear(result);
+    if (acquired) {
+        heartbeat_start(PQdb(db_conn));
+    }
+    return acquired;
+}
+
+void lease_release(PGconn *db_conn, const char *name) {
+    if (!leases_enabled() || !holder[0]) {
+        return;
+    }
+
+    const char *param_values[] = {name, holder};
+    PGresult *result = sql_exec_params(db_conn, __func__,
+        "DELETE FROM meta.leases WHERE name = $1 AND holder = $2", 2, param_values, NULL, NULL);
+    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "Releasing lease on %s failed: %s", name, PQerrorMessage(db_conn));
+    }
+    PQclear(result);
+}
+
+int lease_acquire_entities(PGconn *db_conn, const EntityInfo **entities, int count) {
+    int held = 0;
+    for (int i = 0; i < count; i++) {
+        if (lease_acquire(db_conn, entities[i]->name)) {
+            entities[held++] = entities[i];
+        }
+    }
+    return held;
+}
+
+void lease_release_entities(PGconn *db_conn, const EntityInfo *const *entities, int count) {
+    for (int i = 0; i < count; i++) {
+        lease_release(db_conn, entities[i]->name);
+    }
+}
+
+void leases_shutdown(PGconn *db_conn) {
+    pthread_mutex_lock(&heartbeat_lock);
+    bool running = heartbeat_running;
+    heartbeat_stopping = true;
+    heartbeat_running = false;
+    pthread_cond_signal(&heartbeat_stop);
+    pthread_mutex_unlock(&heartbeat_lock);
+    if (running) {
+        pthread_join(heartbeat_thread, NULL);
+    }
+
+    if (!leases_enabled() || !holder[0] || !db_conn || PQstatus(db_conn) != CONNECTION_OK) {
+        return;
+    }
+    const char *param_values[] = {holder};
+    PGresult *result = sql_exec_params(db_conn, __func__, "DELETE FROM meta.leases WHERE holder = $1", 1,
+                                       param_values, NULL, NULL);
+    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "Releasing leases failed: %s", PQerrorMessage(db_conn));
+    }
+    PQclear(result);
+}
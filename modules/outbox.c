@@ -0,0 +1,30 @@
+#include "../include/outbox.h"
+#include "../include/sql_stats.h"
+#include <stdio.h>
+#include <string.h>
+
+bool outbox_record_reload(PGconn *db_conn, const char *table) {
+    PGresult *result = sql_exec(db_conn, __func__,
+        "SELECT to_regprocedure('changes.record(text, character, text[])') IS NOT NULL");
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Looking up the change feed failed: %s", PQerrorMessage(db_conn));
+        PQclear(result);
+        return false;
+    }
+    bool installed = strcmp(PQgetvalue(result, 0, 0), "t") == 0;
+    PQclear(result);
+    if (!installed) {
+        return true;
+    }
+
+    const char *param_values[] = {table};
+    result = sql_exec_params(db_conn, __func__, "SELECT changes.record($1, 'R', '{}')", 1, param_values, NULL, NULL);
+
+    bool success = (PQresultStatus(result) == PGRES_TUPLES_OK);
+    if (!success) {
+        fprintf(stderr, "Recording reload of %s failed: %s", table, PQerrorMessage(db_conn));
+    }
+
+    PQclear(result);
+    return success;
+}
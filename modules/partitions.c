@@ -0,0 +1,143 @@
+#include "../include/partitions.h"
+#include "../include/sql_stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_MONTHS_AHEAD 2
+
+// Months are counted as year * 12 + (month - 1)
+struct PartitionedTable {
+    const char *name;
+    int *months;        // months known to have a partition
+    int month_count;
+    int month_capacity;
+    int ahead_from;     // current month when the look-ahead was last created, 0 if never
+};
+
+static struct PartitionedTable partitioned_tables[] = {
+    {"field_ops.visits", NULL, 0, 0, 0},
+    {"field_ops.forms", NULL, 0, 0, 0},
+    {"sales.purchase_order_items", NULL, 0, 0, 0},
+    {"inventory.pricelist_items", NULL, 0, 0, 0},
+};
+
+#define PARTITIONED_TABLE_COUNT (sizeof(partitioned_tables) / sizeof(partitioned_tables[0]))
+
+static struct PartitionedTable *partitioned_table_find(const char *name) {
+    for (size_t i = 0; i < PARTITIONED_TABLE_COUNT; i++) {
+        if (strcmp(partitioned_tables[i].name, name) == 0) {
+            return &partitioned_tables[i];
+        }
+    }
+    return NULL;
+}
+
+static bool month_known(const struct PartitionedTable *table, int month) {
+    for (int i = 0; i < table->month_count; i++) {
+        if (table->months[i] == month) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void month_remember(struct PartitionedTable *table, int month) {
+    if (table->month_count == table->month_capacity) {
+        int capacity = table->month_capacity ? table->month_capacity * 2 : 32;
+        int *months = realloc(table->months, (size_t)capacity * sizeof(int));
+        if (!months) {
+            return;
+        }
+        table->months = months;
+        table->month_capacity = capacity;
+    }
+    table->months[table->month_count++] = month;
+}
+
+static int current_month(void) {
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    return (tm.tm_year + 1900) * 12 + tm.tm_mon;
+}
+
+static bool parse_month(const char *date, int *month) {
+    int year, mon;
+    if (sscanf(date, "%4d-%2d", &year, &mon) != 2 || year < 1900 || mon < 1 || mon > 12) {
+        return false;
+    }
+    *month = year * 12 + (mon - 1);
+    return true;
+}
+
+static bool partition_create(PGconn *db_conn, struct PartitionedTable *table, int month) {
+    if (month_known(table, month)) {
+        return true;
+    }
+
+    int year = month / 12, mon = month % 12 + 1;
+    int next_year = (month + 1) / 12, next_mon = (month + 1) % 12 + 1;
+
+    char sql[512];
+    snprintf(sql, sizeof(sql),
+             "CREATE TABLE IF NOT EXISTS %s_y%04dm%02d PARTITION OF %s "
+             "FOR VALUES FROM ('%04d-%02d-01') TO ('%04d-%02d-01')",
+             table->name, year, mon, table->name, year, mon, next_year, next_mon);
+
+    PGresult *result = sql_exec(db_conn, __func__, sql);
+    bool success = (PQresultStatus(result) == PGRES_COMMAND_OK);
+
+    // A failure is remembered too, so it is reported once per run rather than
+    // once per row. Typically the default partition already holds rows for
+    // this month; they keep landing there, which is still correct, just not
+    // pruned.
+    month_remember(table, month);
+    if (!success) {
+        fprintf(stderr, "Creating %04d-%02d partition of %s failed: %s", year, mon, table->name,
+                PQerrorMessage(db_conn));
+    }
+    PQclear(result);
+    return success;
+}
+
+static int months_ahead(void) {
+    const char *configured = getenv("REPSLY_PARTITION_MONTHS_AHEAD");
+    int ahead = configured ? atoi(configured) : DEFAULT_MONTHS_AHEAD;
+    return ahead >= 0 ? ahead : DEFAULT_MONTHS_AHEAD;
+}
+
+bool partition_ensure(PGconn *db_conn, const char *table_name, const char *date) {
+    struct PartitionedTable *table = partitioned_table_find(table_name);
+    if (!table) {
+        return true;
+    }
+
+    bool success = true;
+    int now = current_month();
+    if (table->ahead_from != now) {
+        int ahead = months_ahead();
+        for (int month = now; month <= now + ahead; month++) {
+            success = partition_create(db_conn, table, month) && success;
+        }
+        table->ahead_from = now;
+    }
+
+    int month;
+    if (!date || !*date) {
+        month = now;
+    } else if (!parse_month(date, &month)) {
+        return success;
+    }
+    return partition_create(db_conn, table, month) && success;
+}
+
+void partitions_forget(void) {
+    for (size_t i = 0; i < PARTITIONED_TABLE_COUNT; i++) {
+        free(partitioned_tables[i].months);
+        partitioned_tables[i].months = NULL;
+        partitioned_tables[i].month_count = partitioned_tables[i].month_capacity = 0;
+        partitioned_tables[i].ahead_from = 0;
+    }
+}
@@ -1,6 +1,12 @@
 #include "../include/pricelist.h"
 #include "../include/api.h"
 #include "../include/core_operations.h"
+#include "../include/fingerprint.h"
+#include "../include/partitions.h"
+#include "../include/json_decoder.h"
+#include "../include/thread_pool.h"
+#include "../include/columnar_export.h"
+#include "../include/sql_stats.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -20,6 +26,8 @@ struct PricelistItem {
     char date_available_to[20];
     int min_quantity;
     int max_quantity;
+    Fingerprint key_hash;      // identity within a pricelist: (product_code, client_code)
+    Fingerprint content_hash;  // everything we mirror for the item
 };
 
 struct PricelistData {
@@ -32,6 +40,42 @@ struct PricelistData {
     int item_count;
 };
 
+static Fingerprint pricelist_item_key_hash(const char *product_code, const char *client_code) {
+    Fingerprint fp = fingerprint_init();
+    fp = fingerprint_add_str(fp, product_code);
+    fp = fingerprint_add_str(fp, client_code);
+    return fp;
+}
+
+static Fingerprint pricelist_item_content_hash(const struct PricelistItem *item) {
+    Fingerprint fp = item->key_hash;
+    fp = fingerprint_add_str(fp, item->product_name);
+    fp = fingerprint_add_double(fp, item->price);
+    fp = fingerprint_add_bool(fp, item->active);
+    fp = fingerprint_add_str(fp, item->client_name);
+    fp = fingerprint_add_str(fp, item->manufacture_id);
+    fp = fingerprint_add_str(fp, item->date_available_from);
+    fp = fingerprint_add_str(fp, item->date_available_to);
+    fp = fingerprint_add_int(fp, item->min_quantity);
+    fp = fingerprint_add_int(fp, item->max_quantity);
+    return fp;
+}
+
+// The pricelist hash folds in every item hash, so a change to any item (or
+// an item appearing or vanishing) changes the pricelist hash too.
+Fingerprint pricelist_get_content_hash(PricelistDataPtr pricelist) {
+    Fingerprint fp = fingerprint_init();
+    fp = fingerprint_add_str(fp, pricelist->name);
+    fp = fingerprint_add_bool(fp, pricelist->is_default);
+    fp = fingerprint_add_bool(fp, pricelist->active);
+    fp = fingerprint_add_bool(fp, pricelist->use_prices);
+    fp = fingerprint_add_int(fp, pricelist->item_count);
+    for (int i = 0; i < pricelist->item_count; i++) {
+        fp = fingerprint_add_fingerprint(fp, pricelist->items[i].content_hash);
+    }
+    return fp;
+}
+
 PricelistDataPtr pricelist_create(void) {
     return (PricelistDataPtr)calloc(1, sizeof(struct PricelistData));
 }
@@ -77,10 +121,14 @@ void pricelist_add_item(PricelistDataPtr pricelist, const char* product_code, co
         item->date_available_to[sizeof(item->date_available_to) - 1] = '\0';
         item->min_quantity = min_quantity;
         item->max_quantity = max_quantity;
+        item->key_hash = pricelist_item_key_hash(item->product_code, item->client_code);
+        item->content_hash = pricelist_item_content_hash(item);
         pricelist->item_count++;
     }
 }
-static bool execute_pricelist_query(PGconn *db_conn, const char *query, const char **param_values, int param_count) {
+// tag names the caller in traces and statement statistics
+static bool execute_pricelist_query(PGconn *db_conn, const char *tag, const char *query, const char **param_values,
+                                    int param_count) {
     int param_lengths[param_count];
     int param_formats[param_count];
     for (int i = 0; i < param_count; i++) {
@@ -88,7 +136,7 @@ static bool execute_pricelist_query(PGconn *db_conn, const char *query, const ch
         param_formats[i] = 0;  // All text format
     }
 
-    PGresult *result = PQexecParams(db_conn, query, param_count, NULL, param_values, param_lengths, param_formats, 0);
+    PGresult *result = sql_exec_params(db_conn, tag, query, param_count, param_values, param_lengths, param_formats);
 
     bool success = (PQresultStatus(result) == PGRES_COMMAND_OK);
     if (!success) {
@@ -102,8 +150,8 @@ static bool execute_pricelist_query(PGconn *db_conn, const char *query, const ch
 static bool insert_pricelist_item(PGconn *db_conn, int pricelist_id, struct PricelistItem *item) {
     const char *insert_item_query = 
         "INSERT INTO inventory.pricelist_items "
-        "(pricelist_id, product_id, price, active, client_id, manufacture_id, date_available_from_id, date_available_to_id, min_quantity, max_quantity) "
-        "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10)";
+        "(pricelist_id, product_id, price, active, client_id, manufacture_id, date_available_from_id, date_available_to_id, min_quantity, max_quantity, content_hash) "
+        "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11)";
 
     int product_id = get_or_create_product(db_conn, item->product_code, item->product_name);
     int client_id = get_or_create_client(db_conn, item->client_code, item->client_name);
@@ -116,7 +164,7 @@ static bool insert_pricelist_item(PGconn *db_conn, int pricelist_id, struct Pric
 
     char pricelist_id_str[20], product_id_str[20], price_str[20], active_str[6], 
          client_id_str[20], date_from_id_str[20], date_to_id_str[20],
-         min_quantity_str[20], max_quantity_str[20];
+         min_quantity_str[20], max_quantity_str[20], hash_str[FINGERPRINT_STR_SIZE];
 
     snprintf(pricelist_id_str, sizeof(pricelist_id_str), "%d", pricelist_id);
     snprintf(product_id_str, sizeof(product_id_str), "%d", product_id);
@@ -127,23 +175,26 @@ static bool insert_pricelist_item(PGconn *db_conn, int pricelist_id, struct Pric
     snprintf(date_to_id_str, sizeof(date_to_id_str), "%d", date_to_id);
     snprintf(min_quantity_str, sizeof(min_quantity_str), "%d", item->min_quantity);
     snprintf(max_quantity_str, sizeof(max_quantity_str), "%d", item->max_quantity);
+    fingerprint_to_string(item->content_hash, hash_str, sizeof(hash_str));
 
     const char *param_values[] = {
         pricelist_id_str, product_id_str, price_str, active_str, client_id_str,
         item->manufacture_id, date_from_id_str, date_to_id_str,
-        min_quantity_str, max_quantity_str
+        min_quantity_str, max_quantity_str, hash_str
     };
 
-    return execute_pricelist_query(db_conn, insert_item_query, param_values, 10);
+    return execute_pricelist_query(db_conn, __func__, insert_item_query, param_values, 11);
 }
 
-static bool update_pricelist_item(PGconn *db_conn, int pricelist_id, struct PricelistItem *item) {
+// Rows are addressed by item_id here; the diff in pricelist_update has already
+// matched the incoming item to its stored row.
+static bool update_pricelist_item(PGconn *db_conn, int item_id, struct PricelistItem *item) {
     const char *update_item_query = 
         "UPDATE inventory.pricelist_items SET "
-        "price = $3, active = $4, manufacture_id = $6, "
+        "product_id = $2, price = $3, active = $4, client_id = $5, manufacture_id = $6, "
         "date_available_from_id = $7, date_available_to_id = $8, "
-        "min_quantity = $9, max_quantity = $10 "
-        "WHERE pricelist_id = $1 AND product_id = $2 AND client_id = $5";
+        "min_quantity = $9, max_quantity = $10, content_hash = $11 "
+        "WHERE item_id = $1";
 
     int product_id = get_or_create_product(db_conn, item->product_code, item->product_name);
     int client_id = get_or_create_client(db_conn, item->client_code, item->client_name);
@@ -156,9 +207,9 @@ static bool update_pricelist_item(PGconn *db_conn, int pricelist_id, struct Pric
 
     char pricelist_id_str[20], product_id_str[20], price_str[20], active_str[6], 
          client_id_str[20], date_from_id_str[20], date_to_id_str[20],
-         min_quantity_str[20], max_quantity_str[20];
+         min_quantity_str[20], max_quantity_str[20], hash_str[FINGERPRINT_STR_SIZE];
 
-    snprintf(pricelist_id_str, sizeof(pricelist_id_str), "%d", pricelist_id);
+    snprintf(pricelist_id_str, sizeof(pricelist_id_str), "%d", item_id);
     snprintf(product_id_str, sizeof(product_id_str), "%d", product_id);
     snprintf(price_str, sizeof(price_str), "%f", item->price);
     snprintf(active_str, sizeof(active_str), "%s", item->active ? "true" : "false");
@@ -167,14 +218,15 @@ static bool update_pricelist_item(PGconn *db_conn, int pricelist_id, struct Pric
     snprintf(date_to_id_str, sizeof(date_to_id_str), "%d", date_to_id);
     snprintf(min_quantity_str, sizeof(min_quantity_str), "%d", item->min_quantity);
     snprintf(max_quantity_str, sizeof(max_quantity_str), "%d", item->max_quantity);
+    fingerprint_to_string(item->content_hash, hash_str, sizeof(hash_str));
 
     const char *param_values[] = {
         pricelist_id_str, product_id_str, price_str, active_str, client_id_str,
         item->manufacture_id, date_from_id_str, date_to_id_str,
-        min_quantity_str, max_quantity_str
+        min_quantity_str, max_quantity_str, hash_str
     };
 
-    return execute_pricelist_query(db_conn, update_item_query, param_values, 10);
+    return execute_pricelist_query(db_conn, __func__, update_item_query, param_values, 11);
 }
 
 bool pricelist_insert(PGconn *db_conn, PricelistDataPtr pricelist) {
@@ -185,18 +237,19 @@ bool pricelist_insert(PGconn *db_conn, PricelistDataPtr pricelist) {
 
     const char *insert_pricelist_query = 
         "INSERT INTO inventory.pricelists "
-        "(name, is_default, active, use_prices) "
-        "VALUES ($1, $2, $3, $4) "
+        "(name, is_default, active, use_prices, content_hash) "
+        "VALUES ($1, $2, $3, $4, $5) "
         "RETURNING pricelist_id";
 
-    char is_default_str[6], active_str[6], use_prices_str[6];
+    char is_default_str[6], active_str[6], use_prices_str[6], hash_str[FINGERPRINT_STR_SIZE];
     snprintf(is_default_str, sizeof(is_default_str), "%s", pricelist->is_default ? "true" : "false");
     snprintf(active_str, sizeof(active_str), "%s", pricelist->active ? "true" : "false");
     snprintf(use_prices_str, sizeof(use_prices_str), "%s", pricelist->use_prices ? "true" : "false");
+    fingerprint_to_string(pricelist_get_content_hash(pricelist), hash_str, sizeof(hash_str));
 
-    const char *param_values[] = {pricelist->name, is_default_str, active_str, use_prices_str};
+    const char *param_values[] = {pricelist->name, is_default_str, active_str, use_prices_str, hash_str};
 
-    PGresult *result = PQexecParams(db_conn, insert_pricelist_query, 4, NULL, param_values, NULL, NULL, 0);
+    PGresult *result = sql_exec_params(db_conn, __func__, insert_pricelist_query, 5, param_values, NULL, NULL);
 
     if (PQresultStatus(result) != PGRES_TUPLES_OK) {
         fprintf(stderr, "INSERT INTO inventory.pricelists failed: %s", PQerrorMessage(db_conn));
@@ -216,6 +269,135 @@ bool pricelist_insert(PGconn *db_conn, PricelistDataPtr pricelist) {
     return true;
 }
 
+// Stored items of one pricelist, indexed by key hash with open addressing so
+// that matching 1000 incoming items doesn't turn into a quadratic scan.
+
+struct StoredItem {
+    int item_id;
+    Fingerprint key_hash;
+    Fingerprint content_hash;
+    bool seen;
+};
+
+struct StoredItemIndex {
+    struct StoredItem *items;
+    int count;
+    int *slots;      // index into items, -1 when empty
+    size_t mask;
+};
+
+static bool stored_item_index_load(PGconn *db_conn, int pricelist_id, struct StoredItemIndex *index) {
+    const char *query =
+        "SELECT i.item_id, p.code, c.code, i.content_hash "
+        "FROM inventory.pricelist_items i "
+        "LEFT JOIN inventory.products p ON p.product_id = i.product_id "
+        "LEFT JOIN sales.clients c ON c.client_id = i.client_id "
+        "WHERE i.pricelist_id = $1";
+
+    char pricelist_id_str[20];
+    snprintf(pricelist_id_str, sizeof(pricelist_id_str), "%d", pricelist_id);
+    const char *param_values[] = {pricelist_id_str};
+
+    PGresult *result = sql_exec_params(db_conn, __func__, query, 1, param_values, NULL, NULL);
+
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "SELECT FROM inventory.pricelist_items failed: %s", PQerrorMessage(db_conn));
+        PQclear(result);
+        return false;
+    }
+
+    int rows = PQntuples(result);
+    size_t slot_count = 16;
+    while (slot_count < (size_t)rows * 2) {
+        slot_count <<= 1;
+    }
+
+    index->items = calloc(rows > 0 ? rows : 1, sizeof(struct StoredItem));
+    index->slots = malloc(slot_count * sizeof(int));
+    if (!index->items || !index->slots) {
+        fprintf(stderr, "Error: Failed to allocate pricelist item index\n");
+        free(index->items);
+        free(index->slots);
+        PQclear(result);
+        return false;
+    }
+    index->count = rows;
+    index->mask = slot_count - 1;
+    memset(index->slots, -1, slot_count * sizeof(int));
+
+    for (int row = 0; row < rows; row++) {
+        struct StoredItem *item = &index->items[row];
+        item->item_id = atoi(PQgetvalue(result, row, 0));
+        item->key_hash = pricelist_item_key_hash(PQgetvalue(result, row, 1), PQgetvalue(result, row, 2));
+        item->content_hash = fingerprint_from_string(PQgetvalue(result, row, 3));
+
+        size_t slot = item->key_hash & index->mask;
+        while (index->slots[slot] >= 0) {
+            slot = (slot + 1) & index->mask;
+        }
+        index->slots[slot] = row;
+    }
+
+    PQclear(result);
+    return true;
+}
+
+static struct StoredItem *stored_item_index_find(struct StoredItemIndex *index, Fingerprint key_hash) {
+    size_t slot = key_hash & index->mask;
+    while (index->slots[slot] >= 0) {
+        struct StoredItem *item = &index->items[index->slots[slot]];
+        if (item->key_hash == key_hash && !item->seen) {
+            return item;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    return NULL;
+}
+
+static void stored_item_index_free(struct StoredItemIndex *index) {
+    free(index->items);
+    free(index->slots);
+}
+
+// Removes every stored item the incoming pricelist no longer carries, in one
+// statement.
+static bool delete_vanished_items(PGconn *db_conn, struct StoredItemIndex *index) {
+    size_t capacity = 3;
+    for (int i = 0; i < index->count; i++) {
+        if (!index->items[i].seen) {
+            capacity += 12;
+        }
+    }
+    if (capacity == 3) {
+        return true;
+    }
+
+    char *id_array = malloc(capacity);
+    if (!id_array) {
+        fprintf(stderr, "Error: Failed to allocate pricelist item id list\n");
+        return false;
+    }
+
+    size_t len = 0;
+    id_array[len++] = '{';
+    for (int i = 0; i < index->count; i++) {
+        if (!index->items[i].seen) {
+            len += snprintf(id_array + len, capacity - len, "%s%d", len > 1 ? "," : "", index->items[i].item_id);
+        }
+    }
+    snprintf(id_array + len, capacity - len, "}");
+
+    const char *delete_query = "DELETE FROM inventory.pricelist_items WHERE item_id = ANY($1::int[])";
+    const char *param_values[] = {id_array};
+    bool success = execute_pricelist_query(db_conn, __func__, delete_query, param_values, 1);
+
+    free(id_array);
+    return success;
+}
+
+// Writes a changed pricelist as an item-level diff against what is stored:
+// new items are inserted, items whose content hash moved are updated, and
+// items that disappeared from Repsly are deleted. Unchanged items cost nothing.
 bool pricelist_update(PGconn *db_conn, PricelistDataPtr pricelist) {
     if (!db_conn || !pricelist) {
         fprintf(stderr, "Error: Invalid database connection or pricelist data\n");
@@ -224,20 +406,21 @@ bool pricelist_update(PGconn *db_conn, PricelistDataPtr pricelist) {
 
     const char *update_pricelist_query = 
         "UPDATE inventory.pricelists SET "
-        "is_default = $2, active = $3, use_prices = $4 "
+        "is_default = $2, active = $3, use_prices = $4, content_hash = $5 "
         "WHERE name = $1 "
         "RETURNING pricelist_id";
 
-    char is_default_str[6], active_str[6], use_prices_str[6];
+    char is_default_str[6], active_str[6], use_prices_str[6], hash_str[FINGERPRINT_STR_SIZE];
     snprintf(is_default_str, sizeof(is_default_str), "%s", pricelist->is_default ? "true" : "false");
     snprintf(active_str, sizeof(active_str), "%s", pricelist->active ? "true" : "false");
     snprintf(use_prices_str, sizeof(use_prices_str), "%s", pricelist->use_prices ? "true" : "false");
+    fingerprint_to_string(pricelist_get_content_hash(pricelist), hash_str, sizeof(hash_str));
 
-    const char *param_values[] = {pricelist->name, is_default_str, active_str, use_prices_str};
+    const char *param_values[] = {pricelist->name, is_default_str, active_str, use_prices_str, hash_str};
 
-    PGresult *result = PQexecParams(db_conn, update_pricelist_query, 4, NULL, param_values, NULL, NULL, 0);
+    PGresult *result = sql_exec_params(db_conn, __func__, update_pricelist_query, 5, param_values, NULL, NULL);
 
-    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+    if (PQresultStatus(result) != PGRES_TUPLES_OK || PQntuples(result) == 0) {
         fprintf(stderr, "UPDATE inventory.pricelists failed: %s", PQerrorMessage(db_conn));
         PQclear(result);
         return false;
@@ -246,13 +429,33 @@ bool pricelist_update(PGconn *db_conn, PricelistDataPtr pricelist) {
     pricelist->pricelist_id = atoi(PQgetvalue(result, 0, 0));
     PQclear(result);
 
-    for (int i = 0; i < pricelist->item_count; i++) {
-        if (!update_pricelist_item(db_conn, pricelist->pricelist_id, &pricelist->items[i])) {
-            return false;
+    struct StoredItemIndex index;
+    if (!stored_item_index_load(db_conn, pricelist->pricelist_id, &index)) {
+        return false;
+    }
+
+    bool success = true;
+    for (int i = 0; i < pricelist->item_count && success; i++) {
+        struct PricelistItem *item = &pricelist->items[i];
+        struct StoredItem *stored = stored_item_index_find(&index, item->key_hash);
+
+        if (!stored) {
+            success = insert_pricelist_item(db_conn, pricelist->pricelist_id, item);
+            continue;
+        }
+
+        stored->seen = true;
+        if (stored->content_hash != item->content_hash) {
+            success = update_pricelist_item(db_conn, stored->item_id, item);
         }
     }
 
-    return true;
+    if (success) {
+        success = delete_vanished_items(db_conn, &index);
+    }
+
+    stored_item_index_free(&index);
+    return success;
 }
 
 
@@ -264,6 +467,72 @@ void pricelist_free(PricelistDataPtr pricelist) {
     free(pricelist);
 }
 
+// Fields we read from a Repsly pricelist and its items, in decoder slot order
+enum PricelistField {
+    PRICELIST_FIELD_NAME,
+    PRICELIST_FIELD_IS_DEFAULT,
+    PRICELIST_FIELD_ACTIVE,
+    PRICELIST_FIELD_USE_PRICES,
+    PRICELIST_FIELD_ITEMS,
+    PRICELIST_FIELD_COUNT
+};
+
+static const char *const pricelist_field_names[PRICELIST_FIELD_COUNT] = {
+    [PRICELIST_FIELD_NAME] = "Name",
+    [PRICELIST_FIELD_IS_DEFAULT] = "IsDefault",
+    [PRICELIST_FIELD_ACTIVE] = "Active",
+    [PRICELIST_FIELD_USE_PRICES] = "UsePrices",
+    [PRICELIST_FIELD_ITEMS] = "Items",
+};
+
+enum PricelistItemField {
+    ITEM_FIELD_PRODUCT_CODE,
+    ITEM_FIELD_PRODUCT_NAME,
+    ITEM_FIELD_PRICE,
+    ITEM_FIELD_ACTIVE,
+    ITEM_FIELD_CLIENT_CODE,
+    ITEM_FIELD_CLIENT_NAME,
+    ITEM_FIELD_MANUFACTURE_ID,
+    ITEM_FIELD_DATE_AVAILABLE_FROM,
+    ITEM_FIELD_DATE_AVAILABLE_TO,
+    ITEM_FIELD_MIN_QUANTITY,
+    ITEM_FIELD_MAX_QUANTITY,
+    ITEM_FIELD_COUNT
+};
+
+static const char *const pricelist_item_field_names[ITEM_FIELD_COUNT] = {
+    [ITEM_FIELD_PRODUCT_CODE] = "ProductCode",
+    [ITEM_FIELD_PRODUCT_NAME] = "ProductName",
+    [ITEM_FIELD_PRICE] = "Price",
+    [ITEM_FIELD_ACTIVE] = "Active",
+    [ITEM_FIELD_CLIENT_CODE] = "ClientCode",
+    [ITEM_FIELD_CLIENT_NAME] = "ClientName",
+    [ITEM_FIELD_MANUFACTURE_ID] = "ManufactureID",
+    [ITEM_FIELD_DATE_AVAILABLE_FROM] = "DateAvailableFrom",
+    [ITEM_FIELD_DATE_AVAILABLE_TO] = "DateAvailableTo",
+    [ITEM_FIELD_MIN_QUANTITY] = "MinQuantity",
+    [ITEM_FIELD_MAX_QUANTITY] = "MaxQuantity",
+};
+
+static JsonDecoderPtr pricelist_decoder;
+static JsonDecoderPtr pricelist_item_decoder;
+
+static bool pricelist_decoders_init(void) {
+    if (!pricelist_decoder) {
+        pricelist_decoder = json_decoder_create("pricelists", pricelist_field_names, PRICELIST_FIELD_COUNT);
+    }
+    if (!pricelist_item_decoder) {
+        pricelist_item_decoder = json_decoder_create("pricelist items", pricelist_item_field_names, ITEM_FIELD_COUNT);
+    }
+    return pricelist_decoder && pricelist_item_decoder;
+}
+
+// pricelist_add_item copies with strncpy, so missing strings come through as ""
+static const char *item_text(json_t **fields, enum PricelistItemField field, FieldType type, char *scratch) {
+    const char *text = json_decoder_text(pricelist_item_decoder, fields, field, type, scratch);
+    return text ? text : "";
+}
+
 static PricelistDataPtr pricelist_from_json(json_t *pricelist_json) {
     if (!json_is_object(pricelist_json)) {
         fprintf(stderr, "Error: pricelist_json is not a JSON object\n");
@@ -274,81 +543,220 @@ static PricelistDataPtr pricelist_from_json(json_t *pricelist_json) {
     if (!pricelist) {
         fprintf(stderr, "Error: Failed to create pricelist\n");
         return NULL;
-    }    PricelistDataPtr pricelist = pricelist_create();
-    
-    pricelist_set_name(pricelist, json_string_value(json_object_get(pricelist_json, "Name")));
-    pricelist_set_is_default(pricelist, json_is_true(json_object_get(pricelist_json, "IsDefault")));
-    pricelist_set_active(pricelist, json_is_true(json_object_get(pricelist_json, "Active")));
-    pricelist_set_use_prices(pricelist, json_is_true(json_object_get(pricelist_json, "UsePrices")));
+    }
+
+    json_t *fields[PRICELIST_FIELD_COUNT];
+    json_decoder_decode(pricelist_decoder, pricelist_json, fields);
 
-    json_t *items = json_object_get(pricelist_json, "Items");
+    const char *name = json_string_value(fields[PRICELIST_FIELD_NAME]);
+    pricelist_set_name(pricelist, name ? name : "");
+    pricelist_set_is_default(pricelist, json_is_true(fields[PRICELIST_FIELD_IS_DEFAULT]));
+    pricelist_set_active(pricelist, json_is_true(fields[PRICELIST_FIELD_ACTIVE]));
+    pricelist_set_use_prices(pricelist, json_is_true(fields[PRICELIST_FIELD_USE_PRICES]));
+
+    json_t *items = fields[PRICELIST_FIELD_ITEMS];
     if (json_is_array(items)) {
         size_t index;
         json_t *item;
+        json_t *item_fields[ITEM_FIELD_COUNT];
+        char scratch[7][JSON_VALUE_SCRATCH_SIZE];
         json_array_foreach(items, index, item) {
-            const char *product_code = json_string_value(json_object_get(item, "ProductCode"));
-            const char *product_name = json_string_value(json_object_get(item, "ProductName"));
-            double price = json_real_value(json_object_get(item, "Price"));
-            bool active = json_is_true(json_object_get(item, "Active"));
-            const char *client_code = json_string_value(json_object_get(item, "ClientCode"));
-            const char *client_name = json_string_value(json_object_get(item, "ClientName"));
-            const char *manufacture_id = json_string_value(json_object_get(item, "ManufactureID"));
-            const char *date_available_from = json_string_value(json_object_get(item, "DateAvailableFrom"));
-            const char *date_available_to = json_string_value(json_object_get(item, "DateAvailableTo"));
-            int min_quantity = json_integer_value(json_object_get(item, "MinQuantity"));
-            int max_quantity = json_integer_value(json_object_get(item, "MaxQuantity"));
-
-            pricelist_add_item(pricelist, product_code, product_name, price, active, 
-                               client_code, client_name, manufacture_id,
-                               date_available_from, date_available_to, min_quantity, max_quantity);
+            json_decoder_decode(pricelist_item_decoder, item, item_fields);
+
+            pricelist_add_item(pricelist,
+                               item_text(item_fields, ITEM_FIELD_PRODUCT_CODE, FIELD_TEXT, scratch[0]),
+                               item_text(item_fields, ITEM_FIELD_PRODUCT_NAME, FIELD_TEXT, scratch[1]),
+                               json_number_value(item_fields[ITEM_FIELD_PRICE]),
+                               json_is_true(item_fields[ITEM_FIELD_ACTIVE]),
+                               item_text(item_fields, ITEM_FIELD_CLIENT_CODE, FIELD_TEXT, scratch[2]),
+                               item_text(item_fields, ITEM_FIELD_CLIENT_NAME, FIELD_TEXT, scratch[3]),
+                               item_text(item_fields, ITEM_FIELD_MANUFACTURE_ID, FIELD_TEXT, scratch[4]),
+                               item_text(item_fields, ITEM_FIELD_DATE_AVAILABLE_FROM, FIELD_DATE, scratch[5]),
+                               item_text(item_fields, ITEM_FIELD_DATE_AVAILABLE_TO, FIELD_DATE, scratch[6]),
+                               (int)json_integer_value(item_fields[ITEM_FIELD_MIN_QUANTITY]),
+                               (int)json_integer_value(item_fields[ITEM_FIELD_MAX_QUANTITY]));
         }
     }
     
     return pricelist;
 }
 
-static bool pricelist_exists(PGconn *db_conn, const char *name) {
-    const char *query = "SELECT 1 FROM inventory.pricelists WHERE name = $1";
+// Looks up the stored pricelist by name. Returns false if it hasn't been
+// mirrored yet; otherwise fills in its id and the content hash it was last
+// written with.
+static bool pricelist_lookup(PGconn *db_conn, const char *name, int *pricelist_id, Fingerprint *content_hash) {
+    const char *query = "SELECT pricelist_id, content_hash FROM inventory.pricelists WHERE name = $1";
     const char *param_values[] = { name };
     int param_lengths[] = { strlen(name) };
     int param_formats[] = { 0 };  
 
-    PGresult *result = PQexecParams(db_conn, query, 1, NULL, param_values, param_lengths, param_formats, 0);
+    PGresult *result = sql_exec_params(db_conn, __func__, query, 1, param_values, param_lengths, param_formats);
 
     bool exists = (PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result) > 0);
+    if (exists) {
+        *pricelist_id = atoi(PQgetvalue(result, 0, 0));
+        *content_hash = fingerprint_from_string(PQgetvalue(result, 0, 1));
+    }
     PQclear(result);
 
     return exists;
 }
 
+static bool run_pricelist_command(PGconn *db_conn, const char *command) {
+    PGresult *result = sql_exec(db_conn, command, command);
+
+    bool success = (PQresultStatus(result) == PGRES_COMMAND_OK);
+    if (!success) {
+        fprintf(stderr, "%s failed: %s", command, PQerrorMessage(db_conn));
+    }
+
+    PQclear(result);
+    return success;
+}
+
+// Each pricelist is written in its own transaction so a half-applied diff
+// never leaves a content hash behind that claims the pricelist is current.
+// A changed pricelist is exported whole: every item, flattened with the
+// pricelist name, in the partition of the day it changed.
+static const ExportColumn pricelist_item_export_columns[] = {
+    {"PricelistName", FIELD_TEXT}, {"ProductCode", FIELD_TEXT}, {"ProductName", FIELD_TEXT},
+    {"Price", FIELD_REAL}, {"Active", FIELD_BOOL}, {"ClientCode", FIELD_TEXT},
+    {"ClientName", FIELD_TEXT}, {"ManufactureID", FIELD_TEXT}, {"DateAvailableFrom", FIELD_DATE},
+    {"DateAvailableTo", FIELD_DATE}, {"MinQuantity", FIELD_INTEGER}, {"MaxQuantity", FIELD_INTEGER},
+};
+
+static void pricelist_export(PricelistDataPtr pricelist) {
+    ExportDatasetPtr dataset = export_dataset_get("pricelist_items", pricelist_item_export_columns,
+                                                  sizeof(pricelist_item_export_columns) / sizeof(ExportColumn));
+    if (!dataset) {
+        return;
+    }
+
+    char numbers[3][32];
+    for (int i = 0; i < pricelist->item_count; i++) {
+        const struct PricelistItem *item = &pricelist->items[i];
+        snprintf(numbers[0], sizeof(numbers[0]), "%.17g", item->price);
+        snprintf(numbers[1], sizeof(numbers[1]), "%d", item->min_quantity);
+        snprintf(numbers[2], sizeof(numbers[2]), "%d", item->max_quantity);
+
+        const char *values[] = {
+            pricelist->name, item->product_code, item->product_name,
+            numbers[0], item->active ? "true" : "false", item->client_code,
+            item->client_name, item->manufacture_id,
+            item->date_available_from[0] ? item->date_available_from : NULL,
+            item->date_available_to[0] ? item->date_available_to : NULL,
+            numbers[1], numbers[2],
+        };
+        if (!export_dataset_append(dataset, NULL, pricelist->name, values)) {
+            return;
+        }
+    }
+}
+
+static bool pricelist_sync(PGconn *db_conn, PricelistDataPtr pricelist) {
+    int stored_id;
+    Fingerprint stored_hash;
+
+    bool stored = pricelist_lookup(db_conn, pricelist->name, &stored_id, &stored_hash);
+    if (stored && stored_hash == pricelist_get_content_hash(pricelist)) {
+        pricelist->pricelist_id = stored_id;
+        return true;
+    }
+
+    // Items land in this month's partition, which has to exist before the
+    // transaction starts
+    partition_ensure(db_conn, "inventory.pricelist_items", NULL);
+
+    if (stored) {
+        if (!run_pricelist_command(db_conn, "BEGIN")) {
+            return false;
+        }
+        if (!pricelist_update(db_conn, pricelist)) {
+            run_pricelist_command(db_conn, "ROLLBACK");
+            return false;
+        }
+    } else {
+        if (!run_pricelist_command(db_conn, "BEGIN")) {
+            return false;
+        }
+        if (!pricelist_insert(db_conn, pricelist)) {
+            run_pricelist_command(db_conn, "ROLLBACK");
+            return false;
+        }
+    }
+
+    if (!run_pricelist_command(db_conn, "COMMIT")) {
+        return false;
+    }
+    pricelist_export(pricelist);
+    return true;
+}
+
+// Decoding (and item hashing) runs on the shared pool; each task fills its own
+// slot so pricelists are written back in Repsly's order.
+struct PricelistDecodeBatch {
+    json_t *records;
+    PricelistDataPtr *pricelists;
+};
+
+static void pricelist_decode_task(void *context, size_t index) {
+    struct PricelistDecodeBatch *batch = (struct PricelistDecodeBatch *)context;
+    batch->pricelists[index] = pricelist_from_json(json_array_get(batch->records, index));
+}
+
 bool pricelist_fetch_and_insert(PGconn *db_conn, long last_processed_id) {
     json_t *root = api_fetch_data("pricelists", last_processed_id);
     if (!root) {
         return false;
     }
 
+    bool success = pricelist_load_page(db_conn, root, last_processed_id);
+    json_decref(root);
+    return success;
+}
+
+long pricelist_page_cursor(json_t *root, long last_processed_id) {
+    long max_processed_id = last_processed_id;
     size_t index;
     json_t *pricelist_json;
+    json_array_foreach(root, index, pricelist_json) {
+        long current_id = (long)json_integer_value(json_object_get(pricelist_json, "ID"));
+        if (current_id > max_processed_id) {
+            max_processed_id = current_id;
+        }
+    }
+    return max_processed_id;
+}
+
+bool pricelist_load_page(PGconn *db_conn, json_t *root, long last_processed_id) {
+    if (!pricelist_decoders_init()) {
+        return false;
+    }
+
+    size_t count = json_array_size(root);
+    struct PricelistDecodeBatch batch = {root, calloc(count ? count : 1, sizeof(PricelistDataPtr))};
+    if (!batch.pricelists) {
+        fprintf(stderr, "Failed to allocate pricelist batch\n");
+        return false;
+    }
+    thread_pool_run(thread_pool_shared(), count, pricelist_decode_task, &batch);
+
     long max_processed_id = last_processed_id;
+    for (size_t index = 0; index < count; index++) {
+        PricelistDataPtr pricelist = batch.pricelists[index];
+        if (!pricelist) {
+            continue;
+        }
 
-    json_array_foreach(root, index, pricelist_json) {
-        PricelistDataPtr pricelist = pricelist_from_json(pricelist_json);
-        
-        if (pricelist_exists(db_conn, pricelist->name)) {
-            if (!pricelist_update(db_conn, pricelist)) {
-                fprintf(stderr, "Failed to update pricelist\n");
-                pricelist_free(pricelist);
-                continue;
-            }
-        } else {
-            if (!pricelist_insert(db_conn, pricelist)) {
-                fprintf(stderr, "Failed to insert pricelist\n");
-                pricelist_free(pricelist);
-                continue;
-            }
+        if (!pricelist_sync(db_conn, pricelist)) {
+            fprintf(stderr, "Failed to sync pricelist %s\n", pricelist->name);
+            pricelist_free(pricelist);
+            continue;
         }
 
-        long current_id = pricelist_get_id(pricelist);
+        // The cursor follows Repsly's pricelist ID, not our local serial;
+        // otherwise the same pricelists come back on every run.
+        long current_id = json_integer_value(json_object_get(json_array_get(root, index), "ID"));
         if (current_id > max_processed_id) {
             max_processed_id = current_id;
         }
@@ -356,7 +764,7 @@ bool pricelist_fetch_and_insert(PGconn *db_conn, long last_processed_id) {
         pricelist_free(pricelist);
     }
 
-    json_decref(root);
+    free(batch.pricelists);
 
     // Update the last processed ID
     if (!update_last_processed(db_conn, "pricelists", max_processed_id)) {
@@ -364,4 +772,4 @@ bool pricelist_fetch_and_insert(PGconn *db_conn, long last_processed_id) {
     }
 
     return true;
-}
\ No newline at end of file
+}
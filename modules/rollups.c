@@ -0,0 +1,30 @@
+#include "../include/rollups.h"
+#include "../include/sql_stats.h"
+#include <stdio.h>
+#include <string.h>
+
+bool rollups_rebuild(PGconn *db_conn, const char *table) {
+    PGresult *result = sql_exec(db_conn, __func__, "SELECT to_regprocedure('rollups.rebuild(text)') IS NOT NULL");
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Looking up rollups failed: %s", PQerrorMessage(db_conn));
+        PQclear(result);
+        return false;
+    }
+    bool installed = strcmp(PQgetvalue(result, 0, 0), "t") == 0;
+    PQclear(result);
+    if (!installed) {
+        return true;
+    }
+
+    const char *param_values[] = {table};
+    result = sql_exec_params(db_conn, __func__, "SELECT rollups.rebuild($1)", 1, param_values, NULL, NULL);
+
+    bool success = (PQresultStatus(result) == PGRES_TUPLES_OK);
+    if (!success) {
+        fprintf(stderr, "Rebuilding rollups for %s failed: %s", table ? table : "all tables",
+                PQerrorMessage(db_conn));
+    }
+
+    PQclear(result);
+    return success;
+}
@@ -0,0 +1,236 @@
+#include "../include/scheduler.h"
+#include "../include/api.h"
+#include "../include/core_operations.h"
+#include "../include/leases.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <jansson.h>
+
+enum EntityState {
+    ENTITY_IDLE,        // not part of this run
+    ENTITY_PENDING,
+    ENTITY_SETTLED,     // drained, failed, or held by another instance
+};
+
+struct ScheduledEntity {
+    const EntityInfo *info;
+    int *dependencies;
+    int dependency_count;
+    enum EntityState state;
+
+    long cursor;
+    bool cursor_known;
+    size_t page_capacity;   // most records seen on one page
+    int last_pages;         // pages the previous run loaded
+    long page_ms;           // moving average of fetch plus load time per page
+};
+
+struct Scheduler {
+    struct ScheduledEntity *entities;
+    int count;
+};
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+SchedulerPtr scheduler_create(const EntityInfo *entities, int count) {
+    SchedulerPtr scheduler = calloc(1, sizeof(struct Scheduler));
+    if (!scheduler) {
+        return NULL;
+    }
+    scheduler->entities = calloc((size_t)count, sizeof(struct ScheduledEntity));
+    if (!scheduler->entities) {
+        free(scheduler);
+        return NULL;
+    }
+    scheduler->count = count;
+
+    for (int i = 0; i < count; i++) {
+        struct ScheduledEntity *entity = &scheduler->entities[i];
+        entity->info = &entities[i];
+        if (!entities[i].dependencies) {
+            continue;
+        }
+
+        int named = 0;
+        while (entities[i].dependencies[named]) {
+            named++;
+        }
+        entity->dependencies = calloc((size_t)named, sizeof(int));
+        if (!entity->dependencies) {
+            scheduler_free(scheduler);
+            return NULL;
+        }
+        // Dependencies outside the list being scheduled are ignored
+        for (int d = 0; d < named; d++) {
+            for (int j = 0; j < count; j++) {
+                if (j != i && strcmp(entities[j].name, entities[i].dependencies[d]) == 0) {
+                    entity->dependencies[entity->dependency_count++] = j;
+                }
+            }
+        }
+    }
+    return scheduler;
+}
+
+void scheduler_free(SchedulerPtr scheduler) {
+    if (!scheduler) {
+        return;
+    }
+    for (int i = 0; i < scheduler->count; i++) {
+        free(scheduler->entities[i].dependencies);
+    }
+    free(scheduler->entities);
+    free(scheduler);
+}
+
+static bool entity_ready(const struct Scheduler *scheduler, const struct ScheduledEntity *entity) {
+    for (int d = 0; d < entity->dependency_count; d++) {
+        if (scheduler->entities[entity->dependencies[d]].state == ENTITY_PENDING) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Ready entity expected to drain soonest; one not run before counts as
+// quickest, so its numbers get measured. A dependency cycle falls back to
+// registry order. -1 once nothing is pending.
+static int scheduler_pick(SchedulerPtr scheduler) {
+    int best = -1;
+    int first_pending = -1;
+    long best_cost = 0;
+    for (int i = 0; i < scheduler->count; i++) {
+        struct ScheduledEntity *entity = &scheduler->entities[i];
+        if (entity->state != ENTITY_PENDING) {
+            continue;
+        }
+        if (first_pending < 0) {
+            first_pending = i;
+        }
+        if (!entity_ready(scheduler, entity)) {
+            continue;
+        }
+
+        long cost = (entity->last_pages > 0 ? entity->last_pages : 1) * entity->page_ms;
+        if (best < 0 || cost < best_cost) {
+            best = i;
+            best_cost = cost;
+        }
+    }
+    return best >= 0 ? best : first_pending;
+}
+
+// Records on a page: the length of its record array, the largest array at
+// the top level of the response
+static size_t page_records(json_t *root) {
+    size_t records = 0;
+    const char *key;
+    json_t *value;
+    json_object_foreach(root, key, value) {
+        if (json_is_array(value) && json_array_size(value) > records) {
+            records = json_array_size(value);
+        }
+    }
+    return records;
+}
+
+// One page through load_text when the entity has it, else through the DOM
+static bool scheduler_load(PGconn *db_conn, const EntityInfo *info, long cursor, long *next_cursor,
+                           size_t *records) {
+    if (info->load_text) {
+        size_t length;
+        char *text = api_fetch_raw(info->endpoint, cursor, &length);
+        if (!text) {
+            fprintf(stderr, "Failed to fetch %s\n", info->name);
+            return false;
+        }
+        bool loaded = info->load_text(db_conn, text, length, cursor, next_cursor, records);
+        free(text);
+        if (!loaded) {
+            fprintf(stderr, "Failed to load %s page\n", info->name);
+        }
+        return loaded;
+    }
+
+    json_t *root = api_fetch_data(info->endpoint, cursor);
+    if (!root) {
+        fprintf(stderr, "Failed to fetch %s\n", info->name);
+        return false;
+    }
+
+    *next_cursor = info->page_cursor(root, cursor);
+    *records = page_records(root);
+    bool loaded = info->load_page(db_conn, root, cursor);
+    json_decref(root);
+    if (!loaded) {
+        fprintf(stderr, "Failed to load %s page\n", info->name);
+    }
+    return loaded;
+}
+
+static bool scheduler_drain(PGconn *db_conn, struct ScheduledEntity *entity, const volatile sig_atomic_t *stop) {
+    const EntityInfo *info = entity->info;
+    if (!lease_acquire(db_conn, info->name)) {
+        return true;
+    }
+    if (!entity->cursor_known || leases_enabled()) {
+        entity->cursor = get_last_processed(db_conn, info->name);
+        entity->cursor_known = true;
+    }
+
+    bool success = true;
+    int pages = 0;
+    while (!(stop && *stop)) {
+        long started = now_ms();
+        long next_cursor;
+        size_t records;
+        if (!scheduler_load(db_conn, info, entity->cursor, &next_cursor, &records)) {
+            success = false;
+            break;
+        }
+
+        long elapsed = now_ms() - started;
+        entity->page_ms = entity->page_ms ? (entity->page_ms * 3 + elapsed) / 4 : elapsed;
+        pages++;
+
+        bool advanced = next_cursor > entity->cursor;
+        bool short_page = records < entity->page_capacity;
+        if (records > entity->page_capacity) {
+            entity->page_capacity = records;
+        }
+        if (advanced) {
+            entity->cursor = next_cursor;
+        }
+        if (!advanced || short_page) {
+            break;
+        }
+    }
+
+    entity->last_pages = pages;
+    lease_release(db_conn, info->name);
+    return success;
+}
+
+bool scheduler_run(SchedulerPtr scheduler, PGconn *db_conn, const bool *due, const volatile sig_atomic_t *stop) {
+    for (int i = 0; i < scheduler->count; i++) {
+        scheduler->entities[i].state = !due || due[i] ? ENTITY_PENDING : ENTITY_IDLE;
+    }
+
+    bool success = true;
+    while (!(stop && *stop)) {
+        int next = scheduler_pick(scheduler);
+        if (next < 0) {
+            break;
+        }
+        struct ScheduledEntity *entity = &scheduler->entities[next];
+        success = scheduler_drain(db_conn, entity, stop) && success;
+        entity->state = ENTITY_SETTLED;
+    }
+    return success;
+}
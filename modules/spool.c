@@ -0,0 +1,479 @@
+#include "../include/spool.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define SPOOL_SEGMENT_SIZE (64UL * 1024 * 1024)
+#define SPOOL_RECORD_MAGIC 0x314c5053u   // "SPL1"
+#define MAX_SPOOL_ENTITIES 64
+#define SPOOL_ENTITY_NAME_SIZE 64
+#define SPOOL_PATH_SIZE 1024
+
+// A record is this header followed by the entity name and the page body, both
+// NUL-terminated, padded to 8 bytes. The checksum covers everything after the
+// crc field, so a torn record never looks valid. Freshly created segments are
+// zero-filled, which reads as "no record here".
+struct SpoolRecordHeader {
+    uint32_t magic;
+    uint32_t crc;
+    uint64_t payload_length;
+    int64_t request_cursor;
+    int64_t next_cursor;
+    uint32_t name_length;
+    uint32_t reserved;
+};
+
+struct SpoolSegment {
+    uint64_t seq;
+    uint8_t *data;
+    size_t size;
+};
+
+struct SpoolCursor {
+    char entity_name[SPOOL_ENTITY_NAME_SIZE];
+    long cursor;
+};
+
+struct Spool {
+    char *dir;
+    pthread_mutex_t lock;
+    pthread_cond_t appended;
+
+    struct SpoolSegment write_segment;
+    size_t write_offset;
+
+    // Committed position, plus the end of the record handed out by spool_next
+    uint64_t read_seq;
+    size_t read_offset;
+    struct SpoolSegment read_segment;
+    bool has_pending;
+    uint64_t pending_seq;
+    size_t pending_offset;
+
+    uint64_t oldest_seq;
+
+    struct SpoolCursor cursors[MAX_SPOOL_ENTITIES];
+    int cursor_count;
+};
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+static void segment_path(SpoolPtr spool, uint64_t seq, char *path) {
+    snprintf(path, SPOOL_PATH_SIZE, "%s/segment-%020llu", spool->dir, (unsigned long long)seq);
+}
+
+static void segment_unmap(struct SpoolSegment *segment) {
+    if (segment->data) {
+        munmap(segment->data, segment->size);
+    }
+    segment->data = NULL;
+    segment->size = 0;
+}
+
+// Maps an existing segment, or creates a zero-filled one of at least min_size
+static bool segment_map(SpoolPtr spool, uint64_t seq, bool create, size_t min_size, struct SpoolSegment *segment) {
+    char path[SPOOL_PATH_SIZE];
+    segment_path(spool, seq, path);
+
+    int fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    if (fd < 0) {
+        if (create || errno != ENOENT) {
+            fprintf(stderr, "Failed to open spool segment %s: %s\n", path, strerror(errno));
+        }
+        return false;
+    }
+
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    size_t size = ok ? (size_t)st.st_size : 0;
+    if (ok && create) {
+        size = min_size > SPOOL_SEGMENT_SIZE ? min_size : SPOOL_SEGMENT_SIZE;
+        ok = ftruncate(fd, (off_t)size) == 0;
+    }
+
+    void *data = MAP_FAILED;
+    if (ok && size > 0) {
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to map spool segment %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    segment->seq = seq;
+    segment->data = data;
+    segment->size = size;
+    return true;
+}
+
+static uint32_t record_crc(const struct SpoolRecordHeader *header, const uint8_t *payload) {
+    const uint8_t *start = (const uint8_t *)&header->payload_length;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, start, (uInt)(sizeof(*header) - offsetof(struct SpoolRecordHeader, payload_length)));
+    crc = crc32(crc, payload, (uInt)header->payload_length);
+    return (uint32_t)crc;
+}
+
+static bool record_at(const struct SpoolSegment *segment, size_t offset, struct SpoolRecordHeader *header) {
+    if (offset + sizeof(*header) > segment->size) {
+        return false;
+    }
+    memcpy(header, segment->data + offset, sizeof(*header));
+    if (header->magic != SPOOL_RECORD_MAGIC ||
+        header->payload_length > segment->size - offset - sizeof(*header) ||
+        header->name_length >= header->payload_length) {
+        return false;
+    }
+    return record_crc(header, segment->data + offset + sizeof(*header)) == header->crc;
+}
+
+static size_t record_size(const struct SpoolRecordHeader *header) {
+    return align8(sizeof(*header) + header->payload_length);
+}
+
+static void remember_cursor(SpoolPtr spool, const char *entity_name, long cursor) {
+    for (int i = 0; i < spool->cursor_count; i++) {
+        if (strcmp(spool->cursors[i].entity_name, entity_name) == 0) {
+            if (cursor > spool->cursors[i].cursor) {
+                spool->cursors[i].cursor = cursor;
+            }
+            return;
+        }
+    }
+
+    if (spool->cursor_count < MAX_SPOOL_ENTITIES) {
+        struct SpoolCursor *entry = &spool->cursors[spool->cursor_count++];
+        snprintf(entry->entity_name, sizeof(entry->entity_name), "%s", entity_name);
+        entry->cursor = cursor;
+    }
+}
+
+static bool segment_range(SpoolPtr spool, uint64_t *lowest, uint64_t *highest) {
+    DIR *dir = opendir(spool->dir);
+    if (!dir) {
+        return false;
+    }
+
+    bool found = false;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long long seq;
+        if (sscanf(entry->d_name, "segment-%llu", &seq) != 1) {
+            continue;
+        }
+        if (!found || seq < *lowest) {
+            *lowest = seq;
+        }
+        if (!found || seq > *highest) {
+            *highest = seq;
+        }
+        found = true;
+    }
+
+    closedir(dir);
+    return found;
+}
+
+static bool read_committed(SpoolPtr spool, uint64_t *seq, size_t *offset) {
+    char path[SPOOL_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/committed", spool->dir);
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+
+    unsigned long long committed_seq, committed_offset;
+    bool ok = fscanf(file, "%llu %llu", &committed_seq, &committed_offset) == 2;
+    fclose(file);
+
+    if (ok) {
+        *seq = committed_seq;
+        *offset = (size_t)committed_offset;
+    }
+    return ok;
+}
+
+// Replaces the committed file atomically: a crash leaves either the old or the
+// new position, never a mix.
+static bool write_committed(SpoolPtr spool, uint64_t seq, size_t offset) {
+    char path[SPOOL_PATH_SIZE];
+    char temp_path[SPOOL_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/committed", spool->dir);
+    snprintf(temp_path, sizeof(temp_path), "%s/committed.tmp", spool->dir);
+
+    FILE *file = fopen(temp_path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to write %s: %s\n", temp_path, strerror(errno));
+        return false;
+    }
+
+    bool ok = fprintf(file, "%llu %llu\n", (unsigned long long)seq, (unsigned long long)offset) > 0 &&
+              fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok;
+    if (ok && rename(temp_path, path) != 0) {
+        fprintf(stderr, "Failed to rename %s: %s\n", temp_path, strerror(errno));
+        ok = false;
+    }
+    return ok;
+}
+
+// Walks the uncommitted records to find where appending continues and how far
+// each entity has already been fetched.
+static bool spool_recover(SpoolPtr spool) {
+    uint64_t lowest = 0, highest = 0;
+    bool have_segments = segment_range(spool, &lowest, &highest);
+
+    if (!read_committed(spool, &spool->read_seq, &spool->read_offset)) {
+        spool->read_seq = have_segments ? lowest : 0;
+        spool->read_offset = 0;
+    }
+    spool->oldest_seq = have_segments ? lowest : spool->read_seq;
+
+    if (!have_segments || highest < spool->read_seq) {
+        spool->write_offset = 0;
+        return segment_map(spool, spool->read_seq, true, 0, &spool->write_segment);
+    }
+
+    for (uint64_t seq = spool->read_seq; seq <= highest; seq++) {
+        struct SpoolSegment segment;
+        if (!segment_map(spool, seq, false, 0, &segment)) {
+            if (seq == highest) {
+                return false;
+            }
+            continue;
+        }
+
+        size_t offset = (seq == spool->read_seq) ? spool->read_offset : 0;
+        struct SpoolRecordHeader header;
+        while (record_at(&segment, offset, &header)) {
+            const char *entity_name = (const char *)segment.data + offset + sizeof(header);
+            remember_cursor(spool, entity_name, (long)header.next_cursor);
+            offset += record_size(&header);
+        }
+
+        if (seq == highest) {
+            // Whatever follows the last intact record is a torn append
+            memset(segment.data + offset, 0, segment.size - offset);
+            spool->write_segment = segment;
+            spool->write_offset = offset;
+        } else {
+            segment_unmap(&segment);
+        }
+    }
+
+    return true;
+}
+
+SpoolPtr spool_open(const char *dir) {
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create spool directory %s: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+
+    SpoolPtr spool = calloc(1, sizeof(struct Spool));
+    if (!spool) {
+        return NULL;
+    }
+    spool->dir = strdup(dir);
+    if (!spool->dir) {
+        free(spool);
+        return NULL;
+    }
+    pthread_mutex_init(&spool->lock, NULL);
+    pthread_cond_init(&spool->appended, NULL);
+
+    if (!spool_recover(spool)) {
+        fprintf(stderr, "Failed to recover spool %s\n", dir);
+        spool_close(spool);
+        return NULL;
+    }
+    return spool;
+}
+
+void spool_close(SpoolPtr spool) {
+    if (!spool) {
+        return;
+    }
+    segment_unmap(&spool->write_segment);
+    segment_unmap(&spool->read_segment);
+    pthread_mutex_destroy(&spool->lock);
+    pthread_cond_destroy(&spool->appended);
+    free(spool->dir);
+    free(spool);
+}
+
+bool spool_append(SpoolPtr spool, const char *entity_name, long request_cursor, long next_cursor,
+                  const char *data, size_t length) {
+    struct SpoolRecordHeader header = {0};
+    header.name_length = (uint32_t)strlen(entity_name);
+    header.payload_length = header.name_length + 1 + length + 1;
+    header.request_cursor = request_cursor;
+    header.next_cursor = next_cursor;
+    size_t needed = record_size(&header);
+
+    pthread_mutex_lock(&spool->lock);
+
+    if (spool->write_offset + needed > spool->write_segment.size) {
+        struct SpoolSegment segment;
+        if (!segment_map(spool, spool->write_segment.seq + 1, true, needed, &segment)) {
+            pthread_mutex_unlock(&spool->lock);
+            return false;
+        }
+        segment_unmap(&spool->write_segment);
+        spool->write_segment = segment;
+        spool->write_offset = 0;
+    }
+
+    uint8_t *record = spool->write_segment.data + spool->write_offset;
+    uint8_t *payload = record + sizeof(header);
+    memcpy(payload, entity_name, header.name_length + 1);
+    memcpy(payload + header.name_length + 1, data, length);
+    payload[header.name_length + 1 + length] = '\0';
+
+    header.magic = SPOOL_RECORD_MAGIC;
+    header.crc = record_crc(&header, payload);
+    memcpy(record, &header, sizeof(header));
+
+    // The record only counts once it is on disk
+    long page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t sync_start = (uintptr_t)record & ~(uintptr_t)(page_size - 1);
+    if (msync((void *)sync_start, (uintptr_t)(record + needed) - sync_start, MS_SYNC) != 0) {
+        fprintf(stderr, "Failed to sync spool record: %s\n", strerror(errno));
+        memset(record, 0, sizeof(header));
+        pthread_mutex_unlock(&spool->lock);
+        return false;
+    }
+
+    spool->write_offset += needed;
+    remember_cursor(spool, entity_name, next_cursor);
+    pthread_cond_broadcast(&spool->appended);
+    pthread_mutex_unlock(&spool->lock);
+    return true;
+}
+
+long spool_fetch_cursor(SpoolPtr spool, const char *entity_name, long fallback) {
+    long cursor = fallback;
+
+    pthread_mutex_lock(&spool->lock);
+    for (int i = 0; i < spool->cursor_count; i++) {
+        if (strcmp(spool->cursors[i].entity_name, entity_name) == 0 && spool->cursors[i].cursor > cursor) {
+            cursor = spool->cursors[i].cursor;
+        }
+    }
+    pthread_mutex_unlock(&spool->lock);
+
+    return cursor;
+}
+
+void spool_rewind_cursor(SpoolPtr spool, const char *entity_name, long cursor) {
+    pthread_mutex_lock(&spool->lock);
+    for (int i = 0; i < spool->cursor_count; i++) {
+        if (strcmp(spool->cursors[i].entity_name, entity_name) == 0 && spool->cursors[i].cursor > cursor) {
+            spool->cursors[i].cursor = cursor;
+        }
+    }
+    pthread_mutex_unlock(&spool->lock);
+}
+
+bool spool_next(SpoolPtr spool, SpoolRecord *record, int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&spool->lock);
+
+    uint64_t seq = spool->read_seq;
+    size_t offset = spool->read_offset;
+    while (true) {
+        if (seq == spool->write_segment.seq && offset >= spool->write_offset) {
+            if (pthread_cond_timedwait(&spool->appended, &spool->lock, &deadline) != 0) {
+                pthread_mutex_unlock(&spool->lock);
+                return false;
+            }
+            continue;
+        }
+
+        if (!spool->read_segment.data || spool->read_segment.seq != seq) {
+            segment_unmap(&spool->read_segment);
+            if (!segment_map(spool, seq, false, 0, &spool->read_segment)) {
+                if (seq >= spool->write_segment.seq) {
+                    pthread_mutex_unlock(&spool->lock);
+                    return false;
+                }
+                seq++;
+                offset = 0;
+                continue;
+            }
+        }
+
+        struct SpoolRecordHeader header;
+        if (record_at(&spool->read_segment, offset, &header)) {
+            const uint8_t *payload = spool->read_segment.data + offset + sizeof(header);
+            record->entity_name = (const char *)payload;
+            record->request_cursor = (long)header.request_cursor;
+            record->next_cursor = (long)header.next_cursor;
+            record->data = (const char *)payload + header.name_length + 1;
+            record->length = header.payload_length - header.name_length - 2;
+
+            spool->has_pending = true;
+            spool->pending_seq = seq;
+            spool->pending_offset = offset + record_size(&header);
+            pthread_mutex_unlock(&spool->lock);
+            return true;
+        }
+
+        if (seq >= spool->write_segment.seq) {
+            fprintf(stderr, "Spool segment %llu is corrupt at offset %zu\n", (unsigned long long)seq, offset);
+            pthread_mutex_unlock(&spool->lock);
+            return false;
+        }
+
+        // End of an older segment: carry on in the next one
+        seq++;
+        offset = 0;
+    }
+}
+
+bool spool_commit(SpoolPtr spool) {
+    pthread_mutex_lock(&spool->lock);
+
+    if (!spool->has_pending || !write_committed(spool, spool->pending_seq, spool->pending_offset)) {
+        pthread_mutex_unlock(&spool->lock);
+        return false;
+    }
+
+    spool->read_seq = spool->pending_seq;
+    spool->read_offset = spool->pending_offset;
+    spool->has_pending = false;
+
+    for (; spool->oldest_seq < spool->read_seq; spool->oldest_seq++) {
+        char path[SPOOL_PATH_SIZE];
+        segment_path(spool, spool->oldest_seq, path);
+        if (unlink(path) != 0 && errno != ENOENT) {
+            fprintf(stderr, "Failed to remove spool segment %s: %s\n", path, strerror(errno));
+        }
+    }
+
+    pthread_mutex_unlock(&spool->lock);
+    return true;
+}
@@ -0,0 +1,183 @@
+#include "../include/spool_sync.h"
+#include "../include/api.h"
+#include "../include/json_arena.h"
+#include "../include/core_operations.h"
+#include "../include/leases.h"
+#include "../include/trace.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jansson.h>
+
+#define SPOOL_POLL_MS 200
+
+struct FetchJob {
+    SpoolPtr spool;
+    const EntityInfo *const *entities;
+    const long *cursors;   // -1 skips the entity
+    atomic_bool *stopped;  // set by the load side once an entity's page fails
+    int count;
+    atomic_bool done;
+};
+
+// Fetch side: the only user of the API handle while a spooled sync runs
+static void *fetch_thread(void *arg) {
+    struct FetchJob *job = (struct FetchJob *)arg;
+
+    for (int i = 0; i < job->count; i++) {
+        const EntityInfo *entity = job->entities[i];
+        long cursor = job->cursors[i];
+
+        while (cursor >= 0 && !atomic_load(&job->stopped[i])) {
+            size_t length;
+            char *body = api_fetch_raw(entity->endpoint, cursor, &length);
+            if (!body) {
+                break;
+            }
+
+            json_error_t error;
+            TraceSpan span = trace_begin();
+            json_t *root = json_arena_load(body, length, &error);
+            trace_end(span, "json_parse", entity->endpoint);
+            if (!root) {
+                fprintf(stderr, "JSON parsing error in %s page: %s\n", entity->name, error.text);
+                free(body);
+                break;
+            }
+            long next_cursor = entity->page_cursor(root, cursor);
+            json_decref(root);
+
+            bool spooled = spool_append(job->spool, entity->name, cursor, next_cursor, body, length);
+            free(body);
+            if (!spooled || next_cursor <= cursor) {
+                break;
+            }
+            cursor = next_cursor;
+        }
+    }
+
+    atomic_store(&job->done, true);
+    return NULL;
+}
+
+// Load side. A page that fails because the database went away stays spooled.
+// One that fails against a healthy database, or can't be read, is rejected:
+// it leaves the spool, and the caller stops loading its entity so the cursor
+// stays at that page and the next run fetches it again.
+static bool load_record(PGconn *db_conn, SpoolPtr spool, const SpoolRecord *record, bool *rejected) {
+    const EntityInfo *entity = entity_registry_find(record->entity_name);
+    if (!entity) {
+        fprintf(stderr, "Dropping spooled page of unknown entity %s\n", record->entity_name);
+        return spool_commit(spool);
+    }
+
+    json_error_t error;
+    json_t *root = json_arena_load(record->data, record->length, &error);
+    if (!root) {
+        fprintf(stderr, "Unreadable spooled %s page, fetching it again next run\n", record->entity_name);
+        *rejected = true;
+        return spool_commit(spool);
+    }
+
+    bool loaded = entity->load_page(db_conn, root, record->request_cursor);
+    json_decref(root);
+
+    if (PQstatus(db_conn) != CONNECTION_OK) {
+        fprintf(stderr, "Database unavailable, leaving %s pages spooled\n", record->entity_name);
+        return false;
+    }
+    if (!loaded) {
+        fprintf(stderr, "Failed to load spooled %s page, fetching it again next run\n", record->entity_name);
+        *rejected = true;
+    }
+    return spool_commit(spool);
+}
+
+static int entity_index(const EntityInfo *const *entities, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(entities[i]->name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool spool_sync(PGconn *db_conn, SpoolPtr spool, const EntityInfo *const *entities, int count) {
+    bool db_ok = db_ensure_connected(db_conn);
+
+    // Without the database only entities whose cursor the spool already knows
+    // can be fetched; starting the others from zero would re-download everything.
+    long loaded_to[count];
+    long cursors[count];
+    for (int i = 0; i < count; i++) {
+        loaded_to[i] = db_ok ? get_last_processed(db_conn, entities[i]->name) : -1;
+        cursors[i] = spool_fetch_cursor(spool, entities[i]->name, loaded_to[i]);
+    }
+
+    // Where each entity's first rejected page started, -1 while none was
+    long rewinds[count];
+    atomic_bool stopped[count];
+    for (int i = 0; i < count; i++) {
+        rewinds[i] = -1;
+        atomic_init(&stopped[i], false);
+    }
+
+    struct FetchJob job = {spool, entities, cursors, stopped, count, false};
+
+    // Seed jansson's hashing before two threads start parsing
+    json_object_seed(0);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, fetch_thread, &job) != 0) {
+        fprintf(stderr, "Failed to start fetch thread\n");
+        return false;
+    }
+
+    bool loading = db_ok;
+    while (loading) {
+        bool fetch_done = atomic_load(&job.done);
+
+        SpoolRecord record;
+        if (!spool_next(spool, &record, SPOOL_POLL_MS)) {
+            if (fetch_done) {
+                break;
+            }
+            continue;
+        }
+
+        // Pages after a rejected one are skipped; loading them would move the
+        // cursor past the page that still has to be loaded. So are pages from
+        // before the cursor, which another instance loaded after this one
+        // spooled them, and with leases, pages of entities this instance
+        // doesn't hold: their holder fetches them again from the cursor.
+        int i = entity_index(entities, count, record.entity_name);
+        if (i < 0 && leases_enabled()) {
+            spool_rewind_cursor(spool, record.entity_name, -1);
+            loading = spool_commit(spool);
+            continue;
+        }
+        if (i >= 0 && (rewinds[i] >= 0 || record.request_cursor < loaded_to[i])) {
+            loading = spool_commit(spool);
+            continue;
+        }
+
+        bool rejected = false;
+        long request_cursor = record.request_cursor;
+        loading = load_record(db_conn, spool, &record, &rejected);
+        if (rejected && i >= 0) {
+            rewinds[i] = request_cursor;
+            atomic_store(&stopped[i], true);
+        }
+    }
+
+    // The fetch side finishes its pages even when loading stopped
+    pthread_join(thread, NULL);
+    for (int i = 0; i < count; i++) {
+        if (rewinds[i] >= 0) {
+            spool_rewind_cursor(spool, entities[i]->name, rewinds[i]);
+        }
+    }
+    return loading;
+}
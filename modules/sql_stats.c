@@ -0,0 +1,288 @@
+#include "../include/sql_stats.h"
+#include "../include/trace.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define MAX_SQL_TAGS 128
+#define LATENCY_BUCKETS 24          // bucket b holds latencies below 2^b microseconds
+#define DEFAULT_SLOW_MS 1000
+#define SLOW_CAPTURE_INTERVAL 60    // seconds between plans captured for one tag
+#define MAX_PIPELINED 256
+
+struct SqlTagStats {
+    const char *tag;
+    unsigned long count;
+    unsigned long failures;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    unsigned long buckets[LATENCY_BUCKETS];
+    time_t last_capture;
+};
+
+static struct SqlTagStats tag_stats[MAX_SQL_TAGS];
+static int tag_count;
+static long slow_threshold_ms = -1;   // -1 until read from the environment
+static bool capturing;
+
+// Statements queued in pipeline mode, oldest first
+struct PipelinedStatement {
+    const char *tag;
+    uint64_t start;
+    TraceSpan span;
+};
+
+static struct PipelinedStatement pipelined[MAX_PIPELINED];
+static int pipelined_head;
+static int pipelined_count;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Tags are almost always the same literal, so the pointer is compared first
+static struct SqlTagStats *tag_stats_get(const char *tag) {
+    for (int i = 0; i < tag_count; i++) {
+        if (tag_stats[i].tag == tag || strcmp(tag_stats[i].tag, tag) == 0) {
+            return &tag_stats[i];
+        }
+    }
+    if (tag_count == MAX_SQL_TAGS) {
+        return NULL;
+    }
+    tag_stats[tag_count].tag = tag;
+    return &tag_stats[tag_count++];
+}
+
+static int latency_bucket(uint64_t elapsed_ns) {
+    uint64_t us = elapsed_ns / 1000;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && us >= ((uint64_t)1 << bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+static long slow_threshold(void) {
+    if (slow_threshold_ms < 0) {
+        const char *configured = getenv("REPSLY_SLOW_SQL_MS");
+        slow_threshold_ms = configured ? atol(configured) : DEFAULT_SLOW_MS;
+        if (slow_threshold_ms < 0) {
+            slow_threshold_ms = 0;
+        }
+    }
+    return slow_threshold_ms;
+}
+
+// Only plannable statements are explained; BEGIN, COPY and DDL aren't
+static bool explainable(const char *query) {
+    while (*query == ' ' || *query == '\n' || *query == '(') {
+        query++;
+    }
+    const char *verbs[] = {"SELECT", "INSERT", "UPDATE", "DELETE", "WITH"};
+    for (size_t i = 0; i < sizeof(verbs) / sizeof(verbs[0]); i++) {
+        size_t n = strlen(verbs[i]);
+        if (strncasecmp(query, verbs[i], n) == 0 && (query[n] == ' ' || query[n] == '\n')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool run_quiet(PGconn *conn, const char *command) {
+    PGresult *result = PQexec(conn, command);
+    bool success = (PQresultStatus(result) == PGRES_COMMAND_OK);
+    PQclear(result);
+    return success;
+}
+
+static void capture_plan(PGconn *conn, const char *tag, const char *query, int n_params,
+                         const char *const *param_values, const int *param_lengths, const int *param_formats,
+                         double elapsed_ms) {
+    bool in_transaction = PQtransactionStatus(conn) == PQTRANS_INTRANS;
+    if (!run_quiet(conn, in_transaction ? "SAVEPOINT sql_stats_explain" : "BEGIN")) {
+        return;
+    }
+
+    const char *prefix = "EXPLAIN (ANALYZE, BUFFERS, FORMAT JSON) ";
+    size_t length = strlen(prefix) + strlen(query) + 1;
+    char *explain = malloc(length);
+    PGresult *plan = NULL;
+    if (explain) {
+        snprintf(explain, length, "%s%s", prefix, query);
+        plan = PQexecParams(conn, explain, n_params, NULL, param_values, param_lengths, param_formats, 0);
+        free(explain);
+    }
+    bool planned = PQresultStatus(plan) == PGRES_TUPLES_OK && PQntuples(plan) > 0;
+    if (!planned) {
+        fprintf(stderr, "EXPLAIN of slow %s statement failed: %s", tag, PQerrorMessage(conn));
+    }
+
+    // The rerun's effects go; the plan row is written after, so it commits
+    // with the caller's transaction (or on its own)
+    if (!run_quiet(conn, in_transaction ? "ROLLBACK TO SAVEPOINT sql_stats_explain" : "ROLLBACK") || !planned) {
+        PQclear(plan);
+        return;
+    }
+
+    char duration[32];
+    snprintf(duration, sizeof(duration), "%.3f", elapsed_ms);
+    const char *log_values[] = {tag, query, duration, PQgetvalue(plan, 0, 0)};
+    PGresult *logged = PQexecParams(conn,
+        "INSERT INTO meta.slow_statements (tag, query, duration_ms, plan) VALUES ($1, $2, $3, $4::jsonb)",
+        4, NULL, log_values, NULL, NULL, 0);
+    if (PQresultStatus(logged) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "INSERT INTO meta.slow_statements failed: %s", PQerrorMessage(conn));
+    }
+    PQclear(logged);
+    PQclear(plan);
+}
+
+static struct SqlTagStats *sql_stats_count(const char *tag, uint64_t elapsed, bool failed) {
+    struct SqlTagStats *stats = tag_stats_get(tag);
+    if (stats) {
+        stats->count++;
+        stats->failures += failed;
+        stats->total_ns += elapsed;
+        stats->max_ns = elapsed > stats->max_ns ? elapsed : stats->max_ns;
+        stats->buckets[latency_bucket(elapsed)]++;
+    }
+    return stats;
+}
+
+static void sql_stats_record(PGconn *conn, const char *tag, const char *query, int n_params,
+                             const char *const *param_values, const int *param_lengths, const int *param_formats,
+                             uint64_t start, PGresult *result) {
+    uint64_t elapsed = now_ns() - start;
+    ExecStatusType status = PQresultStatus(result);
+    bool failed = status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK && status != PGRES_COPY_IN;
+
+    struct SqlTagStats *stats = sql_stats_count(tag, elapsed, failed);
+
+    long threshold = slow_threshold();
+    if (failed || threshold == 0 || elapsed < (uint64_t)threshold * 1000000u || capturing || !explainable(query)) {
+        return;
+    }
+
+    time_t now = time(NULL);
+    if (stats && stats->last_capture && now - stats->last_capture < SLOW_CAPTURE_INTERVAL) {
+        return;
+    }
+    if (stats) {
+        stats->last_capture = now;
+    }
+
+    capturing = true;
+    capture_plan(conn, tag, query, n_params, param_values, param_lengths, param_formats, (double)elapsed / 1e6);
+    capturing = false;
+}
+
+PGresult *sql_exec(PGconn *conn, const char *tag, const char *command) {
+    TraceSpan span = trace_begin();
+    uint64_t start = now_ns();
+    PGresult *result = PQexec(conn, command);
+    trace_end(span, tag, NULL);
+    sql_stats_record(conn, tag, command, 0, NULL, NULL, NULL, start, result);
+    return result;
+}
+
+PGresult *sql_exec_params(PGconn *conn, const char *tag, const char *query, int n_params,
+                          const char *const *param_values, const int *param_lengths, const int *param_formats) {
+    TraceSpan span = trace_begin();
+    uint64_t start = now_ns();
+    PGresult *result = PQexecParams(conn, query, n_params, NULL, param_values, param_lengths, param_formats, 0);
+    trace_end(span, tag, n_params > 0 && !(param_formats && param_formats[0]) ? param_values[0] : NULL);
+    sql_stats_record(conn, tag, query, n_params, param_values, param_lengths, param_formats, start, result);
+    return result;
+}
+
+PGresult *sql_exec_prepared(PGconn *conn, const char *tag, const char *stmt_name, const char *query, int n_params,
+                            const char *const *param_values, const int *param_lengths, const int *param_formats) {
+    TraceSpan span = trace_begin();
+    uint64_t start = now_ns();
+    PGresult *result = PQexecPrepared(conn, stmt_name, n_params, param_values, param_lengths, param_formats, 0);
+    trace_end(span, tag, n_params > 0 && !(param_formats && param_formats[0]) ? param_values[0] : NULL);
+    sql_stats_record(conn, tag, query, n_params, param_values, param_lengths, param_formats, start, result);
+    return result;
+}
+
+bool sql_send_params(PGconn *conn, const char *tag, const char *query, int n_params,
+                     const char *const *param_values, const int *param_lengths, const int *param_formats) {
+    TraceSpan span = trace_begin();
+    uint64_t start = now_ns();
+    if (!PQsendQueryParams(conn, query, n_params, NULL, param_values, param_lengths, param_formats, 0)) {
+        sql_stats_count(tag, now_ns() - start, true);
+        return false;
+    }
+
+    // A pipeline longer than the queue still runs; its tail just isn't counted
+    if (pipelined_count < MAX_PIPELINED) {
+        struct PipelinedStatement *statement = &pipelined[(pipelined_head + pipelined_count++) % MAX_PIPELINED];
+        statement->tag = tag;
+        statement->start = start;
+        statement->span = span;
+    }
+    return true;
+}
+
+void sql_pipeline_result(PGresult *result) {
+    ExecStatusType status = PQresultStatus(result);
+    if (status == PGRES_PIPELINE_SYNC) {
+        sql_pipeline_discard();
+        return;
+    }
+    if (pipelined_count == 0) {
+        return;
+    }
+
+    struct PipelinedStatement *statement = &pipelined[pipelined_head];
+    pipelined_head = (pipelined_head + 1) % MAX_PIPELINED;
+    pipelined_count--;
+
+    trace_end(statement->span, statement->tag, NULL);
+    sql_stats_count(statement->tag, now_ns() - statement->start,
+                    status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK);
+}
+
+void sql_pipeline_discard(void) {
+    pipelined_head = 0;
+    pipelined_count = 0;
+}
+
+// Percentiles are read off the histogram, so each is the upper bound of the
+// bucket it falls in
+static double percentile_ms(const struct SqlTagStats *stats, double fraction) {
+    unsigned long target = (unsigned long)(stats->count * fraction);
+    unsigned long seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += stats->buckets[b];
+        if (seen > target) {
+            return (double)((uint64_t)1 << b) / 1000.0;
+        }
+    }
+    return (double)stats->max_ns / 1e6;
+}
+
+static int compare_total(const void *a, const void *b) {
+    const struct SqlTagStats *left = a, *right = b;
+    return (left->total_ns < right->total_ns) - (left->total_ns > right->total_ns);
+}
+
+void sql_stats_report(FILE *out) {
+    struct SqlTagStats sorted[MAX_SQL_TAGS];
+    memcpy(sorted, tag_stats, (size_t)tag_count * sizeof(struct SqlTagStats));
+    qsort(sorted, (size_t)tag_count, sizeof(struct SqlTagStats), compare_total);
+
+    fprintf(out, "%-32s %10s %8s %12s %10s %10s %10s %10s\n", "statement", "calls", "failed", "total ms",
+            "p50 ms", "p95 ms", "p99 ms", "max ms");
+    for (int i = 0; i < tag_count; i++) {
+        const struct SqlTagStats *stats = &sorted[i];
+        fprintf(out, "%-32s %10lu %8lu %12.1f %10.3f %10.3f %10.3f %10.3f\n", stats->tag, stats->count,
+                stats->failures, (double)stats->total_ns / 1e6, percentile_ms(stats, 0.50),
+                percentile_ms(stats, 0.95), percentile_ms(stats, 0.99), (double)stats->max_ns / 1e6);
+    }
+}
@@ -0,0 +1,90 @@
+#include "../include/sql_text.h"
+#include "../include/sql_stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Makes room for extra bytes plus the terminator
+static bool sql_reserve(struct SqlText *sql, size_t extra) {
+    if (sql->length + extra + 1 <= sql->capacity) {
+        return true;
+    }
+    size_t capacity = sql->capacity ? sql->capacity : 1024;
+    while (sql->length + extra + 1 > capacity) {
+        capacity *= 2;
+    }
+    char *data = realloc(sql->data, capacity);
+    if (!data) {
+        sql->failed = true;
+        return false;
+    }
+    sql->data = data;
+    sql->capacity = capacity;
+    return true;
+}
+
+bool sql_append(struct SqlText *sql, const char *text) {
+    size_t n = strlen(text);
+    if (sql->failed || !sql_reserve(sql, n)) {
+        return false;
+    }
+    memcpy(sql->data + sql->length, text, n + 1);
+    sql->length += n;
+    return true;
+}
+
+bool sql_append_escaped(struct SqlText *sql, PGconn *db_conn, const char *text, bool identifier) {
+    char *escaped = identifier ? PQescapeIdentifier(db_conn, text, strlen(text))
+                               : PQescapeLiteral(db_conn, text, strlen(text));
+    if (!escaped) {
+        sql->failed = true;
+        return false;
+    }
+    bool appended = sql_append(sql, escaped);
+    PQfreemem(escaped);
+    return appended;
+}
+
+bool sql_append_array_int(struct SqlText *sql, int value) {
+    char text[16];
+    snprintf(text, sizeof(text), "%s%d", sql->length > 1 ? "," : "", value);
+    return sql_append(sql, text);
+}
+
+bool sql_append_array_text(struct SqlText *sql, const char *value) {
+    if (sql->length > 1 && !sql_append(sql, ",")) {
+        return false;
+    }
+    if (!value) {
+        return sql_append(sql, "NULL");
+    }
+
+    size_t n = strlen(value);
+    if (sql->failed || !sql_reserve(sql, n * 2 + 2)) {
+        return false;
+    }
+    char *out = sql->data + sql->length;
+    *out++ = '"';
+    for (const char *p = value; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            *out++ = '\\';
+        }
+        *out++ = *p;
+    }
+    *out++ = '"';
+    *out = '\0';
+    sql->length = (size_t)(out - sql->data);
+    return true;
+}
+
+bool sql_run(PGconn *db_conn, const char *tag, const char *sql) {
+    PGresult *result = sql_exec(db_conn, tag, sql);
+
+    bool success = (PQresultStatus(result) == PGRES_COMMAND_OK);
+    if (!success) {
+        fprintf(stderr, "%s failed: %s", sql, PQerrorMessage(db_conn));
+    }
+
+    PQclear(result);
+    return success;
+}
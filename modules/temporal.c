@@ -0,0 +1,237 @@
+#include "../include/temporal.h"
+#include <string.h>
+
+#define USEC_PER_DAY 86400000000LL
+#define MS_PER_DAY 86400000LL
+#define UNIX_EPOCH_DAYS 10957       // 1970-01-01, counted from 2000-01-01
+#define MIN_DAYS -730119            // 0001-01-01
+#define MAX_DAYS 2921939            // 9999-12-31
+#define EPOCH_SECONDS_LIMIT 100000000000LL  // larger epoch integers are milliseconds
+
+static int64_t floor_div(int64_t a, int64_t b) {
+    return a / b - (a % b < 0);
+}
+
+// Days since 1970-01-01 for a proleptic Gregorian date, and back
+static int64_t days_from_civil(int year, int month, int day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t year_of_era = year - era * 400;
+    int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+static void civil_from_days(int64_t days, int *year, int *month, int *day) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t day_of_era = days - era * 146097;
+    int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int64_t month_index = (5 * day_of_year + 2) / 153;
+    *day = (int)(day_of_year - (153 * month_index + 2) / 5 + 1);
+    *month = (int)(month_index < 10 ? month_index + 3 : month_index - 9);
+    *year = (int)(year_of_era + era * 400 + (*month <= 2));
+}
+
+static int days_in_month(int year, int month) {
+    static const int lengths[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    return lengths[month - 1] + (month == 2 && leap);
+}
+
+static bool from_unix_ms(int64_t ms, FieldType type, int64_t *value) {
+    int64_t days = floor_div(ms, MS_PER_DAY) - UNIX_EPOCH_DAYS;
+    if (days < MIN_DAYS || days > MAX_DAYS) {
+        return false;
+    }
+    *value = type == FIELD_DATE ? days : ms * 1000 - UNIX_EPOCH_DAYS * USEC_PER_DAY;
+    return true;
+}
+
+
+// Parsing
+
+static bool take_char(const char **p, char c) {
+    if (**p != c) {
+        return false;
+    }
+    (*p)++;
+    return true;
+}
+
+static bool take_digits(const char **p, int count, int *value) {
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        if ((*p)[i] < '0' || (*p)[i] > '9') {
+            return false;
+        }
+        result = result * 10 + ((*p)[i] - '0');
+    }
+    *p += count;
+    *value = result;
+    return true;
+}
+
+// After "/Date(": milliseconds, an optional ±hhmm, then ")/"
+static bool parse_ms_date(const char *p, FieldType type, int64_t *value) {
+    bool negative = take_char(&p, '-');
+    if (*p < '0' || *p > '9') {
+        return false;
+    }
+    int64_t ms = 0;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        if (ms > (INT64_MAX - 9) / 10) {
+            return false;
+        }
+        ms = ms * 10 + (*p - '0');
+    }
+
+    int zone;
+    if ((take_char(&p, '+') || take_char(&p, '-')) && !take_digits(&p, 4, &zone)) {
+        return false;
+    }
+    if (!take_char(&p, ')') || !take_char(&p, '/') || *p) {
+        return false;
+    }
+    return from_unix_ms(negative ? -ms : ms, type, value);
+}
+
+static bool parse_iso(const char *p, FieldType type, int64_t *value) {
+    int year, month, day, hour = 0, minute = 0, second = 0, usec = 0;
+    if (!take_digits(&p, 4, &year) || !take_char(&p, '-') || !take_digits(&p, 2, &month) ||
+        !take_char(&p, '-') || !take_digits(&p, 2, &day)) {
+        return false;
+    }
+    if (year < 1 || month < 1 || month > 12 || day < 1 || day > days_in_month(year, month)) {
+        return false;
+    }
+
+    if ((*p == 'T' || *p == ' ') && p[1] >= '0' && p[1] <= '9') {
+        p++;
+        if (!take_digits(&p, 2, &hour) || !take_char(&p, ':') || !take_digits(&p, 2, &minute)) {
+            return false;
+        }
+        if (take_char(&p, ':')) {
+            if (!take_digits(&p, 2, &second)) {
+                return false;
+            }
+            // Digits past microseconds are dropped
+            if (take_char(&p, '.') || take_char(&p, ',')) {
+                if (*p < '0' || *p > '9') {
+                    return false;
+                }
+                int digits = 0;
+                for (; *p >= '0' && *p <= '9'; p++) {
+                    if (digits < 6) {
+                        usec = usec * 10 + (*p - '0');
+                        digits++;
+                    }
+                }
+                for (; digits < 6; digits++) {
+                    usec *= 10;
+                }
+            }
+        }
+        if (hour > 23 || minute > 59 || second > 59) {
+            return false;
+        }
+    }
+
+    int zone;
+    if (!take_char(&p, 'Z') && (take_char(&p, '+') || take_char(&p, '-'))) {
+        if (!take_digits(&p, 2, &zone)) {
+            return false;
+        }
+        take_char(&p, ':');
+        if (*p >= '0' && *p <= '9' && !take_digits(&p, 2, &zone)) {
+            return false;
+        }
+    }
+    if (*p) {
+        return false;
+    }
+
+    int64_t days = days_from_civil(year, month, day) - UNIX_EPOCH_DAYS;
+    *value = type == FIELD_DATE
+        ? days
+        : days * USEC_PER_DAY + ((hour * 60 + minute) * 60 + second) * 1000000LL + usec;
+    return true;
+}
+
+bool temporal_parse(const char *text, FieldType type, int64_t *value) {
+    if (!text) {
+        return false;
+    }
+    if (strncmp(text, "/Date(", 6) == 0) {
+        return parse_ms_date(text + 6, type, value);
+    }
+    return parse_iso(text, type, value);
+}
+
+bool temporal_from_epoch(int64_t epoch, FieldType type, int64_t *value) {
+    bool seconds = epoch <= EPOCH_SECONDS_LIMIT && epoch >= -EPOCH_SECONDS_LIMIT;
+    return from_unix_ms(seconds ? epoch * 1000 : epoch, type, value);
+}
+
+bool temporal_decode(json_t *json, FieldType type, int64_t *value) {
+    if (json_is_integer(json)) {
+        return temporal_from_epoch((int64_t)json_integer_value(json), type, value);
+    }
+    return temporal_parse(json_string_value(json), type, value);
+}
+
+
+// Output
+
+static char *put_digits(char *out, int64_t number, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        out[i] = (char)('0' + number % 10);
+        number /= 10;
+    }
+    return out + width;
+}
+
+const char *temporal_format(int64_t value, FieldType type, char *out) {
+    int64_t days = type == FIELD_DATE ? value : floor_div(value, USEC_PER_DAY);
+    int year, month, day;
+    civil_from_days(days + UNIX_EPOCH_DAYS, &year, &month, &day);
+
+    char *p = put_digits(out, year, 4);
+    *p++ = '-';
+    p = put_digits(p, month, 2);
+    *p++ = '-';
+    p = put_digits(p, day, 2);
+
+    if (type != FIELD_DATE) {
+        int64_t usec = value - days * USEC_PER_DAY;
+        int64_t seconds = usec / 1000000;
+        *p++ = ' ';
+        p = put_digits(p, seconds / 3600, 2);
+        *p++ = ':';
+        p = put_digits(p, seconds / 60 % 60, 2);
+        *p++ = ':';
+        p = put_digits(p, seconds % 60, 2);
+
+        int64_t fraction = usec % 1000000;
+        if (fraction) {
+            *p++ = '.';
+            p = put_digits(p, fraction, 6);
+            while (p[-1] == '0') {
+                p--;
+            }
+        }
+    }
+    *p = '\0';
+    return out;
+}
+
+int temporal_binary(int64_t value, FieldType type, char *out) {
+    // int64 microseconds or int32 days, big-endian
+    int length = type == FIELD_DATE ? 4 : 8;
+    uint64_t bits = (uint64_t)value;
+    for (int i = 0; i < length; i++) {
+        out[i] = (char)(bits >> (8 * (length - 1 - i)));
+    }
+    return length;
+}
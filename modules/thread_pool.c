@@ -0,0 +1,302 @@
+#include "../include/thread_pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define MAX_POOL_WORKERS 64
+#define RANGES_PER_WORKER 8
+
+// Ranges carry their own task so a worker still draining the previous run
+// can never apply the old task to new indices.
+struct TaskRange {
+    ThreadPoolTask task;
+    void *context;
+    size_t begin;
+    size_t end;
+};
+
+struct WorkDeque {
+    pthread_mutex_t lock;
+    struct TaskRange *ranges;
+    size_t head;      // steal end
+    size_t tail;      // owner end
+    size_t capacity;
+};
+
+struct ThreadPool {
+    pthread_t *threads;
+    struct WorkDeque *deques;
+    int deque_count;
+    int worker_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    unsigned long generation;
+    bool shutting_down;
+
+    atomic_size_t pending;
+};
+
+struct WorkerStart {
+    ThreadPoolPtr pool;
+    int id;
+};
+
+static bool deque_pop_back(struct WorkDeque *deque, struct TaskRange *range) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->tail > deque->head;
+    if (found) {
+        *range = deque->ranges[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool deque_steal_front(struct WorkDeque *deque, struct TaskRange *range) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->tail > deque->head;
+    if (found) {
+        *range = deque->ranges[deque->head++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool worker_next_range(ThreadPoolPtr pool, int id, struct TaskRange *range) {
+    if (deque_pop_back(&pool->deques[id], range)) {
+        return true;
+    }
+    for (int offset = 1; offset < pool->worker_count; offset++) {
+        if (deque_steal_front(&pool->deques[(id + offset) % pool->worker_count], range)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *worker_main(void *arg) {
+    struct WorkerStart start = *(struct WorkerStart *)arg;
+    free(arg);
+
+    ThreadPoolPtr pool = start.pool;
+    unsigned long seen_generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutting_down && pool->generation == seen_generation) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->shutting_down) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen_generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        struct TaskRange range;
+        while (worker_next_range(pool, start.id, &range)) {
+            for (size_t i = range.begin; i < range.end; i++) {
+                range.task(range.context, i);
+            }
+
+            size_t done = range.end - range.begin;
+            if (atomic_fetch_sub(&pool->pending, done) == done) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->work_done);
+                pthread_mutex_unlock(&pool->lock);
+            }
+        }
+    }
+}
+
+ThreadPoolPtr thread_pool_create(int worker_count) {
+    if (worker_count < 1) {
+        worker_count = 1;
+    }
+    if (worker_count > MAX_POOL_WORKERS) {
+        worker_count = MAX_POOL_WORKERS;
+    }
+
+    ThreadPoolPtr pool = calloc(1, sizeof(struct ThreadPool));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->threads = calloc(worker_count, sizeof(pthread_t));
+    pool->deques = calloc(worker_count, sizeof(struct WorkDeque));
+    if (!pool->threads || !pool->deques) {
+        free(pool->threads);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    atomic_init(&pool->pending, 0);
+    for (int i = 0; i < worker_count; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    pool->deque_count = worker_count;
+
+    for (int i = 0; i < worker_count; i++) {
+        struct WorkerStart *start = malloc(sizeof(struct WorkerStart));
+        if (!start) {
+            break;
+        }
+        start->pool = pool;
+        start->id = i;
+
+        if (pthread_create(&pool->threads[i], NULL, worker_main, start) != 0) {
+            fprintf(stderr, "Failed to start decode worker %d\n", i);
+            free(start);
+            break;
+        }
+        pool->worker_count++;
+    }
+
+    if (pool->worker_count == 0) {
+        thread_pool_free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void thread_pool_free(ThreadPoolPtr pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutting_down = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->worker_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for (int i = 0; i < pool->deque_count; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].ranges);
+    }
+
+    pthread_cond_destroy(&pool->work_done);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+int thread_pool_worker_count(ThreadPoolPtr pool) {
+    return pool->worker_count;
+}
+
+static void run_inline(size_t count, ThreadPoolTask task, void *context) {
+    for (size_t i = 0; i < count; i++) {
+        task(context, i);
+    }
+}
+
+void thread_pool_run(ThreadPoolPtr pool, size_t count, ThreadPoolTask task, void *context) {
+    if (count == 0) {
+        return;
+    }
+
+    // Not worth waking anyone for
+    if (!pool || pool->worker_count == 1 || count == 1) {
+        run_inline(count, task, context);
+        return;
+    }
+
+    size_t grain = (count + (size_t)pool->worker_count * RANGES_PER_WORKER - 1) /
+                   ((size_t)pool->worker_count * RANGES_PER_WORKER);
+    size_t range_count = (count + grain - 1) / grain;
+    size_t per_deque = (range_count + pool->worker_count - 1) / pool->worker_count;
+
+    // Only workers that actually started get ranges; the rest of the deques
+    // stay empty.
+    for (int i = 0; i < pool->worker_count; i++) {
+        struct WorkDeque *deque = &pool->deques[i];
+        pthread_mutex_lock(&deque->lock);
+        if (deque->capacity < per_deque) {
+            struct TaskRange *ranges = realloc(deque->ranges, per_deque * sizeof(struct TaskRange));
+            if (ranges) {
+                deque->ranges = ranges;
+                deque->capacity = per_deque;
+            }
+        }
+        bool has_room = deque->capacity >= per_deque;
+        pthread_mutex_unlock(&deque->lock);
+
+        if (!has_room) {
+            run_inline(count, task, context);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->pending, count);
+
+    // Deal the ranges out round-robin so every worker starts with local work
+    int worker = 0;
+    for (size_t begin = 0; begin < count; begin += grain) {
+        struct WorkDeque *deque = &pool->deques[worker];
+        struct TaskRange range = {task, context, begin, begin + grain < count ? begin + grain : count};
+
+        pthread_mutex_lock(&deque->lock);
+        deque->ranges[deque->tail++] = range;
+        pthread_mutex_unlock(&deque->lock);
+
+        worker = (worker + 1) % pool->worker_count;
+    }
+
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+
+    while (atomic_load(&pool->pending) > 0) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->worker_count; i++) {
+        pthread_mutex_lock(&pool->deques[i].lock);
+        pool->deques[i].head = 0;
+        pool->deques[i].tail = 0;
+        pthread_mutex_unlock(&pool->deques[i].lock);
+    }
+}
+
+
+static ThreadPoolPtr shared_pool;
+
+ThreadPoolPtr thread_pool_shared(void) {
+    if (shared_pool) {
+        return shared_pool;
+    }
+
+    int workers = 0;
+    const char *configured = getenv("REPSLY_DECODE_THREADS");
+    if (configured) {
+        workers = atoi(configured);
+    }
+    if (workers <= 0) {
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    shared_pool = thread_pool_create(workers);
+    return shared_pool;
+}
+
+void thread_pool_shared_free(void) {
+    thread_pool_free(shared_pool);
+    shared_pool = NULL;
+}
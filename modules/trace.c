@@ -0,0 +1,178 @@
+#include "../include/trace.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_RING_EVENTS 65536
+#define TRACE_DETAIL_SIZE 48
+
+struct TraceEvent {
+    const char *name;
+    uint64_t start;
+    uint64_t duration;
+    char detail[TRACE_DETAIL_SIZE];
+};
+
+// Written only by its thread. written counts every event ever recorded; the
+// release store publishes an event before the count that covers it.
+struct TraceRing {
+    struct TraceEvent *events;
+    size_t capacity;
+    atomic_size_t written;
+    int thread_id;
+    struct TraceRing *next;
+};
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static const char *trace_path;
+static size_t ring_events = DEFAULT_RING_EVENTS;
+
+static _Atomic(struct TraceRing *) rings;
+static atomic_int ring_count;
+static _Thread_local struct TraceRing *thread_ring;
+static _Thread_local bool thread_ring_failed;
+
+static void trace_configure(void) {
+    const char *path = getenv("REPSLY_TRACE");
+    if (path && *path) {
+        trace_path = path;
+    }
+
+    const char *configured = getenv("REPSLY_TRACE_EVENTS");
+    long events = configured ? atol(configured) : 0;
+    if (events > 0) {
+        ring_events = (size_t)events;
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static struct TraceRing *ring_get(void) {
+    if (thread_ring || thread_ring_failed) {
+        return thread_ring;
+    }
+
+    struct TraceRing *ring = calloc(1, sizeof(struct TraceRing));
+    if (ring) {
+        ring->events = malloc(ring_events * sizeof(struct TraceEvent));
+    }
+    if (!ring || !ring->events) {
+        free(ring);
+        thread_ring_failed = true;
+        return NULL;
+    }
+    ring->capacity = ring_events;
+    ring->thread_id = atomic_fetch_add(&ring_count, 1) + 1;
+
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+    }
+    thread_ring = ring;
+    return ring;
+}
+
+TraceSpan trace_begin(void) {
+    pthread_once(&trace_once, trace_configure);
+    return trace_path ? now_ns() : 0;
+}
+
+void trace_end(TraceSpan span, const char *name, const char *detail) {
+    if (!span) {
+        return;
+    }
+    struct TraceRing *ring = ring_get();
+    if (!ring) {
+        return;
+    }
+
+    size_t written = atomic_load_explicit(&ring->written, memory_order_relaxed);
+    struct TraceEvent *event = &ring->events[written % ring->capacity];
+    event->name = name;
+    event->start = span;
+    event->duration = now_ns() - span;
+    size_t length = detail ? strnlen(detail, TRACE_DETAIL_SIZE - 1) : 0;
+    // A cut detail ends on a UTF-8 character boundary
+    if (detail && detail[length] != '\0') {
+        while (length > 0 && ((unsigned char)detail[length] & 0xC0) == 0x80) {
+            length--;
+        }
+    }
+    memcpy(event->detail, detail ? detail : "", length);
+    event->detail[length] = '\0';
+    atomic_store_explicit(&ring->written, written + 1, memory_order_release);
+}
+
+static void write_json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+void trace_shutdown(void) {
+    if (!trace_path) {
+        return;
+    }
+
+    FILE *out = fopen(trace_path, "w");
+    if (!out) {
+        fprintf(stderr, "Failed to open trace file %s\n", trace_path);
+        return;
+    }
+
+    // Timestamps are made relative to the earliest recorded span
+    uint64_t origin = UINT64_MAX;
+    for (struct TraceRing *ring = atomic_load(&rings); ring; ring = ring->next) {
+        size_t written = atomic_load_explicit(&ring->written, memory_order_acquire);
+        size_t first = written > ring->capacity ? written - ring->capacity : 0;
+        for (size_t i = first; i < written; i++) {
+            uint64_t start = ring->events[i % ring->capacity].start;
+            origin = start < origin ? start : origin;
+        }
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    bool first_event = true;
+    for (struct TraceRing *ring = atomic_load(&rings); ring; ring = ring->next) {
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                     "\"args\":{\"name\":\"thread %d\"}}",
+                first_event ? "" : ",", ring->thread_id, ring->thread_id);
+        first_event = false;
+
+        size_t written = atomic_load_explicit(&ring->written, memory_order_acquire);
+        size_t first = written > ring->capacity ? written - ring->capacity : 0;
+        for (size_t i = first; i < written; i++) {
+            const struct TraceEvent *event = &ring->events[i % ring->capacity];
+            fprintf(out, ",\n{\"name\":");
+            write_json_string(out, event->name);
+            fprintf(out, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", ring->thread_id,
+                    (double)(event->start - origin) / 1000.0, (double)event->duration / 1000.0);
+            if (event->detail[0]) {
+                fprintf(out, ",\"args\":{\"detail\":");
+                write_json_string(out, event->detail);
+                fputc('}', out);
+            }
+            fputc('}', out);
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Failed to write trace file %s\n", trace_path);
+    }
+}
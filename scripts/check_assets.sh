@@ -0,0 +1,82 @@
+#!/bin/sh
+# Checks the asset mirror against a local server. Serves fixture images with
+# python3 -m http.server, points a few test photos at them, runs
+# `repsly_mirror --assets` and checks meta.assets and the store.
+#
+# Run from anywhere after `make`, with the REPSLY_DB_* variables naming a
+# scratch database that has sql/repsly_postgres.sql loaded. Needs psql and
+# python3. The test photos have negative repsly_ids; they and their
+# meta.assets rows are deleted afterwards.
+set -eu
+
+cd "$(dirname "$0")/.."
+port=${ASSET_CHECK_PORT:-8765}
+base="http://127.0.0.1:$port"
+work=$(mktemp -d)
+server=
+
+export PGHOST="$REPSLY_DB_HOST" PGPORT="$REPSLY_DB_PORT" PGUSER="$REPSLY_DB_USER"
+export PGPASSWORD="$REPSLY_DB_PASSWORD" PGDATABASE="$REPSLY_DB_NAME"
+
+sql() {
+    psql -X -q -t -A -v ON_ERROR_STOP=1 -c "$1"
+}
+
+fail() {
+    echo "FAIL: $1" >&2
+    exit 1
+}
+
+cleanup() {
+    if [ -n "$server" ]; then
+        kill "$server" 2>/dev/null || true
+    fi
+    sql "DELETE FROM field_ops.photos WHERE repsly_id < 0;
+         DELETE FROM meta.assets WHERE url LIKE '$base/%'" >/dev/null 2>&1 || true
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+# A 1x1 PNG under two names, so it must be stored once, and a name that 404s
+mkdir -p "$work/fixtures" "$work/store"
+png=iVBORw0KGgoAAAANSUhEUgAAAAEAAAABCAAAAAA6fptVAAAACklEQVR4nGNgAAAAAgABSK+kcQAAAABJRU5ErkJggg==
+echo "$png" | python3 -c 'import base64, sys; sys.stdout.buffer.write(base64.b64decode(sys.stdin.read()))' \
+    > "$work/fixtures/one.png"
+cp "$work/fixtures/one.png" "$work/fixtures/same.png"
+
+python3 -m http.server "$port" --bind 127.0.0.1 --directory "$work/fixtures" >/dev/null 2>&1 &
+server=$!
+tries=0
+until python3 -c "import urllib.request; urllib.request.urlopen('$base/one.png')" 2>/dev/null; do
+    tries=$((tries + 1))
+    [ "$tries" -lt 50 ] || fail "fixture server didn't start on port $port"
+    sleep 0.1
+done
+
+sql "DELETE FROM field_ops.photos WHERE repsly_id < 0;
+     DELETE FROM meta.assets WHERE url LIKE '$base/%';
+     INSERT INTO field_ops.photos (repsly_id, photo_url) VALUES
+         (-1, '$base/one.png'), (-2, '$base/same.png'), (-3, '$base/one.png'), (-4, '$base/missing.png')"
+
+REPSLY_ASSET_DIR="$work/store" bin/repsly_mirror --assets || fail "repsly_mirror --assets exited with $?"
+
+[ "$(sql "SELECT count(*) FROM meta.assets WHERE url LIKE '$base/%'")" = 3 ] ||
+    fail "expected 3 URLs in meta.assets"
+[ "$(sql "SELECT count(DISTINCT path) FROM meta.assets WHERE url LIKE '$base/%' AND http_status = 200")" = 1 ] ||
+    fail "the two copies of one image weren't stored as one file"
+[ "$(sql "SELECT http_status || ':' || (path IS NULL) FROM meta.assets WHERE url = '$base/missing.png'")" = "404:true" ] ||
+    fail "the missing image wasn't recorded as a 404 without a path"
+[ "$(sql "SELECT count(*) FROM field_ops.photos WHERE repsly_id < 0 AND photo_path IS NOT NULL")" = 3 ] ||
+    fail "photo_path wasn't set on the three photos that downloaded"
+
+path=$(sql "SELECT path FROM meta.assets WHERE url = '$base/one.png'")
+sha=$(sql "SELECT sha256 FROM meta.assets WHERE url = '$base/one.png'")
+[ -f "$work/store/$path" ] || fail "$path isn't in the store"
+[ "$(sha256sum "$work/store/$path" | cut -d ' ' -f 1)" = "$sha" ] || fail "$path doesn't match its sha256"
+case "$path" in
+    "$(echo "$sha" | cut -c 1-2)/$sha.png") ;;
+    *) fail "$path isn't named after its sha256" ;;
+esac
+[ "$(find "$work/store" -type f | wc -l)" -eq 1 ] || fail "the store holds more than one file"
+
+echo "Asset mirror checks passed"
@@ -0,0 +1,123 @@
+-- Change feed for downstream consumers. Statement-level triggers on the
+-- mirrored tables record the primary keys each statement inserted, updated
+-- or deleted in changes.outbox, inside the transaction that wrote them, and
+-- NOTIFY repsly_changes, which is delivered when that transaction commits.
+-- Changes to one table by one transaction and operation share a row, so a
+-- page written in one transaction is one record per table.
+--
+-- operation is I, U or D, or R when a backfill rewrote the table with its
+-- triggers off: keys is then empty and the whole table should be reread.
+-- Keys may repeat within a record.
+
+CREATE SCHEMA IF NOT EXISTS changes;
+
+CREATE TABLE changes.outbox (
+    change_id BIGSERIAL PRIMARY KEY,
+    entity TEXT NOT NULL,
+    operation CHAR(1) NOT NULL CHECK (operation IN ('I', 'U', 'D', 'R')),
+    keys TEXT[] NOT NULL,
+    txid BIGINT NOT NULL DEFAULT txid_current(),
+    recorded_at TIMESTAMPTZ NOT NULL DEFAULT now(),
+    UNIQUE (txid, entity, operation)
+);
+
+CREATE INDEX idx_outbox_recorded_at ON changes.outbox(recorded_at);
+
+-- The NOTIFY payload is {"change_id": ..., "entity": ..., "operation": ...};
+-- repeats of one payload within a transaction are delivered once
+CREATE OR REPLACE FUNCTION changes.record(source TEXT, op CHAR(1), changed TEXT[])
+RETURNS void AS $$
+DECLARE
+    id BIGINT;
+BEGIN
+    INSERT INTO changes.outbox AS o (entity, operation, keys)
+    VALUES (source, op, changed)
+    ON CONFLICT (txid, entity, operation) DO UPDATE SET keys = o.keys || EXCLUDED.keys
+    RETURNING change_id INTO id;
+
+    PERFORM pg_notify('repsly_changes',
+                      json_build_object('change_id', id, 'entity', source, 'operation', op)::text);
+END;
+$$ LANGUAGE plpgsql;
+
+-- TG_ARGV[0] names the primary key column. Statements that touched no rows
+-- record nothing.
+CREATE OR REPLACE FUNCTION changes.table_changed()
+RETURNS TRIGGER AS $$
+DECLARE
+    changed TEXT[];
+BEGIN
+    IF TG_OP = 'DELETE' THEN
+        EXECUTE format('SELECT array_agg(%I::text) FROM old_rows', TG_ARGV[0]) INTO changed;
+    ELSE
+        EXECUTE format('SELECT array_agg(%I::text) FROM new_rows', TG_ARGV[0]) INTO changed;
+    END IF;
+
+    IF changed IS NOT NULL THEN
+        PERFORM changes.record(TG_TABLE_SCHEMA || '.' || TG_TABLE_NAME, left(TG_OP, 1), changed);
+    END IF;
+    RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Three triggers per table, as a trigger with transition tables can only
+-- fire on one event
+DO $$
+DECLARE
+    t RECORD;
+BEGIN
+    FOR t IN SELECT * FROM (VALUES
+        ('sales.clients', 'clients', 'client_id'),
+        ('field_ops.visits', 'visits', 'visit_id'),
+        ('field_ops.forms', 'forms', 'form_id'),
+        ('sales.purchase_orders', 'orders', 'order_id'),
+        ('sales.purchase_order_items', 'order_items', 'item_id'),
+        ('inventory.products', 'products', 'product_id'),
+        ('inventory.pricelists', 'pricelists', 'pricelist_id'),
+        ('inventory.pricelist_items', 'pricelist_items', 'item_id'),
+        ('field_ops.photos', 'photos', 'photo_id'),
+        ('field_ops.retail_audits', 'retail_audits', 'audit_id'),
+        ('field_ops.daily_working_time', 'daily_working_time', 'dwt_id'),
+        ('field_ops.visit_schedules', 'visit_schedules', 'schedule_id'),
+        ('field_ops.representatives', 'representatives', 'rep_id'),
+        ('user_mgmt.users', 'users', 'user_id'),
+        ('sales.document_types', 'document_types', 'document_type_id')
+    ) AS tables (source, short_name, key_column)
+    LOOP
+        EXECUTE format('CREATE TRIGGER tr_%s_outbox_insert AFTER INSERT ON %s '
+                       'REFERENCING NEW TABLE AS new_rows FOR EACH STATEMENT '
+                       'EXECUTE FUNCTION changes.table_changed(%L)', t.short_name, t.source, t.key_column);
+        EXECUTE format('CREATE TRIGGER tr_%s_outbox_update AFTER UPDATE ON %s '
+                       'REFERENCING NEW TABLE AS new_rows FOR EACH STATEMENT '
+                       'EXECUTE FUNCTION changes.table_changed(%L)', t.short_name, t.source, t.key_column);
+        EXECUTE format('CREATE TRIGGER tr_%s_outbox_delete AFTER DELETE ON %s '
+                       'REFERENCING OLD TABLE AS old_rows FOR EACH STATEMENT '
+                       'EXECUTE FUNCTION changes.table_changed(%L)', t.short_name, t.source, t.key_column);
+    END LOOP;
+END;
+$$;
+
+
+-- Reading the feed. change_ids are drawn before commit, so they don't
+-- arrive in order when writers overlap; positions are transaction ids
+-- instead. read() returns the changes of transactions from since up to the
+-- oldest one still running, which have all finished, each with the position
+-- to pass next time. Start from 0; an empty result keeps the old position.
+
+CREATE OR REPLACE FUNCTION changes.read(since BIGINT DEFAULT 0)
+RETURNS TABLE (change_id BIGINT, entity TEXT, operation CHAR(1), keys TEXT[], recorded_at TIMESTAMPTZ,
+               next_position BIGINT) AS $$
+    SELECT o.change_id, o.entity, o.operation, o.keys, o.recorded_at, s.xmin
+    FROM (SELECT txid_snapshot_xmin(txid_current_snapshot()) AS xmin) s
+    JOIN changes.outbox o ON o.txid >= since AND o.txid < s.xmin
+    ORDER BY o.change_id;
+$$ LANGUAGE sql STABLE;
+
+-- Drops records older than keep, once every consumer is past them
+CREATE OR REPLACE FUNCTION changes.prune(keep INTERVAL DEFAULT '7 days')
+RETURNS BIGINT AS $$
+    WITH pruned AS (
+        DELETE FROM changes.outbox WHERE recorded_at < now() - keep RETURNING 1
+    )
+    SELECT count(*) FROM pruned;
+$$ LANGUAGE sql;
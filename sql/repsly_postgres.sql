@@ -6,6 +6,8 @@ CREATE SCHEMA IF NOT EXISTS user_mgmt;
 CREATE SCHEMA IF NOT EXISTS meta;
 CREATE SCHEMA IF NOT EXISTS geo;
 CREATE SCHEMA IF NOT EXISTS geography;
+CREATE SCHEMA IF NOT EXISTS form_templates;  -- per-template views over field_ops.forms.answers
+CREATE SCHEMA IF NOT EXISTS backfill;        -- staging tables of --backfill, dropped after each merge
 
 
 -- Meta tables
@@ -33,14 +35,16 @@ CREATE TABLE meta.custom_fields (
     field_id SERIAL PRIMARY KEY,
     entity_type VARCHAR(50),
     field_name VARCHAR(255),
-    field_type VARCHAR(50)
+    field_type VARCHAR(50),
+    UNIQUE (entity_type, field_name)
 );
 
 CREATE TABLE meta.custom_field_values (
     value_id SERIAL PRIMARY KEY,
     field_id INTEGER REFERENCES meta.custom_fields(field_id),
     entity_id INTEGER,
-    value TEXT
+    value TEXT,
+    UNIQUE (field_id, entity_id)
 );
 
 CREATE TABLE meta.attributes (
@@ -49,6 +53,45 @@ CREATE TABLE meta.attributes (
     attribute_type VARCHAR(50)
 );
 
+CREATE TABLE meta.last_processed (
+    entity_name VARCHAR(50) PRIMARY KEY,
+    last_value BIGINT NOT NULL DEFAULT 0
+);
+
+-- Entities claimed by running mirror instances (REPSLY_LEASES=1). A lease
+-- past expires_at is free to take.
+CREATE TABLE meta.leases (
+    name VARCHAR(50) PRIMARY KEY,
+    holder TEXT NOT NULL,
+    acquired_at TIMESTAMPTZ NOT NULL DEFAULT now(),
+    expires_at TIMESTAMPTZ NOT NULL
+);
+
+-- Plans of loader statements that ran over REPSLY_SLOW_SQL_MS
+CREATE TABLE meta.slow_statements (
+    statement_id BIGSERIAL PRIMARY KEY,
+    tag TEXT NOT NULL,
+    query TEXT NOT NULL,
+    duration_ms DOUBLE PRECISION NOT NULL,
+    plan JSONB NOT NULL,
+    captured_at TIMESTAMPTZ NOT NULL DEFAULT now()
+);
+
+CREATE INDEX idx_slow_statements_tag ON meta.slow_statements(tag, captured_at);
+
+-- Every image URL the asset mirror has tried, keyed by URL. path is relative
+-- to REPSLY_ASSET_DIR and NULL while the download keeps failing.
+CREATE TABLE meta.assets (
+    url TEXT PRIMARY KEY,
+    sha256 CHAR(64),
+    path TEXT,
+    bytes BIGINT,
+    http_status INTEGER,
+    fetched_at TIMESTAMPTZ NOT NULL DEFAULT now()
+);
+
+CREATE INDEX idx_assets_sha256 ON meta.assets(sha256);
+
 CREATE TABLE meta.attribute_values (
     value_id SERIAL PRIMARY KEY,
     attribute_id INTEGER REFERENCES meta.attributes(attribute_id),
@@ -108,7 +151,8 @@ CREATE TABLE core.addresses (
     street_address VARCHAR(255),
     zip_code_id INTEGER REFERENCES geography.zip_codes(zip_code_id),
     lat_id INTEGER REFERENCES geo.lat(lat_id),
-    long_id INTEGER REFERENCES geo.long(long_id)
+    long_id INTEGER REFERENCES geo.long(long_id),
+    UNIQUE(street_address, zip_code_id)
 );
 
 CREATE TABLE core.contact_info (
@@ -153,7 +197,7 @@ CREATE TABLE field_ops.rep_code (
 CREATE TABLE field_ops.representatives (
     rep_id SERIAL PRIMARY KEY,
     active BOOLEAN,
-    rep_code_id INTEGER REFERENCES field_ops.rep_code(rep_code_id),
+    rep_code_id INTEGER UNIQUE REFERENCES field_ops.rep_code(rep_code_id),
     note_id INTEGER REFERENCES meta.notes(note_id),
     address_id INTEGER REFERENCES core.addresses(address_id),
     contact_id INTEGER REFERENCES core.contact_info(contact_id),
@@ -167,8 +211,16 @@ CREATE TABLE field_ops.rep_territories (
     PRIMARY KEY (rep_id, territory_id)
 );
 
+-- The fact tables field_ops.visits, field_ops.forms, sales.purchase_order_items
+-- and inventory.pricelist_items are range partitioned by month. Only the
+-- DEFAULT partitions are created here; the mirror adds <table>_yYYYYmMM
+-- partitions ahead of the rows it writes (see partitions.h). Keys carry the
+-- partition column, and other tables keep visit_id without a foreign key,
+-- since a partitioned table can't be referenced by a column it isn't keyed on.
 CREATE TABLE field_ops.visits (
-    visit_id SERIAL PRIMARY KEY,
+    visit_id SERIAL,
+    repsly_id BIGINT,  -- Repsly VisitID
+    visit_date DATE NOT NULL,  -- partition key, the day the visit started
     client_id INTEGER,  -- Will be referenced later
     rep_id INTEGER REFERENCES field_ops.representatives(rep_id),
     time_start_id INTEGER REFERENCES meta.time(time_id),
@@ -182,11 +234,18 @@ CREATE TABLE field_ops.visits (
     precision_end INTEGER,
     visit_status_by_schedule INTEGER,
     visit_ended BOOLEAN,
-    duration_minutes INTEGER 
-);
+    duration_minutes INTEGER,
+    PRIMARY KEY (visit_id, visit_date),
+    -- The upsert target. A unique key must include the partition column, so
+    -- the loaders keep repsly_id unique by moving a visit whose date changed.
+    UNIQUE (repsly_id, visit_date)
+) PARTITION BY RANGE (visit_date);
+
+CREATE TABLE field_ops.visits_default PARTITION OF field_ops.visits DEFAULT;
 
 CREATE TABLE field_ops.daily_working_time (
     dwt_id SERIAL PRIMARY KEY,
+    repsly_id BIGINT UNIQUE,  -- Repsly DailyWorkingTimeID
     rep_id INTEGER REFERENCES field_ops.representatives(rep_id),
     date_id INTEGER REFERENCES meta.date(date_id),
     time_start_id INTEGER REFERENCES meta.time(time_id),
@@ -220,26 +279,38 @@ CREATE TABLE field_ops.visit_schedules (
     client_id INTEGER,  -- Will be referenced later
     schedule_time_id INTEGER REFERENCES meta.time(time_id),
     visit_note_id INTEGER REFERENCES meta.notes(note_id),
-    due_date_id INTEGER REFERENCES meta.date(date_id)
+    due_date_id INTEGER REFERENCES meta.date(date_id),
+    -- The upsert target; a rep, client or time that didn't resolve is NULL and
+    -- must still match its earlier row (PostgreSQL 15+)
+    UNIQUE NULLS NOT DISTINCT (rep_id, client_id, schedule_time_id)
 );
 
 CREATE TABLE field_ops.retail_audits (
     audit_id SERIAL PRIMARY KEY,
+    repsly_id BIGINT UNIQUE,  -- Repsly RetailAuditID
     name VARCHAR(50),
     cancelled BOOLEAN,
     client_id INTEGER,  -- Will be referenced later
     time_id INTEGER REFERENCES meta.time(time_id),
     rep_id INTEGER REFERENCES field_ops.representatives(rep_id),
-    visit_id INTEGER REFERENCES field_ops.visits(visit_id),
+    visit_id INTEGER,  -- field_ops.visits
     note_id INTEGER REFERENCES meta.notes(note_id)
 );
-CREATE TABLE field_operations.forms (
-    form_id SERIAL PRIMARY KEY,
+CREATE TABLE field_ops.forms (
+    form_id SERIAL,
+    repsly_id BIGINT,  -- Repsly FormID
     name VARCHAR(255),
-    visit_id INTEGER REFERENCES field_operations.visits(visit_id),
+    visit_id INTEGER,  -- field_ops.visits
     date_time TIMESTAMP,
-    signature_url TEXT
-);
+    form_date DATE NOT NULL,  -- partition key, date_time's day or the day it was mirrored
+    signature_url TEXT,
+    signature_path TEXT,  -- local copy under REPSLY_ASSET_DIR, see meta.assets
+    answers JSONB NOT NULL DEFAULT '{}',  -- answer per question, as sent by Repsly
+    PRIMARY KEY (form_id, form_date),
+    UNIQUE (repsly_id, form_date)  -- repsly_id alone is kept unique by the loader, which moves redated forms
+) PARTITION BY RANGE (form_date);
+
+CREATE TABLE field_ops.forms_default PARTITION OF field_ops.forms DEFAULT;
 -- Sales tables
 CREATE TABLE sales.clients (
     client_id SERIAL PRIMARY KEY,
@@ -253,17 +324,20 @@ CREATE TABLE sales.clients (
     status VARCHAR(255),
     contact_name_id INTEGER REFERENCES core.names(name_id),
     contact_title_id INTEGER REFERENCES core.names(name_id),
-    name_id INTEGER REFERENCES core.names(name_id)
+    name_id INTEGER REFERENCES core.names(name_id),
+    content_hash BIGINT  -- fingerprint of the mirrored client fields
 );
 
 CREATE TABLE field_ops.photos (
     photo_id SERIAL PRIMARY KEY,
-    visit_id INTEGER REFERENCES field_ops.visits(visit_id),
+    repsly_id BIGINT UNIQUE,  -- Repsly PhotoID
+    visit_id INTEGER,  -- field_ops.visits
     client_id INTEGER REFERENCES sales.clients(client_id),
     rep_id INTEGER REFERENCES field_ops.representatives(rep_id),
     note TEXT,
     date_time TIMESTAMP,
-    photo_url TEXT
+    photo_url TEXT,
+    photo_path TEXT  -- local copy under REPSLY_ASSET_DIR, see meta.assets
 );
 
 ALTER TABLE field_ops.visits ADD CONSTRAINT fk_visits_client FOREIGN KEY (client_id) REFERENCES sales.clients(client_id);
@@ -323,6 +397,7 @@ CREATE TABLE inventory.products (
     ean VARCHAR(20),
     note_id INTEGER REFERENCES meta.notes(note_id),
     image_url TEXT,
+    image_path TEXT,  -- local copy under REPSLY_ASSET_DIR, see meta.assets
     master_product_id INTEGER REFERENCES inventory.products(product_id)
 );
 
@@ -345,9 +420,10 @@ CREATE TABLE sales.purchase_orders (
     due_date_id INTEGER REFERENCES meta.date(date_id),
     rep_id INTEGER REFERENCES field_ops.representatives(rep_id),
     signature_url TEXT,
+    signature_path TEXT,  -- local copy under REPSLY_ASSET_DIR, see meta.assets
     note_id INTEGER REFERENCES meta.notes(note_id),
     taxable BOOLEAN,
-    visit_id INTEGER REFERENCES field_ops.visits(visit_id),
+    visit_id INTEGER,  -- field_ops.visits
     original_document_number TEXT
 );
 
@@ -357,8 +433,9 @@ CREATE TABLE sales.document_item_attributes (
 );
 
 CREATE TABLE sales.purchase_order_items (
-    item_id SERIAL PRIMARY KEY,
+    item_id SERIAL,
     order_id INTEGER REFERENCES sales.purchase_orders(order_id),
+    document_date DATE NOT NULL,  -- partition key, the order's document date
     line_no INTEGER,
     product_id INTEGER REFERENCES inventory.products(product_id),
     package_type_id INTEGER REFERENCES inventory.package_types(package_type_id),
@@ -367,8 +444,11 @@ CREATE TABLE sales.purchase_order_items (
     discount_percent DECIMAL(5,2),
     tax_percent DECIMAL(5,2),
     note_id INTEGER REFERENCES meta.notes(note_id),
-    document_item_attribute_id INTEGER REFERENCES sales.document_item_attributes(attribute_id)
-);
+    document_item_attribute_id INTEGER REFERENCES sales.document_item_attributes(attribute_id),
+    PRIMARY KEY (item_id, document_date)
+) PARTITION BY RANGE (document_date);
+
+CREATE TABLE sales.purchase_order_items_default PARTITION OF sales.purchase_order_items DEFAULT;
 
 ALTER TABLE sales.purchase_order_items ADD CONSTRAINT fk_purchase_order_items_product FOREIGN KEY (product_id) REFERENCES inventory.products(product_id);
 
@@ -377,11 +457,12 @@ CREATE TABLE inventory.pricelists (
     name VARCHAR(255),
     is_default BOOLEAN,
     active BOOLEAN,
-    use_prices BOOLEAN
+    use_prices BOOLEAN,
+    content_hash BIGINT  -- fingerprint of the pricelist and all of its items
 );
 
 CREATE TABLE inventory.pricelist_items (
-    item_id SERIAL PRIMARY KEY,
+    item_id SERIAL,
     pricelist_id INTEGER REFERENCES inventory.pricelists(pricelist_id),
     product_id INTEGER REFERENCES inventory.products(product_id),
     price DECIMAL(18,4),
@@ -391,8 +472,13 @@ CREATE TABLE inventory.pricelist_items (
     date_available_from_id INTEGER REFERENCES meta.date(date_id),
     date_available_to_id INTEGER REFERENCES meta.date(date_id),
     min_quantity INTEGER,
-    max_quantity INTEGER
-);
+    max_quantity INTEGER,
+    content_hash BIGINT,  -- fingerprint of the mirrored item fields
+    mirrored_on DATE NOT NULL DEFAULT CURRENT_DATE,  -- partition key, the day the item was first written
+    PRIMARY KEY (item_id, mirrored_on)
+) PARTITION BY RANGE (mirrored_on);
+
+CREATE TABLE inventory.pricelist_items_default PARTITION OF inventory.pricelist_items DEFAULT;
 
 CREATE TABLE field_ops.retail_audit_items (
     item_id SERIAL PRIMARY KEY,
@@ -439,6 +525,10 @@ CREATE INDEX idx_visits_rep_id ON field_ops.visits(rep_id);
 CREATE INDEX idx_visits_time_start ON field_ops.visits(time_start_id);
 CREATE INDEX idx_visits_time_end ON field_ops.visits(time_end_id);
 
+CREATE INDEX idx_forms_name ON field_ops.forms(name);
+CREATE INDEX idx_forms_visit_id ON field_ops.forms(visit_id);
+CREATE INDEX idx_forms_answers ON field_ops.forms USING GIN (answers jsonb_path_ops);
+
 CREATE INDEX idx_daily_working_time_rep_id ON field_ops.daily_working_time(rep_id);
 CREATE INDEX idx_daily_working_time_date ON field_ops.daily_working_time(date_id);
 
@@ -449,3 +539,5 @@ CREATE INDEX idx_purchase_orders_time ON sales.purchase_orders(time_id);
 CREATE INDEX idx_products_group_id ON inventory.products(group_id);
 CREATE INDEX idx_pricelist_items_product_id ON inventory.pricelist_items(product_id);
 CREATE INDEX idx_pricelist_items_client_id ON inventory.pricelist_items(client_id);
+CREATE INDEX idx_pricelist_items_pricelist_id ON inventory.pricelist_items(pricelist_id);
+CREATE INDEX idx_pricelists_name ON inventory.pricelists(name);
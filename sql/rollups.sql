@@ -0,0 +1,257 @@
+-- Rollups kept in step with the fact tables during ingest. Statement-level
+-- triggers see every row a statement inserted, updated or deleted (transition
+-- tables), so each page's upsert adjusts the rollups once by the difference:
+-- +1 for each new row version, -1 for each old one. rollups.rebuild()
+-- recomputes them from scratch if they ever drift.
+--
+-- Unknown reps and clients are counted under id 0.
+
+CREATE SCHEMA IF NOT EXISTS rollups;
+
+CREATE TABLE rollups.visits_by_rep_day (
+    rep_id INTEGER NOT NULL,
+    day DATE NOT NULL,
+    visits INTEGER NOT NULL DEFAULT 0,
+    ended_visits INTEGER NOT NULL DEFAULT 0,
+    duration_minutes BIGINT NOT NULL DEFAULT 0,
+    PRIMARY KEY (rep_id, day)
+);
+
+-- orders come from sales.purchase_orders, total_amount from their items
+-- (total_amount of sales.purchase_order_items_calculated)
+CREATE TABLE rollups.orders_by_client_month (
+    client_id INTEGER NOT NULL,
+    month DATE NOT NULL,
+    orders INTEGER NOT NULL DEFAULT 0,
+    total_amount DECIMAL(18,4) NOT NULL DEFAULT 0,
+    PRIMARY KEY (client_id, month)
+);
+
+CREATE TABLE rollups.pricelist_coverage (
+    product_id INTEGER NOT NULL,
+    pricelist_id INTEGER NOT NULL,
+    items INTEGER NOT NULL DEFAULT 0,
+    active_items INTEGER NOT NULL DEFAULT 0,
+    PRIMARY KEY (product_id, pricelist_id)
+);
+
+
+-- Delta functions: add sign times the contribution of changed rows
+
+CREATE OR REPLACE FUNCTION rollups.visits_apply(sign INTEGER, changed field_ops.visits[])
+RETURNS void AS $$
+    INSERT INTO rollups.visits_by_rep_day AS r (rep_id, day, visits, ended_visits, duration_minutes)
+    SELECT COALESCE(v.rep_id, 0), v.visit_date,
+           sign * count(*),
+           sign * count(*) FILTER (WHERE v.visit_ended),
+           sign * COALESCE(sum(v.duration_minutes), 0)
+    FROM unnest(changed) v
+    GROUP BY 1, 2
+    ON CONFLICT (rep_id, day) DO UPDATE SET
+        visits = r.visits + EXCLUDED.visits,
+        ended_visits = r.ended_visits + EXCLUDED.ended_visits,
+        duration_minutes = r.duration_minutes + EXCLUDED.duration_minutes;
+$$ LANGUAGE sql;
+
+-- Orders without a document date aren't counted
+CREATE OR REPLACE FUNCTION rollups.orders_apply(sign INTEGER, changed sales.purchase_orders[])
+RETURNS void AS $$
+    INSERT INTO rollups.orders_by_client_month AS r (client_id, month, orders)
+    SELECT COALESCE(o.client_id, 0), date_trunc('month', d.date)::date, sign * count(*)
+    FROM unnest(changed) o
+    JOIN meta.date d ON d.date_id = o.document_date_id
+    GROUP BY 1, 2
+    ON CONFLICT (client_id, month) DO UPDATE SET orders = r.orders + EXCLUDED.orders;
+$$ LANGUAGE sql;
+
+-- An item counts towards its order's client, or client 0 while the order
+-- isn't stored; orders_changed moves the totals when that changes
+CREATE OR REPLACE FUNCTION rollups.order_items_apply(sign INTEGER, changed sales.purchase_order_items[])
+RETURNS void AS $$
+    INSERT INTO rollups.orders_by_client_month AS r (client_id, month, total_amount)
+    SELECT COALESCE(o.client_id, 0), date_trunc('month', i.document_date)::date,
+           sign * COALESCE(sum(i.quantity * i.unit_price * (1 - COALESCE(i.discount_percent, 0) / 100)
+                               * (1 + COALESCE(i.tax_percent, 0) / 100)), 0)
+    FROM unnest(changed) i
+    LEFT JOIN sales.purchase_orders o ON o.order_id = i.order_id
+    GROUP BY 1, 2
+    ON CONFLICT (client_id, month) DO UPDATE SET total_amount = r.total_amount + EXCLUDED.total_amount;
+$$ LANGUAGE sql;
+
+CREATE TYPE rollups.order_client_change AS (order_id INTEGER, from_client INTEGER, to_client INTEGER);
+
+CREATE OR REPLACE FUNCTION rollups.order_items_move(changes rollups.order_client_change[])
+RETURNS void AS $$
+    INSERT INTO rollups.orders_by_client_month AS r (client_id, month, total_amount)
+    SELECT side.client_id, date_trunc('month', i.document_date)::date,
+           COALESCE(sum(side.sign * i.quantity * i.unit_price * (1 - COALESCE(i.discount_percent, 0) / 100)
+                        * (1 + COALESCE(i.tax_percent, 0) / 100)), 0)
+    FROM unnest(changes) c
+    CROSS JOIN LATERAL (VALUES (-1, c.from_client), (1, c.to_client)) side(sign, client_id)
+    JOIN sales.purchase_order_items i ON i.order_id = c.order_id
+    WHERE c.from_client <> c.to_client
+    GROUP BY 1, 2
+    ON CONFLICT (client_id, month) DO UPDATE SET total_amount = r.total_amount + EXCLUDED.total_amount;
+$$ LANGUAGE sql;
+
+CREATE OR REPLACE FUNCTION rollups.pricelist_items_apply(sign INTEGER, changed inventory.pricelist_items[])
+RETURNS void AS $$
+    INSERT INTO rollups.pricelist_coverage AS r (product_id, pricelist_id, items, active_items)
+    SELECT p.product_id, p.pricelist_id, sign * count(*), sign * count(*) FILTER (WHERE p.active)
+    FROM unnest(changed) p
+    WHERE p.product_id IS NOT NULL AND p.pricelist_id IS NOT NULL
+    GROUP BY 1, 2
+    ON CONFLICT (product_id, pricelist_id) DO UPDATE SET
+        items = r.items + EXCLUDED.items,
+        active_items = r.active_items + EXCLUDED.active_items;
+$$ LANGUAGE sql;
+
+
+-- One trigger function per fact table, attached once per event: a trigger
+-- with transition tables can only fire on one. old_rows is only read when
+-- the statement had one, so INSERT never plans it.
+
+CREATE OR REPLACE FUNCTION rollups.visits_changed()
+RETURNS TRIGGER AS $$
+BEGIN
+    IF TG_OP IN ('UPDATE', 'DELETE') THEN
+        PERFORM rollups.visits_apply(-1, ARRAY(SELECT o FROM old_rows o));
+    END IF;
+    IF TG_OP IN ('INSERT', 'UPDATE') THEN
+        PERFORM rollups.visits_apply(1, ARRAY(SELECT n FROM new_rows n));
+    END IF;
+    RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION rollups.orders_changed()
+RETURNS TRIGGER AS $$
+BEGIN
+    IF TG_OP IN ('UPDATE', 'DELETE') THEN
+        PERFORM rollups.orders_apply(-1, ARRAY(SELECT o FROM old_rows o));
+    END IF;
+    IF TG_OP IN ('INSERT', 'UPDATE') THEN
+        PERFORM rollups.orders_apply(1, ARRAY(SELECT n FROM new_rows n));
+    END IF;
+
+    -- The order's items follow it to its new client
+    IF TG_OP = 'INSERT' THEN
+        PERFORM rollups.order_items_move(ARRAY(
+            SELECT (n.order_id, 0, COALESCE(n.client_id, 0))::rollups.order_client_change FROM new_rows n));
+    ELSIF TG_OP = 'UPDATE' THEN
+        PERFORM rollups.order_items_move(ARRAY(
+            SELECT (n.order_id, COALESCE(o.client_id, 0), COALESCE(n.client_id, 0))::rollups.order_client_change
+            FROM old_rows o JOIN new_rows n ON n.order_id = o.order_id));
+    ELSE
+        PERFORM rollups.order_items_move(ARRAY(
+            SELECT (o.order_id, COALESCE(o.client_id, 0), 0)::rollups.order_client_change FROM old_rows o));
+    END IF;
+    RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION rollups.order_items_changed()
+RETURNS TRIGGER AS $$
+BEGIN
+    IF TG_OP IN ('UPDATE', 'DELETE') THEN
+        PERFORM rollups.order_items_apply(-1, ARRAY(SELECT o FROM old_rows o));
+    END IF;
+    IF TG_OP IN ('INSERT', 'UPDATE') THEN
+        PERFORM rollups.order_items_apply(1, ARRAY(SELECT n FROM new_rows n));
+    END IF;
+    RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION rollups.pricelist_items_changed()
+RETURNS TRIGGER AS $$
+BEGIN
+    IF TG_OP IN ('UPDATE', 'DELETE') THEN
+        PERFORM rollups.pricelist_items_apply(-1, ARRAY(SELECT o FROM old_rows o));
+    END IF;
+    IF TG_OP IN ('INSERT', 'UPDATE') THEN
+        PERFORM rollups.pricelist_items_apply(1, ARRAY(SELECT n FROM new_rows n));
+    END IF;
+    RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER tr_visits_rollup_insert AFTER INSERT ON field_ops.visits
+REFERENCING NEW TABLE AS new_rows FOR EACH STATEMENT EXECUTE FUNCTION rollups.visits_changed();
+CREATE TRIGGER tr_visits_rollup_update AFTER UPDATE ON field_ops.visits
+REFERENCING OLD TABLE AS old_rows NEW TABLE AS new_rows FOR EACH STATEMENT EXECUTE FUNCTION rollups.visits_changed();
+CREATE TRIGGER tr_visits_rollup_delete AFTER DELETE ON field_ops.visits
+REFERENCING OLD TABLE AS old_rows FOR EACH STATEMENT EXECUTE FUNCTION rollups.visits_changed();
+
+CREATE TRIGGER tr_orders_rollup_insert AFTER INSERT ON sales.purchase_orders
+REFERENCING NEW TABLE AS new_rows FOR EACH STATEMENT EXECUTE FUNCTION rollups.orders_changed();
+CREATE TRIGGER tr_orders_rollup_update AFTER UPDATE ON sales.purchase_orders
+REFERENCING OLD TABLE AS old_rows NEW TABLE AS new_rows FOR EACH STATEMENT EXECUTE FUNCTION rollups.orders_changed();
+CREATE TRIGGER tr_orders_rollup_delete AFTER DELETE ON sales.purchase_orders
+REFERENCING OLD TABLE AS old_rows FOR EACH STATEMENT EXECUTE FUNCTION rollups.orders_changed();
+
+CREATE TRIGGER tr_order_items_rollup_insert AFTER INSERT ON sales.purchase_order_items
+REFERENCING NEW TABLE AS new_rows FOR EACH STATEMENT EXECUTE FUNCTION rollups.order_items_changed();
+CREATE TRIGGER tr_order_items_rollup_update AFTER UPDATE ON sales.purchase_order_items
+REFERENCING OLD TABLE AS old_rows NEW TABLE AS new_rows FOR EACH STATEMENT EXECUTE FUNCTION rollups.order_items_changed();
+CREATE TRIGGER tr_order_items_rollup_delete AFTER DELETE ON sales.purchase_order_items
+REFERENCING OLD TABLE AS old_rows FOR EACH STATEMENT EXECUTE FUNCTION rollups.order_items_changed();
+
+CREATE TRIGGER tr_pricelist_items_rollup_insert AFTER INSERT ON inventory.pricelist_items
+REFERENCING NEW TABLE AS new_rows FOR EACH STATEMENT EXECUTE FUNCTION rollups.pricelist_items_changed();
+CREATE TRIGGER tr_pricelist_items_rollup_update AFTER UPDATE ON inventory.pricelist_items
+REFERENCING OLD TABLE AS old_rows NEW TABLE AS new_rows FOR EACH STATEMENT EXECUTE FUNCTION rollups.pricelist_items_changed();
+CREATE TRIGGER tr_pricelist_items_rollup_delete AFTER DELETE ON inventory.pricelist_items
+REFERENCING OLD TABLE AS old_rows FOR EACH STATEMENT EXECUTE FUNCTION rollups.pricelist_items_changed();
+
+
+-- Full rebuild of the rollups fed by source (e.g. 'field_ops.visits'), or
+-- of all of them when source is NULL. The sources are locked against writes
+-- for the duration, so no delta can slip in between the scan and the swap.
+
+CREATE OR REPLACE FUNCTION rollups.rebuild(source TEXT DEFAULT NULL)
+RETURNS void AS $$
+BEGIN
+    IF source IS NULL OR source = 'field_ops.visits' THEN
+        LOCK TABLE field_ops.visits IN SHARE MODE;
+        TRUNCATE rollups.visits_by_rep_day;
+        INSERT INTO rollups.visits_by_rep_day (rep_id, day, visits, ended_visits, duration_minutes)
+        SELECT COALESCE(rep_id, 0), visit_date, count(*), count(*) FILTER (WHERE visit_ended),
+               COALESCE(sum(duration_minutes), 0)
+        FROM field_ops.visits
+        GROUP BY 1, 2;
+    END IF;
+
+    IF source IS NULL OR source IN ('sales.purchase_orders', 'sales.purchase_order_items') THEN
+        LOCK TABLE sales.purchase_orders, sales.purchase_order_items IN SHARE MODE;
+        TRUNCATE rollups.orders_by_client_month;
+        INSERT INTO rollups.orders_by_client_month (client_id, month, orders, total_amount)
+        SELECT client_id, month, sum(orders), sum(total_amount)
+        FROM (
+            SELECT COALESCE(o.client_id, 0) AS client_id, date_trunc('month', d.date)::date AS month,
+                   count(*) AS orders, 0 AS total_amount
+            FROM sales.purchase_orders o
+            JOIN meta.date d ON d.date_id = o.document_date_id
+            GROUP BY 1, 2
+            UNION ALL
+            SELECT COALESCE(o.client_id, 0), date_trunc('month', i.document_date)::date, 0,
+                   COALESCE(sum(i.quantity * i.unit_price * (1 - COALESCE(i.discount_percent, 0) / 100)
+                                * (1 + COALESCE(i.tax_percent, 0) / 100)), 0)
+            FROM sales.purchase_order_items i
+            LEFT JOIN sales.purchase_orders o ON o.order_id = i.order_id
+            GROUP BY 1, 2
+        ) parts
+        GROUP BY 1, 2;
+    END IF;
+
+    IF source IS NULL OR source = 'inventory.pricelist_items' THEN
+        LOCK TABLE inventory.pricelist_items IN SHARE MODE;
+        TRUNCATE rollups.pricelist_coverage;
+        INSERT INTO rollups.pricelist_coverage (product_id, pricelist_id, items, active_items)
+        SELECT product_id, pricelist_id, count(*), count(*) FILTER (WHERE active)
+        FROM inventory.pricelist_items
+        WHERE product_id IS NOT NULL AND pricelist_id IS NOT NULL
+        GROUP BY 1, 2;
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
@@ -1,73 +1,157 @@
-#include "client.h"
-#include "form.h"
-#include "pricelists.h"
+#include "entity_registry.h"
+#include "daemon.h"
 #include "api.h"
 #include "core_operations.h"
+#include "thread_pool.h"
+#include "columnar_export.h"
+#include "spool_sync.h"
+#include "event_loop.h"
+#include "backfill.h"
+#include "trace.h"
+#include "sql_stats.h"
+#include "asset_mirror.h"
+#include "rollups.h"
+#include "accounts.h"
+#include "leases.h"
+#include "scheduler.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libpq-fe.h>
 #include <stdbool.h>
 
-#define MAX_ENTITIES 10
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--backfill] [--rebuild-rollups] [--assets] [--daemon] [--event-loop] [--config <path>]\n", program);
+}
 
-typedef struct {
-    const char *name;
-    bool (*fetch_and_insert)(PGconn *db_conn, long last_id_or_timestamp);
-} EntityInfo;
+int main(int argc, char **argv) {
+    bool daemon_mode = false;
+    bool event_loop_mode = false;
+    bool backfill_mode = false;
+    bool rebuild_rollups = false;
+    bool assets_only = false;
+    const char *config_path = getenv("REPSLY_CONFIG");
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--daemon") == 0) {
+            daemon_mode = true;
+        } else if (strcmp(argv[i], "--backfill") == 0) {
+            backfill_mode = true;
+        } else if (strcmp(argv[i], "--rebuild-rollups") == 0) {
+            rebuild_rollups = true;
+        } else if (strcmp(argv[i], "--assets") == 0) {
+            assets_only = true;
+        } else if (strcmp(argv[i], "--event-loop") == 0) {
+            event_loop_mode = true;
+        } else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            config_path = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Each configured account has its own database and credentials, so the
+    // REPSLY_DB_NAME connection and REPSLY_USERNAME aren't used
+    if (accounts_configured(config_path)) {
+        if (backfill_mode || rebuild_rollups || assets_only || event_loop_mode) {
+            fprintf(stderr, "--backfill, --rebuild-rollups, --assets and --event-loop don't apply when accounts "
+                            "are configured\n");
+            usage(argv[0]);
+            return 1;
+        }
+        api_init();
+        int status = accounts_run(config_path, daemon_mode);
+        leases_shutdown(NULL);
+        trace_shutdown();
+        export_shutdown();
+        thread_pool_shared_free();
+        api_cleanup();
+        return status;
+    }
 
-int main() {
     PGconn *db_conn = db_connect();
     if (!db_conn) {
         fprintf(stderr, "Failed to connect to the database\n");
         return 1;
     }
 
+    // Repairs the rollups and exits without syncing
+    if (rebuild_rollups) {
+        bool rebuilt = rollups_rebuild(db_conn, NULL);
+        db_disconnect(db_conn);
+        return rebuilt ? 0 : 1;
+    }
+
     api_init();
 
-    EntityInfo entities[] = {
-        {"clients", client_fetch_and_insert},
-        {"forms", form_fetch_and_insert},
-        {"pricelist", pricelist_fetch_and_insert},
-        //{"clientnotes", clientnotes_fetch_and_insert},
-        //{"visits", visits_fetch_and_insert},
-        //{"purchaseorders", purchaseorders_fetch_and_insert},
-        //{"retailaudits", retailaudits_fetch_and_insert},
-        //{"products", products_fetch_and_insert},
-        //{"pricelistitems", pricelistitems_fetch_and_insert},
-        //{"forms", forms_fetch_and_insert},
-        //{"photos", photos_fetch_and_insert},
-        //{"dailyworkingtime", dailyworkingtime_fetch_and_insert},
-        //{"visitschedules", visitschedules_fetch_and_insert},
-        //{"visitrealizations", visitrealizations_fetch_and_insert},
-        //{"users", users_fetch_and_insert},
-        //{"reps", reps_fetch_and_insert},
-        //{"documenttypes", documenttypes_fetch_and_insert},
-        
-    };
-
-    int num_entities = sizeof(entities) / sizeof(EntityInfo);
-
-    bool all_done = false;
-    while (!all_done) {
-        all_done = true;
+    // Downloads the pending assets and exits without syncing
+    if (assets_only) {
+        bool mirrored = asset_mirror_run(db_conn);
+        api_cleanup();
+        db_disconnect(db_conn);
+        return mirrored ? 0 : 1;
+    }
+
+    int status = 0;
+
+    // The regular sync below then carries on from the cursors it recorded
+    if (backfill_mode && !backfill_run(db_conn, config_path)) {
+        status = 1;
+    }
+
+    const char *spool_dir = getenv("REPSLY_SPOOL_DIR");
+    if (daemon_mode) {
+        status = daemon_run(db_conn, config_path);
+    } else if (spool_dir && *spool_dir) {
+        SpoolPtr spool = spool_open(spool_dir);
+        int num_entities;
+        const EntityInfo *entities = entity_registry(&num_entities);
+        const EntityInfo *sync_entities[num_entities];
+        for (int i = 0; i < num_entities; i++) {
+            sync_entities[i] = &entities[i];
+        }
+
+        int held = lease_acquire_entities(db_conn, sync_entities, num_entities);
+        status = (spool && spool_sync(db_conn, spool, sync_entities, held)) ? 0 : 1;
+        lease_release_entities(db_conn, sync_entities, held);
+        spool_close(spool);
+    } else if (event_loop_mode) {
+        int num_entities;
+        const EntityInfo *entities = entity_registry(&num_entities);
+        const EntityInfo *sync_entities[num_entities];
         for (int i = 0; i < num_entities; i++) {
-            long last_processed = get_last_processed(db_conn, entities[i].name);
-            bool success = entities[i].fetch_and_insert(db_conn, last_processed);
-            
-            if (success) {
-                long new_last_processed = get_last_processed(db_conn, entities[i].name);
-                
-                if (new_last_processed > last_processed) {
-                    all_done = false; 
-                }
-            } else {
-                fprintf(stderr, "Failed to fetch and insert %s\n", entities[i].name);
-            }
+            sync_entities[i] = &entities[i];
         }
+
+        int held = lease_acquire_entities(db_conn, sync_entities, num_entities);
+        status = event_loop_sync(db_conn, sync_entities, held) ? 0 : 1;
+        lease_release_entities(db_conn, sync_entities, held);
+    } else {
+        int num_entities;
+        const EntityInfo *entities = entity_registry(&num_entities);
+
+        SchedulerPtr scheduler = scheduler_create(entities, num_entities);
+        if (!scheduler || !scheduler_run(scheduler, db_conn, NULL, NULL)) {
+            status = 1;
+        }
+        scheduler_free(scheduler);
+    }
+
+    if (!daemon_mode && PQstatus(db_conn) == CONNECTION_OK && !asset_mirror_run(db_conn)) {
+        status = 1;
+    }
+
+    const char *sql_stats = getenv("REPSLY_SQL_STATS");
+    if (sql_stats && *sql_stats && strcmp(sql_stats, "0") != 0) {
+        sql_stats_report(stderr);
     }
 
+    leases_shutdown(db_conn);
+    trace_shutdown();
+    export_shutdown();
+    thread_pool_shared_free();
     api_cleanup();
     db_disconnect(db_conn);
-    return 0;
-}
\ No newline at end of file
+    return status;
+}